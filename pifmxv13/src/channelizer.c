@@ -0,0 +1,146 @@
+#include <complex.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "channelizer.h"
+
+
+#define PI 3.141592654
+
+
+/* The output is
+       y[n] = sum_k sum_m x_k[m] h[n - m*D] exp(j*2*pi*k*n/M)
+   with M channels and an interpolation factor D = M/4. As the exponential
+   only depends on n mod M, the sum over k is one inverse FFT per input
+   sample, and each output sample is then a short polyphase FIR over the
+   last `taps` inverse FFT results.
+*/
+struct channelizer {
+    int channels;       // M, a power of two
+    int interpolation;  // D
+    int taps;           // taps per polyphase branch
+    float *filter;      // prototype low-pass filter, taps*D coefficients
+    float complex *twiddle;
+    int *bit_reverse;
+    float complex *history; // last `taps` IFFT outputs, taps*M values
+    int history_index;
+    unsigned long step;
+};
+
+
+channelizer *channelizer_new(int channels, int taps_per_phase) {
+    if(channels < 4 || (channels & (channels-1)) != 0 || taps_per_phase < 1) return NULL;
+
+    channelizer *c = calloc(1, sizeof(channelizer));
+    if(c == NULL) return NULL;
+
+    c->channels = channels;
+    c->interpolation = channels / 4;
+    c->taps = taps_per_phase;
+
+    int len = c->taps * c->interpolation;
+    c->filter = malloc(len * sizeof(float));
+    c->twiddle = malloc(channels/2 * sizeof(float complex));
+    c->bit_reverse = malloc(channels * sizeof(int));
+    c->history = calloc(c->taps * channels, sizeof(float complex));
+    if(!c->filter || !c->twiddle || !c->bit_reverse || !c->history) {
+        channelizer_free(c);
+        return NULL;
+    }
+
+    // Blackman-windowed sinc with its cut-off at half the channel rate, and a
+    // gain of D to compensate for the zero-stuffing of the interpolation
+    for(int i=0; i<len; i++) {
+        double t = (i - (len-1) / 2.) / c->interpolation;
+        double sinc = (t == 0) ? 1. : sin(PI * t) / (PI * t);
+        double w = .42 - .5 * cos(2*PI * i / (len-1)) + .08 * cos(4*PI * i / (len-1));
+        c->filter[i] = sinc * w;
+    }
+
+    for(int i=0; i<channels/2; i++) {
+        c->twiddle[i] = cexp(I * 2 * PI * i / channels);
+    }
+
+    int bits = 0;
+    while((1 << bits) < channels) bits++;
+    for(int i=0; i<channels; i++) {
+        int r = 0;
+        for(int b=0; b<bits; b++) {
+            if(i & (1 << b)) r |= 1 << (bits-1-b);
+        }
+        c->bit_reverse[i] = r;
+    }
+
+    return c;
+}
+
+
+void channelizer_free(channelizer *c) {
+    if(c == NULL) return;
+    free(c->filter);
+    free(c->twiddle);
+    free(c->bit_reverse);
+    free(c->history);
+    free(c);
+}
+
+
+int channelizer_interpolation(channelizer *c) {
+    return c->interpolation;
+}
+
+
+// In-place radix-2 inverse FFT (without the 1/M normalisation)
+static void ifft(channelizer *c, float complex *v) {
+    int n = c->channels;
+    for(int i=0; i<n; i++) {
+        int r = c->bit_reverse[i];
+        if(r > i) {
+            float complex t = v[i];
+            v[i] = v[r];
+            v[r] = t;
+        }
+    }
+    for(int size=2; size<=n; size<<=1) {
+        int half = size / 2;
+        int stride = n / size;
+        for(int start=0; start<n; start+=size) {
+            for(int j=0; j<half; j++) {
+                float complex t = c->twiddle[j*stride] * v[start+j+half];
+                v[start+j+half] = v[start+j] - t;
+                v[start+j] += t;
+            }
+        }
+    }
+}
+
+
+/* Consumes one sample per channel (in[k] for channel k) and produces
+   channelizer_interpolation() output samples.
+*/
+void channelizer_synthesize(channelizer *c, float complex *in, float complex *out) {
+    int M = c->channels;
+    int D = c->interpolation;
+
+    c->history_index--;
+    if(c->history_index < 0) c->history_index = c->taps - 1;
+    float complex *v = c->history + c->history_index * M;
+    memcpy(v, in, M * sizeof(float complex));
+    ifft(c, v);
+
+    // Offset of this block of D output samples within the period M
+    int base = (c->step & 3) * D;
+    c->step++;
+
+    for(int d=0; d<D; d++) {
+        float complex acc = 0;
+        int h = c->history_index;
+        for(int q=0; q<c->taps; q++) {
+            acc += c->filter[q*D + d] * c->history[h*M + base + d];
+            h++;
+            if(h >= c->taps) h = 0;
+        }
+        out[d] = acc;
+    }
+}
@@ -0,0 +1,19 @@
+#ifndef CHANNELIZER_H
+#define CHANNELIZER_H
+
+#include <complex.h>
+
+/* Polyphase synthesis filter bank: combines `channels` complex baseband
+   streams, each sampled at the channel rate, into one wideband stream sampled
+   at channels/4 times the channel rate. Channel k is centred on k/channels
+   times the output sample rate (i.e. channel spacing is a quarter of the
+   channel rate, the bank is 4x oversampled).
+*/
+typedef struct channelizer channelizer;
+
+extern channelizer *channelizer_new(int channels, int taps_per_phase);
+extern void channelizer_free(channelizer *c);
+extern int channelizer_interpolation(channelizer *c);
+extern void channelizer_synthesize(channelizer *c, float complex *in, float complex *out);
+
+#endif /* CHANNELIZER_H */
@@ -0,0 +1,95 @@
+#include <stdio.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "config_file.h"
+
+
+/*
+ * Reads a station configuration file. Returns 0 on success, -1 if the file
+ * cannot be read or is malformed (in which case cfg is left untouched).
+ */
+int read_config_file(char *filename, station_config *cfg) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) {
+        fprintf(stderr, "Error: could not open configuration file %s.\n", filename);
+        return -1;
+    }
+
+    station_config new_cfg;
+    new_cfg.count = 0;
+    char line[CONFIG_KEY_SIZE + CONFIG_VALUE_SIZE + 2];
+    int line_no = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        line_no++;
+        line[strcspn(line, "\r\n")] = 0;
+
+        char *key = line;
+        while (isspace((unsigned char)*key)) key++;
+        if (*key == '#' || *key == 0) continue;
+
+        // The key is up to the first space, the value is the rest of the line
+        char *value = key;
+        while (*value && !isspace((unsigned char)*value)) value++;
+        if (*value) *value++ = 0;
+
+        if (strlen(key) >= CONFIG_KEY_SIZE || strlen(value) >= CONFIG_VALUE_SIZE) {
+            fprintf(stderr, "Error: %s:%d: entry too long.\n", filename, line_no);
+            fclose(f);
+            return -1;
+        }
+        for (char *c = key; *c; c++) *c = toupper((unsigned char)*c);
+
+        // A repeated key replaces the previous value
+        int i;
+        for (i = 0; i < new_cfg.count; i++) {
+            if (strcmp(new_cfg.keys[i], key) == 0) break;
+        }
+        if (i == new_cfg.count) {
+            if (new_cfg.count >= CONFIG_MAX_ENTRIES) {
+                fprintf(stderr, "Error: %s:%d: too many entries.\n", filename, line_no);
+                fclose(f);
+                return -1;
+            }
+            new_cfg.count++;
+        }
+        strcpy(new_cfg.keys[i], key);
+        strcpy(new_cfg.values[i], value);
+    }
+    fclose(f);
+
+    memcpy(cfg, &new_cfg, sizeof(station_config));
+    return 0;
+}
+
+
+/*
+ * Returns the value of a key, or NULL if the key is not set.
+ */
+char *get_config_value(station_config *cfg, char *key) {
+    for (int i = 0; i < cfg->count; i++) {
+        if (strcmp(cfg->keys[i], key) == 0) return cfg->values[i];
+    }
+    return NULL;
+}
+
+
+/*
+ * Sets a key, replacing its previous value. Returns 0 on success, -1 if the
+ * entry is too long or the configuration is full.
+ */
+int set_config_value(station_config *cfg, char *key, char *value) {
+    if (strlen(key) >= CONFIG_KEY_SIZE || strlen(value) >= CONFIG_VALUE_SIZE) return -1;
+    int i;
+    for (i = 0; i < cfg->count; i++) {
+        if (strcmp(cfg->keys[i], key) == 0) break;
+    }
+    if (i == cfg->count) {
+        if (cfg->count >= CONFIG_MAX_ENTRIES) return -1;
+        cfg->count++;
+    }
+    strcpy(cfg->keys[i], key);
+    strcpy(cfg->values[i], value);
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef CONFIG_FILE_H
+#define CONFIG_FILE_H
+
+#define CONFIG_MAX_ENTRIES 64
+#define CONFIG_KEY_SIZE 16
+#define CONFIG_VALUE_SIZE 256
+
+/* Station configuration file: one "KEY value" entry per line, with the same
+   keys as the control pipe commands (PS, RT, PI, AFA, ...) plus the
+   transmitter settings (FREQ, AUDIO, PPM, SM, CTL). Lines starting with '#'
+   are comments.
+*/
+typedef struct {
+    int count;
+    char keys[CONFIG_MAX_ENTRIES][CONFIG_KEY_SIZE];
+    char values[CONFIG_MAX_ENTRIES][CONFIG_VALUE_SIZE];
+} station_config;
+
+extern int read_config_file(char *filename, station_config *cfg);
+extern char *get_config_value(station_config *cfg, char *key);
+extern int set_config_value(station_config *cfg, char *key, char *value);
+
+#endif /* CONFIG_FILE_H */
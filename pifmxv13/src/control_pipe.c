@@ -7,6 +7,7 @@
 #include <stdint.h>
 
 #include "rds.h"
+#include "fm_mpx.h"
 #include "control_pipe.h"
 #include <ctype.h>
 
@@ -46,6 +47,14 @@ int poll_control_pipe() {
     // Убираем символ новой строки в конце
     if(res[strlen(res)-1] == '\n') res[strlen(res)-1] = 0;
 
+    return process_control_command(res);
+}
+
+/*
+ * Processes one control command (a line without its newline) and updates the
+ * RDS data. Also used for the commands of the configuration file.
+ */
+int process_control_command(char *res) {
     // Используем strncmp для безопасного сравнения команд
     // Формат команд: "CMD <value>"
 
@@ -58,6 +67,144 @@ int poll_control_pipe() {
         return CONTROL_PIPE_PS_SET;
     }
 
+    if (strncmp(res, "LPS ", 4) == 0) {
+        char *arg = res + 4;
+        set_rds_lps(arg);   // UTF-8, обрезается до 32 байт по границе символа
+        printf("LPS set to: \"%s\"\n", arg);
+        fflush(stdout);
+        return CONTROL_PIPE_LPS_SET;
+    }
+
+    if (strncmp(res, "ERT ", 4) == 0) {
+        char *arg = res + 4;
+        set_rds_ert(strcmp(arg, "OFF") == 0 ? "" : arg);   // UTF-8, до 128 байт
+        printf("eRT set to: \"%s\"\n", arg);
+        fflush(stdout);
+        return CONTROL_PIPE_ERT_SET;
+    }
+
+    if (strncmp(res, "ERTG ", 5) == 0) {
+        char *arg = res + 5;
+        if (set_rds_ert_group(arg)) {
+            printf("eRT group set to: %s\n", arg);
+        } else {
+            printf("ERROR: Invalid eRT group. Use a type A ODA group: 5A-9A, 11A-13A.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_ERT_SET;
+    }
+
+    if (strncmp(res, "TMC ", 4) == 0) {
+        char *arg = res + 4;
+        if (set_rds_tmc(arg)) {
+            printf("TMC set to: %s\n", arg);
+        } else {
+            printf("ERROR: Invalid TMC value. Use OFF or ltn,sid[,groups/s[,copies]], e.g. 1,32,1.5,2.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_TMC_SET;
+    }
+
+    if (strncmp(res, "TMCADD ", 7) == 0) {
+        char *arg = res + 7;
+        if (add_rds_tmc_message(arg)) {
+            printf("TMC message added: %s\n", arg);
+        } else {
+            printf("ERROR: Invalid TMC message (or TMC off). Use id,event,location[,extent[,direction[,minutes]]].\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_TMC_SET;
+    }
+
+    if (strncmp(res, "TMCDEL ", 7) == 0) {
+        char *arg = res + 7;
+        if (remove_rds_tmc_message(arg)) {
+            printf("TMC message(s) removed: %s\n", arg);
+        } else {
+            printf("ERROR: No TMC message %s.\n", arg);
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_TMC_SET;
+    }
+
+    if (strncmp(res, "TDC ", 4) == 0) {
+        char *arg = res + 4;
+        if (set_rds_tdc(arg)) {
+            printf("TDC set to: %s\n", arg);
+        } else {
+            printf("ERROR: Invalid TDC value. Use OFF or file[,channel[,groups/s[,A/B]]], e.g. /tmp/tdc,0,1.5.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_TDC_SET;
+    }
+
+    if (strncmp(res, "EON ", 4) == 0) {
+        char *arg = res + 4;
+        if (set_rds_eon(arg)) {
+            printf("EON set to: %s\n", arg);
+        } else {
+            printf("ERROR: Invalid EON value. Use OFF or PI,PS,AF,MF1,MF2,MF3,MF4,LI,PTY,TP,TA,PIN.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_EON_SET;
+    }
+
+    if (strncmp(res, "EONDEL ", 7) == 0) {
+        char *arg = res + 7;
+        if (remove_rds_eon(arg)) {
+            printf("EON network removed: %s\n", arg);
+        } else {
+            printf("ERROR: No EON network %s.\n", arg);
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_EON_SET;
+    }
+
+    if (strncmp(res, "EONRATE ", 8) == 0) {
+        char *arg = res + 8;
+        if (set_rds_eon_rate(atof(arg))) {
+            printf("EON rate set to: %s groups/s\n", arg);
+        } else {
+            printf("ERROR: Invalid EON rate. Use 14A groups/s, at most 3.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_EON_SET;
+    }
+
+    if (strncmp(res, "EONF ", 5) == 0) {
+        char *arg = res + 5;
+        if (strcmp(arg, "0") == 0) {
+            set_rds_eon("OFF");
+            printf("EON from file set to OFF\n");
+        } else if (strcmp(arg, "1") == 0 || strcmp(arg, "R") == 0 || strcmp(arg, "r") == 0) {
+            if (set_rds_eon_from_file(NULL) < 0) {
+                printf("ERROR: EON from file failed. Could not read rds/eon.txt\n");
+            }
+        } else {
+            printf("ERROR: Invalid EONF value. Use 0, 1, or R.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_EONF_SET;
+    }
+
+    if (strcmp(res, "ODA") == 0) {
+        rds_oda_queue_dump(stdout);
+        fflush(stdout);
+        return CONTROL_PIPE_ODA_DUMP;
+    }
+
+    if (strncmp(res, "EMERGENCY ", 10) == 0) {
+        char *arg = res + 10;
+        if (set_rds_emergency(arg)) {
+            printf("Emergency: %s\n", arg);
+            fflush(stdout);
+            return CONTROL_PIPE_EMERGENCY_SET;  // the caller preempts the samples already rendered
+        }
+        printf("ERROR: Invalid emergency group. Use TA or EWS b,c,d (hexadecimal), e.g. EWS 1,ABCD,1234.\n");
+        fflush(stdout);
+        return -1;
+    }
+
     if (strncmp(res, "RT ", 3) == 0) {
         char *arg = res + 3;
         arg[64] = 0; // RT текст не длиннее 64 символов
@@ -461,6 +608,60 @@ int poll_control_pipe() {
         }
     }
 
+    if (strncmp(res, "AUDIO ", 6) == 0) {
+        char *arg = res + 6;
+        // Новый источник открывается в фоне, затем плавный переход (FADE)
+        if (fm_mpx_switch(strcmp(arg, "NONE") == 0 ? NULL : arg) == 0) {
+            printf("AUDIO switching to: %s\n", arg);
+        } else {
+            printf("ERROR: Could not switch audio source.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_AUDIO_SET;
+    }
+
+    if (strncmp(res, "FADE ", 5) == 0) {
+        char *arg = res + 5;
+        float fade = atof(arg);
+        if (fade >= 0 && fade <= 60) {
+            fm_mpx_set_fade(fade);
+            printf("FADE set to: %.2f s\n", fade);
+        } else {
+            printf("ERROR: Invalid FADE value. Must be between 0 and 60 seconds.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_FADE_SET;
+    }
+
+    if (strncmp(res, "SLA ", 4) == 0) {
+        char *arg = res + 4;
+        if (set_rds_sla(arg)) {
+            printf("SLA set to: %s\n", arg);
+            rds_sla_report(stdout);
+        } else {
+            printf("ERROR: Invalid SLA value. Use OFF or e.g. PS=1,AF=2,RT=4 (seconds).\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_SLA_SET;
+    }
+
+    if (strncmp(res, "RFT ", 4) == 0) {
+        char *arg = res + 4;
+        if (fm_mpx_set_rft(arg) == 0) {
+            printf("RFT file set to: %s\n", arg);
+            fm_mpx_rft_report(stdout);
+        } else {
+            printf("ERROR: Invalid RFT file (at most 160 kB) or specification.\n");
+        }
+        fflush(stdout);
+        return CONTROL_PIPE_RFT_SET;
+    }
+
+    if (strcmp(res, "RELOAD") == 0) {
+        // Перечитывание файла конфигурации выполняет pi_fm_x
+        return CONTROL_PIPE_RELOAD;
+    }
+
     // Если ни одна команда не подошла
     printf("ERROR: Unknown command '%s'\n", res);
     fflush(stdout);
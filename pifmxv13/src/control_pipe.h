@@ -28,7 +28,21 @@
 #define CONTROL_PIPE_RTOFF_SET 28
 #define CONTROL_PIPE_RDSBUG_ON_SET 29
 #define CONTROL_PIPE_RDSBUG_OFF_SET 30
+#define CONTROL_PIPE_RELOAD 31
+#define CONTROL_PIPE_AUDIO_SET 32
+#define CONTROL_PIPE_FADE_SET 33
+#define CONTROL_PIPE_SLA_SET 34
+#define CONTROL_PIPE_RFT_SET 35
+#define CONTROL_PIPE_LPS_SET 36
+#define CONTROL_PIPE_ERT_SET 37
+#define CONTROL_PIPE_TMC_SET 38
+#define CONTROL_PIPE_EMERGENCY_SET 39
+#define CONTROL_PIPE_TDC_SET 40
+#define CONTROL_PIPE_EON_SET 41
+#define CONTROL_PIPE_EONF_SET 42
+#define CONTROL_PIPE_ODA_DUMP 43
 
 extern int open_control_pipe(char *filename);
 extern int close_control_pipe();
-extern int poll_control_pipe();
\ No newline at end of file
+extern int poll_control_pipe();
+extern int process_control_command(char *res);
\ No newline at end of file
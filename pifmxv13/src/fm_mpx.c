@@ -1,9 +1,18 @@
+#include <pthread.h>
+#include <semaphore.h>
 #include <sndfile.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <math.h>
+#include <time.h>
 
 #include "rds.h"
+#include "fm_mpx.h"
+#include "playlist.h"
+#include "net_input.h"
+#include "profile.h"
+#include "rds_rft.h"
 
 
 #define PI 3.141592654
@@ -13,34 +22,97 @@
 #define FIR_SIZE (2*FIR_HALF_SIZE-1)
 
 
-size_t length;
-
-// coefficients of the low-pass FIR filter
-float low_pass_fir[FIR_HALF_SIZE];
-
-
 float carrier_38[] = {0.0, 0.8660254037844386, 0.8660254037844388, 1.2246467991473532e-16, -0.8660254037844384, -0.8660254037844386};
 
 float carrier_19[] = {0.0, 0.5, 0.8660254037844386, 1.0, 0.8660254037844388, 0.5, 1.2246467991473532e-16, -0.5, -0.8660254037844384, -1.0, -0.8660254037844386, -0.5};
-    
-int phase_38 = 0;
-int phase_19 = 0;
-
-
-float downsample_factor;
-
 
-float *audio_buffer;
-int audio_index = 0;
-int audio_len = 0;
-float audio_pos;
 
-float fir_buffer_mono[FIR_SIZE] = {0};
-float fir_buffer_stereo[FIR_SIZE] = {0};
-int fir_index = 0;
-int channels;
-
-SNDFILE *inf;
+/* An audio input, read block by block and upsampled to 228 kHz by sample
+   repetition. A source without file or network input is silent.
+*/
+typedef struct {
+    SNDFILE *inf;
+    net_input *net;
+    int channels;
+    int samplerate;
+    float downsample_factor;
+    float fir[FIR_HALF_SIZE];   // low-pass filter for this sample rate
+    int track;                  // index in the playlist, -1: loop the file
+    sf_count_t frames_left;     // frames of the file not read yet
+
+    float *buffer;
+    int index;
+    int len;
+    float pos;
+} audio_source;
+
+
+/* State of one multiplex generator. Like the RDS encoder, the generator used
+   by the calling thread is selected with fm_mpx_select().
+*/
+struct fm_mpx_state {
+    size_t length;
+
+    // Output gain, folded into the filter, pilot and RDS waveform tables
+    float scale;
+    float pilot_19[12];
+
+    // coefficients of the low-pass FIR filter
+    float low_pass_fir[FIR_HALF_SIZE];
+
+    int phase_38;
+    int phase_19;
+
+    audio_source src;
+
+    float fir_buffer_mono[FIR_SIZE];
+    float fir_buffer_stereo[FIR_SIZE];
+    int fir_index;
+    int mono;           // force monophonic operation for stereo input
+
+    // Source switching: the new source is opened and pre-rolled by a
+    // background thread, then handed over through `pending` and crossfaded
+    audio_source *pending;
+    audio_source next;
+    int switching;
+    int fading;
+    int fade_len;       // in samples at 228 kHz
+    int fade_pos;
+    double fade_gain[2];    // cos/sin of the equal-power crossfade
+    double fade_rot[2];
+    struct timespec switch_time;
+    fm_mpx_switch_stats stats;
+    int stats_ready;
+
+    // Playlist: the next track is opened, pre-rolled and its filter computed
+    // by the prefetch thread, and swapped in at the end of the current one
+    playlist *playlist;
+    int playlist_rds;           // announce each track with RT/RT+
+    int announced;              // 1 + the track last announced, 0: none yet
+    pthread_t prefetch;
+    sem_t prefetch_wake;
+    int prefetch_stop;
+    int next_track;             // used by the prefetch thread only
+    audio_source *prefetched;   // ready to be played
+    audio_source *retired;      // finished track, closed by the prefetch thread
+    unsigned long sample_count; // samples generated since fm_mpx_open()
+    int gap_samples;            // silence while the next track was not ready
+    fm_mpx_track_info track_info;
+    int track_ready;
+
+    // RDS2 streams 1-3: one encoder each, added on their own subcarrier
+    rds_encoder *rds2[RDS2_STREAMS];
+    float rds2_level[RDS2_STREAMS];     // relative to the main RDS stream
+    rds_rft *rft;               // file carousel on one of the streams
+    int rft_stream;
+};
+
+static const double rds2_carriers[RDS2_STREAMS] = { 66500, 71250, 76000 };
+
+static fm_mpx_state fm_mpx_default = { .scale = 1, .fade_len = 228000 };
+
+// Generator used by the calling thread
+static __thread fm_mpx_state *mpx = &fm_mpx_default;
 
 
 
@@ -54,130 +126,587 @@ float *alloc_empty_buffer(size_t length) {
 }
 
 
-int fm_mpx_open(char *filename, size_t len) {
-    length = len;
-
-    if(filename != NULL) {
-        // Open the input file
-        SF_INFO sfinfo;
- 
-        // stdin or file on the filesystem?
-        if(filename[0] == '-') {
-            if(! (inf = sf_open_fd(fileno(stdin), SFM_READ, &sfinfo, 0))) {
-                fprintf(stderr, "Error: could not open stdin for audio input.\n") ;
-                return -1;
-            } else {
-                printf("Using stdin for audio input.\n");
+static double ms_since(struct timespec *t) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t->tv_sec) * 1e3 + (now.tv_nsec - t->tv_nsec) / 1e6;
+}
+
+
+/* Reads the next block of a source, rewinding at the end of the file. For a
+   playlist track, returns 1 at the end of the file instead.
+*/
+static int source_read(audio_source *s, size_t length) {
+    if(s->net != NULL) {
+        // One packet from the jitter buffer (or its concealment)
+        s->len = net_input_read(s->net, s->buffer, length);
+        s->index = 0;
+        return 0;
+    }
+
+    for(int j=0; j<2; j++) { // one retry
+        s->len = sf_read_float(s->inf, s->buffer, length);
+        if (s->len < 0) {
+            fprintf(stderr, "Error reading audio\n");
+            return -1;
+        }
+        s->frames_left -= s->len / s->channels;
+        if(s->len == 0) {
+            if(s->track >= 0) {
+                s->index = 0;
+                return 1;
             }
-        } else {
-            if(! (inf = sf_open(filename, SFM_READ, &sfinfo))) {
-                fprintf(stderr, "Error: could not open input file %s.\n", filename) ;
+            if( sf_seek(s->inf, 0, SEEK_SET) < 0 ) {
+                fprintf(stderr, "Could not rewind in audio file, terminating\n");
                 return -1;
-            } else {
-                printf("Using audio file: %s\n", filename);
             }
+        } else {
+            break;
         }
-            
-        int in_samplerate = sfinfo.samplerate;
-        downsample_factor = 228000. / in_samplerate;
-    
-        printf("Input: %d Hz, upsampling factor: %.2f\n", in_samplerate, downsample_factor);
+    }
+    s->index = 0;
+    return 0;
+}
+
+
+static inline int source_silent(audio_source *s) {
+    return s->inf == NULL && s->net == NULL;
+}
 
-        channels = sfinfo.channels;
-        if(channels > 1) {
-            printf("%d channels, generating stereo multiplex.\n", channels);
+
+static void source_close(audio_source *s) {
+    if(s->inf != NULL && sf_close(s->inf) ) {
+        fprintf(stderr, "Error closing audio file");
+    }
+    net_input_close(s->net);
+    if(s->buffer != NULL) free(s->buffer);
+    memset(s, 0, sizeof(audio_source));
+    s->track = -1;
+}
+
+
+static int next_track(audio_source *s);
+
+
+// RT and RT+ of a playlist track (RT+ off if its title has no tags)
+static void announce_track(int track) {
+    playlist_entry *e = &mpx->playlist->entries[track];
+    set_rds_rt(e->rt);
+    if(e->rtp[0]) set_rds_rtp(e->rtp);
+    else disable_rds_rtp();
+    mpx->announced = track + 1;
+}
+
+
+/* Creates the low-pass FIR filter for the given input sample rate. Does not
+   touch the generator state, so that it can run on the prefetch thread.
+*/
+static float compute_filter(float *fir, int samplerate, float scale) {
+    float cutoff_freq = 15000 * .8;
+    if(samplerate/2 < cutoff_freq) cutoff_freq = samplerate/2 * .8;
+
+    // The audio gain (4.05) and the output scale are folded into
+    // the coefficients
+    float gain = 4.05 * scale;
+
+    fir[FIR_HALF_SIZE-1] = gain * 2 * cutoff_freq / 228000 /2;
+    // Here we divide this coefficient by two because it will be counted twice
+    // when applying the filter
+
+    // Only store half of the filter since it is symmetric
+    for(int i=1; i<FIR_HALF_SIZE; i++) {
+        fir[FIR_HALF_SIZE-1-i] = gain *
+            sin(2 * PI * cutoff_freq * i / 228000) / (PI * i)      // sinc
+            * (.54 - .46 * cos(2*PI * (i+FIR_HALF_SIZE) / (2*FIR_HALF_SIZE)));
+                                                          // Hamming window
+    }
+    return cutoff_freq;
+}
+
+
+/* Opens a source, pre-rolls its first block and computes its filter, so that
+   the source is ready to be played without blocking. filename == NULL gives a
+   silent source.
+*/
+static int source_open(audio_source *s, char *filename, size_t length, float scale) {
+    memset(s, 0, sizeof(audio_source));
+    s->track = -1;
+    if(filename == NULL) return 0;
+
+    // Open the input file
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+
+    // stdin, network or file on the filesystem?
+    if(is_net_input(filename)) {
+        if(! (s->net = net_input_open(filename))) return -1;
+        sfinfo.samplerate = net_input_samplerate(s->net);
+        sfinfo.channels = net_input_channels(s->net);
+    } else if(filename[0] == '-') {
+        if(! (s->inf = sf_open_fd(fileno(stdin), SFM_READ, &sfinfo, 0))) {
+            fprintf(stderr, "Error: could not open stdin for audio input.\n") ;
+            return -1;
         } else {
-            printf("1 channel, monophonic operation.\n");
+            printf("Using stdin for audio input.\n");
         }
-    
-    
-        // Create the low-pass FIR filter
-        float cutoff_freq = 15000 * .8;
-        if(in_samplerate/2 < cutoff_freq) cutoff_freq = in_samplerate/2 * .8;
-    
-    
-    
-        low_pass_fir[FIR_HALF_SIZE-1] = 2 * cutoff_freq / 228000 /2;
-        // Here we divide this coefficient by two because it will be counted twice
-        // when applying the filter
-
-        // Only store half of the filter since it is symmetric
-        for(int i=1; i<FIR_HALF_SIZE; i++) {
-            low_pass_fir[FIR_HALF_SIZE-1-i] = 
-                sin(2 * PI * cutoff_freq * i / 228000) / (PI * i)      // sinc
-                * (.54 - .46 * cos(2*PI * (i+FIR_HALF_SIZE) / (2*FIR_HALF_SIZE)));
-                                                              // Hamming window
+    } else {
+        if(! (s->inf = sf_open(filename, SFM_READ, &sfinfo))) {
+            fprintf(stderr, "Error: could not open input file %s.\n", filename) ;
+            return -1;
+        } else {
+            printf("Using audio file: %s\n", filename);
         }
-        printf("Created low-pass FIR filter for audio channels, with cutoff at %.1f Hz\n", cutoff_freq);
-    
-        /*
-        for(int i=0; i<FIR_HALF_SIZE; i++) {
-            printf("%.5f ", low_pass_fir[i]);
+    }
+
+    s->samplerate = sfinfo.samplerate;
+    s->downsample_factor = 228000. / s->samplerate;
+
+    printf("Input: %d Hz, upsampling factor: %.2f\n", s->samplerate, s->downsample_factor);
+
+    s->channels = sfinfo.channels;
+    s->frames_left = sfinfo.frames;
+    if(s->channels > 1) {
+        printf("%d channels, generating stereo multiplex.\n", s->channels);
+    } else {
+        printf("1 channel, monophonic operation.\n");
+    }
+
+    s->buffer = alloc_empty_buffer(length * s->channels);
+    if(s->buffer == NULL || source_read(s, length) < 0) {
+        source_close(s);
+        return -1;
+    }
+    s->pos = 0;     // the first frame is already in the buffer
+    compute_filter(s->fir, s->samplerate, scale);
+
+    return 0;
+}
+
+
+/* Returns the next sample of a source at 228 kHz, as a sum (mono) and a
+   difference (stereo) signal.
+*/
+static inline int source_next(audio_source *s, size_t length, float *sum, float *diff) {
+    if(source_silent(s)) {
+        *sum = *diff = 0;
+        return 0;
+    }
+
+    if(s->pos >= s->downsample_factor) {
+        s->pos -= s->downsample_factor;
+        s->index += s->channels;
+        s->len -= s->channels;
+        if(s->len <= 0) {
+            int err = source_read(s, length);
+            if(err < 0) return -1;
+            if(err > 0 && next_track(s) < 0) {
+                // The next track is not ready yet: play silence meanwhile
+                mpx->gap_samples++;
+                s->pos = s->downsample_factor;
+                *sum = *diff = 0;
+                return 0;
+            }
         }
-        printf("\n");
-        */
-        
-        audio_pos = downsample_factor;
-        audio_buffer = alloc_empty_buffer(length * channels);
-        if(audio_buffer == NULL) return -1;
+    }
+    s->pos++;
+
+    if(s->channels == 1) {
+        *sum = s->buffer[s->index];
+        *diff = 0;
+    } else {
+        // In stereo operation, generate sum and difference signals
+        *sum = s->buffer[s->index] + s->buffer[s->index+1];
+        *diff = s->buffer[s->index] - s->buffer[s->index+1];
+    }
+    return 0;
+}
+
 
-    } // end if(filename != NULL)
-    else {
-        inf = NULL;
-        // inf == NULL indicates that there is no audio
+/* Opens the next playable track of the playlist into `s`, starting from
+   `*track` (which is advanced). Returns -1 if no track can be opened.
+*/
+static int open_track(fm_mpx_state *state, audio_source *s, int *track) {
+    playlist *pl = state->playlist;
+    for(int tries=0; tries<pl->count; tries++) {
+        int t = *track;
+        *track = (t + 1) % pl->count;
+        if(source_open(s, pl->entries[t].path, state->length, state->scale) == 0) {
+            s->track = t;
+            return 0;
+        }
     }
-    
+    fprintf(stderr, "Error: no track of the playlist can be played.\n");
+    return -1;
+}
+
+
+/* Keeps the next track of the playlist ready. Woken up by the rendering
+   thread when it has taken the prefetched track.
+*/
+static void *prefetch_thread(void *arg) {
+    fm_mpx_state *state = arg;
+    audio_source *spare = NULL;
+
+    for(;;) {
+        sem_wait(&state->prefetch_wake);
+        if(__atomic_load_n(&state->prefetch_stop, __ATOMIC_ACQUIRE)) break;
+
+        // Close the finished track here rather than on the rendering thread
+        audio_source *retired = __atomic_exchange_n(&state->retired, NULL, __ATOMIC_ACQ_REL);
+        if(retired != NULL) {
+            source_close(retired);
+            if(spare == NULL) spare = retired; else free(retired);
+        }
+
+        if(__atomic_load_n(&state->prefetched, __ATOMIC_ACQUIRE) != NULL) continue;
+
+        audio_source *s = spare ? spare : malloc(sizeof(audio_source));
+        spare = NULL;
+        if(s == NULL) continue;
+        if(open_track(state, s, &state->next_track) < 0) {
+            free(s);
+            continue;
+        }
+        __atomic_store_n(&state->prefetched, s, __ATOMIC_RELEASE);
+    }
+
+    audio_source *s = __atomic_exchange_n(&state->prefetched, NULL, __ATOMIC_ACQ_REL);
+    if(s != NULL) source_close(s);
+    free(s);
+    s = __atomic_exchange_n(&state->retired, NULL, __ATOMIC_ACQ_REL);
+    if(s != NULL) source_close(s);
+    free(s);
+    free(spare);
+    return NULL;
+}
+
+
+// Called by the rendering thread
+static void stop_prefetch() {
+    __atomic_store_n(&mpx->prefetch_stop, 1, __ATOMIC_RELEASE);
+    sem_post(&mpx->prefetch_wake);
+}
+
+
+/* Called at the end of a playlist track: swaps in the prefetched track, so
+   that it starts on the very next sample. Returns -1 if it is not ready.
+*/
+static int next_track(audio_source *s) {
+    audio_source *next = __atomic_exchange_n(&mpx->prefetched, NULL, __ATOMIC_ACQ_REL);
+    if(next == NULL) return -1;
+
+    audio_source old = *s;
+    *s = *next;
+    *next = old;
+    __atomic_store_n(&mpx->retired, next, __ATOMIC_RELEASE);
+    sem_post(&mpx->prefetch_wake);
+
+    if(!mpx->fading) memcpy(mpx->low_pass_fir, s->fir, sizeof(mpx->low_pass_fir));
+
+    // Normally announced ahead by render(); otherwise (a track that was not
+    // ready in time) with the next group built
+    playlist_entry *e = &mpx->playlist->entries[s->track];
+    if(mpx->playlist_rds && mpx->announced != s->track + 1) announce_track(s->track);
+
+    mpx->track_info.track = s->track;
+    mpx->track_info.rt = e->rt;
+    mpx->track_info.start_sample = mpx->sample_count;
+    mpx->track_info.gap_samples = mpx->gap_samples;
+    mpx->gap_samples = 0;
+    __atomic_store_n(&mpx->track_ready, 1, __ATOMIC_RELEASE);
     return 0;
 }
 
 
-// samples provided by this function are in 0..10: they need to be divided by
-// 10 after.
+/* Opens the audio input: a file, "-" for stdin, a playlist (an M3U file or a
+   directory, played in a loop without gaps between the tracks) or NULL for
+   no audio.
+*/
+int fm_mpx_open(char *filename, size_t len) {
+    mpx->length = len;
+
+    for(int i=0; i<12; i++) {
+        mpx->pilot_19[i] = .9 * mpx->scale * carrier_19[i];
+    }
+
+    if(is_playlist(filename)) {
+        mpx->playlist = playlist_load(filename);
+        if(mpx->playlist == NULL) return -1;
+        mpx->next_track = 0;
+        if(open_track(mpx, &mpx->src, &mpx->next_track) < 0) return -1;
+        mpx->announced = 0;     // the first track, when rendering starts
+
+        // The prefetch thread starts by opening the second track
+        mpx->prefetch_stop = 0;
+        sem_init(&mpx->prefetch_wake, 0, 1);
+        if(pthread_create(&mpx->prefetch, NULL, prefetch_thread, mpx) != 0) {
+            fprintf(stderr, "Error: could not start the playlist prefetch thread.\n");
+            return -1;
+        }
+    } else {
+        // mpx->src.inf == NULL indicates that there is no audio
+        if(source_open(&mpx->src, filename, len, mpx->scale) < 0) return -1;
+    }
+
+    if(!source_silent(&mpx->src)) {
+        float cutoff_freq = compute_filter(mpx->low_pass_fir, mpx->src.samplerate, mpx->scale);
+        printf("Created low-pass FIR filter for audio channels, with cutoff at %.1f Hz\n", cutoff_freq);
+    }
+
+    return 0;
+}
+
+
+// Announces each track of a playlist with RT (and RT+ if the artist is known)
+void fm_mpx_set_playlist_rds(int enabled) {
+    mpx->playlist_rds = enabled;
+}
+
+
+// Statistics of the network input. Returns -1 if the audio is not received from the network.
+int fm_mpx_net_stats(net_input_stats *stats) {
+    if(mpx->src.net == NULL) return -1;
+    net_input_get_stats(mpx->src.net, stats);
+    return 0;
+}
+
+
+/* Returns 1, and the track in `info`, once after each track change of the
+   playlist.
+*/
+int fm_mpx_track_poll(fm_mpx_track_info *info) {
+    if(!__atomic_load_n(&mpx->track_ready, __ATOMIC_ACQUIRE)) return 0;
+    mpx->track_ready = 0;
+    *info = mpx->track_info;
+    return 1;
+}
+
+
+/* Sets the gain applied to the whole multiplex. Must be called before
+   fm_mpx_open(). With the default scale of 1, the samples are in 0..10.
+*/
+void fm_mpx_set_scale(float scale) {
+    mpx->scale = scale;
+    set_rds_level(scale);
+    for(int i=0; i<RDS2_STREAMS; i++) {
+        if(mpx->rds2[i] == NULL) continue;
+        rds_encoder *prev = rds_encoder_select(mpx->rds2[i]);
+        set_rds_level(scale * mpx->rds2_level[i]);
+        rds_encoder_select(prev);
+    }
+}
+
+
+/* Adds (or changes) the RDS2 stream `stream` (1 to 3: 66.5, 71.25, 76 kHz),
+   from a specification "stream,groups[,level[,phase]]": the groups come
+   from a file or FIFO in either format of rds_group_io.h (NONE: PI and
+   filler 0A groups of its own encoder), the level is relative to the main
+   RDS stream (default 1) and the phase of the subcarrier is in degrees
+   (default 0). The streams must be set before the multiplex is generated,
+   so that their bits are aligned with those of the main stream. Returns 0,
+   or -1 for an invalid specification.
+*/
+int fm_mpx_set_rds2(char *spec) {
+    char groups[256];
+    int stream;
+    float level = 1, phase = 0;
+    if(sscanf(spec, "%d,%255[^,],%f,%f", &stream, groups, &level, &phase) < 2 ||
+       stream < 1 || stream > RDS2_STREAMS || level < 0) return -1;
+
+    rds_encoder *enc = mpx->rds2[stream-1];
+    if(enc == NULL) enc = rds_encoder_new();
+    if(enc == NULL) return -1;
+    uint16_t pi = get_rds_pi();
+    rds_encoder *prev = rds_encoder_select(enc);
+    set_rds_pi(pi);
+    set_rds_ps("");
+    set_rds_ct(0);
+    set_rds_rt_enabled(0);
+    set_rds_carrier(rds2_carriers[stream-1], phase);
+    set_rds_level(mpx->scale * level);
+    int ret = set_rds_group_input(strcmp(groups, "NONE") == 0 ? NULL : groups);
+    rds_encoder_select(prev);
+
+    if(ret < 0) {
+        if(mpx->rds2[stream-1] == NULL) rds_encoder_free(enc);
+        return -1;
+    }
+    mpx->rds2[stream-1] = enc;
+    mpx->rds2_level[stream-1] = level;
+    return 0;
+}
+
+
+/* Sends a file (station logo) with the RDS2 file transfer of rds_rft.h,
+   from a specification "file[,stream[,share[,passes]]]": the data groups
+   take every group of the RDS2 stream (default 1, created without groups
+   if it was not set with fm_mpx_set_rds2()), and the main stream gives one
+   group in `share` (default 16) to the announcement and the chunk CRCs.
+   After the first call, replaces the file: only the chunks that changed
+   are sent again. Returns 0, or -1 for an invalid specification or a file
+   that cannot be read.
+*/
+int fm_mpx_set_rft(char *spec) {
+    char file[256];
+    int stream = mpx->rft ? mpx->rft_stream : 1, share = 16, passes = 0;
+    int n = sscanf(spec, "%255[^,],%d,%d,%d", file, &stream, &share, &passes);
+    if(n < 1 || stream < 1 || stream > RDS2_STREAMS) return -1;
+
+    if(mpx->rft != NULL) {
+        if(stream != mpx->rft_stream) return -1;
+        if(n >= 3) rds_rft_set_share(mpx->rft, share);
+        if(n >= 4) rds_rft_set_passes(mpx->rft, passes);
+        return rds_rft_set_file(mpx->rft, file);
+    }
+
+    if(mpx->rds2[stream-1] == NULL) {
+        char rds2_spec[16];
+        snprintf(rds2_spec, sizeof(rds2_spec), "%d,NONE", stream);
+        if(fm_mpx_set_rds2(rds2_spec) < 0) return -1;
+    }
+    rds_rft *rft = rds_rft_new(stream, 0);
+    if(rft == NULL) return -1;
+    if(rds_rft_set_file(rft, file) < 0) {
+        rds_rft_free(rft);
+        return -1;
+    }
+    rds_rft_set_share(rft, share);
+    rds_rft_set_passes(rft, passes);
+
+    set_rds_group_source(rds_rft_oda_group, rft);
+    rds_encoder *prev = rds_encoder_select(mpx->rds2[stream-1]);
+    set_rds_group_source(rds_rft_data_group, rft);
+    rds_encoder_select(prev);
+    mpx->rft = rft;
+    mpx->rft_stream = stream;
+    return 0;
+}
+
+void fm_mpx_rft_report(FILE *f) {
+    if(mpx->rft) rds_rft_report(mpx->rft, f);
+}
+
+
+// samples provided by this function are in 0..10 (times the scale set with
+// fm_mpx_set_scale()).
 int fm_mpx_get_samples(float *mpx_buffer) {
-    get_rds_samples(mpx_buffer, length);
+    return fm_mpx_get_samples_n(mpx_buffer, mpx->length);
+}
+
+
+static void start_crossfade(audio_source *next) {
+    mpx->pending = NULL;
+    mpx->next = *next;
+    free(next);
+
+    mpx->fading = 1;
+    mpx->fade_pos = 0;
+    mpx->fade_gain[0] = 1;
+    mpx->fade_gain[1] = 0;
+    mpx->fade_rot[0] = cos(PI/2 / mpx->fade_len);
+    mpx->fade_rot[1] = sin(PI/2 / mpx->fade_len);
+
+    // During the crossfade, filter with the lower of the two cut-offs
+    if(!source_silent(&mpx->next) && (source_silent(&mpx->src) || mpx->next.samplerate < mpx->src.samplerate))
+        memcpy(mpx->low_pass_fir, mpx->next.fir, sizeof(mpx->low_pass_fir));
+
+    mpx->stats.start_ms = ms_since(&mpx->switch_time);
+}
+
+
+static void end_crossfade() {
+    source_close(&mpx->src);
+    mpx->src = mpx->next;
+    memset(&mpx->next, 0, sizeof(audio_source));
+    mpx->next.track = -1;
+    mpx->fading = 0;
+    if(!source_silent(&mpx->src)) memcpy(mpx->low_pass_fir, mpx->src.fir, sizeof(mpx->low_pass_fir));
+
+    // The playlist is replaced by the new source
+    if(mpx->playlist != NULL && !mpx->prefetch_stop) stop_prefetch();
+
+    mpx->stats.fade_ms = mpx->fade_len / 228.;
+    __atomic_store_n(&mpx->stats_ready, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&mpx->switching, 0, __ATOMIC_RELEASE);
+}
+
+
+/* Samples at 228 kHz until the first one of the next playlist track, or -1
+   if unknown
+*/
+static long track_samples_left(audio_source *s) {
+    if(s->track < 0 || s->inf == NULL || s->len <= 0) return -1;
+    double frames = s->len / s->channels - 1 + s->frames_left;
+    return (long) ceil(s->downsample_factor - s->pos + frames * s->downsample_factor);
+}
+
+
+/* With -plrt: the first track is announced at once, the next one (once
+   prefetched) in the first group on air from its first sample. Returns the
+   number of RDS samples of the block to render before announcing `*track`,
+   or `count` if none.
+*/
+static int track_announce_at(int count, int *track) {
+    if(!mpx->playlist_rds || mpx->playlist == NULL || mpx->fading || mpx->src.track < 0) return count;
+    if(mpx->announced == 0) {
+        *track = mpx->src.track;
+        return 0;
+    }
+    audio_source *next = __atomic_load_n(&mpx->prefetched, __ATOMIC_ACQUIRE);
+    long left = track_samples_left(&mpx->src);
+    if(next == NULL || mpx->announced == next->track + 1 || left < 0 || left > count + 228000) return count;
+    int split = get_rds_samples_to_group(left);
+    if(split >= count) return count;
+    *track = next->track;
+    return split;
+}
+
 
-    if(inf  == NULL) return 0; // if there is no audio, stop here
+// RDS samples, then the audio source(s) through the FIR low-pass filter
+static int render(float *mpx_buffer, int count) {
+    int track;
+    int split = track_announce_at(count, &track);
+    get_rds_samples(mpx_buffer, split);
+    if(split < count) {
+        announce_track(track);
+        get_rds_samples(mpx_buffer + split, count - split);
+    }
+    for(int i=0; i<RDS2_STREAMS; i++) {
+        if(mpx->rds2[i] == NULL) continue;
+        rds_encoder *prev = rds_encoder_select(mpx->rds2[i]);
+        add_rds_samples(mpx_buffer, count);
+        rds_encoder_select(prev);
+    }
+
+    audio_source *next = __atomic_load_n(&mpx->pending, __ATOMIC_ACQUIRE);
+    if(next != NULL) start_crossfade(next);
+
+    if(source_silent(&mpx->src) && !mpx->fading) { // if there is no audio, stop here
+        mpx->sample_count += count;
+        return 0;
+    }
     
-    for(int i=0; i<length; i++) {
-        if(audio_pos >= downsample_factor) {
-            audio_pos -= downsample_factor;
-            
-            if(audio_len == 0) {
-                for(int j=0; j<2; j++) { // one retry
-                    audio_len = sf_read_float(inf, audio_buffer, length);
-                    if (audio_len < 0) {
-                        fprintf(stderr, "Error reading audio\n");
-                        return -1;
-                    }
-                    if(audio_len == 0) {
-                        if( sf_seek(inf, 0, SEEK_SET) < 0 ) {
-                            fprintf(stderr, "Could not rewind in audio file, terminating\n");
-                            return -1;
-                        }
-                    } else {
-                        break;
-                    }
-                }
-                audio_index = 0;
-            } else {
-                audio_index += channels;
-                audio_len -= channels;
-            }
+    for(int i=0; i<count; i++) {
+        float sum, diff;
+        if(source_next(&mpx->src, mpx->length, &sum, &diff) < 0) return -1;
+
+        if(mpx->fading) {
+            float next_sum, next_diff;
+            if(source_next(&mpx->next, mpx->length, &next_sum, &next_diff) < 0) return -1;
+            sum = mpx->fade_gain[0] * sum + mpx->fade_gain[1] * next_sum;
+            diff = mpx->fade_gain[0] * diff + mpx->fade_gain[1] * next_diff;
+
+            double c = mpx->fade_gain[0], s = mpx->fade_gain[1];
+            mpx->fade_gain[0] = c * mpx->fade_rot[0] - s * mpx->fade_rot[1];
+            mpx->fade_gain[1] = s * mpx->fade_rot[0] + c * mpx->fade_rot[1];
+            if(++mpx->fade_pos >= mpx->fade_len) end_crossfade();
         }
-
         
         // First store the current sample(s) into the FIR filter's ring buffer
-        if(channels == 0) {
-            fir_buffer_mono[fir_index] = audio_buffer[audio_index];
-        } else {
-            // In stereo operation, generate sum and difference signals
-            fir_buffer_mono[fir_index] = 
-                audio_buffer[audio_index] + audio_buffer[audio_index+1];
-            fir_buffer_stereo[fir_index] = 
-                audio_buffer[audio_index] - audio_buffer[audio_index+1];
-        }
-        fir_index++;
-        if(fir_index >= FIR_SIZE) fir_index = 0;
+        mpx->fir_buffer_mono[mpx->fir_index] = sum;
+        mpx->fir_buffer_stereo[mpx->fir_index] = diff;
+        mpx->fir_index++;
+        if(mpx->fir_index >= FIR_SIZE) mpx->fir_index = 0;
         
         // Now apply the FIR low-pass filter
         
@@ -185,20 +714,22 @@ int fm_mpx_get_samples(float *mpx_buffer) {
            the coefficients independently, but two-by-two, thus reducing
            the total number of multiplications by a factor of two
         */
+        int stereo = !mpx->mono &&
+            (mpx->src.channels > 1 || (mpx->fading && mpx->next.channels > 1));
         float out_mono = 0;
         float out_stereo = 0;
-        int ifbi = fir_index;  // ifbi = increasing FIR Buffer Index
-        int dfbi = fir_index;  // dfbi = decreasing FIR Buffer Index
+        int ifbi = mpx->fir_index;  // ifbi = increasing FIR Buffer Index
+        int dfbi = mpx->fir_index;  // dfbi = decreasing FIR Buffer Index
         for(int fi=0; fi<FIR_HALF_SIZE; fi++) {  // fi = Filter Index
             dfbi--;
             if(dfbi < 0) dfbi = FIR_SIZE-1;
             out_mono += 
-                low_pass_fir[fi] * 
-                    (fir_buffer_mono[ifbi] + fir_buffer_mono[dfbi]);
-            if(channels > 1) {
+                mpx->low_pass_fir[fi] * 
+                    (mpx->fir_buffer_mono[ifbi] + mpx->fir_buffer_mono[dfbi]);
+            if(stereo) {
                 out_stereo += 
-                    low_pass_fir[fi] * 
-                        (fir_buffer_stereo[ifbi] + fir_buffer_stereo[dfbi]);
+                    mpx->low_pass_fir[fi] * 
+                        (mpx->fir_buffer_stereo[ifbi] + mpx->fir_buffer_stereo[dfbi]);
             }
             ifbi++;
             if(ifbi >= FIR_SIZE) ifbi = 0;
@@ -208,33 +739,178 @@ int fm_mpx_get_samples(float *mpx_buffer) {
 
         mpx_buffer[i] = 
             mpx_buffer[i] +    // RDS data samples are currently in mpx_buffer
-            4.05*out_mono;     // Unmodulated monophonic (or stereo-sum) signal
+            out_mono;          // Unmodulated monophonic (or stereo-sum) signal
             
-        if(channels>1) {
+        if(stereo) {
             mpx_buffer[i] +=
-                4.05 * carrier_38[phase_38] * out_stereo + // Stereo difference signal
-                .9*carrier_19[phase_19];                  // Stereo pilot tone
+                carrier_38[mpx->phase_38] * out_stereo + // Stereo difference signal
+                mpx->pilot_19[mpx->phase_19];           // Stereo pilot tone
 
-            phase_19++;
-            phase_38++;
-            if(phase_19 >= 12) phase_19 = 0;
-            if(phase_38 >= 6) phase_38 = 0;
+            mpx->phase_19++;
+            mpx->phase_38++;
+            if(mpx->phase_19 >= 12) mpx->phase_19 = 0;
+            if(mpx->phase_38 >= 6) mpx->phase_38 = 0;
         }
-            
-        audio_pos++;   
-        
+
+        mpx->sample_count++;
     }
     
     return 0;
 }
 
 
+// Same as fm_mpx_get_samples(), for an arbitrary number of samples.
+int fm_mpx_get_samples_n(float *mpx_buffer, int count) {
+    PROFILE_BEGIN(PROFILE_MPX);
+    int ret = render(mpx_buffer, count);
+    PROFILE_END(PROFILE_MPX);
+    return ret;
+}
+
+
+typedef struct {
+    fm_mpx_state *state;
+    char *filename;
+} switch_request;
+
+// Opens and pre-rolls the new source away from the rendering thread
+static void *switch_thread(void *arg) {
+    switch_request *req = arg;
+    fm_mpx_state *state = req->state;
+
+    audio_source *s = malloc(sizeof(audio_source));
+    if(s == NULL || source_open(s, req->filename, state->length, state->scale) < 0) {
+        free(s);
+        fprintf(stderr, "Error: audio source not switched, keeping the current one.\n");
+        state->stats.failed = 1;
+        state->stats.ready_ms = ms_since(&state->switch_time);
+        __atomic_store_n(&state->stats_ready, 1, __ATOMIC_RELEASE);
+        __atomic_store_n(&state->switching, 0, __ATOMIC_RELEASE);
+    } else {
+        state->stats.ready_ms = ms_since(&state->switch_time);
+        __atomic_store_n(&state->pending, s, __ATOMIC_RELEASE);
+    }
+
+    free(req->filename);
+    free(req);
+    return NULL;
+}
+
+
+/* Switches to another audio source (NULL: no audio) without interrupting the
+   multiplex: the new source is opened in the background, then crossfaded
+   with the current one by fm_mpx_get_samples(). RDS is not affected.
+   Returns -1 if a switch is already in progress.
+*/
+int fm_mpx_switch(char *filename) {
+    if(__atomic_load_n(&mpx->switching, __ATOMIC_ACQUIRE)) {
+        fprintf(stderr, "Error: an audio source switch is already in progress.\n");
+        return -1;
+    }
+    if(is_playlist(filename)) {
+        fprintf(stderr, "Error: a playlist can only be given at start-up (-audio).\n");
+        return -1;
+    }
+
+    switch_request *req = malloc(sizeof(switch_request));
+    if(req == NULL) return -1;
+    req->state = mpx;
+    req->filename = filename ? strdup(filename) : NULL;
+
+    mpx->switching = 1;
+    mpx->stats_ready = 0;
+    memset(&mpx->stats, 0, sizeof(mpx->stats));
+    clock_gettime(CLOCK_MONOTONIC, &mpx->switch_time);
+
+    pthread_t thread;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int err = pthread_create(&thread, &attr, switch_thread, req);
+    pthread_attr_destroy(&attr);
+    if(err != 0) {
+        fprintf(stderr, "Error: could not start the audio switch thread.\n");
+        mpx->switching = 0;
+        free(req->filename);
+        free(req);
+        return -1;
+    }
+    return 0;
+}
+
+
+// Sets the duration of the crossfade used by fm_mpx_switch()
+void fm_mpx_set_fade(float seconds) {
+    mpx->fade_len = seconds * 228000;
+    if(mpx->fade_len < 1) mpx->fade_len = 1;
+}
+
+
+/* Returns 1, and the timings in `stats`, once after each completed (or
+   failed) switch.
+*/
+int fm_mpx_switch_poll(fm_mpx_switch_stats *stats) {
+    if(!__atomic_load_n(&mpx->stats_ready, __ATOMIC_ACQUIRE)) return 0;
+    mpx->stats_ready = 0;
+    *stats = mpx->stats;
+    return 1;
+}
+
+
+/* Forces monophonic operation (no pilot and no stereo difference signal)
+   even for stereo input. Takes effect immediately.
+*/
+void fm_mpx_set_mono(int mono) {
+    mpx->mono = mono;
+}
+
+
 int fm_mpx_close() {
-    if(sf_close(inf) ) {
-        fprintf(stderr, "Error closing audio file");
+    audio_source *pending = __atomic_exchange_n(&mpx->pending, NULL, __ATOMIC_ACQ_REL);
+    if(pending != NULL) {
+        source_close(pending);
+        free(pending);
+    }
+    source_close(&mpx->next);
+    mpx->fading = 0;
+    source_close(&mpx->src);
+
+    if(mpx->playlist != NULL) {
+        if(!mpx->prefetch_stop) stop_prefetch();
+        pthread_join(mpx->prefetch, NULL);
+        sem_destroy(&mpx->prefetch_wake);
+        playlist_free(mpx->playlist);
+        mpx->playlist = NULL;
     }
-    
-    if(audio_buffer != NULL) free(audio_buffer);
     
     return 0;
-}
\ No newline at end of file
+}
+
+fm_mpx_state *fm_mpx_new() {
+    fm_mpx_state *state = malloc(sizeof(fm_mpx_state));
+    if(state == NULL) return NULL;
+    bzero(state, sizeof(fm_mpx_state));
+    state->scale = 1;
+    state->fade_len = 228000;
+    return state;
+}
+
+void fm_mpx_free(fm_mpx_state *state) {
+    if(state == NULL || state == &fm_mpx_default) return;
+    for(int i=0; i<RDS2_STREAMS; i++) rds_encoder_free(state->rds2[i]);
+    if(state->rft) {
+        set_rds_group_source(NULL, NULL);
+        rds_rft_free(state->rft);
+    }
+    if(mpx == state) mpx = &fm_mpx_default;
+    free(state);
+}
+
+/* Selects the generator used by the calling thread. NULL selects the default
+   generator. Returns the previously selected generator.
+*/
+fm_mpx_state *fm_mpx_select(fm_mpx_state *state) {
+    fm_mpx_state *prev = mpx;
+    mpx = state ? state : &fm_mpx_default;
+    return prev;
+}
@@ -1,3 +1,43 @@
+#include <stdio.h>
+
+#include "net_input.h"
+
+typedef struct fm_mpx_state fm_mpx_state;
+
+// Additional RDS2 streams (66.5, 71.25 and 76 kHz)
+#define RDS2_STREAMS 3
+
+// Timings of an audio source switch, in ms from the request
+typedef struct {
+    double ready_ms;    // new source opened and pre-rolled
+    double start_ms;    // crossfade started in the multiplex
+    double fade_ms;     // duration of the crossfade
+    int failed;         // the new source could not be opened
+} fm_mpx_switch_stats;
+
+// A track change of the playlist
+typedef struct {
+    int track;                  // index in the playlist
+    char *rt;                   // RT announced for the track
+    unsigned long start_sample; // first sample of the track, counted from fm_mpx_open()
+    int gap_samples;            // silence inserted because the track was not ready
+} fm_mpx_track_info;
+
 extern int fm_mpx_open(char *filename, size_t len);
+extern void fm_mpx_set_playlist_rds(int enabled);
+extern int fm_mpx_track_poll(fm_mpx_track_info *info);
+extern int fm_mpx_net_stats(net_input_stats *stats);
+extern void fm_mpx_set_scale(float scale);
+extern int fm_mpx_set_rds2(char *spec);
+extern int fm_mpx_set_rft(char *spec);
+extern void fm_mpx_rft_report(FILE *f);
 extern int fm_mpx_get_samples(float *mpx_buffer);
-extern int fm_mpx_close();
\ No newline at end of file
+extern int fm_mpx_get_samples_n(float *mpx_buffer, int count);
+extern void fm_mpx_set_mono(int mono);
+extern int fm_mpx_switch(char *filename);
+extern void fm_mpx_set_fade(float seconds);
+extern int fm_mpx_switch_poll(fm_mpx_switch_stats *stats);
+extern int fm_mpx_close();
+extern fm_mpx_state *fm_mpx_new();
+extern void fm_mpx_free(fm_mpx_state *state);
+extern fm_mpx_state *fm_mpx_select(fm_mpx_state *state);
\ No newline at end of file
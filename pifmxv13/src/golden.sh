@@ -0,0 +1,100 @@
+#!/bin/sh
+# Renders fixed scenarios through the offline path (rds_wav, with a fixed
+# clock and seed) and compares the multiplex and the generated groups with the
+# golden files in golden/. Used by `make check`; `make golden` rewrites the
+# golden files after an intended change of the output.
+#
+# Usage: ./golden.sh check|update
+
+MODE=${1:-check}
+GOLDEN=golden
+TIME=1700000020        # 2023-11-14 22:13:40 UTC: a minute change after 20 s
+OUT=$(mktemp -d) || exit 1
+trap 'rm -rf "$OUT"' EXIT
+
+# CT uses the local time offset
+TZ=UTC
+export TZ
+
+failed=0
+
+# scenario <name> <audio> <seconds> [rds_wav options]
+scenario() {
+    name=$1; audio=$2; seconds=$3
+    shift 3
+    if ! ./rds_wav "$audio" "$OUT/$name.wav" GOLDEN -time $TIME -seconds $seconds -groups "$OUT/$name.txt" "$@" >/dev/null 2>&1; then
+        echo "$name: rendering failed"
+        failed=1
+        return
+    fi
+    if [ "$MODE" = update ]; then
+        cp "$OUT/$name.wav" "$OUT/$name.txt" $GOLDEN/
+        echo "$name: updated"
+        return
+    fi
+    if ! ./mpx_cmp $GOLDEN/$name.wav "$OUT/$name.wav"; then
+        failed=1
+    fi
+    if ! cmp -s $GOLDEN/$name.txt "$OUT/$name.txt"; then
+        echo "$name: groups differ from $GOLDEN/$name.txt"
+        diff $GOLDEN/$name.txt "$OUT/$name.txt" | head -5
+        failed=1
+    fi
+}
+
+mkdir -p $GOLDEN
+scenario rds NONE 0.5
+scenario mono sound_22050.wav 0.5
+scenario stereo stereo_44100.wav 0.5
+scenario random_pi NONE 0.5 -seed 42
+
+# Group sequence over a minute change (CT), and the decoder loop-back: what the
+# encoder sends must be received without errors
+if ./rds_wav NONE "$OUT/ct.wav" GOLDEN -time $TIME -seconds 30 -groups "$OUT/ct.txt" >/dev/null 2>&1; then
+    if [ "$MODE" = update ]; then
+        cp "$OUT/ct.txt" $GOLDEN/
+        echo "ct: updated"
+    elif ! cmp -s $GOLDEN/ct.txt "$OUT/ct.txt"; then
+        echo "ct: groups differ from $GOLDEN/ct.txt"
+        diff $GOLDEN/ct.txt "$OUT/ct.txt" | head -5
+        failed=1
+    fi
+    if ./rds_dec "$OUT/ct.wav" 2>&1 | grep -q "BLER 0.00%"; then
+        echo "ct: decoded without errors"
+    else
+        echo "ct: decoder loop-back failed"
+        ./rds_dec "$OUT/ct.wav"
+        failed=1
+    fi
+else
+    echo "ct: rendering failed"
+    failed=1
+fi
+
+# Groups built ahead (-lookahead) and dropped at each TA and TP switch: the encoder
+# goes back to its state before them, so the segment sequence and the
+# multiplex are those of the modulator building every group itself
+LOOKAHEAD="-time $TIME -seconds 20 -tatoggle 1.5 -tptoggle 0.7 -rtp 1.0.4,4.6.5 -tmc 1,32,1.5 -tmcadd 1,101,12345,2,0,30
+           -eonf rds/eon.txt -afbf rds/afb.txt -lps Lookahead -ert Lookahead -rtm D
+           -rds2 1,NONE -rft rds/band.txt,1,16,1 -inject $GOLDEN/rds.txt"
+if ./rds_wav NONE "$OUT/sync.wav" GOLDEN $LOOKAHEAD -groups "$OUT/sync.txt" >/dev/null 2>&1 &&
+   ./rds_wav NONE "$OUT/ahead.wav" GOLDEN $LOOKAHEAD -groups "$OUT/ahead.txt" -lookahead 8 >/dev/null 2>"$OUT/ahead.log"; then
+    if ! grep -q "[1-9][0-9]* invalidated" "$OUT/ahead.log"; then
+        echo "lookahead: no group invalidated"
+        failed=1
+    elif ! cmp -s "$OUT/sync.txt" "$OUT/ahead.txt"; then
+        echo "lookahead: groups differ from the render without lookahead"
+        diff "$OUT/sync.txt" "$OUT/ahead.txt" | head -5
+        failed=1
+    elif ! ./mpx_cmp "$OUT/sync.wav" "$OUT/ahead.wav"; then
+        failed=1
+    else
+        echo "lookahead: same groups and multiplex after $(grep -o "[0-9]* invalidated" "$OUT/ahead.log")"
+    fi
+else
+    echo "lookahead: rendering failed"
+    failed=1
+fi
+
+[ $failed -eq 0 ] && echo "All golden checks passed." || echo "Golden checks FAILED."
+exit $failed
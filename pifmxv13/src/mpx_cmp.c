@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sndfile.h>
+
+
+#define LENGTH 22800
+
+
+/* Compares a rendered multiplex with a golden one (make check). A difference
+   of a few LSB is allowed: floating point results depend on the compiler
+   flags (e.g. -ffast-math on ARM).
+*/
+int main(int argc, char **argv) {
+    if(argc < 3) {
+        fprintf(stderr, "Error: missing argument.\n");
+        fprintf(stderr, "Syntax: mpx_cmp <golden.wav> <rendered.wav> [tolerance_lsb]\n");
+        return EXIT_FAILURE;
+    }
+    int tolerance = argc > 3 ? atoi(argv[3]) : 2;
+
+    SF_INFO info_a, info_b;
+    memset(&info_a, 0, sizeof(info_a));
+    memset(&info_b, 0, sizeof(info_b));
+    SNDFILE *a = sf_open(argv[1], SFM_READ, &info_a);
+    SNDFILE *b = sf_open(argv[2], SFM_READ, &info_b);
+    if(a == NULL || b == NULL) {
+        fprintf(stderr, "Error: could not open %s.\n", a == NULL ? argv[1] : argv[2]);
+        return EXIT_FAILURE;
+    }
+    if(info_a.samplerate != info_b.samplerate || info_a.channels != info_b.channels) {
+        fprintf(stderr, "%s: format differs from %s.\n", argv[2], argv[1]);
+        return EXIT_FAILURE;
+    }
+
+    static short buf_a[LENGTH], buf_b[LENGTH];
+    unsigned long pos = 0, differences = 0, worst_pos = 0;
+    int worst = 0;
+    sf_count_t na, nb;
+    for(;;) {
+        na = sf_read_short(a, buf_a, LENGTH);
+        nb = sf_read_short(b, buf_b, LENGTH);
+        sf_count_t n = na < nb ? na : nb;
+        for(sf_count_t i=0; i<n; i++) {
+            int d = abs(buf_a[i] - buf_b[i]);
+            if(d > 0) differences++;
+            if(d > worst) {
+                worst = d;
+                worst_pos = pos + i;
+            }
+        }
+        pos += n;
+        if(na != nb || n == 0) break;
+    }
+    sf_close(a);
+    sf_close(b);
+
+    if(na != nb) {
+        fprintf(stderr, "%s: length differs from %s.\n", argv[2], argv[1]);
+        return EXIT_FAILURE;
+    }
+    if(worst > tolerance) {
+        fprintf(stderr, "%s: %lu sample(s) differ, up to %d LSB at sample %lu.\n",
+                argv[2], differences, worst, worst_pos);
+        return EXIT_FAILURE;
+    }
+    printf("%s: %lu samples, %lu differ by up to %d LSB.\n", argv[2], pos, differences, worst);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,393 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "net_input.h"
+
+
+#define NET_SLOTS 256           // jitter buffer size in packets, divides 65536
+#define NET_MAX_ITEMS 4096      // samples per packet
+#define NET_BATCH 16            // packets per recvmmsg() call
+#define NET_LATE_RESYNC 8       // consecutive late packets taken as a sender restart
+#define NET_PACKET_SIZE (12 + 2 * NET_MAX_ITEMS)
+#define RTP_HEADER_SIZE 12
+
+
+typedef struct {
+    int seq;                    // -1: empty
+    int items;
+    float data[NET_MAX_ITEMS];
+} net_slot;
+
+struct net_input {
+    int fd;
+    int rtp;
+    int samplerate;
+    int channels;
+    int latency_ms;
+
+    pthread_t thread;
+    pthread_mutex_t lock;
+    int stop;
+
+    net_slot slots[NET_SLOTS];
+    uint16_t play_seq;          // next packet to be played
+    uint16_t highest_seq;       // highest packet received
+    uint16_t udp_seq;           // sequence numbers given to plain UDP packets
+    int have_packet;            // at least one packet received
+    int late_run;               // consecutive late packets
+    int started;                // the jitter buffer has reached its target
+    int target_packets;
+    int packet_items;           // nominal packet size, from the first packet
+
+    // Packet loss concealment: the last packet, repeated with decreasing gain
+    float last[NET_MAX_ITEMS];
+    int last_items;
+    float conceal_gain;
+
+    // Interarrival jitter, in timestamp units
+    double jitter;
+    double prev_transit;
+    uint32_t udp_timestamp;
+
+    net_input_stats stats;
+
+    uint8_t packets[NET_BATCH][NET_PACKET_SIZE];   // recvmmsg() batch, receiving thread only
+};
+
+
+int is_net_input(char *name) {
+    return name != NULL && (strncmp(name, "rtp://", 6) == 0 || strncmp(name, "udp://", 6) == 0);
+}
+
+
+static double now_seconds() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+
+// Number of packets from play_seq to highest_seq included: 0 once all were
+// played (play_seq is then highest_seq + 1)
+static int buffered_packets(net_input *n) {
+    if(!n->have_packet) return 0;
+    int depth = (int16_t)(n->highest_seq - n->play_seq) + 1;
+    return depth > 0 ? depth : 0;
+}
+
+
+// Puts one packet into the jitter buffer. Called with the lock held.
+static void store_packet(net_input *n, uint8_t *packet, int size, double arrival) {
+    uint16_t seq;
+    uint32_t timestamp;
+    uint8_t *payload;
+    int items;
+
+    if(n->rtp) {
+        if(size < RTP_HEADER_SIZE || (packet[0] >> 6) != 2) return;
+        int header = RTP_HEADER_SIZE + 4 * (packet[0] & 0x0F);     // CSRC list
+        if(packet[0] & 0x10) {                                      // extension
+            if(size < header + 4) return;
+            header += 4 + 4 * ((packet[header+2] << 8) | packet[header+3]);
+        }
+        if(packet[0] & 0x20) size -= packet[size-1];                // padding
+        if(size <= header) return;
+        seq = (packet[2] << 8) | packet[3];
+        timestamp = (uint32_t) packet[4] << 24 | packet[5] << 16 | packet[6] << 8 | packet[7];
+        payload = packet + header;
+        items = (size - header) / 2;
+    } else {
+        seq = n->udp_seq++;
+        timestamp = n->udp_timestamp;
+        payload = packet;
+        items = size / 2;
+        n->udp_timestamp += items / n->channels;
+    }
+    if(items > NET_MAX_ITEMS) items = NET_MAX_ITEMS;
+    items -= items % n->channels;
+    if(items == 0) return;
+
+    if(!n->have_packet) {
+        n->have_packet = 1;
+        n->play_seq = n->highest_seq = seq;
+        n->packet_items = items;
+        float packet_ms = 1e3 * items / n->channels / n->samplerate;
+        n->target_packets = n->latency_ms / packet_ms + 1;
+        if(n->target_packets > NET_SLOTS / 2) n->target_packets = NET_SLOTS / 2;
+        printf("Network audio: first packet, %d samples (%.1f ms), buffering %d packets.\n",
+               items, packet_ms, n->target_packets);
+    }
+
+    int16_t ahead = (int16_t)(seq - n->play_seq);
+    if(ahead < 0 && ahead > -NET_SLOTS && ++n->late_run < NET_LATE_RESYNC) {
+        n->stats.late++;
+        return;
+    }
+    if(ahead < 0 || ahead >= NET_SLOTS) {
+        // Too far ahead or behind, or late again and again (the sender
+        // restarted with new sequence numbers): start again from this packet
+        for(int i=0; i<NET_SLOTS; i++) n->slots[i].seq = -1;
+        n->play_seq = n->highest_seq = seq;
+        n->started = 0;
+    }
+    n->late_run = 0;
+
+    net_slot *slot = &n->slots[seq % NET_SLOTS];
+    if(slot->seq == seq) {
+        n->stats.duplicates++;
+        return;
+    }
+    if((int16_t)(seq - n->highest_seq) < 0) n->stats.reordered++;
+    else n->highest_seq = seq;
+
+    slot->seq = seq;
+    slot->items = items;
+    if(n->rtp) {
+        for(int i=0; i<items; i++)
+            slot->data[i] = (int16_t)(payload[2*i] << 8 | payload[2*i+1]) / 32768.f;
+    } else {
+        for(int i=0; i<items; i++)
+            slot->data[i] = (int16_t)(payload[2*i+1] << 8 | payload[2*i]) / 32768.f;
+    }
+    n->stats.received++;
+
+    // Interarrival jitter (RFC 3550, section 6.4.1)
+    double transit = arrival * n->samplerate - timestamp;
+    if(n->stats.received > 1) {
+        double d = transit - n->prev_transit;
+        if(d < 0) d = -d;
+        n->jitter += (d - n->jitter) / 16;
+    }
+    n->prev_transit = transit;
+}
+
+
+static void *receive_thread(void *arg) {
+    net_input *n = arg;
+    uint8_t (*packets)[NET_PACKET_SIZE] = n->packets;
+    struct mmsghdr msgs[NET_BATCH];
+    struct iovec iovecs[NET_BATCH];
+
+    while(!__atomic_load_n(&n->stop, __ATOMIC_ACQUIRE)) {
+        memset(msgs, 0, sizeof(msgs));
+        for(int i=0; i<NET_BATCH; i++) {
+            iovecs[i].iov_base = packets[i];
+            iovecs[i].iov_len = NET_PACKET_SIZE;
+            msgs[i].msg_hdr.msg_iov = &iovecs[i];
+            msgs[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        // Blocks for the first packet (or the socket timeout), then takes
+        // whatever else is already queued
+        int count = recvmmsg(n->fd, msgs, NET_BATCH, MSG_WAITFORONE, NULL);
+        if(count <= 0) continue;
+        double arrival = now_seconds();
+
+        pthread_mutex_lock(&n->lock);
+        n->stats.batches++;
+        for(int i=0; i<count; i++) {
+            store_packet(n, packets[i], msgs[i].msg_len, arrival);
+        }
+        pthread_mutex_unlock(&n->lock);
+    }
+    return NULL;
+}
+
+
+// Parses rtp://address:port?options
+static int parse_url(net_input *n, char *url, struct sockaddr_in *addr) {
+    char host[256];
+    n->rtp = strncmp(url, "rtp://", 6) == 0;
+    char *p = url + 6;
+
+    char *colon = strrchr(p, ':');
+    if(colon == NULL || colon - p >= (int) sizeof(host)) return -1;
+    memcpy(host, p, colon - p);
+    host[colon - p] = 0;
+    int port = atoi(colon + 1);
+    if(port <= 0 || port > 65535) return -1;
+
+    char *options = strchr(colon, '?');
+    while(options != NULL) {
+        options++;
+        if(strncmp(options, "rate=", 5) == 0) n->samplerate = atoi(options + 5);
+        else if(strncmp(options, "ch=", 3) == 0) n->channels = atoi(options + 3);
+        else if(strncmp(options, "latency=", 8) == 0) n->latency_ms = atoi(options + 8);
+        else return -1;
+        options = strchr(options, '&');
+    }
+    if(n->samplerate <= 0 || n->channels < 1 || n->channels > 2 || n->latency_ms < 0) return -1;
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_port = htons(port);
+    if(host[0] == 0) {
+        addr->sin_addr.s_addr = htonl(INADDR_ANY);
+    } else if(inet_pton(AF_INET, host, &addr->sin_addr) != 1) {
+        struct hostent *he = gethostbyname(host);
+        if(he == NULL) return -1;
+        memcpy(&addr->sin_addr, he->h_addr_list[0], sizeof(addr->sin_addr));
+    }
+    return 0;
+}
+
+
+net_input *net_input_open(char *url) {
+    net_input *n = calloc(1, sizeof(net_input));
+    if(n == NULL) return NULL;
+    n->samplerate = 48000;
+    n->channels = 2;
+    n->latency_ms = 40;
+    n->fd = -1;
+    n->conceal_gain = 0;
+    for(int i=0; i<NET_SLOTS; i++) n->slots[i].seq = -1;
+
+    struct sockaddr_in addr;
+    if(parse_url(n, url, &addr) < 0) {
+        fprintf(stderr, "Error: invalid network input %s.\n", url);
+        fprintf(stderr, "Syntax: rtp://[address]:port[?rate=48000&ch=2&latency=40] (or udp://)\n");
+        free(n);
+        return NULL;
+    }
+
+    n->fd = socket(AF_INET, SOCK_DGRAM, 0);
+    int one = 1;
+    setsockopt(n->fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    int rcvbuf = 1 << 20;
+    setsockopt(n->fd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+    // Lets the receiving thread notice net_input_close()
+    struct timeval timeout = { 0, 100000 };
+    setsockopt(n->fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    if(n->fd < 0 || bind(n->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Error: could not listen on %s.\n", url);
+        if(n->fd >= 0) close(n->fd);
+        free(n);
+        return NULL;
+    }
+    if(IN_MULTICAST(ntohl(addr.sin_addr.s_addr))) {
+        struct ip_mreq mreq;
+        mreq.imr_multiaddr = addr.sin_addr;
+        mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+        if(setsockopt(n->fd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0) {
+            fprintf(stderr, "Error: could not join multicast group of %s.\n", url);
+        }
+    }
+
+    pthread_mutex_init(&n->lock, NULL);
+    if(pthread_create(&n->thread, NULL, receive_thread, n) != 0) {
+        fprintf(stderr, "Error: could not start the network receiving thread.\n");
+        close(n->fd);
+        free(n);
+        return NULL;
+    }
+
+    printf("Listening for %s audio on %s: %d Hz, %d channel(s), %d ms jitter buffer.\n",
+           n->rtp ? "RTP/L16" : "UDP PCM", url, n->samplerate, n->channels, n->latency_ms);
+    return n;
+}
+
+
+int net_input_samplerate(net_input *n) {
+    return n->samplerate;
+}
+
+
+int net_input_channels(net_input *n) {
+    return n->channels;
+}
+
+
+// Repeats the last packet, 6 dB quieter each time. Called with the lock held.
+static int conceal(net_input *n, float *buffer, int max_items) {
+    int items = n->last_items ? n->last_items : n->packet_items;
+    if(items == 0) items = 256 * n->channels;
+    if(items > max_items) items = max_items - max_items % n->channels;
+
+    n->conceal_gain *= .5;
+    if(n->conceal_gain < .01) n->conceal_gain = 0;
+    for(int i=0; i<items; i++) {
+        buffer[i] = i < n->last_items ? n->conceal_gain * n->last[i] : 0;
+    }
+    return items;
+}
+
+
+/* Reads one packet of audio (interleaved samples, at most max_items) from the
+   jitter buffer. Never blocks: a missing packet is concealed, and audio is
+   concealed as well while the buffer fills up. Returns the number of samples.
+*/
+int net_input_read(net_input *n, float *buffer, int max_items) {
+    int items;
+    pthread_mutex_lock(&n->lock);
+
+    int depth = buffered_packets(n);
+    if(!n->started && depth >= n->target_packets && n->target_packets > 0) n->started = 1;
+
+    if(!n->started) {
+        items = conceal(n, buffer, max_items);
+    } else {
+        // Keep the latency near its target when the sender's clock is faster
+        while(depth > 2 * n->target_packets + 2) {
+            net_slot *slot = &n->slots[n->play_seq % NET_SLOTS];
+            if(slot->seq == n->play_seq) slot->seq = -1;
+            n->play_seq++;
+            depth--;
+            n->stats.dropped++;
+        }
+
+        net_slot *slot = &n->slots[n->play_seq % NET_SLOTS];
+        if(slot->seq == n->play_seq) {
+            items = slot->items < max_items ? slot->items : max_items - max_items % n->channels;
+            memcpy(buffer, slot->data, items * sizeof(float));
+            memcpy(n->last, slot->data, items * sizeof(float));
+            n->last_items = items;
+            n->conceal_gain = 1;
+            slot->seq = -1;
+            n->play_seq++;
+        } else if(depth > 1) {
+            // Lost (later packets are there): conceal it and move on
+            items = conceal(n, buffer, max_items);
+            n->stats.lost++;
+            n->play_seq++;
+        } else {
+            // Nothing to play: conceal and re-buffer
+            items = conceal(n, buffer, max_items);
+            n->stats.underruns++;
+            n->started = 0;
+        }
+    }
+
+    pthread_mutex_unlock(&n->lock);
+    return items;
+}
+
+
+void net_input_get_stats(net_input *n, net_input_stats *stats) {
+    pthread_mutex_lock(&n->lock);
+    *stats = n->stats;
+    stats->jitter_ms = 1e3 * n->jitter / n->samplerate;
+    stats->latency_ms = 1e3 * buffered_packets(n) * n->packet_items / n->channels / n->samplerate;
+    stats->target_ms = n->latency_ms;
+    pthread_mutex_unlock(&n->lock);
+}
+
+
+void net_input_close(net_input *n) {
+    if(n == NULL) return;
+    __atomic_store_n(&n->stop, 1, __ATOMIC_RELEASE);
+    pthread_join(n->thread, NULL);
+    close(n->fd);
+    pthread_mutex_destroy(&n->lock);
+    free(n);
+}
@@ -0,0 +1,36 @@
+#ifndef NET_INPUT_H
+#define NET_INPUT_H
+
+/* Network audio input: 16-bit PCM over UDP, either as RTP/L16 (big-endian,
+   RFC 3551) or as plain datagrams of little-endian samples. Given as
+       rtp://[address]:port[?rate=48000&ch=2&latency=40]
+       udp://[address]:port[?...]
+   A multicast address is joined. Packets are received in batches by a
+   background thread into a jitter buffer ordered by sequence number (the
+   arrival order for plain UDP), and lost packets are concealed.
+*/
+typedef struct net_input net_input;
+
+typedef struct {
+    unsigned long received;     // packets put in the jitter buffer
+    unsigned long lost;         // packets missing when due, concealed
+    unsigned long late;         // packets arrived after being concealed
+    unsigned long duplicates;
+    unsigned long reordered;    // packets arrived after a later one
+    unsigned long dropped;      // packets skipped to keep the latency
+    unsigned long underruns;    // jitter buffer ran empty (re-buffering)
+    unsigned long batches;      // recvmmsg() calls that returned packets
+    double jitter_ms;           // interarrival jitter (RFC 3550)
+    double latency_ms;          // audio currently held in the jitter buffer
+    int target_ms;
+} net_input_stats;
+
+extern int is_net_input(char *name);
+extern net_input *net_input_open(char *url);
+extern int net_input_samplerate(net_input *n);
+extern int net_input_channels(net_input *n);
+extern int net_input_read(net_input *n, float *buffer, int max_items);
+extern void net_input_get_stats(net_input *n, net_input_stats *stats);
+extern void net_input_close(net_input *n);
+
+#endif /* NET_INPUT_H */
@@ -0,0 +1,122 @@
+// The jitter buffer is fed directly, without a socket
+#include "net_input.c"
+
+#include <stdbool.h>
+
+#define TEST_ITEMS 480          // 5 ms of stereo at 48 kHz: 9 packets for 40 ms
+
+static int failures = 0;
+
+void assert_count(char* test_name, unsigned long actual, unsigned long expected) {
+    bool equal = actual == expected;
+    printf("Test: %s -> %s\n", test_name, equal ? "PASS" : "FAIL");
+    if (equal) return;
+    printf("Actual:   %lu\n", actual);
+    printf("Expected: %lu\n", expected);
+    failures++;
+}
+
+net_input *test_input() {
+    net_input *n = calloc(1, sizeof(net_input));
+    n->rtp = 1;
+    n->samplerate = 48000;
+    n->channels = 2;
+    n->latency_ms = 40;
+    n->fd = -1;
+    for (int i=0; i < NET_SLOTS; i++) n->slots[i].seq = -1;
+    pthread_mutex_init(&n->lock, NULL);
+    return n;
+}
+
+void send_packet(net_input *n, uint16_t seq) {
+    static uint8_t packet[RTP_HEADER_SIZE + 2 * TEST_ITEMS];
+    memset(packet, 0, sizeof(packet));
+    packet[0] = 0x80;
+    packet[2] = seq >> 8;
+    packet[3] = seq & 0xFF;
+    store_packet(n, packet, sizeof(packet), 0);
+}
+
+void read_packets(net_input *n, int count) {
+    float buffer[NET_MAX_ITEMS];
+    for (int i=0; i < count; i++) net_input_read(n, buffer, NET_MAX_ITEMS);
+}
+
+void test_drain() {
+    net_input *n = test_input();
+    for (int i=0; i < 9; i++) send_packet(n, 65530 + i);    // across the wrap
+    read_packets(n, 9);
+    assert_count("Drain: empty buffer", buffered_packets(n), 0);
+    assert_count("Drain: nothing dropped", n->stats.dropped, 0);
+    assert_count("Drain: nothing lost", n->stats.lost, 0);
+    free(n);
+}
+
+void test_underrun() {
+    net_input *n = test_input();
+    for (int i=0; i < 9; i++) send_packet(n, 100 + i);
+    read_packets(n, 10);
+    assert_count("Underrun: counted once", n->stats.underruns, 1);
+    assert_count("Underrun: re-buffering", n->started, 0);
+    assert_count("Underrun: nothing dropped", n->stats.dropped, 0);
+    // Playback starts again once the target is reached
+    for (int i=0; i < 9; i++) send_packet(n, 109 + i);
+    read_packets(n, 9);
+    assert_count("Underrun: refilled and played", n->play_seq, 118);
+    assert_count("Underrun: nothing lost", n->stats.lost, 0);
+    free(n);
+}
+
+void test_late() {
+    net_input *n = test_input();
+    for (int i=0; i < 9; i++) send_packet(n, 200 + i);
+    read_packets(n, 9);
+    send_packet(n, 204);
+    assert_count("Late: counted", n->stats.late, 1);
+    assert_count("Late: not buffered", buffered_packets(n), 0);
+    free(n);
+}
+
+void test_sender_restart() {
+    net_input *n = test_input();
+    for (int i=0; i < 9; i++) send_packet(n, 30000 + i);
+    read_packets(n, 9);
+    // New random sequence numbers, far behind: taken at once
+    send_packet(n, 1000);
+    assert_count("Restart far behind: not late", n->stats.late, 0);
+    assert_count("Restart far behind: buffered", buffered_packets(n), 1);
+    for (int i=1; i < 9; i++) send_packet(n, 1000 + i);
+    read_packets(n, 9);
+    assert_count("Restart far behind: played", n->play_seq, 1009);
+    // A few packets behind: late until the run is long enough
+    for (int i=0; i < NET_LATE_RESYNC; i++) send_packet(n, 1000 - 100 + i);
+    assert_count("Restart just behind: late first", n->stats.late, NET_LATE_RESYNC - 1);
+    assert_count("Restart just behind: resynchronized", n->play_seq, 1000 - 100 + NET_LATE_RESYNC - 1);
+    for (int i=NET_LATE_RESYNC; i < NET_LATE_RESYNC + 8; i++) send_packet(n, 1000 - 100 + i);
+    read_packets(n, 9);
+    assert_count("Restart just behind: played", n->stats.underruns, 0);
+    free(n);
+}
+
+void test_lost_and_dropped() {
+    net_input *n = test_input();
+    for (int i=0; i < 9; i++) if (i != 3) send_packet(n, 300 + i);
+    send_packet(n, 309);
+    read_packets(n, 10);
+    assert_count("Lost: concealed", n->stats.lost, 1);
+    // The sender runs fast: the latency goes back to 2 * target + 2 packets
+    for (int i=0; i < 30; i++) send_packet(n, 310 + i);
+    read_packets(n, 1);
+    assert_count("Dropped: to keep the latency", n->stats.dropped, 30 - 20);
+    assert_count("Dropped: buffer depth", buffered_packets(n), 19);
+    free(n);
+}
+
+int main() {
+    test_drain();
+    test_underrun();
+    test_late();
+    test_sender_restart();
+    test_lost_and_dropped();
+    return failures > 0;
+}
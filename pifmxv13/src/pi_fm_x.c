@@ -14,10 +14,16 @@
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sndfile.h>
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#endif
 
 #include "rds.h"
 #include "fm_mpx.h"
 #include "control_pipe.h"
+#include "config_file.h"
+#include "rds_decoder.h"
+#include "profile.h"
 
 #include "mailbox.h"
 #include <ctype.h>
@@ -47,6 +53,8 @@
 
 #define NUM_SAMPLES        50000
 #define NUM_CBS            (NUM_SAMPLES * 2)
+#define PREEMPT_MARGIN     456      // samples left to the DMA before a preemption (2 ms)
+#define PREEMPT_CHUNK      1140     // samples changed between two checks of the DMA (5 ms)
 
 #define BCM2708_DMA_NO_WIDE_BURSTS    (1<<26)
 #define BCM2708_DMA_WAIT_RESP        (1<<3)
@@ -143,6 +151,40 @@ struct control_data_s {
 
 static struct control_data_s *ctl;
 
+// Station configuration file (-cfg), re-read on SIGHUP or RELOAD
+static char *config_file = NULL;
+static station_config config;
+// Values that the keys of the configuration file had on the command line (or
+// by default), given back to a key removed from the file. PS and PTYN have no
+// entry when they were not set: varying PS, PTYN off.
+static station_config defaults;
+static volatile sig_atomic_t reload_requested = 0;
+static char **saved_argv;
+
+// DMA ring underruns (the ring was drained before it was refilled)
+static int underruns = 0;
+static int switch_underruns = 0;    // value of `underruns` when the last audio switch was requested
+
+// Decodes the transmitted multiplex again, to check the RDS on air (-rdsmon)
+static rds_decoder *rds_monitor = NULL;
+
+// Raw group streams (-groups, -groups-bin, -inject)
+static char *groups_file = NULL;
+static int groups_binary = 0;
+static char *inject_file = NULL;
+
+// Long PS (-lps text, up to 32 bytes of UTF-8)
+static char *lps_text = NULL;
+// Enhanced RadioText (-ert text, up to 128 bytes of UTF-8; -ertg group)
+static char *ert_text = NULL;
+// Additional RDS2 streams (-rds2 stream,groups[,level[,phase]])
+static char *rds2_specs[RDS2_STREAMS];
+static int rds2_count = 0;
+// File carousel on an RDS2 stream (-rft file[,stream[,share[,passes]]])
+static char *rft_spec = NULL;
+// RDS groups built ahead of the modulator by a low-priority thread (-lookahead n, 0: off)
+static int lookahead_groups = 0;
+
 static void
 udelay(int us)
 {
@@ -152,7 +194,7 @@ udelay(int us)
 }
 
 static void
-terminate(int num)
+shutdown_tx(void)
 {
     // Stop outputting and generating the clock.
     if (clk_reg && gpio_reg && mbox.virt_addr) {
@@ -175,13 +217,40 @@ terminate(int num)
         unmapmem(mbox.virt_addr, NUM_PAGES * 4096);
         mem_unlock(mbox.handle, mbox.mem_ref);
         mem_free(mbox.handle, mbox.mem_ref);
+        mbox.virt_addr = NULL;
     }
+}
+
+static void
+terminate(int num)
+{
+    shutdown_tx();
 
     printf("Terminating: cleanly deactivated the DMA engine and killed the carrier.\n");
 
     exit(num);
 }
 
+// Used when a configuration change cannot be applied while transmitting
+static void
+restart(void)
+{
+    shutdown_tx();
+
+    printf("Restarting to apply the new configuration.\n");
+    fflush(stdout);
+    execv("/proc/self/exe", saved_argv);
+
+    perror("Could not restart");
+    exit(1);
+}
+
+static void
+request_reload(int num)
+{
+    reload_requested = 1;
+}
+
 static void
 fatal(char *fmt, ...)
 {
@@ -225,17 +294,324 @@ map_peripheral(uint32_t base, uint32_t len)
 
 
 
-#define SUBSIZE 1
 #define DATA_SIZE 5000
 
 
-int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt, char *ptyn, uint8_t pty, int tp, int ta, int ms, uint8_t di_flags, float ppm, char *control_pipe, int lic, int pin_day, int pin_hour, int pin_minute, int rt_channel_mode, int ct_flag, int ctz_offset_minutes, int custom_time_set, int custom_time_is_static, int ct_h, int ct_m, int ct_d, int ct_mo, int ct_y, char* afa_str, int afaf_flag, char* afb_str, int afbf_flag, int pio, int pso, int rto, int varying_ps, int rds_bug) {    // Catch all signals possible - it is vital we kill the DMA engine
+/* Programs the PWM clock, which paces the DMA at 228 kHz.
+
+   Set the range to 2 bits. PLLD is at 500 MHz, therefore to get 228 kHz
+   we need a divisor of 500000000 / 2000 / 228 = 1096.491228
+
+   This is 1096 + 2012*2^-12 theoretically
+
+   However the fractional part may have to be adjusted to take the actual
+   frequency of your Pi's oscillator into account. For example on my Pi,
+   the fractional part should be 1916 instead of 2012 to get exactly
+   228 kHz. However RDS decoding is still okay even at 2012.
+
+   So we use the 'ppm' parameter to compensate for the oscillator error.
+   Changing the divider only pauses the DMA pacing for a few hundred
+   microseconds: the carrier keeps running.
+*/
+static void
+set_pwm_divider(float ppm)
+{
+    float divider = (PLLFREQ/(2000*228*(1.+ppm/1.e6)));
+    uint32_t idivider = (uint32_t) divider;
+    uint32_t fdivider = (uint32_t) ((divider - idivider)*pow(2, 12));
+
+    printf("ppm corr is %.4f, divider is %.4f (%d + %d*2^-12) [nominal 1096.4912].\n",
+                ppm, divider, idivider, fdivider);
+
+    clk_reg[PWMCLK_CNTL] = 0x5A000006;              // Source=PLLD and disable
+    udelay(100);
+    // theorically : 1096 + 2012*2^-12
+    clk_reg[PWMCLK_DIV] = 0x5A000000 | (idivider<<12) | fdivider;
+    udelay(100);
+    clk_reg[PWMCLK_CNTL] = 0x5A000216;              // Source=PLLD and enable + MASH filter 1
+    udelay(100);
+}
+
+static uint32_t
+carrier_freq_ctl(uint32_t carrier_freq)
+{
+    // The fractional part is stored in the lower 12 bits
+    return ((float)(PLLFREQ / carrier_freq)) * ( 1 << 12 );
+}
+
+
+/* Applies one configuration entry. Transmitter settings are only applied
+   when `live` (on reload): at start-up main() has already taken them into
+   account.
+*/
+static void
+apply_config_entry(char *key, char *value, int live, uint32_t *freq_ctl, int *varying_ps, int *restart_needed)
+{
+    char line[CONFIG_KEY_SIZE + CONFIG_VALUE_SIZE + 2];
+
+    if (strcmp(key, "FREQ") == 0) {
+        if (!live) return;
+        uint32_t carrier_freq = 1e6 * atof(value);
+        if (carrier_freq < 76e6 || carrier_freq > 108e6) {
+            printf("ERROR: Invalid FREQ in configuration: %s\n", value);
+            return;
+        }
+        *freq_ctl = carrier_freq_ctl(carrier_freq);
+        printf("Frequency set to %3.1f MHz.\n", carrier_freq/1e6);
+    } else if (strcmp(key, "AUDIO") == 0) {
+        if (!live) return;
+        snprintf(line, sizeof(line), "%s %s", key, value);
+        if (process_control_command(line) == CONTROL_PIPE_AUDIO_SET) switch_underruns = underruns;
+    } else if (strcmp(key, "PPM") == 0) {
+        if (!live) return;
+        set_pwm_divider(atof(value));
+    } else if (strcmp(key, "SM") == 0) {
+        if (!live) return;
+        int mono = (value[0] == 'M' || value[0] == 'm');
+        fm_mpx_set_mono(mono);
+        printf("Sound mode set to: %s\n", mono ? "Mono" : "Stereo");
+    } else if (strcmp(key, "CTL") == 0) {
+        if (!live) return;
+        printf("CTL changed: a restart is required.\n");
+        *restart_needed = 1;
+    } else {
+        snprintf(line, sizeof(line), "%s %s", key, value);
+        if (process_control_command(line) == CONTROL_PIPE_PS_SET) *varying_ps = 0;
+    }
+}
+
+/* Applies the entries of `cfg` that differ from `old`. With old == NULL (at
+   start-up), only the RDS entries are applied: the transmitter settings have
+   already been taken into account by main().
+   FREQ, AUDIO, PPM and SM are applied live, while the carrier keeps running;
+   a change of CTL needs a restart. A key removed from the file goes back to
+   its value in `defaults`.
+*/
+static void
+apply_config(station_config *old, station_config *cfg, uint32_t *freq_ctl, int *varying_ps)
+{
+    int restart_needed = 0;
+
+    for (int i = 0; i < cfg->count; i++) {
+        char *key = cfg->keys[i];
+        char *value = cfg->values[i];
+        char *prev = old ? get_config_value(old, key) : NULL;
+        if (prev && strcmp(prev, value) == 0) continue;
+        apply_config_entry(key, value, old != NULL, freq_ctl, varying_ps, &restart_needed);
+    }
+
+    if (old) {
+        for (int i = 0; i < old->count; i++) {
+            char *key = old->keys[i];
+            if (get_config_value(cfg, key)) continue;
+            char *value = get_config_value(&defaults, key);
+            if (value) {
+                printf("%s removed from configuration: back to %s.\n", key, value);
+                if (strcmp(old->values[i], value) != 0)
+                    apply_config_entry(key, value, 1, freq_ctl, varying_ps, &restart_needed);
+            } else if (strcmp(key, "PS") == 0) {
+                printf("PS removed from configuration: back to varying PS.\n");
+                *varying_ps = 1;
+            } else if (strcmp(key, "PTYN") == 0) {
+                printf("PTYN removed from configuration: back to no PTYN.\n");
+                process_control_command("PTYNOFF");
+            } else {
+                printf("%s removed from configuration: no default, keeping current value.\n", key);
+            }
+        }
+    }
+    fflush(stdout);
+
+    if (restart_needed) restart();
+}
+
+/* Records the value of a key before the configuration file is read. */
+static void
+set_default(char *key, const char *fmt, ...)
+{
+    char value[CONFIG_VALUE_SIZE];
+    va_list ap;
+
+    va_start(ap, fmt);
+    vsnprintf(value, sizeof(value), fmt, ap);
+    va_end(ap);
+    set_config_value(&defaults, key, value);
+}
+
+static void
+reload_config(uint32_t *freq_ctl, int *varying_ps)
+{
+    station_config new_config;
+
+    printf("Reloading configuration from %s.\n", config_file);
+    if (read_config_file(config_file, &new_config) < 0) {
+        printf("ERROR: Configuration not reloaded, keeping current settings.\n");
+        return;
+    }
+    station_config old_config = config;
+    config = new_config;
+    apply_config(&old_config, &config, freq_ctl, varying_ps);
+}
+
+#define RENDER_CHUNK 512
+
+
+/* Divider offsets (rounded down) of `n` samples, added to `base` and stored
+   into the ring. With NEON (aarch64, or armv7 built with -mfpu=neon-vfpv4),
+   4 samples per 16-byte store; otherwise one at a time (armv6 has no
+   vector unit, and its VFP does not vectorize this loop).
+*/
+static void
+store_samples(uint32_t *dst, const float *src, int n, uint32_t base)
+{
+    int i = 0;
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+    uint32x4_t b = vdupq_n_u32(base);
+    for (; i + 4 <= n; i += 4) {
+        float32x4_t x = vld1q_f32(src + i);
+#ifdef __aarch64__
+        int32x4_t t = vcvtmq_s32_f32(x);
+#else
+        // Rounded towards zero: one less where that went up (mask = -1)
+        int32x4_t t = vcvtq_s32_f32(x);
+        t = vaddq_s32(t, vreinterpretq_s32_u32(vcltq_f32(x, vcvtq_f32_s32(t))));
+#endif
+        vst1q_u32(dst + i, vaddq_u32(b, vreinterpretq_u32_s32(t)));
+    }
+#endif
+    for (; i < n; i++)
+        dst[i] = base + (int32_t) floorf(src[i]);
+}
+
+/* Renders `count` samples into a span of the DMA sample ring. The generator
+   output is already scaled to divider offsets (see fm_mpx_set_scale()). It
+   goes through a float chunk that stays in the cache, because the RDS
+   overlap-add and the audio filter accumulate into it: doing that in the
+   uncached ring would read it back sample by sample.
+*/
+static int
+render_samples(uint32_t *dst, int count, uint32_t base)
+{
+    float data[RENDER_CHUNK] __attribute__((aligned(16)));
+
+    while (count > 0) {
+        int n = count < RENDER_CHUNK ? count : RENDER_CHUNK;
+        if (fm_mpx_get_samples_n(data, n) < 0)
+            return -1;
+        if (rds_monitor)
+            rds_decoder_process(rds_monitor, data, n);
+        store_samples(dst, data, n, base);
+        dst += n;
+        count -= n;
+    }
+    return 0;
+}
+
+
+// Sample of the ring the DMA is sending
+static int
+dma_sample(void)
+{
+    size_t cur_cb = mem_phys_to_virt(dma_reg[DMA_CONBLK_AD]);
+    return (cur_cb - (size_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2);
+}
+
+static double
+ms_between(struct timespec *a, struct timespec *b)
+{
+    return (b->tv_sec - a->tv_sec) * 1e3 + (b->tv_nsec - a->tv_nsec) / 1e6;
+}
+
+// Time to re-render one sample when preempting, in seconds: measured at each
+// preemption (the first one assumes 0.2 us), doubled when the DMA got too close
+static double preempt_cost = 2e-7;
+
+// Sample of the ring the DMA is sending, counted from first
+static int
+dma_played(int first)
+{
+    int played = dma_sample() - first;
+    return played < 0 ? played + NUM_SAMPLES : played;
+}
+
+/* EMERGENCY command: the RDS of the samples already in the ring, except the
+   next ones the DMA sends while they are re-rendered (from preempt_cost, twice
+   over, plus PREEMPT_MARGIN), is modulated again with the priority group first
+   and the difference is added to them, PREEMPT_CHUNK samples at a time. If
+   the DMA comes within PREEMPT_MARGIN of the samples not changed yet, the ones
+   it has passed are given up and the rest are still changed: the encoder has
+   already moved on to the preempted groups.
+   Reports the time from the command to the end of the priority group on air.
+*/
+static void
+preempt_ring(struct timespec *cmd_time, int last_sample)
+{
+    static float delta[NUM_SAMPLES];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int first = dma_sample();
+    int unplayed = last_sample - first;
+    if (unplayed < 0)
+        unplayed += NUM_SAMPLES;
+    // m samples left: the re-render of unplayed - m must take less than m / 2
+    double r = 2 * preempt_cost * 228000;
+    int margin = (int) (r * unplayed / (1 + r)) + PREEMPT_MARGIN;
+    int ahead = unplayed > margin ? unplayed - margin : 0;
+
+    int air = rds_preempt(ahead, delta);
+    if (air < 0) {
+        printf("Emergency: could not preempt, the priority group follows the %.0f ms of samples in the ring.\n",
+               unplayed / 228.);
+        return;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double rendered = ms_between(&start, &end);
+    if (ahead > 0) {
+        double cost = rendered / 1e3 / ahead;
+        preempt_cost = cost > preempt_cost ? cost : (preempt_cost + cost) / 2;
+    }
+
+    int pos = last_sample - ahead;
+    if (pos < 0)
+        pos += NUM_SAMPLES;
+    int done = 0, lost = 0;
+    while (done < ahead) {
+        int reached = dma_played(first) + PREEMPT_MARGIN - (unplayed - ahead);
+        if (reached > done) {
+            // Sent (or about to be) unchanged: skip past the DMA
+            int n = (reached < ahead ? reached : ahead) - done;
+            lost += n;
+            done += n;
+            pos = (pos + n) % NUM_SAMPLES;
+            continue;
+        }
+        int n = ahead - done < PREEMPT_CHUNK ? ahead - done : PREEMPT_CHUNK;
+        for (int i = done; i < done + n; i++) {
+            ctl->sample[pos] += (int32_t) lrintf(delta[i]);
+            if (++pos >= NUM_SAMPLES)
+                pos = 0;
+        }
+        done += n;
+    }
+    if (lost > 0) {
+        printf("Warning: the DMA reached the samples being re-rendered, %.1f ms of them sent unchanged: "
+               "the groups on air there are damaged.\n", lost / 228.);
+        preempt_cost *= 2;
+    }
+    printf("Emergency: priority group on air after %.1f ms (%.1f ms of samples re-rendered in %.2f ms, "
+           "%.1f ms ahead of the DMA).\n", ms_between(cmd_time, &start) + (unplayed - ahead + air) / 228.,
+           ahead / 228., rendered, (unplayed - ahead) / 228.);
+}
+
+
+int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt, char *ptyn, uint8_t pty, int tp, int ta, int ms, uint8_t di_flags, float ppm, char *control_pipe, int lic, int pin_day, int pin_hour, int pin_minute, int rt_channel_mode, int ct_flag, int ctz_offset_minutes, int custom_time_set, int custom_time_is_static, int ct_h, int ct_m, int ct_d, int ct_mo, int ct_y, char* afa_str, int afaf_flag, char* afb_str, int afbf_flag, int pio, int pso, int rto, int varying_ps, int rds_bug, int mono, int playlist_rds) {    // Catch all signals possible - it is vital we kill the DMA engine
     // on process exit!
     for (int i = 0; i < 64; i++) {
         struct sigaction sa;
 
         memset(&sa, 0, sizeof(sa));
-        sa.sa_handler = terminate;
+        sa.sa_handler = (i == SIGHUP && config_file) ? request_reload : terminate;
         sigaction(i, &sa, NULL);
     }
 
@@ -279,8 +655,7 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
 
 
     // Calculate the frequency control word
-    // The fractional part is stored in the lower 12 bits
-    uint32_t freq_ctl = ((float)(PLLFREQ / carrier_freq)) * ( 1 << 12 );
+    uint32_t freq_ctl = carrier_freq_ctl(carrier_freq);
 
 
     for (int i = 0; i < NUM_SAMPLES; i++) {
@@ -320,22 +695,9 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
     //
     // So we use the 'ppm' parameter to compensate for the oscillator error
 
-    float divider = (PLLFREQ/(2000*228*(1.+ppm/1.e6)));
-    uint32_t idivider = (uint32_t) divider;
-    uint32_t fdivider = (uint32_t) ((divider - idivider)*pow(2, 12));
-
-    printf("ppm corr is %.4f, divider is %.4f (%d + %d*2^-12) [nominal 1096.4912].\n",
-                ppm, divider, idivider, fdivider);
-
     pwm_reg[PWM_CTL] = 0;
     udelay(10);
-    clk_reg[PWMCLK_CNTL] = 0x5A000006;              // Source=PLLD and disable
-    udelay(100);
-    // theorically : 1096 + 2012*2^-12
-    clk_reg[PWMCLK_DIV] = 0x5A000000 | (idivider<<12) | fdivider;
-    udelay(100);
-    clk_reg[PWMCLK_CNTL] = 0x5A000216;              // Source=PLLD and enable + MASH filter 1
-    udelay(100);
+    set_pwm_divider(ppm);
     pwm_reg[PWM_RNG1] = 2;
     udelay(10);
     pwm_reg[PWM_DMAC] = PWMDMAC_ENAB | PWMDMAC_THRSHLD;
@@ -357,13 +719,12 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
 
     size_t last_cb = (size_t)ctl->cb;
 
-    // Data structures for baseband data
-    float data[DATA_SIZE];
-    int data_len = 0;
-    int data_index = 0;
-
-    // Initialize the baseband generator
+    // Initialize the baseband generator. The deviation and the /10
+    // normalisation are folded into its tables: it outputs divider offsets.
+    fm_mpx_set_scale(DEVIATION / 10.);
+    fm_mpx_set_playlist_rds(playlist_rds);
     if(fm_mpx_open(audio_file, DATA_SIZE) < 0) return 1;
+    fm_mpx_set_mono(mono);
 
     // Initialize the RDS modulator
     char myps[9] = {0};
@@ -371,6 +732,7 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
     set_rds_pi_cyclic_mode(1);
     }
     if (rds_bug) {
+    set_rds_seed(time(NULL));
     set_rds_pi_random_mode(1);
     }
     set_rds_pi(pi);
@@ -419,6 +781,8 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
      }
 }
     if (ptyn) set_rds_ptyn(ptyn);
+    if (lps_text) set_rds_lps(lps_text);
+    if (ert_text) set_rds_ert(ert_text);
     if (lic >= 0) set_rds_lic((uint8_t)lic);
     if (pin_day >= 0) set_rds_pin(pin_day, pin_hour, pin_minute);
     uint16_t count = 0;
@@ -430,12 +794,22 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
     varying_ps = 1;
     }
 
+    for (int i = 0; i < rds2_count; i++) {
+        if (fm_mpx_set_rds2(rds2_specs[i]) < 0) fatal("Invalid RDS2 stream: %s\n", rds2_specs[i]);
+        printf("RDS2 stream: %s\n", rds2_specs[i]);
+    }
+    if (rft_spec) {
+        if (fm_mpx_set_rft(rft_spec) < 0) fatal("Invalid RFT file or specification: %s\n", rft_spec);
+        fm_mpx_rft_report(stdout);
+    }
+
     // Initialize the control pipe reader
     if(control_pipe) {
         printf("Waiting for control pipe `%s` to be opened by the writer, e.g. "
                "by running `cat >%s`.\n", control_pipe, control_pipe);
         if(open_control_pipe(control_pipe) == 0) {
             printf("Reading control commands on %s.\n", control_pipe);
+            if(!set_rds_preempt(1)) printf("Warning: no memory for the emergency preemption.\n");
         } else {
             printf("Failed to open control pipe: %s.\n", control_pipe);
             control_pipe = NULL;
@@ -443,8 +817,32 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
     }
 
 
+    if (config_file) {
+        apply_config(NULL, &config, &freq_ctl, &varying_ps);
+        printf("Send SIGHUP or RELOAD to re-read %s.\n", config_file);
+    }
+
+    if (groups_file) {
+        if (set_rds_group_output(groups_file, groups_binary) < 0)
+            fatal("Could not open the group output %s.\n", groups_file);
+        printf("Writing the RDS groups to %s (%s).\n", groups_file, groups_binary ? "binary" : "RDS Spy hex");
+    }
+    if (inject_file) {
+        if (set_rds_group_input(inject_file) < 0)
+            fatal("Could not open the group input %s.\n", inject_file);
+        printf("Sending the RDS groups read from %s.\n", inject_file);
+    }
+    if (lookahead_groups) {
+        if (!set_rds_lookahead(lookahead_groups)) fatal("Could not start the RDS lookahead thread.\n");
+        printf("Building up to %d RDS groups ahead of the modulator.\n", lookahead_groups);
+    }
+
     printf("Starting to transmit on %3.1f MHz.\n", carrier_freq/1e6);
 
+    struct timespec last_loop, last_stats;
+    clock_gettime(CLOCK_MONOTONIC, &last_loop);
+    last_stats = last_loop;
+
     for (;;) {
         // Default (varying) PS
         if(varying_ps) {
@@ -460,44 +858,116 @@ int tx(uint32_t carrier_freq, char *audio_file, uint16_t pi, char *ps, char *rt,
             count++;
         }
 
-        if(control_pipe && poll_control_pipe() == CONTROL_PIPE_PS_SET) {
-            varying_ps = 0;
+        if(control_pipe) {
+            struct timespec cmd_time;
+            clock_gettime(CLOCK_MONOTONIC, &cmd_time);
+            PROFILE_BEGIN(PROFILE_CONTROL);
+            int cmd = poll_control_pipe();
+            PROFILE_END(PROFILE_CONTROL);
+            if(cmd == CONTROL_PIPE_EMERGENCY_SET)
+                preempt_ring(&cmd_time, (last_cb - (size_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2));
+            if(cmd == CONTROL_PIPE_PS_SET) varying_ps = 0;
+            if(cmd == CONTROL_PIPE_RELOAD && config_file) reload_requested = 1;
+            if(cmd == CONTROL_PIPE_AUDIO_SET) switch_underruns = underruns;
+        }
+
+        if(reload_requested) {
+            reload_requested = 0;
+            reload_config(&freq_ctl, &varying_ps);
+        }
+
+        fm_mpx_switch_stats sw;
+        if(fm_mpx_switch_poll(&sw)) {
+            if(sw.failed) {
+                printf("Audio switch failed after %.1f ms.\n", sw.ready_ms);
+            } else {
+                // Rendered samples go on air once the DMA has played the ring
+                printf("Audio switched: pre-rolled in %.1f ms, crossfade started after %.1f ms "
+                       "(on air after %.1f ms), faded over %.0f ms, %d underrun(s).\n",
+                       sw.ready_ms, sw.start_ms, sw.start_ms + NUM_SAMPLES / 228.,
+                       sw.fade_ms, underruns - switch_underruns);
+            }
+            fflush(stdout);
+        }
+
+        fm_mpx_track_info track;
+        if(fm_mpx_track_poll(&track)) {
+            printf("Track %d starts at sample %lu (on air in about %.0f ms): %s\n",
+                   track.track + 1, track.start_sample, NUM_SAMPLES / 228., track.rt);
+            if(track.gap_samples > 0)
+                printf("Warning: %d samples of silence, the track was not ready in time.\n", track.gap_samples);
+            fflush(stdout);
         }
 
+        // The lookahead thread builds groups while the loop sleeps
+        rds_unlock();
         usleep(5000);
+        rds_lock();
+
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        double loop_time = (now.tv_sec - last_loop.tv_sec) + (now.tv_nsec - last_loop.tv_nsec) / 1e9;
+        last_loop = now;
+
+        // Network audio input, RDS update and monitor statistics, every 10 s
+        if(now.tv_sec - last_stats.tv_sec >= 10) {
+            last_stats = now;
+            net_input_stats ns;
+            if(fm_mpx_net_stats(&ns) == 0) {
+                printf("Network audio: %lu packets, %lu lost, %lu late, %lu reordered, %lu duplicate(s), "
+                       "%lu dropped, %lu underrun(s); jitter %.1f ms, latency %.0f ms (target %d ms).\n",
+                       ns.received, ns.lost, ns.late, ns.reordered, ns.duplicates, ns.dropped, ns.underruns,
+                       ns.jitter_ms, ns.latency_ms + NUM_SAMPLES / 228., ns.target_ms);
+            }
+            rds_update_report(stdout);
+            rds_sla_report(stdout);
+            rds_afb_status(stdout);
+            rds_tmc_status(stdout);
+            rds_tdc_status(stdout);
+            rds_eon_status(stdout);
+            fm_mpx_rft_report(stdout);
+            rds_oda_status(stdout);
+            rds_lookahead_status(stdout);
+            if(rds_monitor) rds_decoder_report(rds_monitor, stdout);
+            if(profiling) profile_report(stdout);
+            fflush(stdout);
+        }
 
-        size_t cur_cb = mem_phys_to_virt(dma_reg[DMA_CONBLK_AD]);
         int last_sample = (last_cb - (size_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2);
-        int this_sample = (cur_cb - (size_t)mbox.virt_addr) / (sizeof(dma_cb_t) * 2);
+        int this_sample = dma_sample();
         int free_slots = this_sample - last_sample;
 
         if (free_slots < 0)
             free_slots += NUM_SAMPLES;
 
-        while (free_slots >= SUBSIZE) {
-            // get more baseband samples if necessary
-            if(data_len == 0) {
-                if( fm_mpx_get_samples(data) < 0 ) {
-                    terminate(0);
-                }
-                data_len = DATA_SIZE;
-                data_index = 0;
-            }
-
-            float dval = data[data_index] * (DEVIATION / 10.);
-            data_index++;
-            data_len--;
-
-            int intval = (int)((floor)(dval));
-            //int frac = (int)((dval - (float)intval) * SUBSIZE);
-
-
-            ctl->sample[last_sample++] = (0x5A << 24 | freq_ctl) + intval; //(frac > j ? intval + 1 : intval);
-            if (last_sample == NUM_SAMPLES)
-                last_sample = 0;
+        // If the whole ring was played since the last refill, the carrier was
+        // modulated with stale samples
+        if (loop_time * 228000 >= NUM_SAMPLES || free_slots >= NUM_SAMPLES - NUM_SAMPLES/20) {
+            underruns++;
+            printf("Warning: DMA ring underrun (%.1f ms since last refill).\n", loop_time * 1e3);
+        }
 
-            free_slots -= SUBSIZE;
+        // The first sample rendered now is played after the rest of the ring:
+        // lets the encoder send CT on time
+        struct timespec wall;
+        clock_gettime(CLOCK_REALTIME, &wall);
+        set_rds_air_time(wall.tv_sec + wall.tv_nsec / 1e9 + (NUM_SAMPLES - free_slots) / 228000.);
+
+        // The free part of the ring is one span, or two if it wraps around
+        uint32_t base = 0x5A << 24 | freq_ctl;
+        int span = free_slots;
+        if (last_sample + span > NUM_SAMPLES)
+            span = NUM_SAMPLES - last_sample;
+        PROFILE_BEGIN(PROFILE_REFILL);
+        if (render_samples(ctl->sample + last_sample, span, base) < 0 ||
+            render_samples(ctl->sample, free_slots - span, base) < 0) {
+            terminate(0);
         }
+        PROFILE_END(PROFILE_REFILL);
+        if (profiling) profile_add_samples(free_slots);
+        last_sample += free_slots;
+        if (last_sample >= NUM_SAMPLES)
+            last_sample -= NUM_SAMPLES;
         last_cb = (size_t)(mbox.virt_addr + last_sample * sizeof(dma_cb_t) * 2);
     }
 
@@ -542,6 +1012,9 @@ int main(int argc, char **argv) {
     int pio_flag = 0;       // Для циклического режима
     int rds_bug_flag = 0;   // Для случайного режима
     int varying_ps = 0;
+    int mono_flag = 0;
+    int playlist_rds_flag = 0;
+    saved_argv = argv;
 
     // Parse command-line arguments
     for(int i=1; i<argc; i++) {
@@ -564,6 +1037,10 @@ int main(int argc, char **argv) {
         rto_flag = 1;
         continue;
        }
+       if(strcmp("-profile", arg) == 0 || strcmp("--profile", arg) == 0) {
+        if(profile_start() < 0) fatal("Profiling: perf_event_open() is not available.\n");
+        continue;
+       }
 
         if(arg[0] == '-' && i+1 < argc) param = argv[i+1];
 
@@ -581,6 +1058,15 @@ int main(int argc, char **argv) {
         } else if(strcmp("-ps", arg)==0 && param != NULL) {
             i++;
             ps = param;
+        } else if(strcmp("-lps", arg)==0 && param != NULL) {
+            i++;
+            lps_text = param;
+        } else if(strcmp("-ert", arg)==0 && param != NULL) {
+            i++;
+            ert_text = param;
+        } else if(strcmp("-ertg", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_ert_group(param)) fatal("Invalid eRT group. Use a type A ODA group: 5A-9A, 11A-13A.\n");
         } else if(strcmp("-rt", arg)==0 && param != NULL) {
             i++;
             rt = param;
@@ -590,6 +1076,62 @@ int main(int argc, char **argv) {
         } else if(strcmp("-ctl", arg)==0 && param != NULL) {
             i++;
             control_pipe = param;
+        } else if(strcmp("-cfg", arg)==0 && param != NULL) {
+            i++;
+            config_file = param;
+        } else if(strcmp("-plrt", arg)==0 && param != NULL) {
+            i++;
+            playlist_rds_flag = atoi(param);
+        } else if((strcmp("-groups", arg)==0 || strcmp("-groups-bin", arg)==0) && param != NULL) {
+            i++;
+            groups_file = param;
+            groups_binary = strcmp("-groups-bin", arg)==0;
+        } else if(strcmp("-inject", arg)==0 && param != NULL) {
+            i++;
+            inject_file = param;
+        } else if(strcmp("-rds2", arg)==0 && param != NULL) {
+            i++;
+            if(rds2_count == RDS2_STREAMS) fatal("At most %d RDS2 streams.\n", RDS2_STREAMS);
+            rds2_specs[rds2_count++] = param;
+        } else if(strcmp("-rft", arg)==0 && param != NULL) {
+            i++;
+            rft_spec = param;
+        } else if(strcmp("-lookahead", arg)==0 && param != NULL) {
+            i++;
+            lookahead_groups = atoi(param);
+            if(lookahead_groups < 0 || lookahead_groups > 8) fatal("Invalid lookahead. Use 0 (off) to 8 groups.\n");
+        } else if(strcmp("-burst", arg)==0 && param != NULL) {
+            i++;
+            set_rds_burst(atoi(param));
+        } else if(strcmp("-tmc", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_tmc(param)) fatal("Invalid TMC value. Use ltn,sid[,groups/s[,copies]], e.g. 1,32,1.5,2.\n");
+            set_default("TMC", "%s", param);
+        } else if(strcmp("-tdc", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_tdc(param)) fatal("Invalid TDC value. Use file[,channel[,groups/s[,A/B]]], e.g. /tmp/tdc,0,1.5.\n");
+            set_default("TDC", "%s", param);
+        } else if(strcmp("-eon", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_eon(param)) fatal("Invalid EON value. Use PI,PS,AF,MF1,MF2,MF3,MF4,LI,PTY,TP,TA,PIN.\n");
+        } else if(strcmp("-eonf", arg)==0 && param != NULL) {
+            i++;
+            if(atoi(param) == 1 && set_rds_eon_from_file(NULL) < 0) fatal("EON set from file: FAILED (check rds/eon.txt)\n");
+        } else if(strcmp("-eonrate", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_eon_rate(atof(param))) fatal("Invalid EON rate. Use 14A groups/s, at most 3.\n");
+        } else if(strcmp("-sla", arg)==0 && param != NULL) {
+            i++;
+            if(!set_rds_sla(param)) fatal("Invalid SLA value. Use OFF or e.g. PS=1,AF=2,RT=4 (seconds).\n");
+            set_default("SLA", "%s", param);
+        } else if(strcmp("-rdsmon", arg)==0 && param != NULL) {
+            i++;
+            if(atoi(param) && rds_monitor == NULL) rds_monitor = rds_decoder_new();
+        } else if(strcmp("-sm", arg)==0 && param != NULL) {
+            i++;
+            if(param[0] == 'M' || param[0] == 'm') mono_flag = 1;
+            else if(param[0] == 'S' || param[0] == 's') mono_flag = 0;
+            else fatal("Invalid SM value. Use S (stereo) or M (mono).\n");
         } else if(strcmp("-ecc", arg)==0 && param != NULL) {
             i++;
             ecc_str = param;
@@ -754,14 +1296,68 @@ int main(int argc, char **argv) {
             }
             } else {
             fatal("Unrecognised argument: %s.\n"
-            "Syntax: pi_fm_x [-freq freq] [-audio file] [-ppm ppm_error] [-rds-bug] [-pi pi_code] [-pioff]\n"
-            "                [-ps ps_text] [-psoff] [-rt rt_text] [-rtoff] [-rts A/B/AB] [-rtp tags] [-rtm P/A/D] [-ctl control_pipe]\n"
+            "Syntax: pi_fm_x [-freq freq] [-audio file] [-ppm ppm_error] [-profile] [-rds-bug] [-pi pi_code] [-pioff]\n"
+            "                [-cfg config_file] [-sm S/M] [-plrt 0/1] [-rdsmon 0/1] [-burst 0/1] [-sla targets] [-tmc ltn,sid[,rate[,copies]]] [-tdc file[,channel[,rate[,A/B]]]] [-eon network] [-eonf 0/1] [-eonrate rate] [-rds2 n,groups[,level[,phase]]] [-rft file[,n[,share[,passes]]]] [-lookahead groups] [-groups file] [-groups-bin file] [-inject file]\n"
+            "                [-ps ps_text] [-psoff] [-lps long_ps_text] [-rt rt_text] [-rtoff] [-ert ert_text] [-ertg group] [-rts A/B/AB] [-rtp tags] [-rtm P/A/D] [-ctl control_pipe]\n"
             "                [-ecc code] [-lic code] [-pty code] [-tp 0/1] [-ta 0/1] [-ms M/S] [-di SACD]\n"
             "                [-pin DD,HH,MM] [-ptyn ptyn_text] [-ct 0/1] [-ctz p|mH[:MM]] [-ctc H:M.D.M.Y] [-cts H:M.D.M.Y]\n"
             "                [-afa 0/freq1 freq2 ...] [-afaf 0/1] [-afb 0/main,af1,af2r...] [-afbf 0/1]\n", arg);
         }
     }
 
+    // Transmitter settings of the configuration file take precedence over
+    // the command line; its RDS settings are applied once tx() has set up
+    // the encoder.
+    if (config_file) {
+        static const char *rts_names[] = { "A", "B", "AB" };
+        set_default("FREQ", "%.4f", carrier_freq/1e6);
+        set_default("AUDIO", "%s", audio_file ? audio_file : "NONE");
+        set_default("PPM", "%g", ppm);
+        set_default("SM", "%s", mono_flag ? "M" : "S");
+        set_default("CTL", "%s", control_pipe ? control_pipe : "");
+        if (!pio_flag && !rds_bug_flag) set_default("PI", "%04X", pi);
+        if (ps) set_default("PS", "%s", ps);
+        set_default("RT", "%s", rt);
+        set_default("PTY", "%d", pty);
+        set_default("TP", "%d", tp_flag);
+        set_default("TA", "%d", ta_flag);
+        set_default("MS", "%s", ms_flag ? "M" : "S");
+        set_default("DI", "%s%s%s%s", di_flags & 1 ? "S" : "", di_flags & 2 ? "A" : "",
+                    di_flags & 4 ? "C" : "", di_flags & 8 ? "D" : "");
+        set_default("ECC", "%s", ecc_str ? ecc_str : "OFF");
+        if (lic_val >= 0) set_default("LIC", "%02X", lic_val); else set_default("LIC", "OFF");
+        if (pin_day >= 0) set_default("PIN", "%d,%d,%d", pin_day, pin_hour, pin_minute); else set_default("PIN", "OFF");
+        if (ptyn) set_default("PTYN", "%s", ptyn);
+        set_default("RTS", "%s", rts_names[rt_channel_mode]);
+        set_default("RTP", "%s", rtp ? rtp : "0");
+        set_default("RTM", "%c", rt_mode);
+        set_default("CT", "%d", ct_flag);
+        set_default("AFA", "%s", afa_str);
+        set_default("AFAF", "%d", afaf_flag);
+        set_default("AFB", "%s", afb_str);
+        set_default("AFBF", "%d", afbf_flag);
+        set_default("LPS", "%s", lps_text ? lps_text : "");
+        set_default("ERT", "%s", ert_text ? ert_text : "OFF");
+        if (!get_config_value(&defaults, "TMC")) set_default("TMC", "OFF");
+        if (!get_config_value(&defaults, "TDC")) set_default("TDC", "OFF");
+        if (!get_config_value(&defaults, "SLA")) set_default("SLA", "OFF");
+
+        if (read_config_file(config_file, &config) < 0)
+            fatal("Could not read configuration file %s.\n", config_file);
+        char *value;
+        if ((value = get_config_value(&config, "FREQ"))) {
+            carrier_freq = 1e6 * atof(value);
+            if(carrier_freq < 76e6 || carrier_freq > 108e6)
+                fatal("Incorrect FREQ in %s. Must be in megahertz, between 76 and 108.\n", config_file);
+        }
+        if ((value = get_config_value(&config, "AUDIO")))
+            audio_file = strcmp(value, "NONE") == 0 ? NULL : value;
+        if ((value = get_config_value(&config, "PPM"))) ppm = atof(value);
+        if ((value = get_config_value(&config, "SM"))) mono_flag = (value[0] == 'M' || value[0] == 'm');
+        if ((value = get_config_value(&config, "CTL"))) control_pipe = value;
+        printf("Configuration: %d entries read from %s.\n", config.count, config_file);
+    }
+
     // Set locale based on the environment variables. This is necessary to decode
     // non-ASCII characters using mbtowc() in rds_strings.c.
     char* locale = setlocale(LC_ALL, "");
@@ -784,6 +1380,8 @@ int main(int argc, char **argv) {
     printf("PS: <Varying>\n");
     varying_ps = 1;
     }
+    if (lps_text) printf("LPS: \"%s\"\n", lps_text);
+    if (ert_text) printf("eRT: \"%s\"\n", ert_text);
 
 // Блок вывода информации о RT
     if (rto_flag) {
@@ -805,6 +1403,7 @@ int main(int argc, char **argv) {
     printf("TP set to: %s\n", tp_flag ? "ON" : "OFF");
     printf("TA set to: %s\n", ta_flag ? "ON" : "OFF");
     printf("M/S set to: %s\n", ms_flag ? "Music" : "Speech");
+    printf("SM set to: %s\n", mono_flag ? "Mono" : "Stereo");
     printf("DI set to: S(%d) A(%d) C(%d) D(%d)\n", (di_flags & 1) > 0, (di_flags & 2) > 0, (di_flags & 4) > 0, (di_flags & 8) > 0);
     if(pin_day != -1) printf("PIN set to: Day %d, %02d:%02d\n", pin_day, pin_hour, pin_minute);
     if(ptyn) printf("PTYN set to: \"%s\"\n", ptyn);
@@ -841,7 +1440,7 @@ int main(int argc, char **argv) {
         }
     }
 
-    int errcode = tx(carrier_freq, audio_file, pi, ps, rt, ptyn, pty, tp_flag, ta_flag, ms_flag, di_flags, ppm, control_pipe, lic_val, pin_day, pin_hour, pin_minute, rt_channel_mode, ct_flag, ctz_offset_minutes, custom_time_set, custom_time_is_static, ct_hour, ct_min, ct_day, ct_mon, ct_year, afa_str, afaf_flag, afb_str, afbf_flag, pio_flag, pso_flag, rto_flag, varying_ps, rds_bug_flag);
+    int errcode = tx(carrier_freq, audio_file, pi, ps, rt, ptyn, pty, tp_flag, ta_flag, ms_flag, di_flags, ppm, control_pipe, lic_val, pin_day, pin_hour, pin_minute, rt_channel_mode, ct_flag, ctz_offset_minutes, custom_time_set, custom_time_is_static, ct_hour, ct_min, ct_day, ct_mon, ct_year, afa_str, afaf_flag, afb_str, afbf_flag, pio_flag, pso_flag, rto_flag, varying_ps, rds_bug_flag, mono_flag, playlist_rds_flag);
 
     if (afa_str_is_dynamic) {
         free(afa_str);
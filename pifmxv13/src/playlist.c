@@ -0,0 +1,179 @@
+#define _GNU_SOURCE
+#include <ctype.h>
+#include <dirent.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+
+#include "playlist.h"
+
+
+// A playlist is a directory or a file whose name ends in .m3u or .m3u8
+int is_playlist(char *name) {
+    struct stat st;
+    if (name == NULL || strcmp(name, "-") == 0) return 0;
+    if (stat(name, &st) == 0 && S_ISDIR(st.st_mode)) return 1;
+
+    char *ext = strrchr(name, '.');
+    return ext != NULL && (strcasecmp(ext, ".m3u") == 0 || strcasecmp(ext, ".m3u8") == 0);
+}
+
+
+/* Fills the RT of an entry from "Artist - Title" (the #EXTINF title, or the
+   file name without directory and extension). RT+ tags ITEM.TITLE (1) and
+   ITEM.ARTIST (4) are added when both parts are present.
+*/
+static void set_entry_text(playlist_entry *e, char *title) {
+    while (isspace((unsigned char)*title)) title++;
+    snprintf(e->rt, sizeof(e->rt), "%s", title);
+    e->rtp[0] = 0;
+
+    char *sep = strstr(e->rt, " - ");
+    if (sep == NULL) return;
+    int artist_len = sep - e->rt;
+    int title_start = artist_len + 3;
+    int title_len = strlen(e->rt) - title_start;
+    if (artist_len < 1 || title_len < 1) return;
+
+    // Length markers are the length minus one; the second tag only has 5 bits
+    if (artist_len > 32) artist_len = 32;
+    if (title_start > 63) return;
+    snprintf(e->rtp, sizeof(e->rtp), "1.%d.%d,4.0.%d", title_start, title_len - 1, artist_len - 1);
+}
+
+
+static int add_entry(playlist *pl, int *size, char *path, char *title) {
+    if (pl->count == *size) {
+        int new_size = *size ? 2 * *size : 16;
+        playlist_entry *entries = realloc(pl->entries, new_size * sizeof(playlist_entry));
+        if (entries == NULL) return -1;
+        pl->entries = entries;
+        *size = new_size;
+    }
+
+    playlist_entry *e = &pl->entries[pl->count];
+    e->path = strdup(path);
+    if (e->path == NULL) return -1;
+
+    if (title == NULL) {
+        // Use the file name without its directory and extension
+        char name[256];
+        char *base = strrchr(path, '/');
+        snprintf(name, sizeof(name), "%s", base ? base + 1 : path);
+        char *ext = strrchr(name, '.');
+        if (ext != NULL && ext != name) *ext = 0;
+        set_entry_text(e, name);
+    } else {
+        set_entry_text(e, title);
+    }
+    pl->count++;
+    return 0;
+}
+
+
+static int compare_names(const void *a, const void *b) {
+    return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+
+static int load_directory(playlist *pl, char *dirname) {
+    DIR *dir = opendir(dirname);
+    if (dir == NULL) return -1;
+
+    char **names = NULL;
+    int count = 0, size = 0;
+    struct dirent *de;
+    while ((de = readdir(dir)) != NULL) {
+        if (de->d_name[0] == '.') continue;
+        char path[1024];
+        snprintf(path, sizeof(path), "%s/%s", dirname, de->d_name);
+        struct stat st;
+        if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        if (count == size) {
+            size = size ? 2 * size : 16;
+            char **n = realloc(names, size * sizeof(char *));
+            if (n == NULL) break;
+            names = n;
+        }
+        names[count++] = strdup(path);
+    }
+    closedir(dir);
+
+    qsort(names, count, sizeof(char *), compare_names);
+    int entries_size = 0;
+    for (int i = 0; i < count; i++) {
+        add_entry(pl, &entries_size, names[i], NULL);
+        free(names[i]);
+    }
+    free(names);
+    return 0;
+}
+
+
+// Relative paths in an M3U file are relative to the directory of the file
+static int load_m3u(playlist *pl, char *filename) {
+    FILE *f = fopen(filename, "r");
+    if (f == NULL) return -1;
+
+    char dir[1024];
+    snprintf(dir, sizeof(dir), "%s", filename);
+    char *slash = strrchr(dir, '/');
+    if (slash) slash[1] = 0; else dir[0] = 0;
+
+    char line[1024];
+    char title[256];
+    int have_title = 0;
+    int size = 0;
+    while (fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if (strncmp(line, "#EXTINF:", 8) == 0) {
+            // #EXTINF:duration,Artist - Title
+            char *comma = strchr(line, ',');
+            if (comma) {
+                snprintf(title, sizeof(title), "%s", comma + 1);
+                have_title = 1;
+            }
+            continue;
+        }
+        if (line[0] == '#' || line[0] == 0) continue;
+
+        char path[2048];
+        if (line[0] == '/') snprintf(path, sizeof(path), "%s", line);
+        else snprintf(path, sizeof(path), "%s%s", dir, line);
+        add_entry(pl, &size, path, have_title ? title : NULL);
+        have_title = 0;
+    }
+    fclose(f);
+    return 0;
+}
+
+
+/*
+ * Reads a playlist. Returns NULL if it cannot be read or is empty.
+ */
+playlist *playlist_load(char *name) {
+    playlist *pl = calloc(1, sizeof(playlist));
+    if (pl == NULL) return NULL;
+
+    struct stat st;
+    int err = (stat(name, &st) == 0 && S_ISDIR(st.st_mode)) ?
+        load_directory(pl, name) : load_m3u(pl, name);
+
+    if (err < 0 || pl->count == 0) {
+        fprintf(stderr, "Error: could not read playlist %s, or it is empty.\n", name);
+        playlist_free(pl);
+        return NULL;
+    }
+    printf("Playlist %s: %d tracks.\n", name, pl->count);
+    return pl;
+}
+
+
+void playlist_free(playlist *pl) {
+    if (pl == NULL) return;
+    for (int i = 0; i < pl->count; i++) free(pl->entries[i].path);
+    free(pl->entries);
+    free(pl);
+}
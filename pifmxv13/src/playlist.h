@@ -0,0 +1,24 @@
+#ifndef PLAYLIST_H
+#define PLAYLIST_H
+
+/* Playlist for the audio input: an M3U file or a directory (all its files,
+   in alphabetical order). Each entry carries the RadioText announced when
+   the track starts and, if the artist and title are known, RT+ tags in the
+   format of set_rds_rtp().
+*/
+typedef struct {
+    char *path;
+    char rt[64];        // set_rds_rt() sends 63 characters at most
+    char rtp[32];       // empty if no RT+ tags
+} playlist_entry;
+
+typedef struct {
+    int count;
+    playlist_entry *entries;
+} playlist;
+
+extern int is_playlist(char *name);
+extern playlist *playlist_load(char *name);
+extern void playlist_free(playlist *pl);
+
+#endif /* PLAYLIST_H */
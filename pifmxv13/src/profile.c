@@ -0,0 +1,162 @@
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "profile.h"
+
+
+enum { COUNT_TIME, COUNT_CYCLES, COUNT_INSTRUCTIONS, COUNT_MISSES, COUNTERS };
+
+int profiling = 0;
+
+// Counter group of each thread, opened at its first stage (-2: not yet,
+// -1: not available)
+static __thread int group_fd = -2;
+static __thread int counters;
+static __thread int order[COUNTERS];       // counter of each value read
+static __thread uint64_t start[PROFILE_STAGES][COUNTERS];
+static __thread unsigned active;            // bit mask of the stages begun and not ended
+
+static int available;                       // bit mask of the counters that work
+static uint64_t totals[PROFILE_STAGES][COUNTERS];
+static uint64_t nested[PROFILE_STAGES][COUNTERS];  // of the stages run inside each one
+static unsigned long calls[PROFILE_STAGES];
+static long samples;
+static struct timespec period_start;
+
+static const char *stage_names[PROFILE_STAGES] = {
+    "refill", "multiplex", "rds samples", "rds group", "control pipe"
+};
+// Enclosing stage, to separate the time of a stage from that of its nested
+// stages. A stage only counts as nested when its parent is running in the same
+// thread: the groups built by the lookahead thread are not in "rds samples".
+static const int parent[PROFILE_STAGES] = {
+    -1, PROFILE_REFILL, PROFILE_MPX, PROFILE_RDS_SAMPLES, -1
+};
+
+
+static int open_counter(uint32_t type, uint64_t config, int group) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+}
+
+static void add_counter(int fd, int counter) {
+    if (fd < 0) return;
+    order[counters++] = counter;
+    __atomic_fetch_or(&available, 1 << counter, __ATOMIC_RELAXED);
+}
+
+/* Counters of the calling thread: CPU cycles, instructions and cache misses
+   if the CPU has a usable PMU, and the CPU time of the thread in any case
+*/
+static void open_thread_counters() {
+    counters = 0;
+    group_fd = open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, -1);
+    if (group_fd >= 0) {
+        add_counter(group_fd, COUNT_CYCLES);
+        add_counter(open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, group_fd), COUNT_INSTRUCTIONS);
+        add_counter(open_counter(PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, group_fd), COUNT_MISSES);
+        add_counter(open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, group_fd), COUNT_TIME);
+    } else {
+        group_fd = open_counter(PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, -1);
+        add_counter(group_fd, COUNT_TIME);
+    }
+}
+
+static int read_counters(uint64_t *values) {
+    uint64_t buf[1 + COUNTERS];
+    if (read(group_fd, buf, sizeof(buf)) < (ssize_t) sizeof(uint64_t)) return -1;
+    for (int i = 0; i < counters && i < (int) buf[0]; i++) values[order[i]] = buf[1 + i];
+    return 0;
+}
+
+
+/* Enables the profiling. Returns -1 if no counter can be opened. */
+int profile_start() {
+    clock_gettime(CLOCK_MONOTONIC, &period_start);
+    open_thread_counters();
+    if (group_fd < 0) return -1;
+    profiling = 1;
+    return 0;
+}
+
+void profile_begin(int stage) {
+    if (group_fd == -2) open_thread_counters();
+    if (group_fd < 0) return;
+    read_counters(start[stage]);
+    active |= 1u << stage;
+}
+
+void profile_end(int stage) {
+    if (group_fd < 0) return;
+    active &= ~(1u << stage);
+    uint64_t now[COUNTERS] = {0};
+    if (read_counters(now) < 0) return;
+    int p = parent[stage];
+    for (int c = 0; c < COUNTERS; c++) {
+        __atomic_fetch_add(&totals[stage][c], now[c] - start[stage][c], __ATOMIC_RELAXED);
+        if (p >= 0 && (active & (1u << p)))
+            __atomic_fetch_add(&nested[p][c], now[c] - start[stage][c], __ATOMIC_RELAXED);
+    }
+    __atomic_fetch_add(&calls[stage], 1, __ATOMIC_RELAXED);
+}
+
+/* Counts the output samples, for the per-sample figures of the report */
+void profile_add_samples(long n) {
+    __atomic_fetch_add(&samples, n, __ATOMIC_RELAXED);
+}
+
+
+/* Prints the breakdown since the previous report, then starts a new period.
+   "self" excludes the nested stages: the multiplex without the RDS samples
+   is the audio path (FIR filter), the refill without the multiplex is the
+   conversion and the stores into the DMA ring.
+*/
+void profile_report(FILE *f) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double wall = (now.tv_sec - period_start.tv_sec) + (now.tv_nsec - period_start.tv_nsec) / 1e9;
+    period_start = now;
+
+    uint64_t t[PROFILE_STAGES][COUNTERS], self[PROFILE_STAGES][COUNTERS];
+    unsigned long n[PROFILE_STAGES];
+    for (int s = 0; s < PROFILE_STAGES; s++) {
+        for (int c = 0; c < COUNTERS; c++) {
+            t[s][c] = __atomic_exchange_n(&totals[s][c], 0, __ATOMIC_RELAXED);
+            uint64_t in = __atomic_exchange_n(&nested[s][c], 0, __ATOMIC_RELAXED);
+            self[s][c] = t[s][c] > in ? t[s][c] - in : 0;
+        }
+        n[s] = __atomic_exchange_n(&calls[s], 0, __ATOMIC_RELAXED);
+    }
+    long count = __atomic_exchange_n(&samples, 0, __ATOMIC_RELAXED);
+
+    int hw = available & (1 << COUNT_CYCLES);
+    double per = count > 0 ? 1. / count : 0;
+    fprintf(f, "Profile: %.1f s, %ld samples", wall, count);
+    if (!hw) fprintf(f, " (no hardware counters: CPU time only)");
+    fprintf(f, "\n  %-13s %8s %7s %7s %s\n", "stage", "calls", "CPU %", "self %",
+            hw ? "cycles/sample   self    IPC  misses/ksample" : "ns/sample   self");
+    for (int s = 0; s < PROFILE_STAGES; s++) {
+        if (n[s] == 0) continue;
+        fprintf(f, "  %-13s %8lu %7.2f %7.2f", stage_names[s], n[s],
+                100 * t[s][COUNT_TIME] / 1e9 / wall, 100 * self[s][COUNT_TIME] / 1e9 / wall);
+        if (hw) {
+            double ipc = t[s][COUNT_CYCLES] ? (double) t[s][COUNT_INSTRUCTIONS] / t[s][COUNT_CYCLES] : 0;
+            fprintf(f, " %13.1f %6.1f %6.2f %15.2f\n", t[s][COUNT_CYCLES] * per, self[s][COUNT_CYCLES] * per,
+                    ipc, 1000 * t[s][COUNT_MISSES] * per);
+        } else {
+            fprintf(f, " %9.1f %6.1f\n", t[s][COUNT_TIME] * per, self[s][COUNT_TIME] * per);
+        }
+    }
+}
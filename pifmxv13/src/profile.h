@@ -0,0 +1,32 @@
+#ifndef PROFILE_H
+#define PROFILE_H
+
+#include <stdio.h>
+
+/* Per-stage counters (perf_event_open): CPU cycles, instructions and cache
+   misses when the CPU exposes them, and the CPU time of the thread. Stages
+   are nested: refill > multiplex > RDS samples > RDS group; the report gives
+   the time of each stage with and without its nested stages. The groups
+   built by the lookahead thread count in RDS group only.
+*/
+enum {
+    PROFILE_REFILL,         // refill of the DMA ring (pi_fm_x)
+    PROFILE_MPX,            // fm_mpx_get_samples(): audio, FIR filter, stereo
+    PROFILE_RDS_SAMPLES,    // get_rds_samples(): biphase overlap-add
+    PROFILE_RDS_GROUP,      // get_rds_group(), build_ahead(): group building, CRC
+    PROFILE_CONTROL,        // poll_control_pipe()
+    PROFILE_STAGES
+};
+
+extern int profiling;
+
+extern int profile_start();
+extern void profile_begin(int stage);
+extern void profile_end(int stage);
+extern void profile_add_samples(long samples);
+extern void profile_report(FILE *f);
+
+#define PROFILE_BEGIN(stage) do { if (profiling) profile_begin(stage); } while (0)
+#define PROFILE_END(stage) do { if (profiling) profile_end(stage); } while (0)
+
+#endif /* PROFILE_H */
@@ -1,24 +1,146 @@
 #include <stdint.h>
+#include <stddef.h>
 #include <string.h>
+#include <strings.h>
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <math.h>
+#include <sys/stat.h>
 
+#include "rds.h"
+#include "rds_group_io.h"
+#include "profile.h"
 #include "rds_strings.h"
+#include "rds_tmc.h"
+#include "rds_tdc.h"
+#include "rds_afb.h"
+#include "rds_eon.h"
+#include "rds_oda.h"
+#include "rds_lookahead.h"
 #include "waveforms.h"
 
 #define RT_LENGTH 64
 #define PS_LENGTH 8
+#define LPS_LENGTH 32       // Long PS: UTF-8 bytes, 8 segments of 15A
+#define ERT_LENGTH 128      // eRT: UTF-8 bytes, 32 segments
+#define ERT_AID 0x6552
 #define GROUP_LENGTH 4
 #define MAX_AF_FREQUENCIES 25
 
+/* The RDS error-detection code generator polynomial is
+   x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + x^0
+*/
+#define POLY 0x1B9
+#define POLY_DEG 10
+#define OFFSET_C_PRIME 0x350    // block 3 of the version B groups
+#define MSB_BIT 0x8000
+#define BLOCK_SIZE 16
+
+#define BITS_PER_GROUP (GROUP_LENGTH * (BLOCK_SIZE+POLY_DEG))
+#define SAMPLES_PER_BIT 192
+#define FILTER_SIZE (sizeof(waveform_biphase)/sizeof(float))
+#define SAMPLE_BUFFER_SIZE (SAMPLES_PER_BIT + FILTER_SIZE)
+#define SAMPLE_RATE 228000.
+#define GROUP_SAMPLES (BITS_PER_GROUP * SAMPLES_PER_BIT)
+#define GROUPS_PER_SECOND (SAMPLE_RATE / GROUP_SAMPLES)
+// The first bit of a group is on air about one bit after get_rds_group()
+// (biphase waveform centred 1.5 bits into the sample buffer)
+#define MODULATOR_DELAY SAMPLES_PER_BIT
+// Subcarriers locked to the sample clock: a whole number of cycles in at
+// most this many samples (57 kHz: 4, RDS2 66.5 kHz: 24, 71.25 kHz: 16, 76 kHz: 3)
+#define MAX_CARRIER_PERIOD 48
+// Emergency preemption (rds_preempt()): modulator snapshots at the start of
+// the last groups, and the samples modulated since the oldest one
+#define PREEMPT_GROUPS 8
+#define PREEMPT_HISTORY (PREEMPT_GROUPS * GROUP_SAMPLES)
+#define EMERGENCY_COPIES 2      // priority groups sent in a row
+
 const uint16_t cyclic_pi_sequence[] = {0xA121, 0x2121, 0x012A, 0xA120, 0x012F, 0x0128, 0x0129, 0xBEEF};
 const int cyclic_pi_sequence_size = sizeof(cyclic_pi_sequence) / sizeof(uint16_t);
 
 enum ct_mode { CT_SYSTEM, CT_CUSTOM_TICKING, CT_CUSTOM_STATIC };
 
+/* Services with a target repetition interval (set_rds_sla()), and the group
+   type that carries each of them
+*/
+enum { SERVICE_PS, SERVICE_TA, SERVICE_AF, SERVICE_RT, SERVICE_RTP, SERVICE_1A, SERVICE_PTYN, SERVICE_LPS,
+       SERVICE_ERT, SERVICES };
+enum { SOURCE_0A, SOURCE_2A, SOURCE_RTP, SOURCE_1A, SOURCE_10A, SOURCE_15A, SOURCE_ERT, SOURCES };
+static const char *service_names[SERVICES] = {"PS", "TA", "AF", "RT", "RTP", "1A", "PTYN", "LPS", "ERT"};
+static const char *source_names[SOURCES] = {"0A", "2A", "3A/12A", "1A", "10A", "15A", "3A/eRT"};
+static const int service_source[SERVICES] = {
+    SOURCE_0A, SOURCE_0A, SOURCE_0A, SOURCE_2A, SOURCE_RTP, SOURCE_1A, SOURCE_10A, SOURCE_15A, SOURCE_ERT
+};
+#define MAX_SEGMENTS 32         // eRT; AF: 13 pairs of method A + one pass over the method B table
+#define MIN_SOURCE_RATE 0.5     // groups/s of a group type without a target
+#define SLA_PLAN_INPUTS (SERVICES + 3)  // see sla_plan_inputs()
+#define MAX_TMC_RATE 3.0        // TMC groups/s: the rest is left to PS, AF...
+#define MAX_TDC_RATE 3.0        // same for the transparent data channel
+#define EON_RATE 1.0            // 14A groups/s by default (about 10% of the groups)
+#define MAX_EON_RATE 3.0
+#define MAX_ODA_RATE (GROUPS_PER_SECOND * 3 / 4)  // all the applications: the core cycle keeps the rest
+#define RTP_INTERVAL (4 / GROUPS_PER_SECOND)      // RT+: 3A and 12A in turn, 2 groups in 8
+
+/* Time until a changed PS, TA or RT has been sent completely */
+typedef struct {
+    uint32_t pending;       // segments not sent since the change
+    double changed;         // time of the change
+    int updates;            // completed since the last report
+    double total;
+    double max;
+    double last;
+    // PS/RT (double-buffered): texts requested, replaced by a later one
+    // before they went on air, and sent completely
+    int requested;
+    int superseded;
+    int displayed;
+    double requested_at;    // time of the text waiting for the swap
+} rds_update;
+
+/* Sources of groups whose state is not rolled back with the encoder when
+   the groups built ahead are dropped (see drop_groups()): their groups are
+   kept and sent again instead of new ones
+*/
+enum { REPLAY_NONE, REPLAY_INPUT, REPLAY_14B, REPLAY_TMC, REPLAY_TDC, REPLAY_EON, REPLAY_SOURCE };
+#define REPLAY_MAX (LOOKAHEAD_MAX * REPLAY_SOURCE)  // at most a queue of groups per source
+
+typedef struct {
+    int source;                 // REPLAY_*
+    int declined;               // REPLAY_SOURCE: a slot offered and not taken
+    uint16_t block1_base;       // TP/PTY when it was built
+    uint16_t blocks[GROUP_LENGTH];
+} rds_replay;
+
+/* What is needed to drop a group built ahead (rds_lookahead.h): the
+   encoder state before it, and the group itself if it came from a source
+   that is not rolled back
+*/
+typedef struct {
+    unsigned char *cycle;       // the fields of cycle_fields, one after the other
+    void *afb;                  // rds_afb_save()
+    void *oda;                  // rds_oda_save()
+    rds_replay group;           // source REPLAY_NONE: built from the encoder state
+    int declined;               // slots offered to the group source, not taken
+} rds_group_state;
+
+/* Modulator state when a group is loaded, with the bits of the group: the
+   modulator can start again from there (see rds_preempt())
+*/
+typedef struct {
+    int64_t bits_started;
+    int bit_buffer[BITS_PER_GROUP];
+    float sample_buffer[SAMPLE_BUFFER_SIZE];
+    int cur_output;
+    int in_sample_index;
+    int out_sample_index;
+    int phase;
+    rds_group_state state;      // encoder before the group was built
+} rds_snapshot;
+
+enum { EMERGENCY_TA = 1, EMERGENCY_EWS };
+
 typedef struct {
     uint8_t content_type;
     uint8_t start_marker;
@@ -26,7 +148,11 @@ typedef struct {
     int enabled;
 } rds_rtp_tag;
 
-struct {
+/* Complete state of one RDS encoder: station parameters, position in the
+   group cycle and the biphase modulator. All functions of this module work on
+   the encoder selected for the calling thread (see rds_encoder_select()).
+*/
+struct rds_encoder {
     uint16_t pi;
     uint16_t original_pi;
     int pi_cyclic_mode;     // <-- Флаг для -pio
@@ -39,6 +165,15 @@ struct {
     char ps[PS_LENGTH];
     char rt[RT_LENGTH];
     char original_rt[RT_LENGTH];
+    // Double buffering of PS/RT: the text requested goes on air at the next
+    // segment 0 (see request_ps(), request_rt())
+    char ps_next[PS_LENGTH];
+    char rt_next[RT_LENGTH];
+    int ps_pending;
+    int rt_pending;
+    int ps_fresh;           // the PS on air has not been sent completely yet
+    int rt_fresh;
+    int rt_ab_next;         // A/B flag of rt_next
     char ptyn[PS_LENGTH];
     uint8_t pty;
     uint8_t ecc;
@@ -68,61 +203,246 @@ struct {
     int af_list_size;
     int af_count;
     int af_current_pair_index;
-    uint8_t afb_list[256]; // Увеличенный буфер для всех пар
-    int afb_list_size;
-    int afb_current_pair_index;
+    rds_afb *afb;           // AF method B (set_rds_afb()), NULL: off
     int ps_enabled;
     int rt_enabled;
-} rds_params = {
-    .pi = 0x1234, .original_pi = 0x1234, .pi_cyclic_mode = 0, .pi_random_mode = 0, .buggy_pi_index = 0, .ta = 0, .tp = 0, .ms = 1, .di_flags = 0,
-    .ps = {0}, .rt = {0}, .original_rt = {0}, .ptyn = {0}, .pty = 0,
-    .ecc = 0, .ecc_enabled = 0,
-    .lic = 0, .lic_enabled = 0,
-    .pin_day = 0, .pin_hour = 0, .pin_minute = 0, .pin_enabled = 0,
-    .ptyn_enabled = 0,
-    .ptyn_second_segment_exists = 0,
-    .rt_channel_mode = 0,
-    .rt_ab_flag = 0,
-    .tags = {{0,0,0,0}, {0,0,0,0}},
-    .rtp_enabled = 0,
-    .rtp_item_toggle_bit = 0,
-    .rtp_item_running_bit = 0,
-    .rt_mode = 'P',
-    .ct_enabled = 1,
-    .ct_offset_minutes = 0,
-    .ct_mode = CT_SYSTEM,
-    .af_list_size = 0,
-    .af_count = 0,
-    .af_current_pair_index = 0,
-    .afb_list = {0},
-    .afb_list_size = 0,
-    .afb_current_pair_index = 0,
-    .ps_enabled = 1,
-    .rt_enabled = 1
+    int rt_segments;        // segments up to the end-of-text marker (0x0D)
+    char lps[LPS_LENGTH];   // Long PS (UTF-8), 0x0D after a shorter text
+    int lps_segments;       // segments up to the end of the text, 0: off
+    char ert[ERT_LENGTH];   // eRT (UTF-8), 0x0D after a shorter text
+    int ert_segments;       // segments up to the end of the text, 0: off
+    int ert_group;          // group type code of the eRT groups (type << 1, A)
+
+    // Group cycle
+    int state;
+    int ps_state;
+    int rt_state;
+    int group_1a_cycle_idx;
+    int af_toggle;
+    int cts_counter; // Счетчик для периодической отправки CTS
+    int lps_state;
+    int lps_turn;           // 0A and 15A share the 0A slots of the cycle
+    int ert_state;          // segment, or ert_segments: the 3A announcement
+    int ert_turn;           // 2A and eRT share the RT slots of the cycle
+
+    // Burst after a change of PS/TA/RT (see set_rds_burst())
+    int burst_enabled;
+    int ps_burst;               // 0A groups still to be sent in the burst
+    int rt_burst;               // 2A groups still to be sent in the burst
+    int lps_burst;              // 15A groups still to be sent in the burst
+    uint8_t lps_resend[LPS_LENGTH / 4]; // changed Long PS segments, sent first
+    int ert_burst;              // eRT groups still to be sent in the burst
+    int burst_slot;
+    rds_update ps_update;
+    rds_update ta_update;
+    rds_update rt_update;
+    rds_update lps_update;
+    rds_update ert_update;
+    int64_t update_report_bits; // bits_started at the last rds_update_report()
+
+    // Group mix from target intervals (SLA, see set_rds_sla())
+    double sla_target[SERVICES];    // seconds, 0: no target
+    int sla_order[SERVICES];        // services with a target, as declared
+    int sla_count;
+    int sla_infeasible[SERVICES];
+    double sla_rate[SOURCES];       // planned groups/s
+    double sla_plan_inputs[SLA_PLAN_INPUTS];   // what sla_rate was planned from (see plan_group_mix())
+    double sla_pass[SOURCES];
+    double sla_vtime;
+    int rtp_announce;
+    int ptyn_segment;
+    // Group of the last transmission of each segment (+1, 0: never) and the
+    // worst interval for a complete message since the last report
+    int64_t segment_sent_at[SERVICES][MAX_SEGMENTS];
+    double worst_interval[SERVICES];
+
+    // CT on the sample clock: the group is prepared once a minute and sent in
+    // the group slot closest to the minute boundary on air
+    int64_t bits_started;       // bits put into the modulator so far
+    int64_t group_bits;         // first bit of the group being built
+    int64_t anchor_sample;      // sample with a known air time...
+    double anchor_time;         // ...in seconds since the epoch (0: unknown)
+    double ct_next;             // minute boundary of ct_blocks (0: send at once)
+    uint16_t ct_blocks[3];      // prepared group, without TP/PTY
+
+    // Time source (CT) and random number generator (-rds-bug): can be
+    // replaced for reproducible renders (see set_rds_clock(), set_rds_seed())
+    rds_clock_fn clock;
+    void *clock_arg;
+    uint32_t rand_state;
+    FILE *group_output;         // groups sent (set_rds_group_output())
+    int group_output_binary;
+    int group_output_flush;
+    rds_group_reader *group_input;  // injected groups (set_rds_group_input())
+    rds_group_source_fn source_fn;  // set_rds_group_source()
+    void *source_arg;
+
+    // Application registry (RT+, TMC, TDC, EON, set_rds_group_source()): their
+    // groups are taken before the group cycle or the SLA mix (see rds_oda.h)
+    rds_oda *oda;
+
+    // TMC (set_rds_tmc()): groups 8A and 3A at a fixed rate
+    rds_tmc *tmc;
+    double tmc_rate;
+    unsigned long tmc_groups;   // since the last report
+    unsigned long tmc_slots;
+
+    // Transparent data channel (set_rds_tdc()): groups 5A/5B at most at a
+    // fixed rate
+    rds_tdc *tdc;
+    double tdc_rate;
+    unsigned long tdc_slots;    // since the last report
+
+    // Other networks (EON, set_rds_eon()): 14A groups at a fixed rate, 14B at
+    // once on a TA switch of an ON
+    rds_eon *eon;
+    double eon_rate;
+    unsigned long eon_groups;   // since the last report
+    unsigned long eon_slots;
+
+    // Priority group (set_rds_emergency()): TA (0A) or EWS (9A), sent
+    // before any other, EMERGENCY_COPIES times
+    int emergency;              // EMERGENCY_TA or EMERGENCY_EWS
+    int emergency_copies;       // still to send
+    uint16_t ews_blocks[3];     // block 2 (5 bits), blocks 3 and 4 of the 9A group
+    int emergency_tp;           // TP set before the TA emergency, -1: none
+
+    // Modulator
+    const float *waveform;
+    float waveform_scaled[FILTER_SIZE];
+    int bit_buffer[BITS_PER_GROUP];
+    int bit_pos;
+    float sample_buffer[SAMPLE_BUFFER_SIZE];
+    int prev_output;
+    int cur_output;
+    int cur_bit;
+    int sample_count;
+    int inverting;
+    int phase;
+    int in_sample_index;
+    int out_sample_index;
+    // Subcarrier, unless 57 kHz with zero phase (RDS2, see set_rds_carrier())
+    float carrier[MAX_CARRIER_PERIOD];
+    int carrier_period;         // 0: 57 kHz (sample index modulo 4)
+    // Modulator snapshots for rds_preempt() (set_rds_preempt()), NULL: off
+    rds_snapshot *snapshots;    // ring of PREEMPT_GROUPS
+    int snapshot_count;         // snapshots taken so far
+    float *history;             // the last PREEMPT_HISTORY samples
+    int history_pos;
+    rds_group_state *rewind[PREEMPT_GROUPS];    // groups replaced on air, taken
+    int rewind_count;                           // back with those built ahead
+    // Groups built ahead (set_rds_lookahead()), NULL: built by the
+    // modulator
+    rds_lookahead *lookahead;
+    rds_group_state *states;    // one per queued group, and one more taken by
+    int state_count;            // rds_lookahead_pop() in exchange
+    rds_group_state *spare;
+    // Groups built ahead and dropped, from the sources of REPLAY_*: sent
+    // again, in the same order, before new ones (see replay_take())
+    rds_replay replay[REPLAY_MAX];
+    int replay_count;
+    int built_from;             // REPLAY_* of the group being built
+    int source_declined;        // slots the group source did not take in it
 };
 
+#define RDS_ENCODER_INIT { \
+    .pi = 0x1234, .original_pi = 0x1234, .pi_cyclic_mode = 0, .pi_random_mode = 0, .buggy_pi_index = 0, .ta = 0, .tp = 0, .ms = 1, .di_flags = 0, \
+    .ps = {0}, .rt = {0}, .original_rt = {0}, .ptyn = {0}, .pty = 0, \
+    .ecc = 0, .ecc_enabled = 0, \
+    .lic = 0, .lic_enabled = 0, \
+    .pin_day = 0, .pin_hour = 0, .pin_minute = 0, .pin_enabled = 0, \
+    .ptyn_enabled = 0, \
+    .ptyn_second_segment_exists = 0, \
+    .rt_channel_mode = 0, \
+    .rt_ab_flag = 0, \
+    .tags = {{0,0,0,0}, {0,0,0,0}}, \
+    .rtp_enabled = 0, \
+    .rtp_item_toggle_bit = 0, \
+    .rtp_item_running_bit = 0, \
+    .rt_mode = 'P', \
+    .ct_enabled = 1, \
+    .ct_offset_minutes = 0, \
+    .ct_mode = CT_SYSTEM, \
+    .af_list_size = 0, \
+    .af_count = 0, \
+    .af_current_pair_index = 0, \
+    .ps_enabled = 1, \
+    .rt_enabled = 1, \
+    .rt_segments = RT_LENGTH / 4, \
+    .ert_group = 11 << 1, \
+    .eon_rate = EON_RATE, \
+    .emergency_tp = -1, \
+    .burst_enabled = 1, \
+    .clock = NULL, \
+    .rand_state = 1, \
+    .group_output = NULL, \
+    .group_input = NULL, \
+    .waveform = waveform_biphase, \
+    .bit_pos = BITS_PER_GROUP, \
+    .sample_count = SAMPLES_PER_BIT, \
+    .out_sample_index = SAMPLE_BUFFER_SIZE-1 \
+}
 
-/* The RDS error-detection code generator polynomial is
-   x^10 + x^8 + x^7 + x^5 + x^4 + x^3 + x^0
+static rds_encoder rds_default_encoder = RDS_ENCODER_INIT;
+static const rds_encoder rds_encoder_template = RDS_ENCODER_INIT;
+
+// Encoder used by the calling thread
+static __thread rds_encoder *rds_params = &rds_default_encoder;
+
+/* Fields that building a group changes: position in the group cycle, PS/RT
+   swap, bursts, CT, measures and the groups to send again. A group built
+   ahead and dropped puts them back (see drop_groups()), so every function
+   that reads or writes them outside of the group builders drops the groups
+   built ahead first (drop_lookahead()).
 */
-#define POLY 0x1B9
-#define POLY_DEG 10
-#define MSB_BIT 0x8000
-#define BLOCK_SIZE 16
+#define CYCLE_FIELD(name) {offsetof(rds_encoder, name), sizeof(((rds_encoder *) 0)->name)}
+static const struct {
+    size_t offset;
+    size_t size;
+} cycle_fields[] = {
+    CYCLE_FIELD(pi), CYCLE_FIELD(buggy_pi_index), CYCLE_FIELD(rand_state),
+    CYCLE_FIELD(ps), CYCLE_FIELD(rt), CYCLE_FIELD(ps_pending), CYCLE_FIELD(rt_pending),
+    CYCLE_FIELD(ps_fresh), CYCLE_FIELD(rt_fresh), CYCLE_FIELD(rt_ab_flag), CYCLE_FIELD(rt_segments),
+    CYCLE_FIELD(state), CYCLE_FIELD(ps_state), CYCLE_FIELD(rt_state), CYCLE_FIELD(group_1a_cycle_idx),
+    CYCLE_FIELD(af_toggle), CYCLE_FIELD(af_current_pair_index), CYCLE_FIELD(cts_counter),
+    CYCLE_FIELD(lps_state), CYCLE_FIELD(lps_turn), CYCLE_FIELD(ert_state), CYCLE_FIELD(ert_turn),
+    CYCLE_FIELD(ps_burst), CYCLE_FIELD(rt_burst), CYCLE_FIELD(lps_burst), CYCLE_FIELD(lps_resend),
+    CYCLE_FIELD(ert_burst), CYCLE_FIELD(burst_slot),
+    CYCLE_FIELD(ps_update), CYCLE_FIELD(ta_update), CYCLE_FIELD(rt_update), CYCLE_FIELD(lps_update),
+    CYCLE_FIELD(ert_update),
+    CYCLE_FIELD(sla_pass), CYCLE_FIELD(sla_vtime), CYCLE_FIELD(rtp_announce), CYCLE_FIELD(ptyn_segment),
+    CYCLE_FIELD(segment_sent_at), CYCLE_FIELD(worst_interval),
+    CYCLE_FIELD(ct_next), CYCLE_FIELD(ct_blocks),
+    CYCLE_FIELD(tmc_groups), CYCLE_FIELD(tmc_slots), CYCLE_FIELD(tdc_slots), CYCLE_FIELD(eon_groups),
+    CYCLE_FIELD(eon_slots),
+    CYCLE_FIELD(emergency_copies), CYCLE_FIELD(replay), CYCLE_FIELD(replay_count),
+};
+#define CYCLE_FIELDS (sizeof(cycle_fields) / sizeof(cycle_fields[0]))
+
+// Allocates the buffer of the cycle fields of a group state; returns 0, or
+// -1 if no memory is available
+static int alloc_group_state(rds_group_state *state) {
+    size_t size = 0;
+    for (size_t i = 0; i < CYCLE_FIELDS; i++) size += cycle_fields[i].size;
+    state->cycle = malloc(size);
+    return state->cycle ? 0 : -1;
+}
 
-#define BITS_PER_GROUP (GROUP_LENGTH * (BLOCK_SIZE+POLY_DEG))
-#define SAMPLES_PER_BIT 192
-#define FILTER_SIZE (sizeof(waveform_biphase)/sizeof(float))
-#define SAMPLE_BUFFER_SIZE (SAMPLES_PER_BIT + FILTER_SIZE)
+static void free_group_state(rds_group_state *state) {
+    free(state->cycle);
+    free(state->afb);
+    free(state->oda);
+}
 
 
 uint16_t offset_words[] = {0x0FC, 0x198, 0x168, 0x1B4};
 
-uint8_t freq_to_code(float freq_mhz) {
-    if (freq_mhz < 87.5 || freq_mhz > 108.0) {
-        return 255; // Возвращаем специальное значение для ошибки
-    }
-    return (uint8_t)roundf((freq_mhz - 87.5f) * 10.0f);
+/* Code of an FM frequency (87.6-107.9 MHz), -1 if out of the band: AF lists
+   (methods A and B) and EON
+*/
+int rds_freq_code(double freq) {
+    int code = (int) (freq * 10 + .5) - 875;
+    return code >= 1 && code <= 204 ? code : -1;
 }
 
 /* Classical CRC computation */
@@ -140,303 +460,1124 @@ uint16_t crc(uint16_t block) {
     return crc;
 }
 
-/* Possibly generates a CT (clock time) group if the minute has just changed
+/* CRC-16-CCITT (polynomial 0x1021, initial value 0xFFFF), of the TDC frames
+   and of the RFT file chunks
+*/
+uint16_t rds_crc16(const uint8_t *p, size_t len) {
+    uint16_t crc = 0xFFFF;
+    while (len--) {
+        crc ^= *p++ << 8;
+        for (int i = 0; i < 8; i++) crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+/* Current time of the encoder: the injected clock, or the system time */
+static double rds_time() {
+    if (rds_params->clock) return rds_params->clock(rds_params->clock_arg);
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+/* Number of samples output by get_rds_samples() so far */
+static int64_t rds_samples() {
+    return (rds_params->bits_started - 1) * SAMPLES_PER_BIT + rds_params->sample_count;
+}
+
+/* Per-encoder pseudo-random numbers (xorshift32), so that the output only
+   depends on the seed
+*/
+static uint32_t rds_rand() {
+    uint32_t x = rds_params->rand_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    rds_params->rand_state = x;
+    return x;
+}
+
+/* Encodes the date and time of `tm` (UTC) into blocks 2 to 4 of a CT group,
+   without the TP/PTY bits of block 2
+*/
+static void encode_ct(const struct tm *tm, int offset_minutes, uint16_t *blocks) {
+    int l = tm->tm_mon < 2 ? 1 : 0;
+    int mjd = 14956 + tm->tm_mday +
+                    (int)((tm->tm_year - l) * 365.25) +
+                    (int)((tm->tm_mon + 2 + l * 12) * 30.6001);
+
+    blocks[0] = 0x4000 | (mjd >> 15);
+    blocks[1] = (mjd << 1) | (tm->tm_hour >> 4);
+    blocks[2] = (tm->tm_hour & 0xF) << 12 | tm->tm_min << 6;
+    blocks[2] |= (abs(offset_minutes) / 30) & 0x1F;
+    if (offset_minutes < 0) blocks[2] |= 0x20;
+}
+
+/* Prepares the CT group for the minute starting at `minute` (CT time scale).
+   Called once a minute, so that the group-by-group path makes no libc time
+   calls.
+*/
+static void prepare_ct_group(double minute) {
+    time_t t = (time_t) minute;
+    struct tm tm;
+    gmtime_r(&t, &tm);
+    int offset_minutes = 0;
+    if (rds_params->ct_mode == CT_SYSTEM) {
+        struct tm local_tm;
+        localtime_r(&t, &local_tm);
+        offset_minutes = (local_tm.tm_gmtoff / 60) + rds_params->ct_offset_minutes;
+    }
+    encode_ct(&tm, offset_minutes, rds_params->ct_blocks);
+    rds_params->ct_next = minute;
+}
+
+/* The next sample output by get_rds_samples() goes on air at `time` (seconds
+   since the epoch). Without it, the encoder takes the samples to be on air
+   when they are generated.
+*/
+void set_rds_air_time(double time) {
+    rds_params->anchor_time = time;
+    rds_params->anchor_sample = rds_samples();
+}
+
+/* Number of samples get_rds_samples() outputs before it builds the first
+   group that goes on air `samples` or more from now: a setting changed then
+   goes on air with that group (see fm_mpx.c, playlist tracks)
+*/
+int get_rds_samples_to_group(int samples) {
+    int n = (BITS_PER_GROUP - rds_params->bit_pos + 1) * SAMPLES_PER_BIT - rds_params->sample_count;
+    if (n + MODULATOR_DELAY < samples)
+        n += (samples - n - MODULATOR_DELAY + GROUP_SAMPLES - 1) / GROUP_SAMPLES * GROUP_SAMPLES;
+    return n;
+}
+
+/* Air time of the group being built (with the lookahead, possibly several
+   groups after the one being modulated)
+*/
+static double group_air_time() {
+    int64_t start = rds_params->group_bits * SAMPLES_PER_BIT;
+    if (rds_params->anchor_time == 0) {
+        rds_params->anchor_time = rds_time();
+        rds_params->anchor_sample = start;
+    }
+    int64_t samples = start + MODULATOR_DELAY - rds_params->anchor_sample;
+    return rds_params->anchor_time + samples / SAMPLE_RATE;
+}
+
+/* Possibly generates a CT (clock time) group: in the group slot closest to
+   each minute boundary on air, and at once after the start, a change of the
+   CT settings or a jump of the clock.
    Returns 1 if the CT group was generated, 0 otherwise
 */
 int get_rds_ct_group(uint16_t *blocks) {
-    static int latest_minutes = -1;
-    static int cts_counter = 0; // Счетчик для периодической отправки CTS
-    time_t now_t;
-    struct tm *time_info;
+    if (!rds_params->ct_enabled) {
+        return 0;
+    }
+
+    uint16_t block1_base = (rds_params->tp ? 0x0400 : 0) | (rds_params->pty << 5);
+
+    if (rds_params->ct_mode == CT_CUSTOM_STATIC) {
+        rds_params->cts_counter = (rds_params->cts_counter + 1) % 16;
+        if (rds_params->cts_counter != 1) {
+            return 0;
+        }
+        encode_ct(&rds_params->custom_tm, 0, blocks + 1);
+        blocks[1] |= block1_base;
+        return 1;
+    }
+
+    // Air time of the middle of this group, on the CT time scale
+    double t = group_air_time() + GROUP_SAMPLES / 2 / SAMPLE_RATE;
+    if (rds_params->ct_mode == CT_CUSTOM_TICKING) {
+        t += rds_params->custom_time_start_t - rds_params->real_time_at_set_t;
+    }
 
-    if (!rds_params.ct_enabled) {
+    double late = t - rds_params->ct_next;
+    if (rds_params->ct_next == 0 || late > 1 || late < -61) {
+        prepare_ct_group(floor(t / 60) * 60);
+    } else if (late < 0) {
         return 0;
     }
 
-    switch (rds_params.ct_mode) {
-        case CT_SYSTEM:
-            now_t = time(NULL);
-            time_info = gmtime(&now_t);
+    memcpy(blocks + 1, rds_params->ct_blocks, sizeof(rds_params->ct_blocks));
+    blocks[1] |= block1_base;
+    prepare_ct_group(floor(t / 60) * 60 + 60);
+    return 1;
+}
+
+/* A PS, TA or RT change: all its segments are pending again */
+static void start_update(rds_update *u, uint32_t segments) {
+    u->pending = segments;
+    u->changed = rds_time();
+}
+
+/* Segment `segment` was sent: once none is pending, the change is complete
+   when this group has been received
+*/
+static void segment_sent(rds_update *u, int segment) {
+    if (u->pending == 0) return;
+    u->pending &= ~(1u << segment);
+    if (u->pending != 0) return;
+    double t = group_air_time() + GROUP_SAMPLES / SAMPLE_RATE - u->changed;
+    u->updates++;
+    u->total += t;
+    if (t > u->max) u->max = t;
+    u->last = t;
+}
+
+/* Segment `segment` of a service goes on air in this group. A receiver
+   that tunes in just after a transmission of a segment waits for its next
+   transmission: the worst time to get the complete message is the longest
+   interval between two transmissions of one segment, plus one group.
+*/
+static void service_sent(int service, int segment) {
+    int64_t group = rds_params->group_bits / BITS_PER_GROUP + 1;
+    int64_t *last = &rds_params->segment_sent_at[service][segment];
+    if (*last != 0) {
+        double interval = (group - *last + 1) * GROUP_SAMPLES / SAMPLE_RATE;
+        if (interval > rds_params->worst_interval[service]) rds_params->worst_interval[service] = interval;
+    }
+    *last = group;
+}
+
+/* Segments up to the end-of-text marker (0x0D, mode D): the rest is not sent */
+static int rt_segments(const char *rt) {
+    const char *end = memchr(rt, 0x0D, RT_LENGTH);
+    return end ? (end - rt) / 4 + 1 : RT_LENGTH / 4;
+}
+
+/* Group 0A: PS segment, TA and AF */
+static void build_ps_group(uint16_t *blocks, uint16_t block1_base) {
+    if (rds_params->ps_state == 0 && rds_params->ps_pending) {
+        memcpy(rds_params->ps, rds_params->ps_next, PS_LENGTH);
+        rds_params->ps_pending = 0;
+        rds_params->ps_fresh = 1;
+        start_update(&rds_params->ps_update, 0xF);
+        rds_params->ps_update.changed = rds_params->ps_update.requested_at;
+    }
+    uint8_t di_bit = 0;
+    switch (rds_params->ps_state) {
+        case 0: if (rds_params->di_flags & 8) di_bit = 1; break;
+        case 1: if (rds_params->di_flags & 4) di_bit = 1; break;
+        case 2: if (rds_params->di_flags & 2) di_bit = 1; break;
+        case 3: if (rds_params->di_flags & 1) di_bit = 1; break;
+    }
+    blocks[1] = block1_base | (rds_params->ta ? 0x10 : 0) | (rds_params->ms ? 0x08 : 0) | (di_bit << 2) | rds_params->ps_state;
+
+    int af_sent_this_cycle = 0;
+    
+    if (rds_params->afb && (rds_params->af_toggle == 1 || rds_params->af_list_size == 0)) {
+        // Отправляем AFB: следующее слово таблицы
+        int pos = rds_afb_next(rds_params->afb, &blocks[2], rds_params->group_bits * SAMPLES_PER_BIT / SAMPLE_RATE);
+        if (pos >= 0) {
+            // The SLA tracks the passes over the table (see MAX_SEGMENTS)
+            if (pos == 0) service_sent(SERVICE_AF, rds_params->af_list_size / 2);
+            af_sent_this_cycle = 1;
+        }
+        if (rds_params->af_list_size > 0) rds_params->af_toggle = 0; // В следующий раз отправляем AFA
+    } else if (rds_params->af_list_size > 0) {
+        // Отправляем AFA
+        int num_pairs = rds_params->af_list_size / 2;
+         if (num_pairs > 0) {
+            int pair_index = rds_params->af_current_pair_index;
+            blocks[2] = (rds_params->af_list_to_send[pair_index * 2] << 8) | rds_params->af_list_to_send[pair_index * 2 + 1];
+            rds_params->af_current_pair_index = (pair_index + 1) % num_pairs;
+            service_sent(SERVICE_AF, pair_index);
+            af_sent_this_cycle = 1;
+        }
+        if (rds_params->afb) rds_params->af_toggle = 1; // В следующий раз отправляем AFB
+    }
+
+    if (!af_sent_this_cycle) {
+         blocks[2] = rds_params->pi;
+    }
+
+    if (rds_params->ps_enabled) {
+        blocks[3] = rds_params->ps[rds_params->ps_state*2]<<8 | rds_params->ps[rds_params->ps_state*2+1];
+    } else {
+        blocks[3] = ' '<<8 | ' ';
+    }
+    segment_sent(&rds_params->ps_update, rds_params->ps_state);
+    segment_sent(&rds_params->ta_update, 0);
+    service_sent(SERVICE_PS, rds_params->ps_state);
+    service_sent(SERVICE_TA, 0);
+    if (rds_params->ps_state == 3 && rds_params->ps_fresh) {
+        rds_params->ps_fresh = 0;
+        rds_params->ps_update.displayed++;
+    }
+    rds_params->ps_state = (rds_params->ps_state + 1) % 4;
+}
+
+/* Group 2A: RadioText segment. Only the segments up to the end-of-text
+   marker are sent.
+*/
+static void build_rt_group(uint16_t *blocks, uint16_t block1_base) {
+    if (rds_params->rt_state == 0 && rds_params->rt_pending) {
+        memcpy(rds_params->rt, rds_params->rt_next, RT_LENGTH);
+        rds_params->rt_segments = rt_segments(rds_params->rt);
+        rds_params->rt_ab_flag = rds_params->rt_ab_next;
+        rds_params->rt_pending = 0;
+        rds_params->rt_fresh = 1;
+        start_update(&rds_params->rt_update, (1u << rds_params->rt_segments) - 1);
+        rds_params->rt_update.changed = rds_params->rt_update.requested_at;
+    }
+    uint8_t ab_flag = 0;
+    if (rds_params->rt_channel_mode == 1) ab_flag = 1;
+    else if (rds_params->rt_channel_mode == 2) ab_flag = rds_params->rt_ab_flag;
+    blocks[1] = 0x2000 | block1_base | (ab_flag << 4) | rds_params->rt_state;
+    blocks[2] = rds_params->rt[rds_params->rt_state*4+0]<<8 | rds_params->rt[rds_params->rt_state*4+1];
+    blocks[3] = rds_params->rt[rds_params->rt_state*4+2]<<8 | rds_params->rt[rds_params->rt_state*4+3];
+    segment_sent(&rds_params->rt_update, rds_params->rt_state);
+    service_sent(SERVICE_RT, rds_params->rt_state);
+    if (rds_params->rt_state == rds_params->rt_segments - 1 && rds_params->rt_fresh) {
+        rds_params->rt_fresh = 0;
+        rds_params->rt_update.displayed++;
+    }
+    rds_params->rt_state = (rds_params->rt_state + 1) % rds_params->rt_segments;
+}
+
+/* Group 15A: Long PS segment. The segments changed by the last update
+   come first, alternately, until each has been sent twice; then all the
+   segments up to the end of the text in turn.
+*/
+static void build_lps_group(uint16_t *blocks, uint16_t block1_base) {
+    int segment = -1;
+    for (int i = 0; i < rds_params->lps_segments; i++) {
+        if (rds_params->lps_resend[i] > (segment < 0 ? 0 : rds_params->lps_resend[segment])) segment = i;
+    }
+    if (segment >= 0) {
+        rds_params->lps_resend[segment]--;
+    } else {
+        segment = rds_params->lps_state;
+        rds_params->lps_state = (rds_params->lps_state + 1) % rds_params->lps_segments;
+    }
+    const uint8_t *lps = (const uint8_t *) rds_params->lps + 4*segment;
+    blocks[1] = 0xF000 | block1_base | segment;
+    blocks[2] = lps[0] << 8 | lps[1];
+    blocks[3] = lps[2] << 8 | lps[3];
+    segment_sent(&rds_params->lps_update, segment);
+    service_sent(SERVICE_LPS, segment);
+}
+
+/* eRT (ODA): the 4-byte segments of the text up to its end, then the 3A
+   announcement (AID 6552, UTF-8), so that a receiver gets both in one
+   turn of ert_segments + 1 groups
+*/
+static void build_ert_group(uint16_t *blocks, uint16_t block1_base) {
+    int segment = rds_params->ert_state;
+    if (segment == rds_params->ert_segments) {
+        blocks[1] = 0x3000 | block1_base | rds_params->ert_group;
+        blocks[2] = 0x0001;     // UTF-8, left to right
+        blocks[3] = ERT_AID;
+    } else {
+        const uint8_t *ert = (const uint8_t *) rds_params->ert + 4*segment;
+        blocks[1] = (rds_params->ert_group >> 1) << 12 | block1_base | segment;
+        blocks[2] = ert[0] << 8 | ert[1];
+        blocks[3] = ert[2] << 8 | ert[3];
+        segment_sent(&rds_params->ert_update, segment);
+    }
+    service_sent(SERVICE_ERT, segment);
+    rds_params->ert_state = (segment + 1) % (rds_params->ert_segments + 1);
+}
+
+/* After a change, the changed groups take three group slots out of four
+   until they have been sent twice (PS, then Long PS, RT, eRT); the cycle
+   goes on in the fourth slot. Returns 1 if a group of the burst was built.
+*/
+static int build_burst_group(uint16_t *blocks, uint16_t block1_base) {
+    if (rds_params->ps_burst == 0 && rds_params->lps_burst == 0 && rds_params->rt_burst == 0 &&
+        rds_params->ert_burst == 0) return 0;
+    if (++rds_params->burst_slot % 4 == 0) return 0;
+    if (rds_params->ps_burst > 0) {
+        rds_params->ps_burst--;
+        build_ps_group(blocks, block1_base);
+    } else if (rds_params->lps_burst > 0) {
+        rds_params->lps_burst--;
+        build_lps_group(blocks, block1_base);
+    } else if (rds_params->rt_burst > 0) {
+        rds_params->rt_burst--;
+        build_rt_group(blocks, block1_base);
+    } else {
+        rds_params->ert_burst--;
+        build_ert_group(blocks, block1_base);
+    }
+    return 1;
+}
+
+/* RT+ groups: 3A (ODA announcement) or 12A (tags) */
+static void build_rtp_group(uint16_t *blocks, uint16_t block1_base, int announce) {
+    uint64_t payload = 0;
+    rds_rtp_tag tag1 = rds_params->tags[0];
+    rds_rtp_tag tag2 = rds_params->tags[1];
+
+    payload |= (uint64_t)(rds_params->rtp_item_toggle_bit & 1) << 36;
+    payload |= (uint64_t)(rds_params->rtp_item_running_bit & 1) << 35;
+    if (tag1.enabled) {
+        payload |= (uint64_t)(tag1.content_type & 0x3F) << 29;
+        payload |= (uint64_t)(tag1.start_marker & 0x3F) << 23;
+        payload |= (uint64_t)(tag1.length_marker & 0x3F) << 17;
+    }
+    if (tag2.enabled) {
+        payload |= (uint64_t)(tag2.content_type & 0x3F) << 11;
+        payload |= (uint64_t)(tag2.start_marker & 0x3F) << 5;
+        payload |= (uint64_t)(tag2.length_marker & 0x1F);
+    }
+
+    if (announce) { // Группа 3A (Анонс ODA для RT+): приложение в группах 12A
+        blocks[1] = 0x3000 | block1_base | 12 << 1;
+        blocks[2] = 0x0000;
+        blocks[3] = 0x4BD7; // AID для RT+
+    } else { // Группа 12A (Передача тегов RT+)
+        blocks[1] = 0xC000 | block1_base | ((payload >> 32) & 0x1F);
+        blocks[2] = (payload >> 16) & 0xFFFF;
+        blocks[3] = payload & 0xFFFF;
+    }
+    service_sent(SERVICE_RTP, !announce);
+}
+
+static int rtp_active() {
+    return rds_params->rtp_enabled && (rds_params->tags[0].enabled || rds_params->tags[1].enabled);
+}
+
+/* Types of 1A group enabled (ECC, LIC, PIN), in the order they are sent */
+static int enabled_1a_types(char *types) {
+    int num_enabled = 0;
+    if (rds_params->ecc_enabled) types[num_enabled++] = 'E';
+    if (rds_params->lic_enabled) types[num_enabled++] = 'L';
+    if (rds_params->pin_enabled && num_enabled == 0) types[num_enabled++] = 'P';
+    return num_enabled;
+}
+
+/* Group 1A: ECC, LIC, PIN. Returns 0 if none is enabled */
+static int build_1a_group(uint16_t *blocks, uint16_t block1_base) {
+    char types[4];
+    int num_enabled = enabled_1a_types(types);
+    if (num_enabled == 0) return 0;
+
+    rds_params->group_1a_cycle_idx %= num_enabled;
+    char type_to_send = types[rds_params->group_1a_cycle_idx];
+    blocks[1] = 0x1000 | block1_base;
+    if (rds_params->pin_enabled) {
+        blocks[3] = (rds_params->pin_day << 11) | (rds_params->pin_hour << 6) | rds_params->pin_minute;
+    } else {
+        blocks[3] = 0x0000;
+    }
+    switch (type_to_send) {
+        case 'E': blocks[2] = (0b0000 << 12) | rds_params->ecc; break;
+        case 'L': blocks[2] = (0b0011 << 12) | rds_params->lic; break;
+        case 'P': blocks[2] = rds_params->pi; break;
+    }
+    service_sent(SERVICE_1A, rds_params->group_1a_cycle_idx);
+    rds_params->group_1a_cycle_idx++;
+    return 1;
+}
+
+/* Group 10A: PTYN segment */
+static void build_ptyn_group(uint16_t *blocks, uint16_t block1_base, int segment) {
+    blocks[1] = 0xA000 | block1_base | segment;
+    blocks[2] = rds_params->ptyn[segment*4+0]<<8 | rds_params->ptyn[segment*4+1];
+    blocks[3] = rds_params->ptyn[segment*4+2]<<8 | rds_params->ptyn[segment*4+3];
+    service_sent(SERVICE_PTYN, segment);
+}
+
+/* Number of groups (segments) of a complete message of each service, 0 if
+   the service is not sent
+*/
+static int service_segments(int service) {
+    char types[4];
+    switch (service) {
+        case SERVICE_PS: return 4;
+        case SERVICE_TA: return 1;
+        case SERVICE_AF: return (rds_params->af_list_size / 2) + (rds_params->afb ? rds_afb_words(rds_params->afb) : 0);
+        case SERVICE_RT: return rds_params->rt_enabled ? rds_params->rt_segments : 0;
+        case SERVICE_RTP: return rtp_active() ? 2 : 0;
+        case SERVICE_1A: return enabled_1a_types(types);
+        case SERVICE_PTYN: return rds_params->ptyn_enabled ? 1 + rds_params->ptyn_second_segment_exists : 0;
+        case SERVICE_LPS: return rds_params->lps_segments;
+        case SERVICE_ERT: return rds_params->ert_segments ? rds_params->ert_segments + 1 : 0;
+    }
+    return 0;
+}
+
+/* What the group mix depends on besides the targets: the number of segments
+   of each service, CT and the rates of the ODA applications
+*/
+static void sla_plan_inputs(double *inputs) {
+    for (int s = 0; s < SERVICES; s++) inputs[s] = service_segments(s);
+    inputs[SERVICES] = rds_params->ct_enabled;
+    inputs[SERVICES + 1] = rds_params->oda ? rds_oda_rate(rds_params->oda) : 0;
+    inputs[SERVICES + 2] = rds_params->oda ? rds_oda_app_rate(rds_params->oda, "RT+") : 0;
+}
+
+/* Derives the rate of each group type (groups/s) from the target intervals,
+   in the order they were declared. Every group type in use gets at least
+   MIN_SOURCE_RATE; a target that does not fit in what is left of the budget
+   is infeasible and gets the rest. Spare capacity is shared in proportion to
+   the rates. Run by set_rds_sla(), and again by build_sla_group() when the
+   settings it was planned from (RT length, AF list...) have changed.
+*/
+static void plan_group_mix() {
+    sla_plan_inputs(rds_params->sla_plan_inputs);
+    double budget = GROUPS_PER_SECOND - (rds_params->ct_enabled ? 1 / 60. : 0) -
+                    (rds_params->oda ? rds_oda_rate(rds_params->oda) : 0);
+    double rate[SOURCES] = {0};
+
+    for (int s = 0; s < SERVICES; s++) {
+        int src = service_source[s];
+        // RT+ is sent by the registry, at the interval derived from its target
+        if (service_segments(s) == 0 || rate[src] > 0 || src == SOURCE_RTP) continue;
+        rate[src] = MIN_SOURCE_RATE;
+        budget -= MIN_SOURCE_RATE;
+    }
+    for (int i = 0; i < rds_params->sla_count; i++) {
+        int s = rds_params->sla_order[i];
+        int segments = service_segments(s);
+        rds_params->sla_infeasible[s] = 0;
+        int src = service_source[s];
+        if (segments == 0) continue;
+        if (src == SOURCE_RTP) {
+            // Sent by the registry, 3 groups per target (see register_rtp())
+            rds_params->sla_infeasible[s] = (rds_params->oda ? rds_oda_app_rate(rds_params->oda, "RT+") : 0) <
+                                            3 / rds_params->sla_target[s] - 1e-9;
+            continue;
+        }
+        // In whole groups, the worst interval is that of `segments` groups of
+        // this type, plus the group itself and one group of another type (or
+        // CT) that comes in between
+        int slots = (int) (rds_params->sla_target[s] * GROUPS_PER_SECOND + 1e-9) - 2;
+        double extra = (slots >= segments ? segments * GROUPS_PER_SECOND / slots : INFINITY) - rate[src];
+        if (extra <= 0) continue;
+        if (extra <= budget) {
+            rate[src] += extra;
+            budget -= extra;
+        } else {
+            rate[src] += budget > 0 ? budget : 0;
+            budget = 0;
+            rds_params->sla_infeasible[s] = 1;
+        }
+    }
+
+    double total = 0;
+    for (int src = 0; src < SOURCES; src++) total += rate[src];
+    for (int src = 0; src < SOURCES; src++) {
+        rds_params->sla_rate[src] = budget > 0 && total > 0 ? rate[src] * (1 + budget / total) : rate[src];
+    }
+    rds_params->sla_rate[SOURCE_RTP] = rds_params->oda ? rds_oda_app_rate(rds_params->oda, "RT+") : 0;
+}
+
+/* Next group of the SLA-driven mix (see set_rds_sla()): stride scheduling,
+   each group type is sent every 1/rate seconds, as evenly as possible
+*/
+static void build_sla_group(uint16_t *blocks, uint16_t block1_base) {
+    double inputs[SLA_PLAN_INPUTS];
+    sla_plan_inputs(inputs);
+    if (memcmp(inputs, rds_params->sla_plan_inputs, sizeof(inputs)) != 0) plan_group_mix();
+    int best = SOURCE_0A;
+    double *pass = rds_params->sla_pass;
+    for (int src = 0; src < SOURCES; src++) {
+        if (rds_params->sla_rate[src] <= 0 || src == SOURCE_RTP) continue;
+        // A group type that was off does not catch up on the groups it missed
+        if (pass[src] < rds_params->sla_vtime) pass[src] = rds_params->sla_vtime;
+        if (pass[src] < pass[best] || rds_params->sla_rate[best] <= 0) best = src;
+    }
+    rds_params->sla_vtime = pass[best];
+    pass[best] += 1 / rds_params->sla_rate[best];
+
+    switch (best) {
+        case SOURCE_2A:
+            build_rt_group(blocks, block1_base);
             break;
-        case CT_CUSTOM_TICKING:
-            now_t = rds_params.custom_time_start_t + (time(NULL) - rds_params.real_time_at_set_t);
-            time_info = gmtime(&now_t);
+        case SOURCE_1A:
+            build_1a_group(blocks, block1_base);
             break;
-        case CT_CUSTOM_STATIC:
-            cts_counter = (cts_counter + 1) % 16;
-            if (cts_counter != 1) {
-                return 0;
-            }
-            time_info = &rds_params.custom_tm;
+        case SOURCE_10A:
+            if (!rds_params->ptyn_second_segment_exists) rds_params->ptyn_segment = 0;
+            build_ptyn_group(blocks, block1_base, rds_params->ptyn_segment);
+            rds_params->ptyn_segment = !rds_params->ptyn_segment;
+            break;
+        case SOURCE_15A:
+            build_lps_group(blocks, block1_base);
+            break;
+        case SOURCE_ERT:
+            build_ert_group(blocks, block1_base);
             break;
         default:
-            return 0;
+            build_ps_group(blocks, block1_base);
     }
+}
 
-    if (time_info->tm_min != latest_minutes || rds_params.ct_mode == CT_CUSTOM_STATIC) {
-        latest_minutes = time_info->tm_min;
+/* Takes the first group of `source` waiting to be sent again (see
+   drop_groups()). The PI of the slot is kept, and TP/PTY are the current
+   ones, except for the injected groups and the groups of the group source
+   that did not use the TP/PTY it was given, sent as they were. Returns 1, -1 for a slot the group source did not take
+   (it is not asked again), or 0 if there is none.
+*/
+static int replay_take(int source, uint16_t *blocks, uint16_t block1_base) {
+    for (int i = 0; i < rds_params->replay_count; i++) {
+        rds_replay *r = &rds_params->replay[i];
+        if (r->source != source) continue;
+        int declined = r->declined;
+        int first = source == REPLAY_SOURCE || source == REPLAY_INPUT ? 0 : 1;
+        if (!declined) memcpy(blocks + first, r->blocks + first, (GROUP_LENGTH - first) * sizeof(uint16_t));
+        if (!declined && (first || (source == REPLAY_SOURCE && (blocks[1] & 0x07E0) == r->block1_base)))
+            blocks[1] = (blocks[1] & ~0x07E0) | block1_base;
+        rds_params->replay_count--;
+        memmove(r, r + 1, (rds_params->replay_count - i) * sizeof(rds_replay));
+        return declined ? -1 : 1;
+    }
+    return 0;
+}
 
-        int l = time_info->tm_mon < 2 ? 1 : 0;
-        int mjd = 14956 + time_info->tm_mday +
-                        (int)((time_info->tm_year - l) * 365.25) +
-                        (int)((time_info->tm_mon + 2 + l * 12) * 30.6001);
+/* Forgets the groups of `source` waiting to be sent again (the source is
+   stopped or replaced)
+*/
+static void replay_flush(int source) {
+    int n = 0;
+    for (int i = 0; i < rds_params->replay_count; i++) {
+        if (rds_params->replay[i].source != source) rds_params->replay[n++] = rds_params->replay[i];
+    }
+    rds_params->replay_count = n;
+}
 
-        blocks[1] = 0x4000 | (rds_params.tp ? 0x0400 : 0) | (rds_params.pty << 5) | (mjd >> 15); // <-- ИЗМЕНЕНА ЭТА СТРОКА
-        blocks[2] = (mjd << 1) | (time_info->tm_hour >> 4);
-        blocks[3] = (time_info->tm_hour & 0xF) << 12 | time_info->tm_min << 6;
+/* Groups of the registry applications (see register_oda()) */
+static int tmc_oda_group(void *arg, uint16_t *blocks, uint16_t block1_base) {
+    if (!replay_take(REPLAY_TMC, blocks, block1_base)) {
+        if (!rds_tmc_group(rds_params->tmc, blocks, block1_base, group_air_time())) return 0;
+        rds_params->built_from = REPLAY_TMC;
+    }
+    rds_params->tmc_groups++;
+    return 1;
+}
 
-        if (rds_params.ct_mode == CT_SYSTEM) {
-            struct tm *local_tm = localtime(&now_t);
-            int total_offset_minutes = (local_tm->tm_gmtoff / 60) + rds_params.ct_offset_minutes;
-            int offset_sign = (total_offset_minutes < 0) ? 1 : 0;
-            int offset_val_abs = abs(total_offset_minutes);
-            int offset_code = (offset_val_abs / 30);
-            blocks[3] |= offset_code & 0x1F;
-            if (offset_sign) blocks[3] |= 0x20;
-        }
+static int tdc_oda_group(void *arg, uint16_t *blocks, uint16_t block1_base) {
+    if (!replay_take(REPLAY_TDC, blocks, block1_base)) {
+        if (!rds_tdc_group(rds_params->tdc, blocks, block1_base)) return 0;
+        rds_params->built_from = REPLAY_TDC;
+    }
+    if (blocks[1] & 0x0800) blocks[2] = blocks[0];      // 5B: PI in block 3 too
+    return 1;
+}
 
-        return 1;
-    } else {
+static int eon_oda_group(void *arg, uint16_t *blocks, uint16_t block1_base) {
+    if (!replay_take(REPLAY_EON, blocks, block1_base)) {
+        if (!rds_eon_group(rds_params->eon, blocks, block1_base,
+                           rds_params->group_bits * SAMPLES_PER_BIT / SAMPLE_RATE)) return 0;
+        rds_params->built_from = REPLAY_EON;
+    }
+    rds_params->eon_groups++;
+    return 1;
+}
+
+/* 14B group: the TA of an other network has changed */
+static int eon_ta_group(uint16_t *blocks, uint16_t block1_base) {
+    if (!replay_take(REPLAY_14B, blocks, block1_base)) {
+        if (rds_params->eon == NULL || !rds_eon_ta_group(rds_params->eon, blocks, block1_base)) return 0;
+        rds_params->built_from = REPLAY_14B;
+    }
+    blocks[2] = blocks[0];      // PI in block 3 too
+    return 1;
+}
+
+/* The group source: its answers for the slots offered in groups built
+   ahead and dropped are replayed too, as it counts the slots it is offered
+*/
+static int source_oda_group(void *arg, uint16_t *blocks, uint16_t block1_base) {
+    int replayed = replay_take(REPLAY_SOURCE, blocks, block1_base);
+    if (replayed) return replayed > 0;
+    if (!rds_params->source_fn(rds_params->source_arg, blocks, block1_base)) {
+        rds_params->source_declined++;
         return 0;
     }
+    rds_params->built_from = REPLAY_SOURCE;
+    return 1;
+}
+
+static int rtp_oda_group(void *arg, uint16_t *blocks, uint16_t block1_base) {
+    if (!rtp_active()) return 0;
+    rds_params->rtp_announce = !rds_params->rtp_announce;
+    build_rtp_group(blocks, block1_base, rds_params->rtp_announce);
+    return 1;
+}
+
+/* Registers an application (see rds_oda.h) with the registry of the encoder,
+   created with the first one. Returns 1, or 0 (with a message) if there is
+   no room for it.
+*/
+static int register_oda(const char *name, uint16_t aid, int group, double interval, int priority,
+                        rds_oda_group_fn fn, void *arg) {
+    if (rds_params->oda == NULL) rds_params->oda = rds_oda_new(GROUPS_PER_SECOND, MAX_ODA_RATE);
+    if (rds_params->oda == NULL) return 0;
+    rds_oda_app app = {name, aid, group, interval, priority, fn, arg};
+    if (rds_oda_register(rds_params->oda, &app) == 0) return 1;
+    printf("RDS: no room for %s at %.2f groups/s (%.2f of %.2f groups/s already reserved).\n", name,
+           interval > 0 ? 1 / interval : 0,
+           rds_oda_rate(rds_params->oda) - rds_oda_app_rate(rds_params->oda, name), MAX_ODA_RATE);
+    return 0;
+}
+
+static void unregister_oda(const char *name) {
+    if (rds_params->oda) rds_oda_unregister(rds_params->oda, name);
+}
+
+/* RT+: 3A and 12A in turn, at the interval of its SLA target if any */
+static int register_rtp() {
+    double target = rds_params->sla_target[SERVICE_RTP];
+    double interval = target > 0 ? fmax(target / 3, 1 / GROUPS_PER_SECOND) : RTP_INTERVAL;
+    return register_oda("RT+", 0x4BD7, 12 << 1, interval, 4, rtp_oda_group, NULL);
 }
 
-void get_rds_group(int *buffer) {
-    static int state = 0;
-    static int ps_state = 0;
-    static int rt_state = 0;
-    static int group_1a_cycle_idx = 0;
-    static int af_toggle = 0;
-    uint16_t blocks[GROUP_LENGTH] = {rds_params.pi, 0, 0, 0};
+/* Builds the next group of the cycle */
+static void build_rds_group(uint16_t *blocks) {
+    blocks[1] = blocks[2] = blocks[3] = 0;
 
     // --- НАША НОВАЯ, ЧИСТАЯ ЛОГИКА ---
-    if (rds_params.pi_random_mode) {
+    if (rds_params->pi_random_mode) {
         // Режим -rds-bug: полностью случайный PI
-        rds_params.pi = (rand() % 0xFFFE) + 1;
-    } else if (rds_params.pi_cyclic_mode) {
+        rds_params->pi = (rds_rand() % 0xFFFE) + 1;
+    } else if (rds_params->pi_cyclic_mode) {
         // Режим -pio: циклическая смена PI из последовательности
-        rds_params.pi = cyclic_pi_sequence[rds_params.buggy_pi_index];
-        rds_params.buggy_pi_index = (rds_params.buggy_pi_index + 1) % cyclic_pi_sequence_size;
+        rds_params->pi = cyclic_pi_sequence[rds_params->buggy_pi_index];
+        rds_params->buggy_pi_index = (rds_params->buggy_pi_index + 1) % cyclic_pi_sequence_size;
     }
     // Присваиваем измененный PI первому блоку
-    blocks[0] = rds_params.pi;
+    blocks[0] = rds_params->pi;
     // ------------------------------------
 
+    uint16_t block1_base_other = (rds_params->tp ? 0x0400 : 0) | (rds_params->pty << 5);
+
+    if (rds_params->tmc) rds_params->tmc_slots++;
+    if (rds_params->tdc) rds_params->tdc_slots++;
+    if (rds_params->eon) rds_params->eon_slots++;
     if (get_rds_ct_group(blocks)) {
         // Группа CT (время) имеет приоритет и была отправлена.
+    } else if (eon_ta_group(blocks, block1_base_other)) {
+        // Group 14B: the TA of another network changed
+    } else if (build_burst_group(blocks, block1_base_other)) {
+        // Burst after a change of PS/TA/RT
+    } else if (rds_params->oda &&
+               rds_oda_group(rds_params->oda, blocks, block1_base_other, rds_params->group_bits / BITS_PER_GROUP)) {
+        // Application group (RT+, TMC, TDC, EON, RFT)
+    } else if (rds_params->sla_count > 0) {
+        build_sla_group(blocks, block1_base_other);
     } else {
-        uint16_t block1_base_other = (rds_params.tp ? 0x0400 : 0) | (rds_params.pty << 5);
-        int group_sent = 0;
-
-        // Логика генерации групп RT+
-        if (rds_params.rtp_enabled && (rds_params.tags[0].enabled || rds_params.tags[1].enabled)) {
-            uint64_t payload = 0;
-            rds_rtp_tag tag1 = rds_params.tags[0];
-            rds_rtp_tag tag2 = rds_params.tags[1];
-
-            payload |= (uint64_t)(rds_params.rtp_item_toggle_bit & 1) << 36;
-            payload |= (uint64_t)(rds_params.rtp_item_running_bit & 1) << 35;
-            if (tag1.enabled) {
-                payload |= (uint64_t)(tag1.content_type & 0x3F) << 29;
-                payload |= (uint64_t)(tag1.start_marker & 0x3F) << 23;
-                payload |= (uint64_t)(tag1.length_marker & 0x3F) << 17;
-            }
-            if (tag2.enabled) {
-                payload |= (uint64_t)(tag2.content_type & 0x3F) << 11;
-                payload |= (uint64_t)(tag2.start_marker & 0x3F) << 5;
-                payload |= (uint64_t)(tag2.length_marker & 0x1F);
-            }
+        int group_1A_sent = 0;
+        if (rds_params->state == 3) {
+            group_1A_sent = build_1a_group(blocks, block1_base_other);
+        }
 
-            uint8_t app_code = (payload >> 32) & 0x1F;
-
-            if (state == 6) { // Группа 3A (Анонс ODA для RT+)
-                blocks[1] = 0x3000 | block1_base_other | app_code;
-                blocks[2] = 0x0000;
-                blocks[3] = 0x4BD7; // AID для RT+
-                group_sent = 1;
-            } else if (state == 7) { // Группа 12A (Передача тегов RT+)
-                blocks[1] = 0xC000 | block1_base_other | app_code;
-                blocks[2] = (payload >> 16) & 0xFFFF;
-                blocks[3] = payload & 0xFFFF;
-                group_sent = 1;
+        if (!group_1A_sent) {
+            int rt_slot = rds_params->state == 4 || rds_params->state == 5;
+            if (rt_slot && rds_params->ert_segments > 0 &&
+                (!rds_params->rt_enabled || (rds_params->ert_turn = !rds_params->ert_turn))) {
+                build_ert_group(blocks, block1_base_other); // eRT: every other RT slot
+            } else if (rt_slot && rds_params->rt_enabled) { // Группа 2A (RadioText)
+                build_rt_group(blocks, block1_base_other);
+            } else if (rds_params->ptyn_enabled && rds_params->state == 1) { // PTYN Сегмент 0
+                build_ptyn_group(blocks, block1_base_other, 0);
+            } else if (rds_params->ptyn_enabled && rds_params->ptyn_second_segment_exists && rds_params->state == 2) { // PTYN Сегмент 1
+                build_ptyn_group(blocks, block1_base_other, 1);
+            } else if (rds_params->lps_segments > 0 && (rds_params->lps_turn = !rds_params->lps_turn)) {
+                build_lps_group(blocks, block1_base_other); // Группа 15A (Long PS)
+            } else { // Группа 0A (PS и AF)
+                build_ps_group(blocks, block1_base_other);
             }
         }
 
-        if (!group_sent) {
-            int group_1A_sent = 0;
-            if (state == 3) {
-                char enabled_1a_types[4];
-                int num_enabled = 0;
-                if (rds_params.ecc_enabled) enabled_1a_types[num_enabled++] = 'E';
-                if (rds_params.lic_enabled) enabled_1a_types[num_enabled++] = 'L';
-                if (rds_params.pin_enabled && num_enabled == 0) enabled_1a_types[num_enabled++] = 'P';
-
-                if (num_enabled > 0) {
-                    group_1a_cycle_idx %= num_enabled;
-                    char type_to_send = enabled_1a_types[group_1a_cycle_idx];
-                    uint16_t block1_base = (rds_params.tp ? 0x0400 : 0) | (rds_params.pty << 5);
-                    blocks[1] = 0x1000 | block1_base;
-                    if (rds_params.pin_enabled) {
-                        blocks[3] = (rds_params.pin_day << 11) | (rds_params.pin_hour << 6) | rds_params.pin_minute;
-                    } else {
-                        blocks[3] = 0x0000;
-                    }
-                    switch (type_to_send) {
-                        case 'E': blocks[2] = (0b0000 << 12) | rds_params.ecc; break;
-                        case 'L': blocks[2] = (0b0011 << 12) | rds_params.lic; break;
-                        case 'P': blocks[2] = rds_params.pi; break;
-                    }
-                    group_1A_sent = 1;
-                    group_1a_cycle_idx++;
-                }
-            }
+        rds_params->state = (rds_params->state + 1) % 8;
+    }
 
-            if (!group_1A_sent) {
-                if ((state == 4 || state == 5) && rds_params.rt_enabled) { // Группа 2A (RadioText)
-                    uint8_t ab_flag = 0;
-                    if (rds_params.rt_channel_mode == 1) ab_flag = 1;
-                    else if (rds_params.rt_channel_mode == 2) ab_flag = rds_params.rt_ab_flag;
-                    blocks[1] = 0x2000 | block1_base_other | (ab_flag << 4) | rt_state;
-                    blocks[2] = rds_params.rt[rt_state*4+0]<<8 | rds_params.rt[rt_state*4+1];
-                    blocks[3] = rds_params.rt[rt_state*4+2]<<8 | rds_params.rt[rt_state*4+3];
-                    rt_state = (rt_state + 1) % 16;
-                } else if (rds_params.ptyn_enabled && state == 1) { // PTYN Сегмент 0
-                    blocks[1] = 0xA000 | block1_base_other | 0;
-                    blocks[2] = rds_params.ptyn[0*4+0]<<8 | rds_params.ptyn[0*4+1];
-                    blocks[3] = rds_params.ptyn[0*4+2]<<8 | rds_params.ptyn[0*4+3];
-                } else if (rds_params.ptyn_enabled && rds_params.ptyn_second_segment_exists && state == 2) { // PTYN Сегмент 1
-                    blocks[1] = 0xA000 | block1_base_other | 1;
-                    blocks[2] = rds_params.ptyn[1*4+0]<<8 | rds_params.ptyn[1*4+1];
-                    blocks[3] = rds_params.ptyn[1*4+2]<<8 | rds_params.ptyn[1*4+3];
-                } else { // Группа 0A (PS и AF)
-                    uint8_t di_bit = 0;
-                    switch (ps_state) {
-                        case 0: if (rds_params.di_flags & 8) di_bit = 1; break;
-                        case 1: if (rds_params.di_flags & 4) di_bit = 1; break;
-                        case 2: if (rds_params.di_flags & 2) di_bit = 1; break;
-                        case 3: if (rds_params.di_flags & 1) di_bit = 1; break;
-                    }
-                    blocks[1] = block1_base_other | (rds_params.ta ? 0x10 : 0) | (rds_params.ms ? 0x08 : 0) | (di_bit << 2) | ps_state;
-
-                    int af_sent_this_cycle = 0;
-                    
-                    if (af_toggle == 1 && rds_params.afb_list_size > 0) {
-                        // Отправляем AFB
-                        int num_pairs = rds_params.afb_list_size / 2;
-                        if (num_pairs > 0) {
-                            int pair_index = rds_params.afb_current_pair_index;
-                            blocks[2] = (rds_params.afb_list[pair_index * 2] << 8) | rds_params.afb_list[pair_index * 2 + 1];
-                            rds_params.afb_current_pair_index = (pair_index + 1) % num_pairs;
-                            af_sent_this_cycle = 1;
-                        }
-                        if (rds_params.af_list_size > 0) af_toggle = 0; // В следующий раз отправляем AFA
-                    } else if (rds_params.af_list_size > 0) {
-                        // Отправляем AFA
-                        int num_pairs = rds_params.af_list_size / 2;
-                         if (num_pairs > 0) {
-                            int pair_index = rds_params.af_current_pair_index;
-                            blocks[2] = (rds_params.af_list_to_send[pair_index * 2] << 8) | rds_params.af_list_to_send[pair_index * 2 + 1];
-                            rds_params.af_current_pair_index = (pair_index + 1) % num_pairs;
-                            af_sent_this_cycle = 1;
-                        }
-                        if (rds_params.afb_list_size > 0) af_toggle = 1; // В следующий раз отправляем AFB
-                    }
-
-                    if (!af_sent_this_cycle) {
-                         blocks[2] = rds_params.pi;
-                    }
-
-                    if (rds_params.ps_enabled) {
-                        blocks[3] = rds_params.ps[ps_state*2]<<8 | rds_params.ps[ps_state*2+1];
-                    } else {
-                        blocks[3] = ' '<<8 | ' ';
-                    }
-                    ps_state = (ps_state + 1) % 4;
-                }
-            }
-        }
+}
 
-        state = (state + 1) % 8;
+/* Priority group (set_rds_emergency()): a 0A group with the TA flag, or an
+   EWS group (9A, content defined by the operator)
+*/
+static void build_priority_group(uint16_t *blocks) {
+    uint16_t block1_base = (rds_params->tp ? 0x0400 : 0) | (rds_params->pty << 5);
+    blocks[0] = rds_params->pi;
+    if (rds_params->emergency == EMERGENCY_TA) {
+        build_ps_group(blocks, block1_base);
+    } else {
+        blocks[1] = 0x9000 | block1_base | (rds_params->ews_blocks[0] & 0x1F);
+        blocks[2] = rds_params->ews_blocks[1];
+        blocks[3] = rds_params->ews_blocks[2];
     }
+    rds_params->emergency_copies--;
+}
+
+/* Next group: priority, injected (see set_rds_group_input()) or from the
+   group cycle
+*/
+static void next_rds_group(uint16_t *blocks) {
+    int injected = 0;
+    rds_params->built_from = REPLAY_NONE;
+    rds_params->source_declined = 0;
+    if (rds_params->emergency_copies > 0) {
+        build_priority_group(blocks);
+        injected = 1;
+    } else if (replay_take(REPLAY_INPUT, blocks, 0)) {
+        injected = 1;
+    } else if (rds_params->group_input) {
+        int r = rds_group_reader_next(rds_params->group_input, blocks);
+        if (r < 0) {
+            rds_group_reader_close(rds_params->group_input);
+            rds_params->group_input = NULL;
+            printf("RDS: end of the injected groups, back to the group cycle.\n");
+        }
+        injected = r > 0;
+        if (injected) rds_params->built_from = REPLAY_INPUT;
+    }
+    if (!injected) build_rds_group(blocks);
+}
+
+/* Writes the group that goes on air now (set_rds_group_output()) */
+static void write_group(const uint16_t *blocks) {
+    if (rds_params->group_output == NULL) return;
+    rds_group_write(rds_params->group_output, rds_params->group_output_binary, blocks, group_air_time());
+    if (rds_params->group_output_flush) fflush(rds_params->group_output);
+}
 
-    // Расчет CRC и формирование битстрима
+/* Builds the next group without modulating it, and moves the clock of the
+   encoder on by one group: generates group streams much faster than real
+   time.
+*/
+void get_rds_group_blocks(uint16_t *blocks) {
+    PROFILE_BEGIN(PROFILE_RDS_GROUP);
+    rds_params->group_bits = rds_params->bits_started;
+    next_rds_group(blocks);
+    write_group(blocks);
+    rds_params->bits_started += BITS_PER_GROUP;
+    PROFILE_END(PROFILE_RDS_GROUP);
+}
+
+/* CRC: the group as 4 words of 26 bits, block and check word */
+static void encode_group(uint16_t *blocks, uint32_t *words) {
     for (int i=0; i<GROUP_LENGTH; i++) {
-        uint16_t block = blocks[i];
-        uint16_t check = crc(block) ^ offset_words[i];
-        if (rds_params.pi_cyclic_mode && i == 0) {
+        uint16_t check = crc(blocks[i]) ^ (i == 2 && (blocks[1] & 0x0800) ? OFFSET_C_PRIME : offset_words[i]);
+        if (rds_params->pi_cyclic_mode && i == 0) {
             check = check ^ 0x0001; // Инвертируем последний бит CRC
         }
-        for (int j=0; j<BLOCK_SIZE; j++) {
-            *buffer++ = ((block & (1<<(BLOCK_SIZE-1))) != 0);
-            block <<= 1;
+        words[i] = (uint32_t) blocks[i] << POLY_DEG | (check & ((1 << POLY_DEG) - 1));
+    }
+}
+
+/* Bitstream: the bits of the group, MSB first */
+static void unpack_group(const uint32_t *words, int *buffer) {
+    for (int i=0; i<GROUP_LENGTH; i++) {
+        for (int j=BLOCK_SIZE+POLY_DEG-1; j>=0; j--) {
+            *buffer++ = (words[i] >> j) & 1;
         }
-        for (int j=0; j<POLY_DEG; j++) {
-            *buffer++= ((check & (1<<(POLY_DEG-1))) != 0);
-            check <<= 1;
+    }
+}
+
+/* Keeps the encoder state before a group */
+static void save_group_state(rds_group_state *state) {
+    unsigned char *p = state->cycle;
+    for (size_t i = 0; i < CYCLE_FIELDS; i++) {
+        memcpy(p, (char *) rds_params + cycle_fields[i].offset, cycle_fields[i].size);
+        p += cycle_fields[i].size;
+    }
+    if (rds_params->afb) rds_afb_save(rds_params->afb, &state->afb);
+    if (rds_params->oda) rds_oda_save(rds_params->oda, &state->oda);
+}
+
+static void restore_group_state(const rds_group_state *state) {
+    const unsigned char *p = state->cycle;
+    for (size_t i = 0; i < CYCLE_FIELDS; i++) {
+        memcpy((char *) rds_params + cycle_fields[i].offset, p, cycle_fields[i].size);
+        p += cycle_fields[i].size;
+    }
+    if (rds_params->afb) rds_afb_restore(rds_params->afb, state->afb);
+    if (rds_params->oda) rds_oda_restore(rds_params->oda, state->oda);
+}
+
+/* Builds the next group, and keeps in `state` (if not NULL) what is
+   needed to take it back (see drop_groups())
+*/
+static void build_group(uint16_t *blocks, rds_group_state *state) {
+    if (state) save_group_state(state);
+    next_rds_group(blocks);
+    if (state == NULL) return;
+    state->group.source = rds_params->built_from;
+    state->group.block1_base = (rds_params->tp ? 0x0400 : 0) | (rds_params->pty << 5);
+    state->declined = rds_params->source_declined;
+    memcpy(state->group.blocks, blocks, sizeof(state->group.blocks));
+}
+
+/* The group that starts now, taken from the lookahead queue or built, with
+   its state in `state` if not NULL (rds_preempt())
+*/
+static void get_rds_group(int *buffer, rds_group_state *state) {
+    PROFILE_BEGIN(PROFILE_RDS_GROUP);
+    uint32_t words[GROUP_LENGTH];
+    uint16_t blocks[GROUP_LENGTH];
+    rds_params->group_bits = rds_params->bits_started;
+    if (rds_params->lookahead &&
+        rds_lookahead_pop(rds_params->lookahead, rds_params->bits_started, words, (void **) &rds_params->spare)) {
+        for (int i = 0; i < GROUP_LENGTH; i++) blocks[i] = words[i] >> POLY_DEG;
+        if (state) {
+            rds_group_state built = *rds_params->spare;
+            *rds_params->spare = *state;
+            *state = built;
         }
+    } else {
+        build_group(blocks, state);
+        encode_group(blocks, words);
     }
+    write_group(blocks);
+    unpack_group(words, buffer);
+    PROFILE_END(PROFILE_RDS_GROUP);
 }
 
-/* Get a number of RDS samples... (rest of the file is unchanged) */
-void get_rds_samples(float *buffer, int count) {
-    static int bit_buffer[BITS_PER_GROUP];
-    static int bit_pos = BITS_PER_GROUP;
-    static float sample_buffer[SAMPLE_BUFFER_SIZE] = {0};
-    static int prev_output = 0;
-    static int cur_output = 0;
-    static int cur_bit = 0;
-    static int sample_count = SAMPLES_PER_BIT;
-    static int inverting = 0;
-    static int phase = 0;
-    static int in_sample_index = 0;
-    static int out_sample_index = SAMPLE_BUFFER_SIZE-1;
+/* Builds the group that starts at bit `bits` for the lookahead queue, in
+   the producer thread (which holds the encoder lock)
+*/
+static void build_ahead(void *arg, int64_t bits, uint32_t *words, void *state) {
+    uint16_t blocks[GROUP_LENGTH];
+    PROFILE_BEGIN(PROFILE_RDS_GROUP);
+    rds_params = arg;
+    rds_params->group_bits = bits;
+    build_group(blocks, state);
+    encode_group(blocks, words);
+    PROFILE_END(PROFILE_RDS_GROUP);
+}
+
+/* The groups built ahead are dropped (rds_lookahead.h), oldest first: the
+   encoder goes back to its state before the first one, and the groups
+   taken from the modules, the group source or the injected stream, which
+   cannot go back, are kept to be sent again in the same order (with the
+   slots the group source did not take). The next groups are then the ones
+   the modulator would have built itself. The groups replaced on air by a
+   preemption (rds_preempt()) come before them.
+*/
+static void drop_groups(void *arg, void **states, int count) {
+    rds_encoder *prev = rds_params;
+    rds_group_state *s[PREEMPT_GROUPS + LOOKAHEAD_MAX];
+    rds_params = arg;
+    int n = rds_params->rewind_count;
+    memcpy(s, rds_params->rewind, n * sizeof(s[0]));
+    memcpy(s + n, states, count * sizeof(s[0]));
+    count += n;
+    rds_params->rewind_count = 0;
+    if (count == 0) {
+        rds_params = prev;
+        return;
+    }
+    restore_group_state(s[0]);
+    for (int i = 0; i < count; i++) {
+        for (int j = 0; j < s[i]->declined && rds_params->replay_count < REPLAY_MAX; j++) {
+            rds_params->replay[rds_params->replay_count++] = (rds_replay) {REPLAY_SOURCE, 1, 0, {0}};
+        }
+        if (s[i]->group.source == REPLAY_NONE || rds_params->replay_count == REPLAY_MAX) continue;
+        rds_params->replay[rds_params->replay_count++] = s[i]->group;
+    }
+    rds_params = prev;
+}
+
+/* A change that must go on air at once: the groups built ahead are dropped
+   (see drop_groups()), the producer starts again from the group after the
+   one being modulated
+*/
+static void drop_lookahead() {
+    if (rds_params->lookahead == NULL) return;
+    rds_lookahead_invalidate(rds_params->lookahead,
+                             rds_params->bits_started - rds_params->bit_pos + BITS_PER_GROUP);
+}
+
+/* Keeps the state of the modulator when a group has been loaded */
+static void save_snapshot() {
+    rds_snapshot *snap = &rds_params->snapshots[rds_params->snapshot_count++ % PREEMPT_GROUPS];
+    snap->bits_started = rds_params->bits_started;
+    memcpy(snap->bit_buffer, rds_params->bit_buffer, sizeof(snap->bit_buffer));
+    memcpy(snap->sample_buffer, rds_params->sample_buffer, sizeof(snap->sample_buffer));
+    snap->cur_output = rds_params->cur_output;
+    snap->in_sample_index = rds_params->in_sample_index;
+    snap->out_sample_index = rds_params->out_sample_index;
+    snap->phase = rds_params->phase;
+}
+
+/* Puts the modulator back to a snapshot: the same samples follow */
+static void restore_snapshot(rds_snapshot *snap) {
+    rds_params->bits_started = snap->bits_started;
+    memcpy(rds_params->bit_buffer, snap->bit_buffer, sizeof(snap->bit_buffer));
+    memcpy(rds_params->sample_buffer, snap->sample_buffer, sizeof(snap->sample_buffer));
+    rds_params->cur_output = snap->cur_output;
+    rds_params->in_sample_index = snap->in_sample_index;
+    rds_params->out_sample_index = snap->out_sample_index;
+    rds_params->phase = snap->phase;
+    rds_params->bit_pos = 0;
+    rds_params->sample_count = SAMPLES_PER_BIT;
+    rds_params->history_pos = snap->bits_started * SAMPLES_PER_BIT % PREEMPT_HISTORY;
+}
+
+/* RDS samples: biphase-shaped symbols on the subcarrier, written into
+   `buffer`, or added to it (further RDS2 streams)
+*/
+static void modulate(float *buffer, int count, int add) {
+    PROFILE_BEGIN(PROFILE_RDS_SAMPLES);
     for(int i=0; i<count; i++) {
-        if(sample_count >= SAMPLES_PER_BIT) {
-            if(bit_pos >= BITS_PER_GROUP) {
-                get_rds_group(bit_buffer);
-                bit_pos = 0;
+        if(rds_params->sample_count >= SAMPLES_PER_BIT) {
+            if(rds_params->bit_pos >= BITS_PER_GROUP) {
+                get_rds_group(rds_params->bit_buffer, rds_params->snapshots ?
+                              &rds_params->snapshots[rds_params->snapshot_count % PREEMPT_GROUPS].state : NULL);
+                rds_params->bit_pos = 0;
+                if(rds_params->snapshots) save_snapshot();
             }
-            cur_bit = bit_buffer[bit_pos];
-            prev_output = cur_output;
-            cur_output = prev_output ^ cur_bit;
-            inverting = (cur_output == 1);
-            float *src = waveform_biphase;
-            int idx = in_sample_index;
+            rds_params->bits_started++;
+            rds_params->cur_bit = rds_params->bit_buffer[rds_params->bit_pos];
+            rds_params->prev_output = rds_params->cur_output;
+            rds_params->cur_output = rds_params->prev_output ^ rds_params->cur_bit;
+            rds_params->inverting = (rds_params->cur_output == 1);
+            const float *src = rds_params->waveform;
+            int idx = rds_params->in_sample_index;
             for(int j=0; j<FILTER_SIZE; j++) {
                 float val = (*src++);
-                if(inverting) val = -val;
-                sample_buffer[idx++] += val;
+                if(rds_params->inverting) val = -val;
+                rds_params->sample_buffer[idx++] += val;
                 if(idx >= SAMPLE_BUFFER_SIZE) idx = 0;
             }
-            in_sample_index += SAMPLES_PER_BIT;
-            if(in_sample_index >= SAMPLE_BUFFER_SIZE) in_sample_index -= SAMPLE_BUFFER_SIZE;
-            bit_pos++;
-            sample_count = 0;
+            rds_params->in_sample_index += SAMPLES_PER_BIT;
+            if(rds_params->in_sample_index >= SAMPLE_BUFFER_SIZE) rds_params->in_sample_index -= SAMPLE_BUFFER_SIZE;
+            rds_params->bit_pos++;
+            rds_params->sample_count = 0;
         }
-        float sample = sample_buffer[out_sample_index];
-        sample_buffer[out_sample_index] = 0;
-        out_sample_index++;
-        if(out_sample_index >= SAMPLE_BUFFER_SIZE) out_sample_index = 0;
-        switch(phase) {
-            case 0: case 2: sample = 0; break;
-            case 1: break;
-            case 3: sample = -sample; break;
+        float sample = rds_params->sample_buffer[rds_params->out_sample_index];
+        rds_params->sample_buffer[rds_params->out_sample_index] = 0;
+        rds_params->out_sample_index++;
+        if(rds_params->out_sample_index >= SAMPLE_BUFFER_SIZE) rds_params->out_sample_index = 0;
+        if(rds_params->carrier_period) {
+            sample *= rds_params->carrier[rds_params->phase];
+            if(++rds_params->phase >= rds_params->carrier_period) rds_params->phase = 0;
+        } else {
+            switch(rds_params->phase) {
+                case 0: case 2: sample = 0; break;
+                case 1: break;
+                case 3: sample = -sample; break;
+            }
+            rds_params->phase = (rds_params->phase + 1) % 4;
         }
-        phase = (phase + 1) % 4;
-        *buffer++ = sample;
-        sample_count++;
+        if(rds_params->history) {
+            rds_params->history[rds_params->history_pos] = sample;
+            if(++rds_params->history_pos >= PREEMPT_HISTORY) rds_params->history_pos = 0;
+        }
+        if(add) *buffer++ += sample;
+        else *buffer++ = sample;
+        rds_params->sample_count++;
+    }
+    PROFILE_END(PROFILE_RDS_SAMPLES);
+}
+
+/* Get a number of RDS samples */
+void get_rds_samples(float *buffer, int count) {
+    modulate(buffer, count, 0);
+}
+
+/* Adds a number of RDS samples to `buffer`: for the RDS2 streams, on top of
+   the main one
+*/
+void add_rds_samples(float *buffer, int count) {
+    modulate(buffer, count, 1);
+}
+
+/* Emergency preemption: the priority group (set_rds_emergency()) goes on
+   air before the last `ahead` samples modulated, which are not on air yet.
+   The modulator goes back to the group it was sending then, modulates it
+   again up to the next bit boundary, cuts it there and goes on with the
+   priority group and the groups after it, up to the current position.
+   `delta` receives the new minus the old sample for each of the `ahead`
+   samples, to be added to the multiplex already rendered. The groups cut or
+   replaced are taken back, with those built ahead (see drop_groups()): they
+   are built again after the priority group.
+   Returns the number of samples from the first one of `delta` until the
+   priority group has been sent completely, or -1 if there is no priority
+   group, preemption is off (set_rds_preempt()) or `ahead` goes back further
+   than the snapshots.
+*/
+int rds_preempt(int ahead, float *delta) {
+    if (rds_params->snapshots == NULL || rds_params->emergency_copies == 0 || ahead < 0) return -1;
+    int64_t now = rds_samples();
+    int64_t from = now - ahead;
+
+    // Last group loaded at or before `from`
+    int oldest = rds_params->snapshot_count > PREEMPT_GROUPS ? rds_params->snapshot_count - PREEMPT_GROUPS : 0;
+    int first = rds_params->snapshot_count - 1;
+    while (first >= oldest && rds_params->snapshots[first % PREEMPT_GROUPS].bits_started * SAMPLES_PER_BIT > from)
+        first--;
+    if (first < oldest) return -1;
+    rds_snapshot *snap = &rds_params->snapshots[first % PREEMPT_GROUPS];
+    int64_t start = snap->bits_started * SAMPLES_PER_BIT;
+    if (now - start > PREEMPT_HISTORY) return -1;
+    int64_t cut = start + (from - start + SAMPLES_PER_BIT - 1) / SAMPLES_PER_BIT * SAMPLES_PER_BIT;
+
+    int copies = rds_params->emergency_copies;
+    for (int i = first; i < rds_params->snapshot_count; i++)
+        rds_params->rewind[rds_params->rewind_count++] = &rds_params->snapshots[i % PREEMPT_GROUPS].state;
+    drop_lookahead();
+    drop_groups(rds_params, NULL, 0);       // if nothing was built ahead
+    rds_params->emergency_copies = copies;
+
+    // Old samples, minus...
+    for (int i = 0; i < ahead; i++) delta[i] = -rds_params->history[(from + i) % PREEMPT_HISTORY];
+
+    // ...the same ones up to the cut...
+    float skipped[4 * SAMPLES_PER_BIT];
+    restore_snapshot(snap);
+    for (int64_t n = from - start; n > 0; ) {
+        int count = n < 4 * SAMPLES_PER_BIT ? n : 4 * SAMPLES_PER_BIT;
+        modulate(skipped, count, 0);
+        n -= count;
     }
+    int64_t until = cut < now ? cut : now;
+    modulate(delta, until - from, 1);
+
+    // ...then the priority group and the next ones
+    rds_params->bit_pos = BITS_PER_GROUP;
+    rds_params->snapshot_count = first + 1;
+    if (cut < now) modulate(delta + (cut - from), now - cut, 1);
+    return cut - from + MODULATOR_DELAY + GROUP_SAMPLES;
+}
+
+/* Moves the encoder to the subcarrier `freq` (Hz) with the phase `phase`
+   (degrees, relative to the first sample): 57 kHz for the main stream,
+   66.5, 71.25 or 76 kHz for the RDS2 streams 1 to 3. The frequency must have
+   a whole number of cycles in at most MAX_CARRIER_PERIOD samples. Returns 0,
+   or -1 for a frequency that is not locked to the sample clock.
+*/
+int set_rds_carrier(double freq, double phase) {
+    int period = 1;
+    while(period <= MAX_CARRIER_PERIOD && fabs(remainder(freq * period / SAMPLE_RATE, 1)) > 1e-9) period++;
+    if(period > MAX_CARRIER_PERIOD || freq <= 0 || freq >= SAMPLE_RATE / 2) return -1;
+
+    if(freq == 57000 && phase == 0) {
+        rds_params->carrier_period = 0;     // 0, 1, 0, -1: no multiplication
+    } else {
+        for(int i = 0; i < period; i++) {
+            rds_params->carrier[i] = sin(2 * M_PI * freq * i / SAMPLE_RATE + phase * M_PI / 180);
+        }
+        rds_params->carrier_period = period;
+    }
+    rds_params->phase = 0;
+    return 0;
+}
+
+/* Scales the biphase waveform, so that the RDS samples come out at the
+   final output level without a separate multiplication */
+void set_rds_level(float level) {
+    for (int i = 0; i < FILTER_SIZE; i++) {
+        rds_params->waveform_scaled[i] = waveform_biphase[i] * level;
+    }
+    rds_params->waveform = rds_params->waveform_scaled;
 }
 
 int set_rds_af(char* af_list_str) {
-    rds_params.af_count = 0;
-    rds_params.af_list_size = 0;
-    rds_params.af_current_pair_index = 0;
+    drop_lookahead();
+    rds_params->af_count = 0;
+    rds_params->af_list_size = 0;
+    rds_params->af_current_pair_index = 0;
 
     if (strcmp(af_list_str, "0") == 0) {
-        rds_params.af_list_to_send[0] = 224;
-        rds_params.af_list_to_send[1] = 205; // Filler
-        rds_params.af_list_size = 2;
+        rds_params->af_list_to_send[0] = 224;
+        rds_params->af_list_to_send[1] = 205; // Filler
+        rds_params->af_list_size = 2;
         return 1;
     }
 
@@ -445,13 +1586,13 @@ int set_rds_af(char* af_list_str) {
     char* to_free = str;
     char* token;
 
-    while ((token = strsep(&str, " ,")) != NULL && rds_params.af_count < MAX_AF_FREQUENCIES) {
+    while ((token = strsep(&str, " ,")) != NULL && rds_params->af_count < MAX_AF_FREQUENCIES) {
         if (strlen(token) == 0) continue;
         float freq = atof(token);
         if (freq == 0) continue;
-        uint8_t code = freq_to_code(freq);
-        if (code != 255) {
-            temp_freq_codes[rds_params.af_count++] = code;
+        int code = rds_freq_code(freq);
+        if (code >= 0) {
+            temp_freq_codes[rds_params->af_count++] = code;
         } else {
             fprintf(stderr, "Error: Invalid or out-of-range AF frequency: %s.\n", token);
             free(to_free);
@@ -461,30 +1602,31 @@ int set_rds_af(char* af_list_str) {
     free(to_free);
 
     // FIX: Если частота всего одна, дублируем её для лучшей совместимости
-    if (rds_params.af_count == 1) {
+    if (rds_params->af_count == 1) {
         temp_freq_codes[1] = temp_freq_codes[0];
-        rds_params.af_count = 2;
+        rds_params->af_count = 2;
     }
 
-    rds_params.af_list_to_send[0] = 224 + rds_params.af_count;
-    memcpy(&rds_params.af_list_to_send[1], temp_freq_codes, rds_params.af_count);
-    rds_params.af_list_size = 1 + rds_params.af_count;
+    rds_params->af_list_to_send[0] = 224 + rds_params->af_count;
+    memcpy(&rds_params->af_list_to_send[1], temp_freq_codes, rds_params->af_count);
+    rds_params->af_list_size = 1 + rds_params->af_count;
 
-    if (rds_params.af_list_size % 2 != 0) {
-        rds_params.af_list_to_send[rds_params.af_list_size++] = 205;
+    if (rds_params->af_list_size % 2 != 0) {
+        rds_params->af_list_to_send[rds_params->af_list_size++] = 205;
     }
 
     return 1;
 }
 
 int set_rds_af_from_file(int afaf) {
+    drop_lookahead();
     if (afaf == 0) {
-        rds_params.af_count = 0;
-        rds_params.af_list_size = 0;
-        rds_params.af_current_pair_index = 0;
+        rds_params->af_count = 0;
+        rds_params->af_list_size = 0;
+        rds_params->af_current_pair_index = 0;
         // Устанавливаем код "No AF exists"
-        rds_params.af_list_to_send[0] = 224;
-        rds_params.af_list_size = 1;
+        rds_params->af_list_to_send[0] = 224;
+        rds_params->af_list_size = 1;
         return 1;
     }
 
@@ -524,136 +1666,328 @@ int set_rds_af_from_file(int afaf) {
     return set_rds_af(all_freqs);
 }
 
+/* Starts the burst of a changed PS/TA (0A groups) or RT, and the measure of
+   the time until it is complete (for PS and RT, from the request of the
+   text that is swapped in: see build_ps_group()). Changes before the transmission starts (initial
+   settings) are not measured. A PS or RT not sent completely yet finishes
+   its pass first, in the group cycle: a scroller does not get a burst for
+   each step.
+*/
+static void ps_changed(int ta_only) {
+    if (rds_params->bits_started == 0) return;
+    if (ta_only) {
+        start_update(&rds_params->ta_update, 0x1);
+    } else {
+        rds_params->ps_update.requested_at = rds_time();
+    }
+    if (!rds_params->burst_enabled) return;
+    if (rds_params->ps_fresh) {
+        if (!ta_only) return;
+    } else {
+        rds_params->ps_state = 0;
+    }
+    // The TA flag is in every 0A group: one is enough, but a full PS is sent
+    rds_params->ps_burst = (ta_only ? 4 : 8) + (4 - rds_params->ps_state) % 4;
+    rds_params->burst_slot = 0;
+}
+
+static void rt_changed() {
+    rds_params->rt_update.requested_at = rds_time();
+    if (!rds_params->burst_enabled || rds_params->rt_fresh) return;
+    rds_params->rt_state = 0;
+    rds_params->rt_burst = 2 * rt_segments(rds_params->rt_next);
+    rds_params->burst_slot = 0;
+}
+
+/* PS requested: on air at once before the transmission starts, otherwise
+   at the next segment 0. A request that comes before the swap replaces the
+   previous one (coalesced): a receiver never gets segments of two texts in
+   one pass, and a scroller faster than the 4 groups of a PS only skips
+   texts.
+*/
+static void request_ps(const char *ps) {
+    if (rds_params->bits_started == 0) {
+        memcpy(rds_params->ps, ps, PS_LENGTH);
+        return;
+    }
+    int coalesced = rds_params->ps_pending;
+    memcpy(rds_params->ps_next, ps, PS_LENGTH);
+    rds_params->ps_pending = 1;
+    rds_params->ps_update.requested++;
+    if (!coalesced) {
+        ps_changed(0);
+        return;
+    }
+    // Already waiting for the swap: only the text changes
+    rds_params->ps_update.superseded++;
+    rds_params->ps_update.requested_at = rds_time();
+}
+
+/* The same for the formatted RT in rt_next (see request_ps()) */
+static void request_rt() {
+    if (rds_params->bits_started == 0 || !rds_params->rt_enabled) {
+        memcpy(rds_params->rt, rds_params->rt_next, RT_LENGTH);
+        rds_params->rt_segments = rt_segments(rds_params->rt);
+        rds_params->rt_ab_flag = rds_params->rt_ab_next;
+        if (rds_params->rt_state >= rds_params->rt_segments) rds_params->rt_state = 0;
+        rds_params->rt_pending = 0;
+        return;
+    }
+    int coalesced = rds_params->rt_pending;
+    rds_params->rt_pending = 1;
+    rds_params->rt_update.requested++;
+    if (!coalesced) {
+        rt_changed();
+        return;
+    }
+    rds_params->rt_update.superseded++;
+    rds_params->rt_update.requested_at = rds_time();
+}
+
+/* Formats the RT for sending into rt_next; returns 1 if it differs from
+   the last text requested
+*/
+static int update_rt() {
+    char rt[RT_LENGTH];
+    fill_rds_string_mode(rt, rds_params->original_rt, RT_LENGTH, rds_params->rt_mode);
+    int changed = memcmp(rt, rds_params->rt_pending ? rds_params->rt_next : rds_params->rt, RT_LENGTH) != 0;
+    memcpy(rds_params->rt_next, rt, RT_LENGTH);
+    return changed;
+}
+
 void set_rds_rt_mode(char mode) {
+    drop_lookahead();
     if (mode == 'P' || mode == 'A' || mode == 'D') {
-        rds_params.rt_mode = mode;
+        rds_params->rt_mode = mode;
         // Переформатируем существующий текст с новым режимом
-        fill_rds_string_mode(rds_params.rt, rds_params.original_rt, RT_LENGTH, rds_params.rt_mode);
+        if (update_rt()) request_rt();
     }
 }
 
 void set_rds_pi(uint16_t pi_code) {
-    rds_params.pi = pi_code;
+    drop_lookahead();
+    rds_params->pi = pi_code;
     // Сохраняем код как "оригинальный", если он не нулевой.
     // Это позволит нам восстановить его командой PION.
     if (pi_code != 0x0000) {
-        rds_params.original_pi = pi_code;
+        rds_params->original_pi = pi_code;
     }
 }
 
 void set_rds_ct(int ct) {
-    rds_params.ct_enabled = ct;
+    drop_lookahead();
+    rds_params->ct_enabled = ct;
+    rds_params->ct_next = 0;
 }
 
 void set_rds_ctz(int offset_minutes) {
-    rds_params.ct_offset_minutes = offset_minutes;
+    drop_lookahead();
+    rds_params->ct_offset_minutes = offset_minutes;
+    rds_params->ct_next = 0;
 }
 
 void set_rds_cts(int hour, int minute, int day, int month, int year) {
-    rds_params.ct_mode = CT_CUSTOM_STATIC;
-    rds_params.custom_tm.tm_hour = hour;
-    rds_params.custom_tm.tm_min = minute;
-    rds_params.custom_tm.tm_mday = day;
-    rds_params.custom_tm.tm_mon = month - 1;
-    rds_params.custom_tm.tm_year = year - 1900;
-    rds_params.custom_tm.tm_isdst = -1; // Let mktime decide
+    drop_lookahead();
+    rds_params->ct_mode = CT_CUSTOM_STATIC;
+    rds_params->custom_tm.tm_hour = hour;
+    rds_params->custom_tm.tm_min = minute;
+    rds_params->custom_tm.tm_mday = day;
+    rds_params->custom_tm.tm_mon = month - 1;
+    rds_params->custom_tm.tm_year = year - 1900;
+    rds_params->custom_tm.tm_isdst = -1; // Let mktime decide
+    rds_params->ct_next = 0;
 }
 
 void set_rds_ctc(int hour, int minute, int day, int month, int year) {
     set_rds_cts(hour, minute, day, month, year); // Use the same logic to fill the struct
-    rds_params.ct_mode = CT_CUSTOM_TICKING;
-    rds_params.real_time_at_set_t = time(NULL);
+    rds_params->ct_mode = CT_CUSTOM_TICKING;
+    rds_params->real_time_at_set_t = rds_time();
     // timegm treats the struct as UTC and converts to UTC time_t, which is correct for us.
-    rds_params.custom_time_start_t = timegm(&rds_params.custom_tm);
+    rds_params->custom_time_start_t = timegm(&rds_params->custom_tm);
 }
 
 void set_rds_rt(char *rt) {
-    // Если включен режим AB, переключаем канал (A -> B -> A)
-    if (rds_params.rt_channel_mode == 2) {
-        rds_params.rt_ab_flag = !rds_params.rt_ab_flag;
-    }
+    drop_lookahead();
+    // In AB mode, the channel switches (A -> B -> A) with the text: once for
+    // the texts coalesced before the swap
+    rds_params->rt_ab_next = rds_params->rt_channel_mode == 2 ? !rds_params->rt_ab_flag : rds_params->rt_ab_flag;
     // Сохраняем "чистую" версию текста
-    strncpy(rds_params.original_rt, rt, RT_LENGTH - 1);
-    rds_params.original_rt[RT_LENGTH - 1] = '\0'; // Гарантируем завершающий ноль
+    strncpy(rds_params->original_rt, rt, RT_LENGTH - 1);
+    rds_params->original_rt[RT_LENGTH - 1] = '\0'; // Гарантируем завершающий ноль
 
     // Форматируем текст для отправки с учётом текущего режима
-    fill_rds_string_mode(rds_params.rt, rds_params.original_rt, RT_LENGTH, rds_params.rt_mode);
+    if (update_rt() || rds_params->rt_channel_mode == 2) request_rt();
 }
 
 void set_rds_ps(char *ps) {
-    fill_rds_string(rds_params.ps, ps, 8);
+    drop_lookahead();
+    char next[PS_LENGTH];
+    fill_rds_string(next, ps, 8);
+    if (memcmp(next, rds_params->ps_pending ? rds_params->ps_next : rds_params->ps, PS_LENGTH) != 0) request_ps(next);
+}
+
+/* Long PS (group 15A): up to 32 bytes of UTF-8, never cut inside a
+   character; an empty text stops the 15A groups. The segments that differ
+   from the previous text are sent first (see build_lps_group()), in a burst
+   if enabled.
+*/
+void set_rds_lps(char *lps) {
+    drop_lookahead();
+    char old[LPS_LENGTH];
+    int old_segments = rds_params->lps_segments;
+    memcpy(old, rds_params->lps, LPS_LENGTH);
+    int len = fill_utf8_string(rds_params->lps, lps, LPS_LENGTH);
+    // Segments up to the one with the 0x0D that ends a shorter text
+    rds_params->lps_segments = len == 0 ? 0 : (len < LPS_LENGTH ? len / 4 + 1 : LPS_LENGTH / 4);
+    if (rds_params->lps_state >= rds_params->lps_segments) rds_params->lps_state = 0;
+    if (memcmp(old, rds_params->lps, LPS_LENGTH) == 0) return;
+    memset(rds_params->lps_resend, 0, sizeof(rds_params->lps_resend));
+    rds_params->lps_burst = 0;
+    if (rds_params->bits_started == 0 || rds_params->lps_segments == 0) return;
+
+    uint32_t changed = 0;
+    for (int i = 0; i < rds_params->lps_segments; i++) {
+        if (i >= old_segments || memcmp(old + 4*i, rds_params->lps + 4*i, 4) != 0) {
+            changed |= 1u << i;
+            rds_params->lps_resend[i] = 2;
+        }
+    }
+    if (changed == 0) return;
+    start_update(&rds_params->lps_update, changed);
+    if (!rds_params->burst_enabled) return;
+    rds_params->lps_burst = 2 * __builtin_popcount(changed);
+    rds_params->burst_slot = 0;
+}
+
+/* Enhanced RadioText (ODA): up to 128 bytes of UTF-8, cut before a
+   character that does not fit; an empty text stops eRT. Only the segments
+   up to the end of the text are sent, in the RT slots of the group cycle
+   (every other one when RT is on).
+*/
+void set_rds_ert(char *ert) {
+    drop_lookahead();
+    char old[ERT_LENGTH];
+    memcpy(old, rds_params->ert, ERT_LENGTH);
+    int len = fill_utf8_string(rds_params->ert, ert, ERT_LENGTH);
+    rds_params->ert_segments = len == 0 ? 0 : (len < ERT_LENGTH ? len / 4 + 1 : ERT_LENGTH / 4);
+    if (rds_params->ert_state > rds_params->ert_segments) rds_params->ert_state = 0;
+    if (memcmp(old, rds_params->ert, ERT_LENGTH) == 0) return;
+    rds_params->ert_state = 0;
+    rds_params->ert_burst = 0;
+    if (rds_params->bits_started == 0 || rds_params->ert_segments == 0) return;
+    start_update(&rds_params->ert_update, (uint32_t) ((1ull << rds_params->ert_segments) - 1));
+    if (!rds_params->burst_enabled) return;
+    rds_params->ert_burst = 2 * (rds_params->ert_segments + 1);
+    rds_params->burst_slot = 0;
+}
+
+/* Group type of the eRT groups, e.g. "12A": one of the type A groups that
+   ODAs may use (5A to 9A, 11A to 13A). Returns 1 on success, 0 otherwise.
+*/
+int set_rds_ert_group(char *type) {
+    drop_lookahead();
+    char version = 'A';
+    int n = 0;
+    if (sscanf(type, "%d%c", &n, &version) < 1 || (version != 'A' && version != 'a')) return 0;
+    if (n < 5 || n > 13 || n == 10) return 0;
+    rds_params->ert_group = n << 1;
+    return 1;
 }
 
 void set_rds_ta(int ta) {
-    rds_params.ta = ta;
+    drop_lookahead();
+    if (!ta && rds_params->emergency_tp >= 0) {
+        // end of the TA emergency: back to the TP set before it
+        rds_params->tp = rds_params->emergency_tp;
+        rds_params->emergency_tp = -1;
+    }
+    if (ta != rds_params->ta) {
+        rds_params->ta = ta;
+        ps_changed(1);
+    }
 }
 
 void set_rds_tp(int tp) {
-    rds_params.tp = tp;
+    drop_lookahead();
+    if (rds_params->emergency_tp >= 0) rds_params->emergency_tp = tp;    // after the TA emergency
+    else rds_params->tp = tp;
 }
 
 void set_rds_ms(int ms) {
-    rds_params.ms = ms;
+    drop_lookahead();
+    rds_params->ms = ms;
 }
 
 void set_rds_pty(uint8_t pty_code) {
-    rds_params.pty = pty_code;
+    drop_lookahead();
+    rds_params->pty = pty_code;
 }
 
 void set_rds_ecc(uint8_t ecc_code) {
-    rds_params.ecc = ecc_code;
-    rds_params.ecc_enabled = 1;
+    drop_lookahead();
+    rds_params->ecc = ecc_code;
+    rds_params->ecc_enabled = 1;
 }
 
 void set_rds_lic(uint8_t lic_code) {
-    rds_params.lic = lic_code;
-    rds_params.lic_enabled = 1;
+    drop_lookahead();
+    rds_params->lic = lic_code;
+    rds_params->lic_enabled = 1;
 }
 
 void set_rds_pin(uint8_t day, uint8_t hour, uint8_t minute) {
-    rds_params.pin_day = day;
-    rds_params.pin_hour = hour;
-    rds_params.pin_minute = minute;
-    rds_params.pin_enabled = 1;
+    drop_lookahead();
+    rds_params->pin_day = day;
+    rds_params->pin_hour = hour;
+    rds_params->pin_minute = minute;
+    rds_params->pin_enabled = 1;
 }
 
 void set_rds_di(uint8_t flags) {
-    rds_params.di_flags = flags;
+    drop_lookahead();
+    rds_params->di_flags = flags;
 }
 
 void set_rds_ptyn(char *ptyn) {
-    fill_rds_string(rds_params.ptyn, ptyn, 8);
-    rds_params.ptyn_enabled = 1;
+    drop_lookahead();
+    fill_rds_string(rds_params->ptyn, ptyn, 8);
+    rds_params->ptyn_enabled = 1;
 
     // Проверяем, есть ли во втором сегменте (символы 4-7) что-то кроме пробелов
-    rds_params.ptyn_second_segment_exists = 0;
+    rds_params->ptyn_second_segment_exists = 0;
     for (int i = 4; i < 8; i++) {
-        if (rds_params.ptyn[i] != ' ') {
-            rds_params.ptyn_second_segment_exists = 1;
+        if (rds_params->ptyn[i] != ' ') {
+            rds_params->ptyn_second_segment_exists = 1;
             break;
         }
     }
 }
 
 void set_rds_rt_channel(int mode) {
+    drop_lookahead();
     if (mode >= 0 && mode <= 2) {
-        rds_params.rt_channel_mode = mode;
+        rds_params->rt_channel_mode = mode;
     }
 }
 
 void reset_rds_ct() {
-    rds_params.ct_mode = CT_SYSTEM;
-    rds_params.ct_offset_minutes = 0;
+    drop_lookahead();
+    rds_params->ct_mode = CT_SYSTEM;
+    rds_params->ct_offset_minutes = 0;
+    rds_params->ct_next = 0;
 }
 
 void disable_rds_rtp() {
-    rds_params.rtp_enabled = 0;
+    drop_lookahead();
+    rds_params->rtp_enabled = 0;
+    unregister_oda("RT+");
     // Сбрасываем теги на всякий случай
-    rds_params.tags[0].enabled = 0;
-    rds_params.tags[1].enabled = 0;
+    rds_params->tags[0].enabled = 0;
+    rds_params->tags[1].enabled = 0;
 }
 
 int set_rds_rtp(char *rtp_string) {
+    drop_lookahead();
     // Временно храним теги здесь, чтобы не испортить текущие рабочие теги в случае ошибки
     rds_rtp_tag temp_tags[2] = {{0,0,0,0}, {0,0,0,0}};
 
@@ -689,212 +2023,713 @@ int set_rds_rtp(char *rtp_string) {
     free(to_free);
 
     if (tag_index == 0) return 0; // Не найдено ни одного корректного тега
+    if (!register_rtp()) return 0;
 
     // Успех! Теперь применяем изменения в основной структуре параметров.
-    rds_params.rtp_item_toggle_bit = !rds_params.rtp_item_toggle_bit;
-    rds_params.rtp_item_running_bit = 1;
+    rds_params->rtp_item_toggle_bit = !rds_params->rtp_item_toggle_bit;
+    rds_params->rtp_item_running_bit = 1;
 
-    rds_params.tags[0] = temp_tags[0];
-    rds_params.tags[1] = temp_tags[1];
+    rds_params->tags[0] = temp_tags[0];
+    rds_params->tags[1] = temp_tags[1];
 
     // Длина второго тега ограничена 5 битами
-    if (rds_params.tags[1].enabled) {
-        rds_params.tags[1].length_marker &= 0x1F;
+    if (rds_params->tags[1].enabled) {
+        rds_params->tags[1].length_marker &= 0x1F;
     }
 
-    rds_params.rtp_enabled = 1;
+    rds_params->rtp_enabled = 1;
 
     return 1; // Возвращаем успех
 }
 
 void disable_rds_ecc() {
-    rds_params.ecc_enabled = 0;
+    drop_lookahead();
+    rds_params->ecc_enabled = 0;
 }
 
 void disable_rds_lic() {
-    rds_params.lic_enabled = 0;
+    drop_lookahead();
+    rds_params->lic_enabled = 0;
 }
 
 void disable_rds_pin() {
-    rds_params.pin_enabled = 0;
+    drop_lookahead();
+    rds_params->pin_enabled = 0;
 }
 
 void disable_rds_ptyn() {
-    rds_params.ptyn_enabled = 0;
+    drop_lookahead();
+    rds_params->ptyn_enabled = 0;
 }
 
 uint16_t get_rds_pi() {
-    return rds_params.pi;
+    return rds_params->pi;
 }
 uint8_t get_rds_pty() {
-    return rds_params.pty;
+    return rds_params->pty;
 }
 int get_rds_tp() {
-    return rds_params.tp;
+    return rds_params->tp;
 }
 int get_rds_ta() {
-    return rds_params.ta;
+    return rds_params->ta;
 }
 int get_rds_ms() {
-    return rds_params.ms;
+    return rds_params->ms;
 }
 uint8_t get_rds_ecc() {
-    return rds_params.ecc;
+    return rds_params->ecc;
 }
 
 uint8_t get_rds_di() {
-    return rds_params.di_flags;
+    return rds_params->di_flags;
 }
 
 void set_rds_pi_cyclic_mode(int enabled) {
-    rds_params.pi_cyclic_mode = enabled;
+    drop_lookahead();
+    rds_params->pi_cyclic_mode = enabled;
 }
 
-void set_rds_pi_random_mode(int enabled) {
-    rds_params.pi_random_mode = enabled;
-    // Если режим выключается, восстанавливаем исходный PI
-    if (!enabled) {
-        rds_params.pi = rds_params.original_pi;
-    }
+/* Replaces the system time used for CT with `clock(arg)` (NULL restores the
+   system time). A clock that follows the number of rendered samples makes the
+   output reproducible.
+*/
+void set_rds_clock(rds_clock_fn clock, void *arg) {
+    rds_params->clock = clock;
+    rds_params->clock_arg = arg;
 }
 
-void set_rds_ps_enabled(int enabled) {
-    rds_params.ps_enabled = enabled;
+/* Enables (default) or disables the burst of the changed groups after a
+   change of PS, TA or RT
+*/
+void set_rds_burst(int enabled) {
+    drop_lookahead();
+    rds_params->burst_enabled = enabled;
+    if (!enabled) rds_params->ps_burst = rds_params->lps_burst = rds_params->rt_burst = rds_params->ert_burst = 0;
 }
 
-void set_rds_rt_enabled(int enabled) {
-    rds_params.rt_enabled = enabled;
+static void report_update(FILE *f, const char *name, rds_update *u) {
+    if (u->updates == 0) return;
+    fprintf(f, "  %-3s %3d change(s): complete on air after %.0f ms (mean), %.0f ms (max), %.0f ms (last)\n",
+            name, u->updates, 1e3 * u->total / u->updates, 1e3 * u->max, 1e3 * u->last);
+    u->updates = 0;
+    u->total = u->max = 0;
 }
 
-void set_rds_pi_null(int nullify) {
-    if (nullify) {
-        rds_params.pi = 0x0000;
+/* PS/RT texts displayed (sent completely) against the texts requested */
+static void report_requests(FILE *f, const char *name, rds_update *u, double seconds) {
+    if (u->requested == 0) return;
+    fprintf(f, "  %-3s %3d request(s) (%.2f/s), %d displayed (%.2f/s), %d superseded before the swap\n",
+            name, u->requested, u->requested / seconds, u->displayed, u->displayed / seconds, u->superseded);
+    u->requested = u->superseded = u->displayed = 0;
+}
+
+/* Prints the time from each change of PS, TA, RT, Long PS or eRT to the end
+   of the group that completes it on air (for Long PS: the changed segments),
+   and the rate of the PS/RT texts displayed against the rate requested,
+   since the previous report
+*/
+void rds_update_report(FILE *f) {
+    drop_lookahead();
+    rds_update *u[5] = {&rds_params->ps_update, &rds_params->ta_update, &rds_params->rt_update,
+                        &rds_params->lps_update, &rds_params->ert_update};
+    double seconds = (rds_params->bits_started - rds_params->update_report_bits) * SAMPLES_PER_BIT / SAMPLE_RATE;
+    rds_params->update_report_bits = rds_params->bits_started;
+    if (u[0]->updates + u[1]->updates + u[2]->updates + u[3]->updates + u[4]->updates +
+        u[0]->requested + u[2]->requested == 0) return;
+    fprintf(f, "RDS updates (burst %s, RT %d segment(s)):\n", rds_params->burst_enabled ? "on" : "off",
+            rds_params->rt_segments);
+    report_update(f, "PS", u[0]);
+    report_update(f, "TA", u[1]);
+    report_update(f, "RT", u[2]);
+    report_update(f, "LPS", u[3]);
+    report_update(f, "ERT", u[4]);
+    if (seconds <= 0) return;
+    report_requests(f, "PS", u[0], seconds);
+    report_requests(f, "RT", u[2], seconds);
+}
+
+/* Replaces the fixed group cycle with a mix derived from target maximum
+   intervals for a complete message, e.g. "PS=1,AF=2,RT=4" (seconds; services
+   PS, TA, AF, RT, RTP, 1A, PTYN, LPS, ERT). The targets are met in the order given
+   when the 11.4 groups/s are not enough for all. "OFF" restores the fixed
+   cycle. Returns 1 on success, 0 if the list is invalid.
+*/
+int set_rds_sla(char *spec) {
+    drop_lookahead();
+    double target[SERVICES] = {0};
+    int order[SERVICES];
+    int count = 0;
+
+    if (strcasecmp(spec, "OFF") != 0 && strcmp(spec, "0") != 0) {
+        char *str = strdup(spec);
+        if (str == NULL) return 0;
+        char *to_free = str;
+        char *token;
+        while ((token = strsep(&str, ", ")) != NULL) {
+            if (strlen(token) == 0) continue;
+            char *eq = strchr(token, '=');
+            double seconds = eq ? atof(eq + 1) : 0;
+            int s = 0;
+            if (eq) *eq = '\0';
+            while (s < SERVICES && strcasecmp(token, service_names[s]) != 0) s++;
+            if (s == SERVICES || seconds <= 0 || target[s] > 0) {
+                free(to_free);
+                return 0;
+            }
+            target[s] = seconds;
+            order[count++] = s;
+        }
+        free(to_free);
+        if (count == 0) return 0;
+    }
+
+    memcpy(rds_params->sla_target, target, sizeof(target));
+    memcpy(rds_params->sla_order, order, count * sizeof(int));
+    rds_params->sla_count = count;
+    memset(rds_params->worst_interval, 0, sizeof(rds_params->worst_interval));
+    if (rds_params->rtp_enabled) register_rtp();    // at the interval of the new target
+    if (count > 0) plan_group_mix();
+    return 1;
+}
+
+/* Prints the planned rate of each service and the worst interval achieved
+   since the previous report (no output without targets)
+*/
+void rds_sla_report(FILE *f) {
+    drop_lookahead();
+    if (rds_params->sla_count == 0) return;
+    fprintf(f, "RDS group mix (%.2f groups/s):\n", GROUPS_PER_SECOND);
+    for (int s = 0; s < SERVICES; s++) {
+        int segments = service_segments(s);
+        if (segments == 0) continue;
+        int src = service_source[s];
+        fprintf(f, "  %-4s ", service_names[s]);
+        if (rds_params->sla_target[s] > 0) {
+            fprintf(f, "target %5.2f s%s", rds_params->sla_target[s],
+                    rds_params->sla_infeasible[s] ? " INFEASIBLE" : "           ");
+        } else {
+            fprintf(f, "no target                ");
+        }
+        double rate = rds_params->sla_rate[src];
+        double planned = rate > 0 ? (ceil(segments * GROUPS_PER_SECOND / rate - 1e-9) + 2) / GROUPS_PER_SECOND : 0;
+        fprintf(f, " %-6s %5.2f groups/s, planned %5.2f s", source_names[src], rate, planned);
+        if (rds_params->worst_interval[s] > 0) fprintf(f, ", worst %5.2f s", rds_params->worst_interval[s]);
+        fprintf(f, "\n");
+        rds_params->worst_interval[s] = 0;
+    }
+}
+
+/* TMC (ALERT-C) from a specification "ltn,sid[,rate[,repeat]]": location
+   table number and service identifier (0-63), TMC groups per second
+   (default 1, at most MAX_TMC_RATE) and copies of each message sent in a
+   row (default 2). The messages are kept when the settings change; "OFF"
+   stops TMC and drops them. Returns 1 on success, 0 if the specification
+   is invalid.
+*/
+int set_rds_tmc(char *spec) {
+    drop_lookahead();
+    if (strcasecmp(spec, "OFF") == 0) {
+        unregister_oda("TMC");
+        replay_flush(REPLAY_TMC);
+        rds_tmc_free(rds_params->tmc);
+        rds_params->tmc = NULL;
+        return 1;
+    }
+    int ltn, sid, repeat = 2;
+    double rate = 1;
+    if (sscanf(spec, "%d,%d,%lf,%d", &ltn, &sid, &rate, &repeat) < 2 || ltn < 0 || ltn > 63 ||
+        sid < 0 || sid > 63 || rate <= 0 || rate > MAX_TMC_RATE || repeat < 1 || repeat > 5) return 0;
+    if (!register_oda("TMC", TMC_AID, 8 << 1, 1 / rate, 1, tmc_oda_group, NULL)) return 0;
+
+    if (rds_params->tmc) {
+        rds_tmc_set_system(rds_params->tmc, ltn, sid);
     } else {
-        rds_params.pi = rds_params.original_pi;
+        rds_params->tmc = rds_tmc_new(ltn, sid);
+        if (rds_params->tmc == NULL) {
+            unregister_oda("TMC");
+            return 0;
+        }
     }
+    rds_tmc_set_repeat(rds_params->tmc, repeat);
+    rds_params->tmc_rate = rate;
+    return 1;
 }
 
-int set_rds_afb(char* afb_list_str) {
-    rds_params.afb_list_size = 0;
-    rds_params.afb_current_pair_index = 0;
+/* Adds (or replaces) a TMC message "id,event,location[,extent[,direction[,minutes]]]":
+   ALERT-C event code, location code of the location table, extent (0-7),
+   direction (0: positive, 1: negative), duration (default 60 minutes).
+   Returns 1 on success, 0 if TMC is off or the message is invalid.
+*/
+int add_rds_tmc_message(char *spec) {
+    int id, event, location, extent = 0, direction = 0, minutes = 60;
+    if (rds_params->tmc == NULL ||
+        sscanf(spec, "%d,%d,%d,%d,%d,%d", &id, &event, &location, &extent, &direction, &minutes) < 3) return 0;
+    return rds_tmc_add(rds_params->tmc, id, event, location, extent, direction, minutes, rds_time()) == 0;
+}
 
-    if (strcmp(afb_list_str, "0") == 0) {
-        return 1; // Выключаем
+/* Removes the TMC message `id` ("ALL": every message). Returns 1 if a
+   message was removed.
+*/
+int remove_rds_tmc_message(char *id) {
+    if (rds_params->tmc == NULL) return 0;
+    return rds_tmc_remove(rds_params->tmc, strcasecmp(id, "ALL") == 0 ? -1 : atoi(id)) == 0;
+}
+
+/* Prints the TMC rate planned and achieved, and the message table */
+void rds_tmc_status(FILE *f) {
+    drop_lookahead();
+    if (rds_params->tmc == NULL) return;
+    double measured = rds_params->tmc_slots ?
+                      GROUPS_PER_SECOND * rds_params->tmc_groups / rds_params->tmc_slots : 0;
+    fprintf(f, "TMC: %.2f groups/s planned, %.2f sent\n", rds_params->tmc_rate, measured);
+    rds_tmc_report(rds_params->tmc, f, rds_time(), rds_params->tmc_rate);
+    rds_params->tmc_groups = rds_params->tmc_slots = 0;
+}
+
+/* Creates the table of other networks, registered for 14A groups at
+   eon_rate. Returns 1, or 0 if there is no room for them.
+*/
+static int new_eon() {
+    if (rds_params->eon) return 1;
+    if (!register_oda("EON", 0, 14 << 1, 1 / rds_params->eon_rate, 3, eon_oda_group, NULL)) return 0;
+    rds_params->eon = rds_eon_new();
+    if (rds_params->eon == NULL) unregister_oda("EON");
+    return rds_params->eon != NULL;
+}
+
+/* Adds an other network (EON), or replaces the one with the same PI: a line
+   "PI,PS,AF,MF1,MF2,MF3,MF4,LI,PTY,TP,TA,PIN" (see rds_eon.h). A change of
+   its TA sends 14B groups at once. "OFF" removes every network. Returns 1
+   on success, 0 if the description is invalid.
+*/
+int set_rds_eon(char *spec) {
+    drop_lookahead();
+    if (strcasecmp(spec, "OFF") == 0) {
+        unregister_oda("EON");
+        replay_flush(REPLAY_EON);
+        replay_flush(REPLAY_14B);
+        rds_eon_free(rds_params->eon);
+        rds_params->eon = NULL;
+        return 1;
     }
+    if (!new_eon()) return 0;
+    return rds_eon_set(rds_params->eon, spec) == 0;
+}
 
-    uint8_t all_pairs_list[256];
-    int total_pairs = 0;
+/* Removes the other network with the PI `pi` (hexadecimal). Returns 1 if
+   there was one.
+*/
+int remove_rds_eon(char *pi) {
+    if (rds_params->eon == NULL) return 0;
+    return rds_eon_remove(rds_params->eon, strtol(pi, NULL, 16)) == 0;
+}
 
-    char* str_variants = strdup(afb_list_str);
-    if (!str_variants) return 0;
-    char* to_free_variants = str_variants;
-    char* variant_token;
+/* Loads the other networks from `path` (NULL: rds/eon.txt), one per line,
+   in place of the table. The networks that stay keep their turn, and the
+   group cycle goes on. Returns the number of networks, or -1 if the file
+   cannot be read or has an invalid line (the table is then unchanged).
+*/
+int set_rds_eon_from_file(const char *path) {
+    drop_lookahead();
+    // As for afa.txt: run from src/, from the project root or next to the file
+    const char *paths_to_try[] = {"rds/eon.txt", "src/rds/eon.txt", "eon.txt"};
+    FILE *f = path ? fopen(path, "r") : NULL;
+    for (int i = 0; path == NULL && i < 3; i++) {
+        f = fopen(paths_to_try[i], "r");
+        if (f) path = paths_to_try[i];
+    }
+    if (f == NULL) return -1;
 
-    while ((variant_token = strsep(&str_variants, "|")) != NULL) {
-        uint8_t af_codes_in_variant[MAX_AF_FREQUENCIES];
-        uint8_t rv_flags_in_variant[MAX_AF_FREQUENCIES];
-        int variant_af_count = 0;
-        uint8_t tuned_freq_code = 0;
+    int count = new_eon() ? rds_eon_load(rds_params->eon, f) : -1;
+    fclose(f);
+    if (count >= 0) printf("EON: %d other network(s) read from %s\n", count, path);
+    return count;
+}
 
-        char* str_freqs = strdup(variant_token);
-        if (!str_freqs) { free(to_free_variants); return 0; }
-        char* to_free_freqs = str_freqs;
-        char* freq_token;
-        int is_first_freq = 1;
+/* 14A groups per second (default EON_RATE, at most MAX_EON_RATE). Returns 1
+   on success, 0 if the rate is out of range or there is no room for it.
+*/
+int set_rds_eon_rate(double rate) {
+    drop_lookahead();
+    if (rate <= 0 || rate > MAX_EON_RATE) return 0;
+    if (rds_params->eon && !register_oda("EON", 0, 14 << 1, 1 / rate, 3, eon_oda_group, NULL)) return 0;
+    rds_params->eon_rate = rate;
+    return 1;
+}
 
-        while ((freq_token = strsep(&str_freqs, " ,")) != NULL) {
-            if (strlen(freq_token) == 0) continue;
+/* Prints the 14A rate planned and achieved, and the full cycle of each
+   other network
+*/
+void rds_eon_status(FILE *f) {
+    drop_lookahead();
+    if (rds_params->eon == NULL) return;
+    double measured = rds_params->eon_slots ?
+                      GROUPS_PER_SECOND * rds_params->eon_groups / rds_params->eon_slots : 0;
+    fprintf(f, "EON: %.2f 14A groups/s planned, %.2f sent\n", rds_params->eon_rate, measured);
+    rds_eon_report(rds_params->eon, f, rds_params->eon_rate);
+    rds_params->eon_groups = rds_params->eon_slots = 0;
+}
 
-            int is_regional = 0;
-            int len = strlen(freq_token);
-            if (tolower(freq_token[len - 1]) == 'r') {
-                is_regional = 1;
-                freq_token[len - 1] = '\0';
-            }
+/* Priority group, sent EMERGENCY_COPIES times before any other: "TA"
+   (0A groups with the TP and TA flags set) or "EWS b,c,d" (group 9A: the 5
+   bits of block 2 and blocks 3 and 4, hexadecimal). rds_preempt() sends it
+   before the samples already rendered. Returns 1 on success, 0 if the
+   specification is invalid.
+*/
+int set_rds_emergency(char *spec) {
+    drop_lookahead();
+    unsigned int b, c, d;
+    if (strcasecmp(spec, "TA") == 0) {
+        rds_params->emergency = EMERGENCY_TA;
+        if (rds_params->emergency_tp < 0) rds_params->emergency_tp = rds_params->tp;
+        rds_params->tp = 1;
+        set_rds_ta(1);
+    } else if (strncasecmp(spec, "EWS ", 4) == 0 && sscanf(spec + 4, "%x,%x,%x", &b, &c, &d) == 3 &&
+               b <= 0x1F && c <= 0xFFFF && d <= 0xFFFF) {
+        rds_params->emergency = EMERGENCY_EWS;
+        rds_params->ews_blocks[0] = b;
+        rds_params->ews_blocks[1] = c;
+        rds_params->ews_blocks[2] = d;
+    } else {
+        return 0;
+    }
+    rds_params->emergency_copies = EMERGENCY_COPIES;
+    return 1;
+}
 
-            float freq = atof(freq_token);
-            if (freq == 0) continue;
-            uint8_t code = freq_to_code(freq);
+/* Keeps the modulator snapshots and the samples that rds_preempt() needs
+   (PREEMPT_GROUPS groups, about 0.7 s). Returns 1, or 0 if no memory is
+   available.
+*/
+static void free_snapshots(rds_encoder *enc) {
+    for (int i = 0; enc->snapshots && i < PREEMPT_GROUPS; i++) free_group_state(&enc->snapshots[i].state);
+    free(enc->snapshots);
+    free(enc->history);
+    enc->snapshots = NULL;
+    enc->history = NULL;
+}
 
-            if (code == 255) {
-                fprintf(stderr, "Error: Invalid AFB frequency: %s\n", freq_token);
-                free(to_free_freqs); free(to_free_variants); return 0;
-            }
+int set_rds_preempt(int enabled) {
+    free_snapshots(rds_params);
+    if (!enabled) return 1;
 
-            if (is_first_freq) {
-                tuned_freq_code = code;
-                is_first_freq = 0;
-            } else if (variant_af_count < MAX_AF_FREQUENCIES) {
-                af_codes_in_variant[variant_af_count] = code;
-                rv_flags_in_variant[variant_af_count] = is_regional;
-                variant_af_count++;
-            }
-        }
-        free(to_free_freqs);
-
-        if (tuned_freq_code != 0 && variant_af_count > 0) {
-            all_pairs_list[total_pairs * 2] = 224 + variant_af_count;
-            all_pairs_list[total_pairs * 2 + 1] = tuned_freq_code;
-            total_pairs++;
-
-            for (int i = 0; i < variant_af_count; i++) {
-                uint8_t af_code = af_codes_in_variant[i];
-                uint8_t is_rv = rv_flags_in_variant[i];
-                uint8_t F1 = is_rv ? (af_code > tuned_freq_code ? af_code : tuned_freq_code) : (af_code < tuned_freq_code ? af_code : tuned_freq_code);
-                uint8_t F2 = is_rv ? (af_code < tuned_freq_code ? af_code : tuned_freq_code) : (af_code > tuned_freq_code ? af_code : tuned_freq_code);
-                if (F1==F2) {F1=tuned_freq_code; F2=af_code;}
-
-                all_pairs_list[total_pairs * 2] = F1;
-                all_pairs_list[total_pairs * 2 + 1] = F2;
-                total_pairs++;
-            }
-        }
+    rds_params->snapshots = calloc(PREEMPT_GROUPS, sizeof(rds_snapshot));
+    rds_params->history = calloc(PREEMPT_HISTORY, sizeof(float));
+    int failed = rds_params->snapshots == NULL || rds_params->history == NULL;
+    for (int i = 0; !failed && i < PREEMPT_GROUPS; i++) failed = alloc_group_state(&rds_params->snapshots[i].state) < 0;
+    if (failed) {
+        set_rds_preempt(0);
+        return 0;
     }
-    free(to_free_variants);
+    rds_params->snapshot_count = 0;
+    rds_params->history_pos = rds_samples() % PREEMPT_HISTORY;
+    return 1;
+}
 
-    if (total_pairs > 0) {
-        memcpy(rds_params.afb_list, all_pairs_list, total_pairs * 2);
-        rds_params.afb_list_size = total_pairs * 2;
+/* Groups built ahead by a low-priority thread (rds_lookahead.h): `groups`
+   groups (1 to LOOKAHEAD_MAX) already encoded wait for the modulator, 0
+   stops it. The calling thread owns the encoder: it holds the encoder lock
+   from now on, and releases it while it sleeps (rds_unlock(), rds_lock()).
+   Returns 1, or 0 if the thread cannot be started.
+*/
+static void free_group_states(rds_encoder *enc) {
+    for (int i = 0; i < enc->state_count; i++) free_group_state(&enc->states[i]);
+    free(enc->states);
+    enc->states = enc->spare = NULL;
+    enc->state_count = 0;
+}
+
+int set_rds_lookahead(int groups) {
+    rds_lookahead_stop(rds_params->lookahead);
+    rds_params->lookahead = NULL;
+    free_group_states(rds_params);
+    if (groups < 1 || groups > LOOKAHEAD_MAX) return groups == 0;
+
+    rds_params->states = calloc(groups + 1, sizeof(rds_group_state));
+    if (rds_params->states == NULL) return 0;
+    rds_params->state_count = groups + 1;
+    void *states[LOOKAHEAD_MAX];
+    for (int i = 0; i <= groups; i++) {
+        if (alloc_group_state(&rds_params->states[i]) < 0) {
+            free_group_states(rds_params);
+            return 0;
+        }
+        if (i < groups) states[i] = &rds_params->states[i];
+    }
+    rds_params->spare = &rds_params->states[groups];
+
+    int64_t next = rds_params->bits_started - rds_params->bit_pos + BITS_PER_GROUP;
+    // The producer builds groups before the modulator loads them: without
+    // an air time, the next group goes on air now (see group_air_time())
+    if (rds_params->anchor_time == 0) {
+        rds_params->anchor_time = rds_time();
+        rds_params->anchor_sample = next * SAMPLES_PER_BIT;
     }
+    rds_params->lookahead = rds_lookahead_start(groups, BITS_PER_GROUP, next, states, build_ahead, drop_groups,
+                                                rds_params);
+    if (rds_params->lookahead == NULL) free_group_states(rds_params);
+    return rds_params->lookahead != NULL;
+}
 
-    return 1;
+void rds_lock() {
+    if (rds_params->lookahead) rds_lookahead_lock(rds_params->lookahead);
 }
 
-int set_rds_afb_from_file(int afbf) {
-    if (afbf == 0) {
-        rds_params.afb_list_size = 0;
+void rds_unlock() {
+    if (rds_params->lookahead) rds_lookahead_unlock(rds_params->lookahead);
+}
+
+void rds_lookahead_status(FILE *f) {
+    if (rds_params->lookahead) rds_lookahead_report(rds_params->lookahead, f);
+}
+
+/* Transparent data channel from a specification "path[,channel[,rate[,B]]]":
+   file or named pipe of messages, channel (0-31, default 0), groups per
+   second at most (default 1, at most MAX_TDC_RATE), "B" for groups 5B.
+   "OFF" stops it. Returns 1 on success, 0 if the specification is invalid
+   or the file cannot be opened.
+*/
+int set_rds_tdc(char *spec) {
+    drop_lookahead();
+    if (strcasecmp(spec, "OFF") == 0) {
+        unregister_oda("TDC");
+        replay_flush(REPLAY_TDC);
+        rds_tdc_close(rds_params->tdc);
+        rds_params->tdc = NULL;
         return 1;
     }
+    char path[256], version = 'A';
+    int channel = 0;
+    double rate = 1;
+    if (sscanf(spec, "%255[^,],%d,%lf,%c", path, &channel, &rate, &version) < 1 || channel < 0 ||
+        channel > 31 || rate <= 0 || rate > MAX_TDC_RATE || (version != 'A' && version != 'B')) return 0;
+
+    rds_tdc *tdc = rds_tdc_open(path, channel, version == 'B');
+    if (tdc == NULL) return 0;
+    if (!register_oda("TDC", 0, 5 << 1 | (version == 'B'), 1 / rate, 2, tdc_oda_group, NULL)) {
+        rds_tdc_close(tdc);
+        return 0;
+    }
+    replay_flush(REPLAY_TDC);
+    rds_tdc_close(rds_params->tdc);
+    rds_params->tdc = tdc;
+    rds_params->tdc_rate = rate;
+    return 1;
+}
 
-    const char* paths_to_try[] = {"rds/afb.txt", "src/rds/afb.txt", "afb.txt"};
-    FILE* f = NULL;
-    char found_path[256] = {0};
-    for (int i = 0; i < 3; i++) {
-        f = fopen(paths_to_try[i], "r");
-        if (f) {
-            strncpy(found_path, paths_to_try[i], sizeof(found_path) - 1);
-            break;
-        }
+/* Prints the payload rate and the queue of the transparent data channel */
+void rds_tdc_status(FILE *f) {
+    drop_lookahead();
+    if (rds_params->tdc == NULL) return;
+    fprintf(f, "TDC: at most %.2f groups/s\n", rds_params->tdc_rate);
+    rds_tdc_report(rds_params->tdc, f, rds_params->tdc_slots / GROUPS_PER_SECOND);
+    rds_params->tdc_slots = 0;
+}
+
+/* Seeds the pseudo-random generator of the encoder (random PI of -rds-bug) */
+void set_rds_seed(uint32_t seed) {
+    drop_lookahead();
+    rds_params->rand_state = seed ? seed : 1;
+}
+
+/* Writes every group sent to `path` ("-": stdout, NULL: off), in the
+   hexadecimal format of RDS Spy or in the binary format with air times (see
+   rds_group_io.h). Returns 0, or -1 if the file cannot be opened.
+*/
+int set_rds_group_output(const char *path, int binary) {
+    if (rds_params->group_output && rds_params->group_output != stdout) fclose(rds_params->group_output);
+    rds_params->group_output = NULL;
+    if (path == NULL) return 0;
+
+    FILE *f = strcmp(path, "-") == 0 ? stdout : fopen(path, "w");
+    if (f == NULL) return -1;
+    // Pipes and devices (e.g. a hardware encoder) get each group at once
+    struct stat st;
+    rds_params->group_output_flush = fstat(fileno(f), &st) != 0 || !S_ISREG(st.st_mode);
+    rds_params->group_output_binary = binary;
+    rds_params->group_output = f;
+    rds_group_write_header(f, binary);
+    return 0;
+}
+
+/* Sends the groups read from `path` (file, FIFO, "-": stdin) instead of the
+   group cycle, in either format of set_rds_group_output(). The cycle resumes
+   at the end of a file, and while a FIFO has no complete group. NULL stops
+   the injection. Returns 0, or -1 if the file cannot be opened.
+*/
+int set_rds_group_input(const char *path) {
+    drop_lookahead();
+    replay_flush(REPLAY_INPUT);
+    rds_group_reader_close(rds_params->group_input);
+    rds_params->group_input = NULL;
+    if (path == NULL) return 0;
+    rds_params->group_input = rds_group_reader_open(path);
+    return rds_params->group_input ? 0 : -1;
+}
+
+/* Offers each group slot (after CT and the update bursts) to `fn`, which
+   fills the blocks and returns 1, or returns 0 to leave the slot to the
+   group cycle. Block 1 holds the PI when `fn` is called; it may be replaced
+   (RDS2 data groups). NULL removes the source.
+*/
+void set_rds_group_source(rds_group_source_fn fn, void *arg) {
+    drop_lookahead();
+    replay_flush(REPLAY_SOURCE);
+    unregister_oda("SOURCE");
+    rds_params->source_fn = fn;
+    rds_params->source_arg = arg;
+    if (fn) register_oda("SOURCE", 0, -1, 0, 5, source_oda_group, NULL);
+}
+
+/* Prints the applications of the registry, with the groups sent and the
+   worst latency of each one since the previous report
+*/
+void rds_oda_status(FILE *f) {
+    drop_lookahead();
+    if (rds_params->oda) rds_oda_report(rds_params->oda, f);
+}
+
+/* Prints the queue of the registry (order of the next groups) */
+void rds_oda_queue_dump(FILE *f) {
+    if (rds_params->oda) rds_oda_dump(rds_params->oda, f);
+    else fprintf(f, "ODA queue: no application\n");
+}
+
+void set_rds_pi_random_mode(int enabled) {
+    drop_lookahead();
+    rds_params->pi_random_mode = enabled;
+    // Если режим выключается, восстанавливаем исходный PI
+    if (!enabled) {
+        rds_params->pi = rds_params->original_pi;
     }
+}
 
-    if (!f) {
-        perror("Error: Could not find afb.txt in default locations");
+void set_rds_ps_enabled(int enabled) {
+    drop_lookahead();
+    rds_params->ps_enabled = enabled;
+}
+
+void set_rds_rt_enabled(int enabled) {
+    drop_lookahead();
+    rds_params->rt_enabled = enabled;
+    if (!enabled) rds_params->rt_burst = 0;
+}
+
+void set_rds_pi_null(int nullify) {
+    drop_lookahead();
+    if (nullify) {
+        rds_params->pi = 0x0000;
+    } else {
+        rds_params->pi = rds_params->original_pi;
+    }
+}
+
+/* Replaces the AF method B table (NULL or empty: off) */
+static void replace_afb(rds_afb *afb) {
+    drop_lookahead();
+    rds_afb_free(rds_params->afb);
+    if (afb && rds_afb_count(afb) == 0) {
+        rds_afb_free(afb);
+        afb = NULL;
+    }
+    rds_params->afb = afb;
+}
+
+/* AF method B from a list of variants "tuned,af1,af2r,...|..." (see
+   rds_afb.h), "0": off. Returns 1 on success, 0 if a variant is invalid
+   (the table is then unchanged).
+*/
+int set_rds_afb(char* afb_list_str) {
+    if (strcmp(afb_list_str, "0") == 0) {
+        replace_afb(NULL);
+        return 1; // Выключаем
+    }
+    rds_afb *afb = rds_afb_new();
+    if (afb == NULL || rds_afb_parse(afb, afb_list_str) < 0) {
+        rds_afb_free(afb);
         return 0;
     }
-    printf("Reading AFB list from: %s\n", found_path);
+    replace_afb(afb);
+    return 1;
+}
 
-    char line[1024];
-    char all_freqs[2048] = {0};
-    while (fgets(line, sizeof(line), f)) {
-        line[strcspn(line, "\r\n")] = 0;
-        strcat(all_freqs, line);
-        strcat(all_freqs, "|");
+/* Loads the AF method B variants from `path` (NULL: rds/afb.txt), one per
+   line, in place of the table; the file is read line by line, without limit
+   on its size. Returns the number of variants, or -1 if the file cannot be
+   read or has an invalid line (the table is then unchanged).
+*/
+int set_rds_afb_file(const char *path) {
+    const char *paths_to_try[] = {"rds/afb.txt", "src/rds/afb.txt", "afb.txt"};
+    FILE *f = path ? fopen(path, "r") : NULL;
+    for (int i = 0; path == NULL && i < 3; i++) {
+        f = fopen(paths_to_try[i], "r");
+        if (f) path = paths_to_try[i];
     }
+    if (f == NULL) {
+        perror("Error: Could not open the AFB list");
+        return -1;
+    }
+
+    rds_afb *afb = rds_afb_new();
+    int count = afb ? rds_afb_load(afb, f) : -1;
     fclose(f);
+    if (count < 0) {
+        rds_afb_free(afb);
+        return -1;
+    }
+    printf("AFB: %d variant(s) in %d words read from %s\n", count, rds_afb_words(afb), path);
+    replace_afb(afb);
+    return count;
+}
 
-    if (strlen(all_freqs) > 0) {
-        all_freqs[strlen(all_freqs) - 1] = '\0';
+int set_rds_afb_from_file(int afbf) {
+    if (afbf == 0) {
+        replace_afb(NULL);
+        return 1;
     }
+    return set_rds_afb_file(NULL) >= 0;
+}
 
-    return set_rds_afb(all_freqs);
-}
\ No newline at end of file
+/* Prints the AF method B table: for each variant, the 0A groups and the
+   time in which a receiver gets it complete
+*/
+void rds_afb_status(FILE *f) {
+    drop_lookahead();
+    if (rds_params->afb == NULL) return;
+    fprintf(f, "AF method B:\n");
+    // One AFB word every 0A group, every other one with method A too
+    rds_afb_report(rds_params->afb, f, rds_params->af_list_size > 0 ? 2 : 1);
+}
+
+rds_encoder *rds_encoder_new() {
+    rds_encoder *enc = malloc(sizeof(rds_encoder));
+    if (enc == NULL) return NULL;
+    memcpy(enc, &rds_encoder_template, sizeof(rds_encoder));
+    return enc;
+}
+
+void rds_encoder_free(rds_encoder *enc) {
+    if (enc == NULL || enc == &rds_default_encoder) return;
+    if (rds_params == enc) rds_params = &rds_default_encoder;
+    rds_lookahead_stop(enc->lookahead);
+    free_group_states(enc);
+    if (enc->group_output && enc->group_output != stdout) fclose(enc->group_output);
+    rds_group_reader_close(enc->group_input);
+    rds_tmc_free(enc->tmc);
+    rds_tdc_close(enc->tdc);
+    rds_eon_free(enc->eon);
+    rds_oda_free(enc->oda);
+    rds_afb_free(enc->afb);
+    free_snapshots(enc);
+    free(enc);
+}
+
+/* Selects the encoder used by the calling thread. NULL selects the default
+   (process-wide) encoder. Returns the previously selected encoder.
+*/
+rds_encoder *rds_encoder_select(rds_encoder *enc) {
+    rds_encoder *prev = rds_params;
+    rds_params = enc ? enc : &rds_default_encoder;
+    return prev;
+}
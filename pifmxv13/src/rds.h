@@ -3,11 +3,47 @@
 
 
 #include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+typedef struct rds_encoder rds_encoder;
+typedef double (*rds_clock_fn)(void *arg);
+typedef int (*rds_group_source_fn)(void *arg, uint16_t *blocks, uint16_t block1_base);
+
+extern rds_encoder *rds_encoder_new();
+extern void rds_encoder_free(rds_encoder *enc);
+extern rds_encoder *rds_encoder_select(rds_encoder *enc);
 
 extern void get_rds_samples(float *buffer, int count);
+extern void add_rds_samples(float *buffer, int count);
+extern int set_rds_carrier(double freq, double phase);
+extern void set_rds_level(float level);
 extern void set_rds_pi(uint16_t pi_code);
 extern void set_rds_rt(char *rt);
 extern void set_rds_ps(char *ps);
+extern void set_rds_lps(char *lps);
+extern void set_rds_ert(char *ert);
+extern int set_rds_ert_group(char *type);
+extern int set_rds_tmc(char *spec);
+extern int add_rds_tmc_message(char *spec);
+extern int remove_rds_tmc_message(char *id);
+extern void rds_tmc_status(FILE *f);
+extern int set_rds_tdc(char *spec);
+extern void rds_tdc_status(FILE *f);
+extern int set_rds_eon(char *spec);
+extern int remove_rds_eon(char *pi);
+extern int set_rds_eon_from_file(const char *path);
+extern int set_rds_eon_rate(double rate);
+extern void rds_eon_status(FILE *f);
+extern void rds_oda_status(FILE *f);
+extern void rds_oda_queue_dump(FILE *f);
+extern int set_rds_emergency(char *spec);
+extern int set_rds_preempt(int enabled);
+extern int rds_preempt(int ahead, float *delta);
+extern int set_rds_lookahead(int groups);
+extern void rds_lock();
+extern void rds_unlock();
+extern void rds_lookahead_status(FILE *f);
 extern void set_rds_ta(int ta);
 extern void set_rds_tp(int tp);
 extern void set_rds_pty(uint8_t pty_code);
@@ -31,6 +67,18 @@ extern void disable_rds_pin();
 extern void disable_rds_ptyn();
 extern void set_rds_pi_cyclic_mode(int enabled);
 extern void set_rds_pi_random_mode(int enabled);
+extern void set_rds_clock(rds_clock_fn clock, void *arg);
+extern void set_rds_air_time(double time);
+extern int get_rds_samples_to_group(int samples);
+extern void set_rds_seed(uint32_t seed);
+extern void set_rds_burst(int enabled);
+extern void rds_update_report(FILE *f);
+extern int set_rds_sla(char *spec);
+extern void rds_sla_report(FILE *f);
+extern int set_rds_group_output(const char *path, int binary);
+extern int set_rds_group_input(const char *path);
+extern void set_rds_group_source(rds_group_source_fn fn, void *arg);
+extern void get_rds_group_blocks(uint16_t *blocks);
 extern void set_rds_ps_enabled(int enabled);
 extern void set_rds_rt_enabled(int enabled);
 
@@ -47,5 +95,10 @@ extern int set_rds_af(char* af_list_str);
 extern int set_rds_af_from_file(int afaf);
 extern int set_rds_afb(char* afb_list_str);
 extern int set_rds_afb_from_file(int afbf);
+extern int set_rds_afb_file(const char *path);
+extern void rds_afb_status(FILE *f);
+
+extern int rds_freq_code(double freq);
+extern uint16_t rds_crc16(const uint8_t *p, size_t len);
 
 #endif /* RDS_H */
\ No newline at end of file
@@ -0,0 +1,280 @@
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds.h"
+#include "rds_afb.h"
+
+
+#define REPORT_VARIANTS 16          // variants listed one by one in the report
+
+typedef struct {
+    int first;                  // its first word in the table
+    int words;
+    uint8_t tuned;
+    double cycle_start;         // time the variant was last started, -1: not yet
+    double last_cycle;          // time between its last two starts, 0: none yet
+} afb_variant;
+
+struct rds_afb {
+    uint16_t *word;             // block 3 of the 0A groups, variant after variant
+    int word_count;
+    int word_capacity;
+    afb_variant *variants;
+    int count;
+    int capacity;
+    int pos;                    // next word
+    int variant;                // variant of the next word
+
+    // Since the last report
+    unsigned long sent;
+    double first_sent;
+    double last_sent;
+};
+
+
+rds_afb *rds_afb_new() {
+    return calloc(1, sizeof(rds_afb));
+}
+
+void rds_afb_free(rds_afb *a) {
+    if (a == NULL) return;
+    free(a->word);
+    free(a->variants);
+    free(a);
+}
+
+int rds_afb_count(rds_afb *a) {
+    return a->count;
+}
+
+int rds_afb_words(rds_afb *a) {
+    return a->word_count;
+}
+
+static int grow(rds_afb *a, int words) {
+    if (a->word_count + words > a->word_capacity) {
+        int capacity = a->word_capacity ? 2 * a->word_capacity : 64;
+        while (capacity < a->word_count + words) capacity *= 2;
+        uint16_t *word = realloc(a->word, capacity * sizeof(uint16_t));
+        if (word == NULL) return -1;
+        a->word = word;
+        a->word_capacity = capacity;
+    }
+    if (a->count == a->capacity) {
+        int capacity = a->capacity ? 2 * a->capacity : 16;
+        afb_variant *variants = realloc(a->variants, capacity * sizeof(afb_variant));
+        if (variants == NULL) return -1;
+        a->variants = variants;
+        a->capacity = capacity;
+    }
+    return 0;
+}
+
+/* Adds a variant "tuned,af1,af2r,..." (see rds_afb.h) at the end of the
+   table. Returns 1, 0 if it has no AF (nothing to send), or -1 if a
+   frequency is invalid, if it has more than AFB_MAX_AF frequencies or if no
+   memory is available.
+*/
+int rds_afb_add(rds_afb *a, const char *variant) {
+    uint8_t code[AFB_MAX_AF + 1];
+    uint8_t regional[AFB_MAX_AF + 1];
+    int n = 0;
+    const char *p = variant;
+
+    while (*p) {
+        p += strspn(p, " ,\t\r\n");
+        if (*p == 0) break;
+        char *end;
+        double freq = strtod(p, &end);
+        if (end == p) {
+            fprintf(stderr, "AFB: invalid frequency in \"%s\"\n", variant);
+            return -1;
+        }
+        p = end;
+        int rv = tolower((unsigned char) *p) == 'r';
+        if (rv) p++;
+        if (freq == 0) continue;
+        int c = rds_freq_code(freq);
+        if (c < 0) {
+            fprintf(stderr, "AFB: invalid frequency %.1f\n", freq);
+            return -1;
+        }
+        if (n == AFB_MAX_AF + 1) {
+            fprintf(stderr, "AFB: more than %d frequencies for %.1f MHz\n", AFB_MAX_AF, (code[0] + 875) / 10.);
+            return -1;
+        }
+        code[n] = c;
+        regional[n] = rv;
+        n++;
+    }
+    if (n < 2) return 0;
+
+    if (grow(a, n) < 0) return -1;
+    uint16_t *w = &a->word[a->word_count];
+    uint8_t tuned = code[0];
+    w[0] = (224 + n - 1) << 8 | tuned;
+    for (int i = 1; i < n; i++) {
+        uint8_t lo = code[i] < tuned ? code[i] : tuned;
+        uint8_t hi = code[i] < tuned ? tuned : code[i];
+        uint8_t f1 = regional[i] ? hi : lo;
+        uint8_t f2 = regional[i] ? lo : hi;
+        if (f1 == f2) {
+            f1 = tuned;
+            f2 = code[i];
+        }
+        w[i] = f1 << 8 | f2;
+    }
+    a->variants[a->count++] = (afb_variant) {a->word_count, n, tuned, -1, 0};
+    a->word_count += n;
+    return 1;
+}
+
+/* Adds the variants of a list separated by "|". Returns the number of
+   variants of the table, or -1 for an invalid variant.
+*/
+int rds_afb_parse(rds_afb *a, const char *list) {
+    char *str = strdup(list);
+    if (str == NULL) return -1;
+    char *to_free = str;
+    char *token;
+    while ((token = strsep(&str, "|")) != NULL) {
+        if (rds_afb_add(a, token) < 0) {
+            free(to_free);
+            return -1;
+        }
+    }
+    free(to_free);
+    return a->count;
+}
+
+/* Adds the variants of `f`, one per line (or several separated by "|"), of
+   any length and number; empty lines and lines starting with # are skipped.
+   Returns the number of variants of the table, or -1 for an invalid line.
+*/
+int rds_afb_load(rds_afb *a, FILE *f) {
+    char *line = NULL;
+    size_t size = 0;
+    int number = 0;
+    while (getline(&line, &size, f) >= 0) {
+        number++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#') continue;
+        if (rds_afb_parse(a, p) < 0) {
+            fprintf(stderr, "AFB: invalid variant on line %d: %s", number, line);
+            free(line);
+            return -1;
+        }
+    }
+    free(line);
+    return a->count;
+}
+
+
+/* Next word of the rotation; `now` (seconds) measures the cycles. Returns
+   the index of the word in the table, or -1 if the table is empty.
+*/
+int rds_afb_next(rds_afb *a, uint16_t *word, double now) {
+    if (a->word_count == 0) return -1;
+    afb_variant *v = &a->variants[a->variant];
+    if (a->pos == v->first) {
+        if (v->cycle_start >= 0) v->last_cycle = now - v->cycle_start;
+        v->cycle_start = now;
+    }
+    int pos = a->pos;
+    *word = a->word[pos];
+    if (++a->pos == v->first + v->words) {
+        a->variant = (a->variant + 1) % a->count;
+        a->pos = a->variants[a->variant].first;
+    }
+
+    if (a->sent++ == 0) a->first_sent = now;
+    a->last_sent = now;
+    return pos;
+}
+
+typedef struct {
+    int pos;
+    int variant;
+    unsigned long sent;
+    double first_sent;
+    double last_sent;
+    int count;                  // variants, -1: not saved
+    double cycle[][2];          // cycle_start and last_cycle of each variant
+} afb_state;
+
+/* Copies the position in the table and the measures into `*state`: one
+   block, allocated or grown as needed (released with free()). Returns 0, or
+   -1 if no memory is available (the state is then not usable).
+*/
+int rds_afb_save(rds_afb *a, void **state) {
+    afb_state *s = realloc(*state, sizeof(afb_state) + a->count * sizeof(s->cycle[0]));
+    if (s == NULL) {
+        if (*state) ((afb_state *) *state)->count = -1;
+        return -1;
+    }
+    *state = s;
+    s->pos = a->pos;
+    s->variant = a->variant;
+    s->sent = a->sent;
+    s->first_sent = a->first_sent;
+    s->last_sent = a->last_sent;
+    s->count = a->count;
+    for (int i = 0; i < a->count; i++) {
+        s->cycle[i][0] = a->variants[i].cycle_start;
+        s->cycle[i][1] = a->variants[i].last_cycle;
+    }
+    return 0;
+}
+
+/* Goes back to a state saved with the same table (the words sent since
+   then are sent again)
+*/
+void rds_afb_restore(rds_afb *a, const void *state) {
+    const afb_state *s = state;
+    if (s == NULL || s->count != a->count) return;
+    a->pos = s->pos;
+    a->variant = s->variant;
+    a->sent = s->sent;
+    a->first_sent = s->first_sent;
+    a->last_sent = s->last_sent;
+    for (int i = 0; i < a->count; i++) {
+        a->variants[i].cycle_start = s->cycle[i][0];
+        a->variants[i].last_cycle = s->cycle[i][1];
+    }
+}
+
+
+static void print_variant(rds_afb *a, FILE *f, afb_variant *v, int groups_per_word, double rate) {
+    // At worst, the receiver tunes in just after the start of its variant
+    int groups = (a->word_count + v->words - 1) * groups_per_word;
+    fprintf(f, "  %5.1f MHz: %2d AF, complete within %d 0A groups", (v->tuned + 875) / 10., v->words - 1, groups);
+    if (rate > 0) fprintf(f, " (%.1f s)", (a->word_count + v->words - 1) / rate);
+    if (v->last_cycle > 0) fprintf(f, ", last cycle %.1f s", v->last_cycle);
+    fprintf(f, "\n");
+}
+
+/* Prints the table: for each variant, the number of 0A groups (one AFB word
+   every `groups_per_word` 0A groups) and the time at the rate measured
+   since the previous report in which the receiver gets it complete
+*/
+void rds_afb_report(rds_afb *a, FILE *f, int groups_per_word) {
+    double rate = a->sent > 1 && a->last_sent > a->first_sent ? (a->sent - 1) / (a->last_sent - a->first_sent) : 0;
+    fprintf(f, "  %d variant(s) in %d words (%lu sent, %.2f words/s): one pass in %d 0A groups",
+            a->count, a->word_count, a->sent, rate, a->word_count * groups_per_word);
+    if (rate > 0) fprintf(f, " (%.1f s)", a->word_count / rate);
+    fprintf(f, "\n");
+
+    afb_variant *longest = NULL;
+    for (int i = 0; i < a->count; i++) {
+        afb_variant *v = &a->variants[i];
+        if (i < REPORT_VARIANTS) print_variant(a, f, v, groups_per_word, rate);
+        else if (longest == NULL || v->words > longest->words) longest = v;
+    }
+    if (longest) {
+        fprintf(f, "  ... %d more variant(s), the longest:\n", a->count - REPORT_VARIANTS);
+        print_variant(a, f, longest, groups_per_word, rate);
+    }
+    a->sent = 0;
+}
@@ -0,0 +1,38 @@
+#ifndef RDS_AFB_H
+#define RDS_AFB_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* AF method B: a table of variants, one per transmitter of the network,
+   each one described by "tuned,af1,af2r,..." (MHz): the frequency of the
+   transmitter, then its alternative frequencies; "r" marks a regional
+   variant (same programme, other regional content). Variants are separated
+   by "|" in a list, or given one per line in a file.
+
+   Each variant is pre-encoded into block-3 words of 0A groups: the number
+   of frequencies (224 + n) with the tuned frequency, then one pair per AF,
+   the tuned frequency first for a same-programme AF in ascending order, in
+   descending order for a regional one. The words of a variant are sent one
+   after the other, and the variants in turn: the receiver gets its list in
+   one block, and every variant completes within one pass over the table
+   plus its own length (see rds_afb_report()).
+*/
+#define AFB_MAX_AF 25               // frequencies of one variant (codes 225-249)
+
+typedef struct rds_afb rds_afb;
+
+extern rds_afb *rds_afb_new();
+extern void rds_afb_free(rds_afb *a);
+extern int rds_afb_add(rds_afb *a, const char *variant);
+extern int rds_afb_parse(rds_afb *a, const char *list);
+extern int rds_afb_load(rds_afb *a, FILE *f);
+extern int rds_afb_count(rds_afb *a);
+extern int rds_afb_words(rds_afb *a);
+extern int rds_afb_next(rds_afb *a, uint16_t *word, double now);
+// Groups built ahead and dropped (rds_lookahead.h): back to a saved state
+extern int rds_afb_save(rds_afb *a, void **state);
+extern void rds_afb_restore(rds_afb *a, const void *state);
+extern void rds_afb_report(rds_afb *a, FILE *f, int groups_per_word);
+
+#endif /* RDS_AFB_H */
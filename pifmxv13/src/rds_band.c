@@ -0,0 +1,301 @@
+#define _GNU_SOURCE
+#include <complex.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "rds.h"
+#include "fm_mpx.h"
+#include "channelizer.h"
+
+
+#define PI 3.141592654
+
+#define MPX_RATE 228000
+#define CHANNEL_RATE (2 * MPX_RATE)
+#define BLOCK 2280                   // MPX samples per block (10 ms)
+#define CHANNEL_BLOCK (2 * BLOCK)    // channel-rate samples per block
+#define TAPS_PER_PHASE 32
+#define MAX_STATIONS 256
+
+
+typedef struct {
+    double offset;      // Hz, relative to the centre of the band
+    uint16_t pi;
+    char *ps;
+    char *rt;
+    char *audio;
+
+    rds_encoder *rds;
+    fm_mpx_state *mpx;
+
+    int channel;
+    double phase;
+    double residual_inc;    // NCO increment for the offset within the channel
+    float prev_mpx;
+
+    float mpx_buffer[BLOCK];
+    float complex out[2][CHANNEL_BLOCK];
+} station;
+
+
+static station stations[MAX_STATIONS];
+static int num_stations = 0;
+static int num_threads;
+static int num_blocks;
+static double deviation = 75000;
+static pthread_barrier_t barrier;
+// Block at which a thread failed (-1: none), checked by all of them after
+// the barrier that ends each block, so that they stop at the same one
+static int failed_block = -1;
+
+static int failed_by(int b) {
+    int f = __atomic_load_n(&failed_block, __ATOMIC_RELAXED);
+    return f >= 0 && f <= b;
+}
+
+
+/* Station list: one station per line,
+       offset_khz,PI,PS,audio,RT
+   where audio is a file name or NONE, and RT is the rest of the line.
+*/
+static int read_stations(char *filename) {
+    FILE *f = fopen(filename, "r");
+    if(f == NULL) {
+        fprintf(stderr, "Error: could not open station list %s.\n", filename);
+        return -1;
+    }
+
+    char line[512];
+    while(fgets(line, sizeof(line), f)) {
+        line[strcspn(line, "\r\n")] = 0;
+        if(line[0] == '#' || line[0] == 0) continue;
+        if(num_stations >= MAX_STATIONS) {
+            fprintf(stderr, "Error: too many stations (max %d).\n", MAX_STATIONS);
+            fclose(f);
+            return -1;
+        }
+
+        char *str = line;
+        char *fields[5];
+        int n = 0;
+        while(n < 4 && (fields[n] = strsep(&str, ",")) != NULL) n++;
+        if(n < 4 || str == NULL) {
+            fprintf(stderr, "Error: invalid station line: %s\n", line);
+            fclose(f);
+            return -1;
+        }
+        fields[4] = str;
+
+        station *st = &stations[num_stations++];
+        st->offset = atof(fields[0]) * 1e3;
+        st->pi = (uint16_t) strtol(fields[1], NULL, 16);
+        st->ps = strdup(fields[2]);
+        st->audio = strcmp(fields[3], "NONE") == 0 ? NULL : strdup(fields[3]);
+        st->rt = strdup(fields[4]);
+    }
+    fclose(f);
+
+    if(num_stations == 0) {
+        fprintf(stderr, "Error: no station in %s.\n", filename);
+        return -1;
+    }
+    return 0;
+}
+
+
+/* Renders one block of a station: MPX, then FM modulation at the channel
+   rate (2x linear interpolation of the MPX) including the residual
+   frequency shift inside its channel.
+*/
+static int render_station(station *st, int buf) {
+    rds_encoder_select(st->rds);
+    fm_mpx_select(st->mpx);
+    if(fm_mpx_get_samples(st->mpx_buffer) < 0) return -1;
+
+    // MPX samples are in 0..10, 10 meaning full deviation
+    double k_dev = 2 * PI * deviation / 10. / CHANNEL_RATE;
+    double phase = st->phase;
+    float prev = st->prev_mpx;
+    float complex *out = st->out[buf];
+    for(int i=0; i<BLOCK; i++) {
+        float cur = st->mpx_buffer[i];
+        phase += st->residual_inc + k_dev * (prev + cur) / 2;
+        if(phase > PI) phase -= 2*PI; else if(phase < -PI) phase += 2*PI;
+        *out++ = cosf(phase) + I * sinf(phase);
+        phase += st->residual_inc + k_dev * cur;
+        if(phase > PI) phase -= 2*PI; else if(phase < -PI) phase += 2*PI;
+        *out++ = cosf(phase) + I * sinf(phase);
+        prev = cur;
+    }
+    st->phase = phase;
+    st->prev_mpx = prev;
+    return 0;
+}
+
+
+static void *worker(void *arg) {
+    int id = (int)(intptr_t) arg;
+    for(int b=0; b<=num_blocks; b++) {
+        if(b < num_blocks) {
+            for(int s=id; s<num_stations; s+=num_threads) {
+                if(render_station(&stations[s], b & 1) < 0) {
+                    fprintf(stderr, "Error: station %d failed to render.\n", s);
+                    __atomic_store_n(&failed_block, b, __ATOMIC_RELAXED);
+                    break;
+                }
+            }
+        }
+        pthread_barrier_wait(&barrier);
+        if(failed_by(b)) break;
+    }
+    return NULL;
+}
+
+
+static double elapsed(struct timespec *a, struct timespec *b) {
+    return (b->tv_sec - a->tv_sec) + (b->tv_nsec - a->tv_nsec) / 1e9;
+}
+
+
+int main(int argc, char **argv) {
+    int channels = 32;
+    double seconds = 10;
+    num_threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+    if(argc < 3) {
+        fprintf(stderr, "Error: missing argument.\n");
+        fprintf(stderr, "Syntax: rds_band <stations.txt> <out.cf32> [-channels M] [-seconds S] [-threads T] [-dev kHz]\n");
+        return EXIT_FAILURE;
+    }
+    for(int i=3; i+1<argc; i+=2) {
+        if(strcmp("-channels", argv[i]) == 0) channels = atoi(argv[i+1]);
+        else if(strcmp("-seconds", argv[i]) == 0) seconds = atof(argv[i+1]);
+        else if(strcmp("-threads", argv[i]) == 0) num_threads = atoi(argv[i+1]);
+        else if(strcmp("-dev", argv[i]) == 0) deviation = atof(argv[i+1]) * 1e3;
+        else {
+            fprintf(stderr, "Error: unrecognised argument: %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    channelizer *chz = channelizer_new(channels, TAPS_PER_PHASE);
+    if(chz == NULL) {
+        fprintf(stderr, "Error: the number of channels must be a power of two, at least 4.\n");
+        return EXIT_FAILURE;
+    }
+    int D = channelizer_interpolation(chz);
+    double out_rate = (double) CHANNEL_RATE * D;
+    double spacing = out_rate / channels;
+
+    if(read_stations(argv[1]) < 0) return EXIT_FAILURE;
+    if(num_threads < 1) num_threads = 1;
+    if(num_threads > num_stations) num_threads = num_stations;
+    num_blocks = (int) ceil(seconds * MPX_RATE / BLOCK);
+
+    printf("Output: %.3f MHz complex, %d channels spaced %.1f kHz.\n", out_rate/1e6, channels, spacing/1e3);
+
+    for(int s=0; s<num_stations; s++) {
+        station *st = &stations[s];
+        int k = (int) lround(st->offset / spacing);
+        if(k <= -channels/2 || k >= channels/2) {
+            fprintf(stderr, "Error: station %04X at %+.1f kHz is outside the band (+/- %.1f kHz).\n",
+                    st->pi, st->offset/1e3, (channels/2 - 1) * spacing / 1e3);
+            return EXIT_FAILURE;
+        }
+        st->channel = (k + channels) % channels;
+        st->residual_inc = 2 * PI * (st->offset - k * spacing) / CHANNEL_RATE;
+
+        st->rds = rds_encoder_new();
+        st->mpx = fm_mpx_new();
+        if(st->rds == NULL || st->mpx == NULL) return EXIT_FAILURE;
+        rds_encoder_select(st->rds);
+        fm_mpx_select(st->mpx);
+        set_rds_pi(st->pi);
+        set_rds_ps(st->ps);
+        set_rds_rt(st->rt);
+        if(fm_mpx_open(st->audio, BLOCK) != 0) {
+            fprintf(stderr, "Error: could not set up the multiplex generator of station %04X.\n", st->pi);
+            return EXIT_FAILURE;
+        }
+        printf("Station %04X \"%s\" at %+.1f kHz (channel %d).\n", st->pi, st->ps, st->offset/1e3, k);
+    }
+    rds_encoder_select(NULL);
+    fm_mpx_select(NULL);
+
+    FILE *outf = strcmp(argv[2], "-") == 0 ? stdout : fopen(argv[2], "wb");
+    if(outf == NULL) {
+        fprintf(stderr, "Error: could not open output file %s.\n", argv[2]);
+        return EXIT_FAILURE;
+    }
+
+    float complex *in = malloc(channels * sizeof(float complex));
+    float complex *out = malloc((size_t) CHANNEL_BLOCK * D * sizeof(float complex));
+    if(in == NULL || out == NULL) return EXIT_FAILURE;
+    float level = 1. / num_stations;
+
+    struct timespec wall_start, wall_end, cpu_start, cpu_end;
+    clock_gettime(CLOCK_MONOTONIC, &wall_start);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);
+
+    // The workers render block b while this thread synthesizes block b-1
+    pthread_barrier_init(&barrier, NULL, num_threads + 1);
+    pthread_t threads[num_threads];
+    for(int t=0; t<num_threads; t++) {
+        pthread_create(&threads[t], NULL, worker, (void *)(intptr_t) t);
+    }
+
+    for(int b=0; b<=num_blocks; b++) {
+        if(b > 0) {
+            int buf = (b-1) & 1;
+            for(int i=0; i<CHANNEL_BLOCK; i++) {
+                memset(in, 0, channels * sizeof(float complex));
+                for(int s=0; s<num_stations; s++) {
+                    in[stations[s].channel] += level * stations[s].out[buf][i];
+                }
+                channelizer_synthesize(chz, in, out + (size_t) i * D);
+            }
+            if(fwrite(out, sizeof(float complex), (size_t) CHANNEL_BLOCK * D, outf) != (size_t) CHANNEL_BLOCK * D) {
+                fprintf(stderr, "Error: writing to %s.\n", argv[2]);
+                __atomic_store_n(&failed_block, b, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_barrier_wait(&barrier);
+        if(failed_by(b)) break;
+    }
+
+    for(int t=0; t<num_threads; t++) pthread_join(threads[t], NULL);
+    pthread_barrier_destroy(&barrier);
+    if(failed_block >= 0) return EXIT_FAILURE;
+
+    clock_gettime(CLOCK_MONOTONIC, &wall_end);
+    clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_end);
+    double wall = elapsed(&wall_start, &wall_end);
+    double cpu = elapsed(&cpu_start, &cpu_end);
+    double rendered = (double) num_blocks * BLOCK / MPX_RATE;
+    double msps = rendered * out_rate / wall / 1e6;
+
+    fprintf(stderr, "Rendered %d stations, %.2f s of band in %.2f s (%.2fx real time), %.2f Msps.\n",
+            num_stations, rendered, wall, rendered / wall, msps);
+    fprintf(stderr, "Throughput: %.2f stations x Msps per core (%.2f cores busy, %d worker threads).\n",
+            num_stations * msps / (cpu / wall), cpu / wall, num_threads);
+
+    if(outf != stdout) fclose(outf);
+    for(int s=0; s<num_stations; s++) {
+        rds_encoder_select(stations[s].rds);
+        fm_mpx_select(stations[s].mpx);
+        if(stations[s].audio) fm_mpx_close();
+        fm_mpx_free(stations[s].mpx);
+        rds_encoder_free(stations[s].rds);
+    }
+    channelizer_free(chz);
+    free(in);
+    free(out);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,68 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sndfile.h>
+#include <time.h>
+
+#include "rds_decoder.h"
+
+
+#define LENGTH 22800
+
+
+/* Decodes the RDS of a 228 kHz multiplex (e.g. the output of rds_wav) */
+int main(int argc, char **argv) {
+    if(argc < 2) {
+        fprintf(stderr, "Error: missing argument.\n");
+        fprintf(stderr, "Syntax: rds_dec <in_mpx.wav> [-groups] [-carrier freq_hz]\n");
+        return EXIT_FAILURE;
+    }
+
+    SF_INFO sfinfo;
+    memset(&sfinfo, 0, sizeof(sfinfo));
+    SNDFILE *inf = strcmp(argv[1], "-") == 0 ?
+        sf_open_fd(fileno(stdin), SFM_READ, &sfinfo, 0) : sf_open(argv[1], SFM_READ, &sfinfo);
+    if(inf == NULL) {
+        fprintf(stderr, "Error: could not open input file %s.\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    if(sfinfo.samplerate != 228000 || sfinfo.channels != 1) {
+        fprintf(stderr, "Error: the multiplex must be mono, sampled at 228 kHz.\n");
+        return EXIT_FAILURE;
+    }
+
+    rds_decoder *dec = rds_decoder_new();
+    if(dec == NULL) return EXIT_FAILURE;
+    for(int i=2; i<argc; i++) {
+        if(strcmp(argv[i], "-groups") == 0) {
+            rds_decoder_set_dump(dec, stdout);
+        } else if(strcmp(argv[i], "-carrier") == 0 && i+1 < argc) {
+            // RDS2 streams: 66500, 71250, 76000
+            if(rds_decoder_set_carrier(dec, atof(argv[++i])) < 0) {
+                fprintf(stderr, "Error: the carrier must be locked to the 228 kHz sample rate.\n");
+                return EXIT_FAILURE;
+            }
+        } else {
+            fprintf(stderr, "Error: unknown option %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    static float buffer[LENGTH];
+    double cpu = 0;
+    sf_count_t n;
+    while((n = sf_read_float(inf, buffer, LENGTH)) > 0) {
+        clock_t start = clock();
+        rds_decoder_process(dec, buffer, n);
+        cpu += (double) (clock() - start) / CLOCKS_PER_SEC;
+    }
+    sf_close(inf);
+
+    rds_decoder_report(dec, stderr);
+    rds_decoder_stats st;
+    rds_decoder_get_stats(dec, &st);
+    if(cpu > 0) fprintf(stderr, "Decoding speed: %.1fx real time.\n", st.seconds / cpu);
+
+    rds_decoder_free(dec);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,489 @@
+#include <complex.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds.h"
+#include "rds_decoder.h"
+#include "rds_tdc.h"
+
+
+#define PI 3.141592654
+
+#define MPX_RATE 228000
+#define DECIMATION 12                       // 228 kHz -> 19 kHz
+#define BASEBAND_RATE (MPX_RATE / DECIMATION)
+#define SAMPLES_PER_BIT 16                  // at 19 kHz: 1187.5 bps
+#define STAGE1_TAPS 96
+#define STAGE2_TAPS 64
+
+#define BLOCK_BITS 26
+#define OFFSET_C_PRIME 0x350
+#define MAX_BAD_BLOCKS 10                   // consecutive, before losing sync
+#define EON_NETWORKS 64                     // other networks followed
+#define MAX_CARRIER_PERIOD 48               // samples, see set_rds_carrier()
+
+
+// Offset words and CRC of the encoder
+extern uint16_t offset_words[];
+extern uint16_t crc(uint16_t block);
+
+
+struct rds_decoder {
+    // 57 kHz demodulation and decimation
+    float stage1[STAGE1_TAPS];
+    float stage2[STAGE2_TAPS];
+    float complex history1[2*STAGE1_TAPS];
+    int index1;
+    float complex history2[2*STAGE2_TAPS];
+    int index2;
+    int phase;                      // sample index modulo the carrier period
+    float complex mixer[MAX_CARRIER_PERIOD];    // exp(-j 2 pi f n / fs)
+    int period;                     // 57 kHz = fs/4: 4
+    int decimation_count;
+
+    // Carrier phase (BPSK: from the average of z^2)
+    float complex phase_avg;
+    float complex carrier;
+
+    // Biphase symbol timing
+    float y[SAMPLES_PER_BIT];       // last bit period of baseband samples
+    int y_index;
+    float energy[SAMPLES_PER_BIT];  // matched filter output energy per phase
+    int best_phase;
+    int prev_symbol;
+
+    // Block synchronisation
+    uint32_t reg;                   // last 26 bits
+    unsigned long bit_count;
+    int8_t matches[128];            // offset matched at each recent bit (-1: none)
+    uint16_t infos[128];            // information word of the block ending at each recent bit
+    int synced;
+    int bits_to_block;
+    int expected;                   // next block: 0=A, 1=B, 2=C/C', 3=D
+    int bad_blocks;
+
+    // Group assembly
+    uint16_t blocks[4];
+    int block_ok[4];
+    int ps_mask;
+    uint32_t rt_mask;
+    int rt_ab;
+    int rt_complete;
+    int lps_mask;
+    int ert_group;                  // group type code announced for eRT, -1: none
+    uint32_t ert_mask;
+    uint8_t tdc_frame[TDC_MAX_MESSAGE + 4];    // frame being received (all channels)
+    int tdc_pos;
+    struct {
+        uint16_t pi;
+        char ps[8];
+        int ps_mask;
+    } eon[EON_NETWORKS];            // other networks (14A)
+
+    unsigned long samples;
+    FILE *dump;
+    rds_decoder_stats stats;
+};
+
+
+static void lowpass(float *h, int taps, double cutoff, double rate) {
+    double sum = 0;
+    for(int i=0; i<taps; i++) {
+        double t = i - (taps-1) / 2.;
+        double x = 2 * cutoff / rate * t;
+        double sinc = (t == 0) ? 1. : sin(PI * x) / (PI * x);
+        double w = .42 - .5 * cos(2*PI * i / (taps-1)) + .08 * cos(4*PI * i / (taps-1));
+        h[i] = sinc * w;
+        sum += h[i];
+    }
+    for(int i=0; i<taps; i++) h[i] /= sum;
+}
+
+
+rds_decoder *rds_decoder_new() {
+    rds_decoder *d = calloc(1, sizeof(rds_decoder));
+    if(d == NULL) return NULL;
+
+    // First stage: keeps the 57 kHz +/- 4 kHz band before decimating to
+    // 19 kHz. Second stage: RDS bandwidth (+/- 2.4 kHz), rejects what is
+    // left of the stereo difference signal.
+    lowpass(d->stage1, STAGE1_TAPS, 4000, MPX_RATE);
+    lowpass(d->stage2, STAGE2_TAPS, 3000, BASEBAND_RATE);
+    memset(d->matches, -1, sizeof(d->matches));
+    d->stats.ps_time = d->stats.rt_time = d->stats.lps_time = d->stats.ert_time = d->stats.sync_time = -1;
+    d->stats.ta_time = d->stats.ews_time = d->stats.eon_ps_time = d->stats.eon_ta_time = -1;
+    d->ert_group = -1;
+    d->rt_ab = -1;
+    rds_decoder_set_carrier(d, 57000);
+    return d;
+}
+
+
+/* Receives the subcarrier `freq` (Hz) instead of 57 kHz, e.g. the RDS2
+   streams at 66.5, 71.25 or 76 kHz. The frequency must have a whole number
+   of cycles in at most MAX_CARRIER_PERIOD samples. Returns 0, or -1.
+*/
+int rds_decoder_set_carrier(rds_decoder *d, double freq) {
+    int period = 1;
+    while(period <= MAX_CARRIER_PERIOD && fabs(remainder(freq * period / MPX_RATE, 1)) > 1e-9) period++;
+    if(period > MAX_CARRIER_PERIOD) return -1;
+    for(int i=0; i<period; i++) d->mixer[i] = cexpf(-I * (float) (2*PI * freq * i / MPX_RATE));
+    d->period = period;
+    d->phase = 0;
+    return 0;
+}
+
+
+void rds_decoder_free(rds_decoder *d) {
+    free(d);
+}
+
+
+/* Prints every group, in the hexadecimal format of RDS Spy ("----" for a
+   block with errors).
+*/
+void rds_decoder_set_dump(rds_decoder *d, FILE *f) {
+    d->dump = f;
+}
+
+
+// One byte of the transparent data channel: frames start with STX, bytes
+// between frames are fill
+static void tdc_byte(rds_decoder *d, uint8_t b) {
+    if(d->tdc_pos == 0 && b != TDC_STX) return;
+    d->tdc_frame[d->tdc_pos++] = b;
+    int len = d->tdc_frame[1];
+    if(d->tdc_pos < 2 || d->tdc_pos < len + 4) return;
+    d->tdc_pos = 0;
+    if((d->tdc_frame[len+2] << 8 | d->tdc_frame[len+3]) != rds_crc16(d->tdc_frame + 1, len + 1)) {
+        d->stats.tdc_errors++;
+        return;
+    }
+    d->stats.tdc_messages++;
+    memcpy(d->stats.tdc_last, d->tdc_frame + 2, len);
+    d->stats.tdc_last[len] = 0;
+}
+
+static void process_group(rds_decoder *d) {
+    if(d->dump) {
+        for(int i=0; i<4; i++) {
+            if(d->block_ok[i]) fprintf(d->dump, "%04X", d->blocks[i]);
+            else fprintf(d->dump, "----");
+            fputc(i < 3 ? ' ' : '\n', d->dump);
+        }
+    }
+    if(!(d->block_ok[0] && d->block_ok[1] && d->block_ok[2] && d->block_ok[3])) return;
+
+    double now = (double) d->samples / MPX_RATE;
+    uint16_t b = d->blocks[1], c = d->blocks[2], dd = d->blocks[3];
+    int type = b >> 12;
+    int version = (b >> 11) & 1;
+    d->stats.groups++;
+    d->stats.group_types[2*type + version]++;
+    d->stats.pi = d->blocks[0];
+
+    if(type == 0) {
+        int seg = b & 3;
+        d->stats.ps[2*seg] = dd >> 8;
+        d->stats.ps[2*seg+1] = dd & 0xFF;
+        d->ps_mask |= 1 << seg;
+        if(d->ps_mask == 0xF && d->stats.ps_time < 0) d->stats.ps_time = now;
+        if((b & 0x10) && version == 0 && d->stats.ta_time < 0) d->stats.ta_time = now;
+    } else if(type == 2) {
+        int ab = (b >> 4) & 1;
+        int seg = b & 0xF;
+        if(ab != d->rt_ab) {
+            // New text
+            d->rt_ab = ab;
+            d->rt_mask = 0;
+            d->rt_complete = 0;
+            memset(d->stats.rt, ' ', 64);
+        }
+        int width = version ? 2 : 4;
+        char chars[4] = { c >> 8, c & 0xFF, dd >> 8, dd & 0xFF };
+        memcpy(d->stats.rt + width*seg, version ? chars + 2 : chars, width);
+        d->rt_mask |= 1 << seg;
+
+        // Complete when all the segments up to the end of the text are there
+        int segments = 16;
+        int last = segments - 1;
+        for(int i=0; i<segments*width; i++) {
+            if(d->stats.rt[i] == '\r' && (d->rt_mask >> (i / width)) & 1) {
+                last = i / width;
+                break;
+            }
+        }
+        uint32_t needed = (last == 31) ? 0xFFFFFFFF : (1u << (last+1)) - 1;
+        if(!d->rt_complete && (d->rt_mask & needed) == needed) {
+            d->rt_complete = 1;
+            if(d->stats.rt_time < 0) d->stats.rt_time = now;
+        }
+    } else if(type == 3 && version == 0 && dd == 0x6552) {
+        d->ert_group = b & 0x1F;
+    } else if(type == 5) {
+        if(version == 0) {
+            tdc_byte(d, c >> 8);
+            tdc_byte(d, c & 0xFF);
+        }
+        tdc_byte(d, dd >> 8);
+        tdc_byte(d, dd & 0xFF);
+    } else if(type == 14) {
+        if(version == 1) {
+            if(d->stats.eon_ta_time < 0) d->stats.eon_ta_time = now;
+            return;
+        }
+        // PS of the other network: variants 0 to 3
+        int n;
+        for(n=0; n<d->stats.eon_networks && d->eon[n].pi != dd; n++);
+        if(n == d->stats.eon_networks) {
+            if(n == EON_NETWORKS) return;
+            d->eon[n].pi = dd;
+            d->stats.eon_networks++;
+        }
+        int variant = b & 0xF;
+        if(variant > 3 || d->eon[n].ps_mask == 0xF) return;
+        d->eon[n].ps[2*variant] = c >> 8;
+        d->eon[n].ps[2*variant+1] = c & 0xFF;
+        d->eon[n].ps_mask |= 1 << variant;
+        if(d->eon[n].ps_mask == 0xF) {
+            d->stats.eon_complete++;
+            d->stats.eon_ps_time = now;
+        }
+    } else if(type == 9 && version == 0 && d->ert_group != 18) {
+        if(d->stats.ews_time < 0) d->stats.ews_time = now;
+    } else if(2*type + version == d->ert_group) {
+        // eRT: complete with all the segments up to the 0x0D
+        int seg = b & 0x1F;
+        char chars[4] = { c >> 8, c & 0xFF, dd >> 8, dd & 0xFF };
+        memcpy(d->stats.ert + 4*seg, chars, 4);
+        d->ert_mask |= 1u << seg;
+        int last = 31;
+        for(int i=0; i<128; i++) {
+            if(d->stats.ert[i] == '\r' && (d->ert_mask >> (i / 4)) & 1) {
+                last = i / 4;
+                break;
+            }
+        }
+        uint32_t needed = (last == 31) ? 0xFFFFFFFF : (1u << (last+1)) - 1;
+        if((d->ert_mask & needed) == needed && d->stats.ert_time < 0) d->stats.ert_time = now;
+    } else if(type == 15 && version == 0) {
+        // Long PS: complete with all the segments up to the 0x0D
+        int seg = b & 7;
+        char chars[4] = { c >> 8, c & 0xFF, dd >> 8, dd & 0xFF };
+        memcpy(d->stats.lps + 4*seg, chars, 4);
+        d->lps_mask |= 1 << seg;
+        int last = 7;
+        for(int i=0; i<32; i++) {
+            if(d->stats.lps[i] == '\r' && (d->lps_mask >> (i / 4)) & 1) {
+                last = i / 4;
+                break;
+            }
+        }
+        int needed = (1 << (last+1)) - 1;
+        if((d->lps_mask & needed) == needed && d->stats.lps_time < 0) d->stats.lps_time = now;
+    }
+}
+
+
+static int syndrome_offset(uint32_t reg) {
+    uint16_t info = reg >> 10;
+    uint16_t syndrome = (crc(info) ^ reg) & 0x3FF;   // crc() leaves bits above the 10th
+    for(int k=0; k<4; k++) {
+        if(syndrome == offset_words[k]) return k;
+    }
+    if(syndrome == OFFSET_C_PRIME) return 2;
+    return -1;
+}
+
+
+static void process_bit(rds_decoder *d, int bit) {
+    d->reg = ((d->reg << 1) | bit) & 0x3FFFFFF;
+    d->bit_count++;
+
+    // Two offsets in sequence, 26 bits apart: (re)synchronisation. Once
+    // synchronised, only after a bad block and off the current block
+    // boundaries (a group cut short, e.g. by an emergency preemption)
+    int m = syndrome_offset(d->reg);
+    d->matches[d->bit_count % 128] = m;
+    d->infos[d->bit_count % 128] = d->reg >> 10;
+    if(m >= 0 && d->bit_count > BLOCK_BITS &&
+       d->matches[(d->bit_count - BLOCK_BITS) % 128] == (m + 3) % 4 &&
+       (!d->synced || (d->bad_blocks > 0 && d->bits_to_block != 1))) {
+        d->synced = 1;
+        d->stats.syncs++;
+        if(d->stats.sync_time < 0) d->stats.sync_time = (double) d->samples / MPX_RATE;
+        d->bad_blocks = 0;
+        d->expected = (m + 1) % 4;
+        d->bits_to_block = BLOCK_BITS;
+        memset(d->block_ok, 0, sizeof(d->block_ok));
+        d->blocks[m] = d->reg >> 10;
+        d->block_ok[m] = 1;
+        if(m > 0) {
+            // The block before, in the same group
+            d->blocks[m-1] = d->infos[(d->bit_count - BLOCK_BITS) % 128];
+            d->block_ok[m-1] = 1;
+        }
+        if(m == 3) {
+            // The group is incomplete, start with the next one
+            d->block_ok[3] = 0;
+        }
+        return;
+    }
+    if(!d->synced) return;
+
+    if(--d->bits_to_block > 0) return;
+    d->bits_to_block = BLOCK_BITS;
+
+    int k = d->expected;
+    uint16_t info = d->reg >> 10;
+    uint16_t syndrome = (crc(info) ^ d->reg) & 0x3FF;
+    int ok = syndrome == offset_words[k] || (k == 2 && syndrome == OFFSET_C_PRIME);
+
+    d->stats.blocks++;
+    if(ok) {
+        d->bad_blocks = 0;
+    } else {
+        d->stats.block_errors++;
+        d->bad_blocks++;
+    }
+    d->blocks[k] = info;
+    d->block_ok[k] = ok;
+
+    if(k == 3) {
+        process_group(d);
+        memset(d->block_ok, 0, sizeof(d->block_ok));
+    }
+    d->expected = (k + 1) % 4;
+
+    if(d->bad_blocks >= MAX_BAD_BLOCKS) {
+        d->synced = 0;
+        memset(d->matches, -1, sizeof(d->matches));
+    }
+}
+
+
+// One sample of the 19 kHz complex baseband
+static void process_baseband(rds_decoder *d, float complex z) {
+    // Carrier phase: BPSK, so z^2 has a constant phase of twice the carrier
+    d->phase_avg += (z*z - d->phase_avg) * (1.f / 2048);
+
+    // Half of that phase, ambiguous by pi: keep the one closer to the
+    // previous estimate, otherwise the sign of the symbols flips whenever the
+    // phase of z^2 crosses +/- pi
+    float complex carrier = cexpf(I * .5f * cargf(d->phase_avg));
+    if(crealf(carrier * conjf(d->carrier)) < 0) carrier = -carrier;
+    d->carrier = carrier;
+    float y = crealf(z * conjf(carrier));
+
+    d->y[d->y_index] = y;
+    d->y_index = (d->y_index + 1) % SAMPLES_PER_BIT;
+
+    // Biphase matched filter over the last bit period: first half minus
+    // second half
+    float r = 0;
+    for(int i=0; i<SAMPLES_PER_BIT; i++) {
+        float v = d->y[(d->y_index + i) % SAMPLES_PER_BIT];
+        r += i < SAMPLES_PER_BIT/2 ? v : -v;
+    }
+
+    int p = d->samples / DECIMATION % SAMPLES_PER_BIT;
+    d->energy[p] += (fabsf(r) - d->energy[p]) * (1.f / 32);
+
+    if(p == d->best_phase) {
+        int symbol = r > 0;
+        process_bit(d, symbol != d->prev_symbol);   // differential decoding
+        d->prev_symbol = symbol;
+
+        for(int i=0; i<SAMPLES_PER_BIT; i++) {
+            if(d->energy[i] > d->energy[d->best_phase]) d->best_phase = i;
+        }
+    }
+}
+
+
+/* Decodes a block of 228 kHz multiplex samples. */
+void rds_decoder_process(rds_decoder *d, float *mpx, int count) {
+    for(int n=0; n<count; n++) {
+        float complex v = mpx[n] * d->mixer[d->phase];
+        if(++d->phase >= d->period) d->phase = 0;
+
+        d->history1[d->index1] = d->history1[d->index1 + STAGE1_TAPS] = v;
+        if(++d->index1 >= STAGE1_TAPS) d->index1 = 0;
+
+        d->samples++;
+        if(++d->decimation_count < DECIMATION) continue;
+        d->decimation_count = 0;
+
+        float complex acc = 0;
+        float complex *h1 = d->history1 + d->index1;
+        for(int k=0; k<STAGE1_TAPS; k++) acc += d->stage1[k] * h1[k];
+
+        d->history2[d->index2] = d->history2[d->index2 + STAGE2_TAPS] = acc;
+        if(++d->index2 >= STAGE2_TAPS) d->index2 = 0;
+
+        float complex z = 0;
+        float complex *h2 = d->history2 + d->index2;
+        for(int k=0; k<STAGE2_TAPS; k++) z += d->stage2[k] * h2[k];
+
+        process_baseband(d, z);
+    }
+}
+
+
+void rds_decoder_get_stats(rds_decoder *d, rds_decoder_stats *stats) {
+    *stats = d->stats;
+    stats->seconds = (double) d->samples / MPX_RATE;
+}
+
+
+void rds_decoder_report(rds_decoder *d, FILE *f) {
+    rds_decoder_stats st;
+    rds_decoder_get_stats(d, &st);
+
+    fprintf(f, "RDS decoder: %.1f s of multiplex, ", st.seconds);
+    if(st.syncs == 0) {
+        fprintf(f, "no synchronisation.\n");
+        return;
+    }
+    fprintf(f, "synchronised after %.3f s (%d time(s)).\n", st.sync_time, st.syncs);
+    fprintf(f, "Blocks: %lu, errors: %lu, BLER %.2f%%. Groups: %lu.\n",
+            st.blocks, st.block_errors, st.blocks ? 100. * st.block_errors / st.blocks : 0., st.groups);
+    fprintf(f, "Group types:");
+    for(int i=0; i<32; i++) {
+        if(st.group_types[i]) fprintf(f, " %d%c:%lu", i/2, 'A' + i%2, st.group_types[i]);
+    }
+    fprintf(f, "\nPI: %04X\n", st.pi);
+    if(st.ps_time >= 0) fprintf(f, "PS: \"%s\" complete after %.3f s\n", st.ps, st.ps_time);
+    else fprintf(f, "PS: incomplete\n");
+    if(st.rt_time >= 0) {
+        int len = strcspn(st.rt, "\r");
+        fprintf(f, "RT: \"%.*s\" complete after %.3f s\n", len, st.rt, st.rt_time);
+    } else {
+        fprintf(f, "RT: incomplete\n");
+    }
+    if(st.group_types[30]) {
+        int len = strcspn(st.lps, "\r");
+        if(st.lps_time >= 0) fprintf(f, "LPS: \"%.*s\" complete after %.3f s\n", len, st.lps, st.lps_time);
+        else fprintf(f, "LPS: incomplete\n");
+    }
+    if(st.ta_time >= 0) fprintf(f, "TA: set after %.3f s\n", st.ta_time);
+    if(st.ews_time >= 0) fprintf(f, "EWS: first group after %.3f s\n", st.ews_time);
+    if(st.tdc_messages || st.tdc_errors) {
+        fprintf(f, "TDC: %lu message(s), %lu with CRC errors; last: \"%s\"\n",
+                st.tdc_messages, st.tdc_errors, st.tdc_last);
+    }
+    if(st.eon_networks) {
+        fprintf(f, "EON: %d other network(s), %d with a complete PS", st.eon_networks, st.eon_complete);
+        if(st.eon_ps_time >= 0) fprintf(f, " (the last one after %.3f s)", st.eon_ps_time);
+        fprintf(f, "\n");
+    }
+    if(st.eon_ta_time >= 0) fprintf(f, "EON: first 14B (TA switch) after %.3f s\n", st.eon_ta_time);
+    if(d->ert_group >= 0) {
+        int len = strcspn(st.ert, "\r");
+        if(st.ert_time >= 0) fprintf(f, "eRT: \"%.*s\" complete after %.3f s\n", len, st.ert, st.ert_time);
+        else fprintf(f, "eRT: incomplete\n");
+    }
+}
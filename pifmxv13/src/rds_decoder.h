@@ -0,0 +1,52 @@
+#ifndef RDS_DECODER_H
+#define RDS_DECODER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Software RDS receiver for a 228 kHz multiplex, such as the output of the
+   multiplex generator: 57 kHz demodulation, biphase symbol and differential
+   decoding, block synchronisation on the offset words and syndrome check.
+   The subcarrier (57 kHz = fs/4, or an RDS2 stream) must be locked to the
+   sample clock, as it is in this program; only the carrier phase and the bit timing are
+   recovered.
+*/
+typedef struct rds_decoder rds_decoder;
+
+typedef struct {
+    unsigned long blocks;       // blocks received while synchronised
+    unsigned long block_errors; // blocks failing the syndrome check
+    unsigned long groups;       // groups with four valid blocks
+    unsigned long group_types[32];  // per type, index 2*type + version (0A, 0B, 1A, ...)
+    int syncs;                  // number of times the synchronisation was (re)acquired
+    double sync_time;           // seconds of input until the first synchronisation
+    uint16_t pi;
+    char ps[9];
+    char rt[65];
+    char lps[33];               // Long PS (15A), UTF-8
+    char ert[129];              // eRT (ODA 6552), UTF-8
+    double ps_time;             // seconds of input until the first complete PS, -1 if none
+    double rt_time;             // same for RT
+    double lps_time;            // same for Long PS
+    double ert_time;            // same for eRT (from the announcement on)
+    double ta_time;             // seconds until the first 0A group with TA set, -1 if none
+    double ews_time;            // same for the first EWS group (9A)
+    unsigned long tdc_messages; // transparent data channel (5A/5B): frames with a valid CRC
+    unsigned long tdc_errors;   // frames with a CRC error
+    char tdc_last[256];         // last message received
+    int eon_networks;           // other networks (14A) received
+    int eon_complete;           // of which with a complete PS
+    double eon_ps_time;         // seconds until the last of these PS was complete
+    double eon_ta_time;         // seconds until the first 14B group, -1 if none
+    double seconds;             // input processed
+} rds_decoder_stats;
+
+extern rds_decoder *rds_decoder_new();
+extern void rds_decoder_free(rds_decoder *d);
+extern void rds_decoder_set_dump(rds_decoder *d, FILE *f);
+extern int rds_decoder_set_carrier(rds_decoder *d, double freq);
+extern void rds_decoder_process(rds_decoder *d, float *mpx, int count);
+extern void rds_decoder_get_stats(rds_decoder *d, rds_decoder_stats *stats);
+extern void rds_decoder_report(rds_decoder *d, FILE *f);
+
+#endif /* RDS_DECODER_H */
@@ -0,0 +1,330 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds.h"
+#include "rds_eon.h"
+#include "rds_strings.h"
+
+
+#define MAX_FIELDS 12
+#define MAX_ITEMS (4 + 1 + (EON_MAX_AF + 2) / 2 + 4 + 2)  // PS, PTY/TA, AF, MF, LI, PIN
+#define VARIANT_AF 4
+#define VARIANT_MF 5
+#define VARIANT_LI 12
+#define VARIANT_PTY_TA 13
+#define VARIANT_PIN 14
+
+typedef struct {
+    uint16_t pi;
+    char ps[8];
+    uint8_t pty;
+    uint8_t tp;
+    uint8_t ta;
+
+    // 14A groups of the ON, sent in turn: variant and block 3
+    uint8_t variant[MAX_ITEMS];
+    uint16_t info[MAX_ITEMS];
+    int items;
+    int pos;                    // next one
+
+    int ta_first;               // TA changed: variant 13 before the others
+    int tb_copies;              // 14B groups still to send
+    double cycle_start;         // time the current cycle started, -1: not yet
+    double last_cycle;          // duration of the last complete cycle, 0: none yet
+} eon_network;
+
+struct rds_eon {
+    eon_network *nets;
+    int count;
+    int capacity;
+    int next;                   // network of the next 14A group
+    int ta_pending;             // networks with ta_first or tb_copies
+
+    // Since the last report
+    unsigned long sent;
+    unsigned long ta_sent;
+};
+
+
+rds_eon *rds_eon_new() {
+    return calloc(1, sizeof(rds_eon));
+}
+
+void rds_eon_free(rds_eon *e) {
+    if (e == NULL) return;
+    free(e->nets);
+    free(e);
+}
+
+int rds_eon_count(rds_eon *e) {
+    return e->count;
+}
+
+/* Code of the FM frequency at `s` (see rds_freq_code()), -1 if none */
+static int parse_freq_code(const char *s, char **end) {
+    double freq = strtod(s, end);
+    return *end == s ? -1 : rds_freq_code(freq);
+}
+
+static void add_item(eon_network *on, int variant, uint16_t info) {
+    on->variant[on->items] = variant;
+    on->info[on->items] = info;
+    on->items++;
+}
+
+/* Parses the description of a network (see rds_eon.h). Returns 0, or -1 if
+   a field is invalid.
+*/
+static int parse_network(const char *line, eon_network *on) {
+    char buf[512];
+    char *field[MAX_FIELDS] = {0};
+    int fields = 0;
+    char *end;
+
+    if (strlen(line) >= sizeof(buf)) return -1;
+    strcpy(buf, line);
+    buf[strcspn(buf, "\r\n")] = 0;
+    for (char *p = buf; p && fields < MAX_FIELDS; fields++) {
+        field[fields] = p;
+        p = strchr(p, ',');
+        if (p) *p++ = 0;
+    }
+    if (fields < 2) return -1;
+
+    memset(on, 0, sizeof(*on));
+    on->cycle_start = -1;
+    long pi = strtol(field[0], &end, 16);
+    if (end == field[0] || pi <= 0 || pi > 0xFFFF) return -1;
+    on->pi = pi;
+    fill_rds_string(on->ps, field[1], sizeof(on->ps));
+    if (field[8] && *field[8]) on->pty = atoi(field[8]) & 0x1F;
+    if (field[9] && *field[9]) on->tp = atoi(field[9]) ? 1 : 0;
+    if (field[10] && *field[10]) on->ta = atoi(field[10]) ? 1 : 0;
+
+    for (int i = 0; i < 4; i++) add_item(on, i, (uint8_t) on->ps[2*i] << 8 | (uint8_t) on->ps[2*i+1]);
+    add_item(on, VARIANT_PTY_TA, on->pty << 11 | on->ta);
+
+    // AF, method A: number of frequencies, then the frequencies, in pairs
+    if (field[2] && *field[2]) {
+        uint8_t list[EON_MAX_AF + 2];
+        int n = 0;
+        for (char *p = field[2]; *p; p = end) {
+            while (*p == ' ') p++;
+            if (*p == 0) break;
+            int code = parse_freq_code(p, &end);
+            if (code < 0 || n == EON_MAX_AF) return -1;
+            list[1 + n++] = code;
+        }
+        list[0] = 224 + n;
+        if ((n + 1) % 2) list[1 + n++] = 205;   // filler
+        for (int i = 0; i < n + 1; i += 2) add_item(on, VARIANT_AF, list[i] << 8 | list[i+1]);
+    }
+    // Mapped frequencies: tuning frequency of this network, frequency of the ON
+    for (int i = 0; i < 4; i++) {
+        char *f = field[3 + i];
+        if (f == NULL || *f == 0) continue;
+        int tuning = parse_freq_code(f, &end);
+        int mapped = tuning < 0 ? -1 : parse_freq_code(end, &end);
+        if (mapped < 0) return -1;
+        add_item(on, VARIANT_MF + i, tuning << 8 | mapped);
+    }
+    if (field[7] && *field[7]) {
+        long li = strtol(field[7], &end, 16);
+        if (end == field[7] || li < 0 || li > 0xFFFF) return -1;
+        add_item(on, VARIANT_LI, li);
+    }
+    if (field[11] && *field[11] && strtol(field[11], NULL, 10) != 0) {
+        int day, hour, minute;
+        if (sscanf(field[11], "%2d%2d%2d", &day, &hour, &minute) != 3 || day < 1 || day > 31 ||
+            hour > 23 || minute > 59) return -1;
+        add_item(on, VARIANT_PIN, day << 11 | hour << 6 | minute);
+    }
+    return 0;
+}
+
+/* Keeps the turn, the cycle and the pending TA of `old` in `on`, which
+   replaces it. A TA switch makes the ON go first and sends 14B groups.
+*/
+static void carry_state(eon_network *on, const eon_network *old) {
+    on->pos = old->pos < on->items ? old->pos : 0;
+    on->cycle_start = old->cycle_start;
+    on->last_cycle = old->last_cycle;
+    on->ta_first = old->ta_first;
+    on->tb_copies = old->tb_copies;
+    if (on->ta != old->ta) {
+        on->ta_first = 1;
+        on->tb_copies = EON_TA_COPIES;
+    }
+}
+
+static void count_pending(rds_eon *e) {
+    e->ta_pending = 0;
+    for (int i = 0; i < e->count; i++) {
+        if (e->nets[i].ta_first || e->nets[i].tb_copies) e->ta_pending++;
+    }
+}
+
+static int find(eon_network *nets, int count, uint16_t pi) {
+    for (int i = 0; i < count; i++) {
+        if (nets[i].pi == pi) return i;
+    }
+    return -1;
+}
+
+/* Adds a network, or replaces the network with the same PI. Returns 0, or
+   -1 for an invalid description or if no memory is available.
+*/
+int rds_eon_set(rds_eon *e, const char *line) {
+    eon_network on;
+    if (parse_network(line, &on) < 0) return -1;
+    int i = find(e->nets, e->count, on.pi);
+    if (i >= 0) {
+        carry_state(&on, &e->nets[i]);
+    } else {
+        if (e->count == e->capacity) {
+            int capacity = e->capacity ? 2 * e->capacity : 16;
+            eon_network *nets = realloc(e->nets, capacity * sizeof(eon_network));
+            if (nets == NULL) return -1;
+            e->nets = nets;
+            e->capacity = capacity;
+        }
+        i = e->count++;
+        if (on.ta) on.tb_copies = EON_TA_COPIES;
+    }
+    e->nets[i] = on;
+    count_pending(e);
+    return 0;
+}
+
+/* Replaces the table with the networks of `f`, one per line (empty lines and
+   lines starting with # are skipped). The networks already in the table keep
+   their place in the turn, so that a reload does not disturb the cycle.
+   Returns the number of networks, or -1 (the table is left as it was) for
+   an invalid line.
+*/
+int rds_eon_load(rds_eon *e, FILE *f) {
+    eon_network *nets = NULL;
+    int count = 0, capacity = 0, number = 0;
+    char line[512];
+
+    while (fgets(line, sizeof(line), f)) {
+        number++;
+        char *p = line + strspn(line, " \t");
+        if (*p == '#' || *p == '\r' || *p == '\n' || *p == 0) continue;
+        if (count == capacity) {
+            capacity = capacity ? 2 * capacity : 16;
+            eon_network *grown = realloc(nets, capacity * sizeof(eon_network));
+            if (grown == NULL) {
+                free(nets);
+                return -1;
+            }
+            nets = grown;
+        }
+        eon_network *on = &nets[count];
+        if (parse_network(p, on) < 0) {
+            fprintf(stderr, "EON: invalid network on line %d: %s", number, line);
+            free(nets);
+            return -1;
+        }
+        int old = find(e->nets, e->count, on->pi);
+        if (old >= 0) {
+            carry_state(on, &e->nets[old]);
+        } else if (on->ta) {
+            on->tb_copies = EON_TA_COPIES;
+        }
+        count++;
+    }
+
+    // The turn goes on with the same network, if it is still there
+    int next = 0;
+    if (e->next < e->count) next = find(nets, count, e->nets[e->next].pi);
+    free(e->nets);
+    e->nets = nets;
+    e->count = count;
+    e->capacity = capacity;
+    e->next = next < 0 || next >= count ? 0 : next;
+    count_pending(e);
+    return count;
+}
+
+/* Removes the network `pi`. Returns 0, or -1 if there is none. */
+int rds_eon_remove(rds_eon *e, uint16_t pi) {
+    int i = find(e->nets, e->count, pi);
+    if (i < 0) return -1;
+    memmove(&e->nets[i], &e->nets[i+1], (e->count - i - 1) * sizeof(eon_network));
+    e->count--;
+    if (e->next > i) e->next--;
+    if (e->next >= e->count) e->next = 0;
+    count_pending(e);
+    return 0;
+}
+
+
+/* Next 14B group, after a TA switch of an ON. Returns 0 if none is due.
+   Block 3 (PI of this network) is left to the caller.
+*/
+int rds_eon_ta_group(rds_eon *e, uint16_t *blocks, uint16_t block1_base) {
+    if (e->ta_pending == 0) return 0;
+    for (int i = 0; i < e->count; i++) {
+        eon_network *on = &e->nets[i];
+        if (on->tb_copies == 0) continue;
+        blocks[1] = 0xE800 | block1_base | on->tp << 4 | on->ta << 3;
+        blocks[3] = on->pi;
+        if (--on->tb_copies == 0 && !on->ta_first) e->ta_pending--;
+        e->ta_sent++;
+        return 1;
+    }
+    return 0;
+}
+
+/* Next 14A group: variant 13 of an ON whose TA changed, otherwise the next
+   variant of the next ON in turn. `now` (seconds) measures the cycles.
+   Returns 0 if the table is empty.
+*/
+int rds_eon_group(rds_eon *e, uint16_t *blocks, uint16_t block1_base, double now) {
+    if (e->count == 0) return 0;
+    eon_network *on = NULL;
+    int item = -1;
+
+    for (int i = 0; i < e->count && e->ta_pending > 0; i++) {
+        if (!e->nets[i].ta_first) continue;
+        on = &e->nets[i];
+        on->ta_first = 0;
+        if (on->tb_copies == 0) e->ta_pending--;
+        for (item = 0; on->variant[item] != VARIANT_PTY_TA; item++);
+        break;
+    }
+    if (on == NULL) {
+        on = &e->nets[e->next];
+        e->next = (e->next + 1) % e->count;
+        item = on->pos;
+        if (item == 0) {
+            if (on->cycle_start >= 0) on->last_cycle = now - on->cycle_start;
+            on->cycle_start = now;
+        }
+        on->pos = (on->pos + 1) % on->items;
+    }
+
+    blocks[1] = 0xE000 | block1_base | on->tp << 4 | on->variant[item];
+    blocks[2] = on->info[item];
+    blocks[3] = on->pi;
+    e->sent++;
+    return 1;
+}
+
+
+/* Prints the table: for each ON, the time to send all its variants at `rate`
+   14A groups/s (and the last cycle measured)
+*/
+void rds_eon_report(rds_eon *e, FILE *f, double rate) {
+    fprintf(f, "  %d network(s), %lu 14A and %lu 14B group(s) sent\n", e->count, e->sent, e->ta_sent);
+    for (int i = 0; i < e->count && rate > 0; i++) {
+        eon_network *on = &e->nets[i];
+        fprintf(f, "  %04X \"%.8s\" PTY %d TP %d TA %d: %d variant(s), full cycle %.1f s", on->pi, on->ps,
+                on->pty, on->tp, on->ta, on->items, on->items * e->count / rate);
+        if (on->last_cycle > 0) fprintf(f, " (last %.1f s)", on->last_cycle);
+        fprintf(f, "\n");
+    }
+    e->sent = e->ta_sent = 0;
+}
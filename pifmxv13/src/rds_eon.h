@@ -0,0 +1,37 @@
+#ifndef RDS_EON_H
+#define RDS_EON_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* EON (Enhanced Other Networks, group 14): a table of other networks (ON),
+   each one described by a line
+     PI,PS,AF,MF1,MF2,MF3,MF4,LI,PTY,TP,TA,PIN
+   e.g. D392,WDR 2   ,102.1,87.6 92.1,87.7 92.2,,,0000,10,1,0,022254
+   AF: frequencies of the ON (method A); MFn: a frequency of this network and
+   the frequency the ON maps to it; LI: linkage information (hexadecimal);
+   PIN: day, hour, minute (DDHHMM). Fields after PI and PS can be empty.
+
+   Group 14A: block 2 bit 4 = TP(ON), bits 3..0 = variant; block 3 = the
+   information of the variant (0-3: PS, 4: AF, 5-8: mapped frequencies,
+   12: LI, 13: PTY and TA, 14: PIN); block 4 = PI(ON). The ONs are taken in
+   turn, one variant each; an ON whose TA changed goes first with variant 13.
+   Group 14B (on a TA switch of an ON): block 2 bit 4 = TP(ON), bit 3 =
+   TA(ON); block 4 = PI(ON).
+*/
+#define EON_MAX_AF 25
+#define EON_TA_COPIES 4             // 14B groups sent on a TA switch
+
+typedef struct rds_eon rds_eon;
+
+extern rds_eon *rds_eon_new();
+extern void rds_eon_free(rds_eon *e);
+extern int rds_eon_set(rds_eon *e, const char *line);
+extern int rds_eon_load(rds_eon *e, FILE *f);
+extern int rds_eon_remove(rds_eon *e, uint16_t pi);
+extern int rds_eon_count(rds_eon *e);
+extern int rds_eon_ta_group(rds_eon *e, uint16_t *blocks, uint16_t block1_base);
+extern int rds_eon_group(rds_eon *e, uint16_t *blocks, uint16_t block1_base, double now);
+extern void rds_eon_report(rds_eon *e, FILE *f, double rate);
+
+#endif /* RDS_EON_H */
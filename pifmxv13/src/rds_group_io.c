@@ -0,0 +1,137 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rds_group_io.h"
+
+
+#define BUFFER_SIZE 4096
+
+struct rds_group_reader {
+    int fd;
+    int fifo;           // a pipe: no data is not the end
+    int binary;         // -1 until the first bytes are read
+    char buffer[BUFFER_SIZE];
+    int len;
+    int pos;
+    int eof;
+};
+
+
+/* Opens a group stream (file, FIFO, or "-" for stdin). Reading never blocks,
+   so a FIFO can be fed while the modulator runs.
+*/
+rds_group_reader *rds_group_reader_open(const char *path) {
+    rds_group_reader *r = calloc(1, sizeof(rds_group_reader));
+    if (r == NULL) return NULL;
+    r->fd = strcmp(path, "-") == 0 ? dup(STDIN_FILENO) : open(path, O_RDONLY | O_NONBLOCK);
+    if (r->fd < 0) {
+        free(r);
+        return NULL;
+    }
+    fcntl(r->fd, F_SETFL, fcntl(r->fd, F_GETFL) | O_NONBLOCK);
+    struct stat st;
+    r->fifo = fstat(r->fd, &st) == 0 && !S_ISREG(st.st_mode);
+    r->binary = -1;
+    return r;
+}
+
+void rds_group_reader_close(rds_group_reader *r) {
+    if (r == NULL) return;
+    close(r->fd);
+    free(r);
+}
+
+static int fill(rds_group_reader *r) {
+    if (r->pos > 0) {
+        memmove(r->buffer, r->buffer + r->pos, r->len - r->pos);
+        r->len -= r->pos;
+        r->pos = 0;
+    }
+    if (r->len == BUFFER_SIZE) return 0;    // line too long: dropped by the caller
+    int n = read(r->fd, r->buffer + r->len, BUFFER_SIZE - r->len);
+    if (n > 0) {
+        r->len += n;
+        return n;
+    }
+    if (n == 0 && !r->fifo) r->eof = 1;
+    return 0;
+}
+
+static uint64_t get_le(const unsigned char *p, int bytes) {
+    uint64_t v = 0;
+    for (int i = bytes - 1; i >= 0; i--) v = v << 8 | p[i];
+    return v;
+}
+
+static int parse_line(const char *line, uint16_t *blocks) {
+    if (line[0] == '#') return 0;
+    unsigned int b[4];
+    if (sscanf(line, "%4x %4x %4x %4x", &b[0], &b[1], &b[2], &b[3]) != 4) return 0;
+    for (int i = 0; i < 4; i++) blocks[i] = b[i];
+    return 1;
+}
+
+/* Reads the next group. Returns 1 if a group was read, 0 if none is available
+   yet (FIFO), -1 at the end of the stream.
+*/
+int rds_group_reader_next(rds_group_reader *r, uint16_t *blocks) {
+    for (;;) {
+        int avail = r->len - r->pos;
+        char *p = r->buffer + r->pos;
+
+        if (r->binary < 0) {
+            if (avail >= 8 || (r->eof && avail > 0)) {
+                r->binary = avail >= 8 && memcmp(p, RDS_GROUPS_MAGIC, 8) == 0;
+                if (r->binary) r->pos += 8;
+                continue;
+            }
+        } else if (r->binary) {
+            if (avail >= RDS_GROUPS_RECORD) {
+                const unsigned char *rec = (const unsigned char *) p;
+                for (int i = 0; i < 4; i++) blocks[i] = get_le(rec + 8 + 2*i, 2);
+                r->pos += RDS_GROUPS_RECORD;
+                return 1;
+            }
+        } else {
+            char *nl = memchr(p, '\n', avail);
+            if (nl != NULL || (r->eof && avail > 0) || avail == BUFFER_SIZE) {
+                int line_len = nl ? nl - p : avail;
+                char line[64];
+                int n = line_len < (int) sizeof(line) - 1 ? line_len : (int) sizeof(line) - 1;
+                memcpy(line, p, n);
+                line[n] = '\0';
+                r->pos += nl ? line_len + 1 : line_len;
+                if (parse_line(line, blocks)) return 1;
+                continue;
+            }
+        }
+
+        // Everything buffered is used up
+        if (r->eof) return -1;
+        if (fill(r) == 0 && !r->eof) return 0;
+    }
+}
+
+
+void rds_group_write_header(FILE *f, int binary) {
+    if (binary) fwrite(RDS_GROUPS_MAGIC, 1, 8, f);
+}
+
+void rds_group_write(FILE *f, int binary, const uint16_t *blocks, double air_time) {
+    if (!binary) {
+        fprintf(f, "%04X %04X %04X %04X\n", blocks[0], blocks[1], blocks[2], blocks[3]);
+        return;
+    }
+    unsigned char rec[RDS_GROUPS_RECORD];
+    uint64_t us = (uint64_t) (air_time * 1e6 + .5);
+    for (int i = 0; i < 8; i++) rec[i] = us >> (8*i);
+    for (int i = 0; i < 4; i++) {
+        rec[8 + 2*i] = blocks[i];
+        rec[9 + 2*i] = blocks[i] >> 8;
+    }
+    fwrite(rec, 1, RDS_GROUPS_RECORD, f);
+}
@@ -0,0 +1,29 @@
+#ifndef RDS_GROUP_IO_H
+#define RDS_GROUP_IO_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Streams of raw RDS groups.
+
+   Hexadecimal (RDS Spy): one group per line, "PPPP BBBB CCCC DDDD". Anything
+   after the fourth block is ignored; lines with a missing block ("----") and
+   lines starting with '#' are skipped.
+
+   Binary: the 8 bytes RDS_GROUPS_MAGIC, then 16 bytes per group: the time
+   the group goes on air in microseconds since the epoch (64 bits), then the
+   four blocks (16 bits each), all little-endian.
+*/
+#define RDS_GROUPS_MAGIC "RDSGRP01"
+#define RDS_GROUPS_RECORD 16
+
+typedef struct rds_group_reader rds_group_reader;
+
+extern rds_group_reader *rds_group_reader_open(const char *path);
+extern int rds_group_reader_next(rds_group_reader *r, uint16_t *blocks);
+extern void rds_group_reader_close(rds_group_reader *r);
+
+extern void rds_group_write_header(FILE *f, int binary);
+extern void rds_group_write(FILE *f, int binary, const uint16_t *blocks, double air_time);
+
+#endif /* RDS_GROUP_IO_H */
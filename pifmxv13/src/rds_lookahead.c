@@ -0,0 +1,231 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+
+#include "rds_lookahead.h"
+
+
+#define GROUP_WORDS 4
+#define PRODUCER_NICE 10            // below the sample loop (Linux: per thread)
+
+typedef struct {
+    int64_t bits;               // first bit of the group
+    uint32_t words[GROUP_WORDS];
+    void *state;                // of the caller, filled by fn
+} queued_group;
+
+struct rds_lookahead {
+    int depth;
+    int group_bits;
+    rds_lookahead_fn fn;
+    rds_lookahead_drop_fn drop;
+    void *arg;
+
+    pthread_t thread;
+    pthread_mutex_t encoder;    // held by the owner of the encoder, except while it sleeps
+    pthread_mutex_t lock;       // the queue and the counters
+    pthread_cond_t space;
+    queued_group queue[LOOKAHEAD_MAX];     // ring of `depth` groups
+    int head;
+    int count;
+    int64_t next_bits;          // first bit of the group the producer builds next
+    int stop;
+
+    // Since the last report
+    unsigned long produced;
+    unsigned long taken;
+    unsigned long invalidated;  // groups built, dropped before they went on air
+    unsigned long missed;       // groups the modulator had to build itself
+    unsigned long depth_sum;
+    int min_depth;
+    unsigned long built;
+    double build_total;         // seconds
+    double build_max;
+};
+
+
+static double elapsed(const struct timespec *from, const struct timespec *to) {
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+/* Fills the queue, one group at a time under the encoder lock. Only the
+   owner changes the queue position (rds_lookahead_pop(), invalidate()), and
+   it holds the encoder lock to do so: a group is never dropped while it is
+   being built.
+*/
+static void *producer_thread(void *arg) {
+    rds_lookahead *la = arg;
+    setpriority(PRIO_PROCESS, 0, PRODUCER_NICE);
+
+    pthread_mutex_lock(&la->lock);
+    while (!la->stop) {
+        if (la->count == la->depth) {
+            pthread_cond_wait(&la->space, &la->lock);
+            continue;
+        }
+        pthread_mutex_unlock(&la->lock);
+        pthread_mutex_lock(&la->encoder);
+        pthread_mutex_lock(&la->lock);
+        // The owner may have taken groups or stopped us in the meantime
+        if (la->stop || la->count == la->depth) {
+            pthread_mutex_unlock(&la->encoder);
+            continue;
+        }
+        int64_t bits = la->next_bits;
+        pthread_mutex_unlock(&la->lock);
+
+        // Only this thread uses the free slots of the ring
+        queued_group *g = &la->queue[(la->head + la->count) % la->depth];
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        la->fn(la->arg, bits, g->words, g->state);
+        clock_gettime(CLOCK_MONOTONIC, &end);
+
+        pthread_mutex_lock(&la->lock);
+        pthread_mutex_unlock(&la->encoder);
+        double t = elapsed(&start, &end);
+        la->built++;
+        la->build_total += t;
+        if (t > la->build_max) la->build_max = t;
+        g->bits = bits;
+        la->count++;
+        la->next_bits = bits + la->group_bits;
+        la->produced++;
+    }
+    pthread_mutex_unlock(&la->lock);
+    return NULL;
+}
+
+
+/* Starts the producer with a queue of `depth` groups (at most
+   LOOKAHEAD_MAX) of `group_bits` bits, the first one at `next_bits`, and
+   the `depth` states of the caller that go with them (exchanged with the
+   caller's by rds_lookahead_pop()). The calling thread owns the encoder: it
+   comes back holding the encoder lock. Returns NULL if the thread cannot be
+   started.
+*/
+rds_lookahead *rds_lookahead_start(int depth, int group_bits, int64_t next_bits, void **states,
+                                   rds_lookahead_fn fn, rds_lookahead_drop_fn drop, void *arg) {
+    if (depth < 1 || depth > LOOKAHEAD_MAX) return NULL;
+    rds_lookahead *la = calloc(1, sizeof(rds_lookahead));
+    if (la == NULL) return NULL;
+    la->depth = depth;
+    la->group_bits = group_bits;
+    la->next_bits = next_bits;
+    la->fn = fn;
+    la->drop = drop;
+    la->arg = arg;
+    for (int i = 0; i < depth; i++) la->queue[i].state = states[i];
+    la->min_depth = depth;
+    pthread_mutex_init(&la->encoder, NULL);
+    pthread_mutex_init(&la->lock, NULL);
+    pthread_cond_init(&la->space, NULL);
+    pthread_mutex_lock(&la->encoder);
+    if (pthread_create(&la->thread, NULL, producer_thread, la) != 0) {
+        pthread_mutex_unlock(&la->encoder);
+        pthread_mutex_destroy(&la->encoder);
+        pthread_mutex_destroy(&la->lock);
+        pthread_cond_destroy(&la->space);
+        free(la);
+        return NULL;
+    }
+    return la;
+}
+
+/* Empties the queue (la->lock held, released here): the producer goes on
+   at `next_bits`, and the caller gets the states of the groups back
+*/
+static void drop_queue(rds_lookahead *la, int64_t next_bits) {
+    void *states[LOOKAHEAD_MAX];
+    int count = la->count;
+    for (int i = 0; i < count; i++) states[i] = la->queue[(la->head + i) % la->depth].state;
+    la->invalidated += count;
+    la->count = 0;
+    la->next_bits = next_bits;
+    pthread_cond_signal(&la->space);
+    pthread_mutex_unlock(&la->lock);
+    if (count > 0) la->drop(la->arg, states, count);
+}
+
+/* Stops the producer; called by the owner of the encoder, holding the lock.
+   The groups queued are dropped.
+*/
+void rds_lookahead_stop(rds_lookahead *la) {
+    if (la == NULL) return;
+    pthread_mutex_lock(&la->lock);
+    drop_queue(la, la->next_bits);
+    pthread_mutex_lock(&la->lock);
+    la->stop = 1;
+    pthread_cond_signal(&la->space);
+    pthread_mutex_unlock(&la->lock);
+    pthread_mutex_unlock(&la->encoder);
+    pthread_join(la->thread, NULL);
+    pthread_mutex_destroy(&la->encoder);
+    pthread_mutex_destroy(&la->lock);
+    pthread_cond_destroy(&la->space);
+    free(la);
+}
+
+void rds_lookahead_lock(rds_lookahead *la) {
+    pthread_mutex_lock(&la->encoder);
+}
+
+void rds_lookahead_unlock(rds_lookahead *la) {
+    pthread_mutex_unlock(&la->encoder);
+}
+
+
+/* Takes the group that starts at bit `bits`, and exchanges its state with
+   `*state`. Returns 1, or 0 if it is not in the queue: the groups queued
+   for other positions are dropped, the caller builds this one, and the
+   producer goes on with the next one.
+*/
+int rds_lookahead_pop(rds_lookahead *la, int64_t bits, uint32_t *words, void **state) {
+    pthread_mutex_lock(&la->lock);
+    la->taken++;
+    la->depth_sum += la->count;
+    if (la->count < la->min_depth) la->min_depth = la->count;
+    if (la->count == 0 || la->queue[la->head].bits != bits) {
+        la->missed++;
+        drop_queue(la, bits + la->group_bits);
+        return 0;
+    }
+    queued_group *g = &la->queue[la->head];
+    memcpy(words, g->words, sizeof(g->words));
+    void *s = g->state;
+    g->state = *state;
+    *state = s;
+    la->head = (la->head + 1) % la->depth;
+    la->count--;
+    pthread_cond_signal(&la->space);
+    pthread_mutex_unlock(&la->lock);
+    return 1;
+}
+
+/* Drops the groups queued: the producer starts again with the group at
+   `next_bits`
+*/
+void rds_lookahead_invalidate(rds_lookahead *la, int64_t next_bits) {
+    pthread_mutex_lock(&la->lock);
+    drop_queue(la, next_bits);
+}
+
+
+/* Prints the depth of the queue when the modulator takes a group, the
+   groups invalidated or built by the modulator, and the build time
+*/
+void rds_lookahead_report(rds_lookahead *la, FILE *f) {
+    pthread_mutex_lock(&la->lock);
+    fprintf(f, "RDS lookahead: %lu group(s) taken, queue of %d: at least %d, %.1f on average; "
+            "%lu invalidated, %lu built by the modulator; build time %.3f ms on average, %.3f ms at most\n",
+            la->taken, la->depth, la->taken ? la->min_depth : la->count,
+            la->taken ? (double) la->depth_sum / la->taken : 0, la->invalidated, la->missed,
+            la->built ? 1e3 * la->build_total / la->built : 0, 1e3 * la->build_max);
+    la->taken = la->produced = la->built = la->invalidated = la->missed = la->depth_sum = 0;
+    la->min_depth = la->depth;
+    la->build_total = la->build_max = 0;
+    pthread_mutex_unlock(&la->lock);
+}
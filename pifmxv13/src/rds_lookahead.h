@@ -0,0 +1,41 @@
+#ifndef RDS_LOOKAHEAD_H
+#define RDS_LOOKAHEAD_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Groups built ahead of the modulator by a low-priority thread, into a
+   queue of a few groups already encoded: 4 words of 26 bits (block and
+   check word, MSB first). The modulator only takes the next one; if it is
+   not there (queue empty, or built for another position after a
+   preemption), the caller builds the group itself.
+
+   The encoder state is shared: the producer builds a group only while it
+   holds the encoder lock, which the thread that owns the encoder keeps
+   except while it sleeps (rds_lookahead_lock()/unlock()). Each group
+   queued comes with a state of the caller, filled by the build function
+   (the encoder state before the group). A change that must go on air at
+   once invalidates the groups queued: the caller gets their states back,
+   oldest first, to undo what building them changed, and the producer
+   starts again from the group after the one being modulated.
+*/
+#define LOOKAHEAD_MAX 8             // groups
+
+typedef struct rds_lookahead rds_lookahead;
+
+// Builds the group that starts at bit `bits` into `words`, and keeps in
+// `state` what is needed to drop it
+typedef void (*rds_lookahead_fn)(void *arg, int64_t bits, uint32_t *words, void *state);
+// The `count` groups queued are dropped: their states, oldest first
+typedef void (*rds_lookahead_drop_fn)(void *arg, void **states, int count);
+
+extern rds_lookahead *rds_lookahead_start(int depth, int group_bits, int64_t next_bits, void **states,
+                                          rds_lookahead_fn fn, rds_lookahead_drop_fn drop, void *arg);
+extern void rds_lookahead_stop(rds_lookahead *la);
+extern void rds_lookahead_lock(rds_lookahead *la);
+extern void rds_lookahead_unlock(rds_lookahead *la);
+extern int rds_lookahead_pop(rds_lookahead *la, int64_t bits, uint32_t *words, void **state);
+extern void rds_lookahead_invalidate(rds_lookahead *la, int64_t next_bits);
+extern void rds_lookahead_report(rds_lookahead *la, FILE *f);
+
+#endif /* RDS_LOOKAHEAD_H */
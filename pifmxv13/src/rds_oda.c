@@ -0,0 +1,348 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds_oda.h"
+
+
+#define NAME_LENGTH 16
+
+typedef struct {
+    rds_oda_app app;
+    char name[NAME_LENGTH];
+    double period;              // slots between two groups, 0: background
+    double release;             // first slot of the current period
+
+    // Since the last report
+    unsigned long sent;
+    unsigned long late;         // sent after the deadline
+    double worst;               // slots from the release to the transmission
+    int64_t slots;              // slots offered
+} oda_entry;
+
+struct rds_oda {
+    double slots_per_second;
+    double max_rate;            // groups/s of all the applications with an interval
+
+    oda_entry *apps;
+    int count;
+    int capacity;
+
+    // Indices of the applications: released (by deadline), and waiting for
+    // their release (by release)
+    int *ready;
+    int ready_count;
+    int *waiting;
+    int waiting_count;
+    int background_next;
+    int64_t slot;               // last slot offered
+};
+
+
+static double deadline(const oda_entry *e) {
+    return e->release + e->period;
+}
+
+static int before(rds_oda *r, int ready, int a, int b) {
+    oda_entry *x = &r->apps[a], *y = &r->apps[b];
+    if (!ready) return x->release < y->release;
+    if (deadline(x) != deadline(y)) return deadline(x) < deadline(y);
+    return x->app.priority < y->app.priority;
+}
+
+static void heap_push(rds_oda *r, int ready, int app) {
+    int *heap = ready ? r->ready : r->waiting;
+    int pos = ready ? r->ready_count++ : r->waiting_count++;
+    heap[pos] = app;
+    while (pos > 0 && before(r, ready, heap[pos], heap[(pos - 1) / 2])) {
+        int m = heap[pos];
+        heap[pos] = heap[(pos - 1) / 2];
+        heap[(pos - 1) / 2] = m;
+        pos = (pos - 1) / 2;
+    }
+}
+
+static int heap_pop(rds_oda *r, int ready) {
+    int *heap = ready ? r->ready : r->waiting;
+    int *count = ready ? &r->ready_count : &r->waiting_count;
+    int top = heap[0];
+    heap[0] = heap[--*count];
+    for (int pos = 0;;) {
+        int child = 2 * pos + 1;
+        if (child >= *count) break;
+        if (child + 1 < *count && before(r, ready, heap[child + 1], heap[child])) child++;
+        if (!before(r, ready, heap[child], heap[pos])) break;
+        int m = heap[pos];
+        heap[pos] = heap[child];
+        heap[child] = m;
+        pos = child;
+    }
+    return top;
+}
+
+/* Puts every application with an interval back into the heaps, after the
+   table changed
+*/
+static void rebuild_heaps(rds_oda *r) {
+    r->ready_count = r->waiting_count = 0;
+    for (int i = 0; i < r->count; i++) {
+        if (r->apps[i].period > 0) heap_push(r, r->apps[i].release <= r->slot, i);
+    }
+}
+
+
+rds_oda *rds_oda_new(double slots_per_second, double max_rate) {
+    rds_oda *r = calloc(1, sizeof(rds_oda));
+    if (r == NULL) return NULL;
+    r->slots_per_second = slots_per_second;
+    r->max_rate = max_rate;
+    return r;
+}
+
+void rds_oda_free(rds_oda *r) {
+    if (r == NULL) return;
+    free(r->apps);
+    free(r->ready);
+    free(r->waiting);
+    free(r);
+}
+
+static int find(rds_oda *r, const char *name) {
+    for (int i = 0; i < r->count; i++) {
+        if (strcmp(r->apps[i].name, name) == 0) return i;
+    }
+    return -1;
+}
+
+/* Groups per second of the applications with an interval */
+double rds_oda_rate(rds_oda *r) {
+    double rate = 0;
+    for (int i = 0; i < r->count; i++) {
+        if (r->apps[i].period > 0) rate += r->slots_per_second / r->apps[i].period;
+    }
+    return rate;
+}
+
+/* Groups per second of the application `name`, 0 if it is not registered
+   or in the background
+*/
+double rds_oda_app_rate(rds_oda *r, const char *name) {
+    int i = find(r, name);
+    return i >= 0 && r->apps[i].period > 0 ? r->slots_per_second / r->apps[i].period : 0;
+}
+
+/* Adds an application, or replaces the one with the same name (its place in
+   the queue is kept). Returns 0, or -1 if the interval is shorter than one
+   group, if the applications would take more than the maximum rate, or if
+   no memory is available.
+*/
+int rds_oda_register(rds_oda *r, const rds_oda_app *app) {
+    double period = app->interval * r->slots_per_second;
+    if (app->interval < 0 || (app->interval > 0 && period < 1 - 1e-9)) return -1;
+
+    int i = find(r, app->name);
+    double rate = rds_oda_rate(r) - (i >= 0 ? rds_oda_app_rate(r, app->name) : 0);
+    if (app->interval > 0 && rate + 1 / app->interval > r->max_rate + 1e-9) return -1;
+
+    if (i < 0) {
+        if (r->count == r->capacity) {
+            int capacity = r->capacity ? 2 * r->capacity : 8;
+            oda_entry *apps = realloc(r->apps, capacity * sizeof(oda_entry));
+            if (apps == NULL) return -1;
+            r->apps = apps;
+            int *ready = realloc(r->ready, capacity * sizeof(int));
+            if (ready == NULL) return -1;
+            r->ready = ready;
+            int *waiting = realloc(r->waiting, capacity * sizeof(int));
+            if (waiting == NULL) return -1;
+            r->waiting = waiting;
+            r->capacity = capacity;
+        }
+        i = r->count++;
+        memset(&r->apps[i], 0, sizeof(oda_entry));
+        r->apps[i].release = r->slot + 1;
+    }
+    oda_entry *e = &r->apps[i];
+    e->app = *app;
+    snprintf(e->name, NAME_LENGTH, "%s", app->name);
+    e->app.name = e->name;
+    e->period = period;
+    rebuild_heaps(r);
+    return 0;
+}
+
+/* Removes the application `name`. Returns 0, or -1 if there is none. */
+int rds_oda_unregister(rds_oda *r, const char *name) {
+    int i = find(r, name);
+    if (i < 0) return -1;
+    r->apps[i] = r->apps[--r->count];
+    r->apps[i].app.name = r->apps[i].name;
+    rebuild_heaps(r);
+    return 0;
+}
+
+
+/* Gives the free slot `slot` to the application with the earliest deadline
+   among the released ones that have a group to send, otherwise to a
+   background application. Returns 0 if none took it.
+*/
+int rds_oda_group(rds_oda *r, uint16_t *blocks, uint16_t block1_base, int64_t slot) {
+    r->slot = slot;
+    while (r->waiting_count > 0 && r->apps[r->waiting[0]].release <= slot) {
+        heap_push(r, 1, heap_pop(r, 0));
+    }
+
+    int sent = 0;
+    int idle[r->ready_count > 0 ? r->ready_count : 1];
+    int idle_count = 0;
+    while (!sent && r->ready_count > 0) {
+        int i = heap_pop(r, 1);
+        oda_entry *e = &r->apps[i];
+        e->slots++;
+        if (!e->app.fn(e->app.arg, blocks, block1_base)) {
+            idle[idle_count++] = i;
+            continue;
+        }
+        sent = 1;
+        e->sent++;
+        if (slot - e->release > e->worst) e->worst = slot - e->release;
+        if (slot > deadline(e)) e->late++;
+        // Late: one group to catch up at most
+        e->release = fmax(e->release + e->period, slot + 1 - e->period);
+        heap_push(r, e->release <= slot, i);
+    }
+    // Nothing to send: asked again from the next slot, the deadline moves on
+    for (int k = 0; k < idle_count; k++) {
+        r->apps[idle[k]].release = slot + 1;
+        heap_push(r, 0, idle[k]);
+    }
+    if (sent) return 1;
+
+    for (int k = 0; k < r->count; k++) {
+        int i = (r->background_next + k) % r->count;
+        oda_entry *e = &r->apps[i];
+        if (e->period > 0) continue;
+        e->slots++;
+        if (e->app.fn(e->app.arg, blocks, block1_base)) {
+            e->sent++;
+            r->background_next = i + 1;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+typedef struct {
+    int count;                  // applications, -1: not saved
+    int ready_count;
+    int waiting_count;
+    int background_next;
+    int64_t slot;
+    // The applications, then the two heaps
+    oda_entry apps[];
+} oda_state;
+
+/* Copies the queue (releases, heaps) and the counters of the applications
+   into `*state`: one block, allocated or grown as needed (released with
+   free()). Returns 0, or -1 if no memory is available (the state is then
+   not usable).
+*/
+int rds_oda_save(rds_oda *r, void **state) {
+    size_t size = sizeof(oda_state) + r->count * sizeof(oda_entry) +
+                  (r->ready_count + r->waiting_count) * sizeof(int);
+    oda_state *s = realloc(*state, size);
+    if (s == NULL) {
+        if (*state) ((oda_state *) *state)->count = -1;
+        return -1;
+    }
+    *state = s;
+    s->count = r->count;
+    s->ready_count = r->ready_count;
+    s->waiting_count = r->waiting_count;
+    s->background_next = r->background_next;
+    s->slot = r->slot;
+    memcpy(s->apps, r->apps, r->count * sizeof(oda_entry));
+    int *heaps = (int *) (s->apps + r->count);
+    memcpy(heaps, r->ready, r->ready_count * sizeof(int));
+    memcpy(heaps + r->ready_count, r->waiting, r->waiting_count * sizeof(int));
+    return 0;
+}
+
+/* Goes back to a state saved with the same applications: the slots given
+   since then are given again
+*/
+void rds_oda_restore(rds_oda *r, const void *state) {
+    const oda_state *s = state;
+    if (s == NULL || s->count != r->count) return;
+    r->ready_count = s->ready_count;
+    r->waiting_count = s->waiting_count;
+    r->background_next = s->background_next;
+    r->slot = s->slot;
+    memcpy(r->apps, s->apps, r->count * sizeof(oda_entry));
+    const int *heaps = (const int *) (s->apps + r->count);
+    memcpy(r->ready, heaps, r->ready_count * sizeof(int));
+    memcpy(r->waiting, heaps + r->ready_count, r->waiting_count * sizeof(int));
+}
+
+
+static void print_app(FILE *f, oda_entry *e) {
+    fprintf(f, "  %-8s ", e->name);
+    if (e->app.aid) fprintf(f, "AID %04X ", e->app.aid);
+    else fprintf(f, "         ");
+    if (e->app.group >= 0) fprintf(f, "%2d%c ", e->app.group >> 1, e->app.group & 1 ? 'B' : 'A');
+    else fprintf(f, " -  ");
+}
+
+/* Prints, for each application, the groups sent and the worst latency from
+   its release (it meets its deadline if that is within its interval)
+*/
+void rds_oda_report(rds_oda *r, FILE *f) {
+    if (r->count == 0) return;
+    fprintf(f, "ODA: %d application(s), %.2f of %.2f groups/s reserved\n", r->count, rds_oda_rate(r), r->max_rate);
+    for (int i = 0; i < r->count; i++) {
+        oda_entry *e = &r->apps[i];
+        print_app(f, e);
+        double seconds = e->slots / r->slots_per_second;
+        if (e->period > 0) {
+            fprintf(f, "interval %5.2f s: %lu group(s), worst latency %.2f s, %lu late\n",
+                    e->period / r->slots_per_second, e->sent, e->worst / r->slots_per_second, e->late);
+        } else {
+            fprintf(f, "background: %lu group(s) in %.1f s of free slots\n", e->sent, seconds);
+        }
+        e->sent = e->late = 0;
+        e->worst = 0;
+        e->slots = 0;
+    }
+}
+
+/* Prints the queue: the released applications by deadline, then those
+   waiting for their release, then the background ones
+*/
+void rds_oda_dump(rds_oda *r, FILE *f) {
+    fprintf(f, "ODA queue at group %lld: %d released, %d waiting, %.2f of %.2f groups/s reserved\n",
+            (long long) r->slot, r->ready_count, r->waiting_count, rds_oda_rate(r), r->max_rate);
+
+    // Copies of the heaps, emptied in order
+    int ready[r->ready_count + 1], waiting[r->waiting_count + 1];
+    int ready_count = r->ready_count, waiting_count = r->waiting_count;
+    memcpy(ready, r->ready, ready_count * sizeof(int));
+    memcpy(waiting, r->waiting, waiting_count * sizeof(int));
+    while (r->ready_count > 0 || r->waiting_count > 0) {
+        int is_ready = r->ready_count > 0;
+        oda_entry *e = &r->apps[heap_pop(r, is_ready)];
+        print_app(f, e);
+        fprintf(f, "priority %d, interval %.2f s: %s, deadline in %.0f ms\n", e->app.priority,
+                e->period / r->slots_per_second, is_ready ? "released" : "waiting",
+                1e3 * (deadline(e) - r->slot) / r->slots_per_second);
+    }
+    memcpy(r->ready, ready, ready_count * sizeof(int));
+    memcpy(r->waiting, waiting, waiting_count * sizeof(int));
+    r->ready_count = ready_count;
+    r->waiting_count = waiting_count;
+    for (int i = 0; i < r->count; i++) {
+        if (r->apps[i].period > 0) continue;
+        print_app(f, &r->apps[i]);
+        fprintf(f, "priority %d, background\n", r->apps[i].app.priority);
+    }
+}
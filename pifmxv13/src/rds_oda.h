@@ -0,0 +1,49 @@
+#ifndef RDS_ODA_H
+#define RDS_ODA_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Registry of the applications that add groups to the core PS/RT/AF cycle
+   (RT+, TMC, TDC, EON, RFT...). Each one declares its AID, its group type
+   and the target interval between two of its groups, and gives a callback
+   that builds the next group (blocks 2 to 4; ODA announcements included, if
+   the application sends them).
+
+   The group slots that CT, the bursts and the priority groups leave free go
+   first to the applications, earliest deadline first: an application is
+   released one interval after its previous release, and its deadline is one
+   interval later (equal deadlines: lower priority value first). The total
+   rate of the applications is limited when they register, so that every
+   deadline can be met and the core cycle keeps the rest of the groups.
+   Background applications (interval 0) take the free slots that are left,
+   in turn, before the core cycle.
+*/
+typedef struct rds_oda rds_oda;
+
+typedef int (*rds_oda_group_fn)(void *arg, uint16_t *blocks, uint16_t block1_base);
+
+typedef struct {
+    const char *name;           // registering a name again replaces the application
+    uint16_t aid;               // 0: not an ODA
+    int group;                  // group type code (type << 1 | version B), -1: none
+    double interval;            // target, seconds between two groups; 0: background
+    int priority;
+    rds_oda_group_fn fn;        // returns 0 if the application has no group to send
+    void *arg;
+} rds_oda_app;
+
+extern rds_oda *rds_oda_new(double slots_per_second, double max_rate);
+extern void rds_oda_free(rds_oda *r);
+extern int rds_oda_register(rds_oda *r, const rds_oda_app *app);
+extern int rds_oda_unregister(rds_oda *r, const char *name);
+extern double rds_oda_rate(rds_oda *r);
+extern double rds_oda_app_rate(rds_oda *r, const char *name);
+extern int rds_oda_group(rds_oda *r, uint16_t *blocks, uint16_t block1_base, int64_t slot);
+// Groups built ahead and dropped (rds_lookahead.h): back to a saved state
+extern int rds_oda_save(rds_oda *r, void **state);
+extern void rds_oda_restore(rds_oda *r, const void *state);
+extern void rds_oda_report(rds_oda *r, FILE *f);
+extern void rds_oda_dump(rds_oda *r, FILE *f);
+
+#endif /* RDS_ODA_H */
@@ -0,0 +1,292 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rds.h"
+#include "rds_rft.h"
+
+
+#define SEGMENT_BYTES 5
+#define ODA_GROUP 13                // application group 13A
+#define GROUPS_PER_SECOND (228000. / (104 * 192))
+
+struct rds_rft {
+    int pipe;
+    int file_id;
+    int version;
+    int toggle;
+
+    // The file is read once (RFT_MAX_SIZE at most): a change on disk while
+    // it is sent cannot touch the copy, and is noticed by check_file()
+    char *path;
+    uint8_t *data;
+    size_t size;
+    struct stat st;             // to notice that the file was replaced
+    int segments;
+    int chunks;
+    uint16_t *crc;              // CRC of each chunk of the copy
+
+    // Carousel: the chunks that changed with the last version first, then
+    // all segments in order
+    uint8_t *dirty;
+    int dirty_count;
+    int dirty_chunk;
+    int dirty_segment;
+    int next_segment;
+    int passes;                 // passes after each change, 0: endless
+    int pass;
+
+    // Announcement and CRCs on the main stream, one group in `share`
+    int share;
+    int share_count;
+    int oda_state;
+    int crc_chunk;
+
+    // Data group slots of the stream, to measure the carousel cycle
+    unsigned long slots;
+    unsigned long pass_start;
+    unsigned long last_pass;
+    unsigned long resent;
+};
+
+
+static size_t chunk_bytes(rds_rft *r, int chunk) {
+    size_t start = (size_t) chunk * RFT_CHUNK_SEGMENTS * SEGMENT_BYTES;
+    size_t len = RFT_CHUNK_SEGMENTS * SEGMENT_BYTES;
+    return start + len > r->size ? r->size - start : len;
+}
+
+// Reads the whole file; fails if it is shorter than st_size (truncated meanwhile)
+static uint8_t *read_file(int fd, size_t size) {
+    uint8_t *data = malloc(size);
+    size_t done = 0;
+    while (data != NULL && done < size) {
+        ssize_t n = pread(fd, data + done, size - done, done);
+        if (n <= 0) {
+            free(data);
+            return NULL;
+        }
+        done += n;
+    }
+    return data;
+}
+
+
+rds_rft *rds_rft_new(int pipe, int file_id) {
+    rds_rft *r = calloc(1, sizeof(rds_rft));
+    if (r == NULL) return NULL;
+    r->pipe = pipe & 0xF;
+    r->file_id = file_id & 0x3F;
+    r->share = 16;
+    return r;
+}
+
+static void release_file(rds_rft *r) {
+    free(r->data);
+    free(r->crc);
+    free(r->dirty);
+    r->data = NULL;
+    r->crc = NULL;
+    r->dirty = NULL;
+}
+
+void rds_rft_free(rds_rft *r) {
+    if (r == NULL) return;
+    release_file(r);
+    free(r->path);
+    free(r);
+}
+
+
+/* Sends the file `path` (NULL: stops the transfer). The file is copied and
+   the CRC of each chunk computed. When a file of the same size was already
+   sent, only the chunks whose CRC changed are sent again before the carousel
+   resumes. Returns 0, or -1 if the file cannot be read or is larger than
+   RFT_MAX_SIZE (the current file is kept).
+*/
+int rds_rft_set_file(rds_rft *r, const char *path) {
+    if (path == NULL) {
+        release_file(r);
+        free(r->path);
+        r->path = NULL;
+        return 0;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return -1;
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0 || st.st_size > RFT_MAX_SIZE) {
+        close(fd);
+        return -1;
+    }
+    uint8_t *data = read_file(fd, st.st_size);
+    close(fd);
+    if (data == NULL) return -1;
+
+    int segments = (st.st_size + SEGMENT_BYTES - 1) / SEGMENT_BYTES;
+    int chunks = (segments + RFT_CHUNK_SEGMENTS - 1) / RFT_CHUNK_SEGMENTS;
+    uint16_t *crc = calloc(chunks, sizeof(uint16_t));
+    uint8_t *dirty = calloc(chunks, 1);
+    if (crc == NULL || dirty == NULL) {
+        free(data);
+        free(crc);
+        free(dirty);
+        return -1;
+    }
+
+    // Previous version: compare chunk by chunk
+    rds_rft old = *r;
+    r->data = data;
+    r->size = st.st_size;
+    r->st = st;
+    r->segments = segments;
+    r->chunks = chunks;
+    r->crc = crc;
+    r->dirty = dirty;
+    for (int c = 0; c < chunks; c++)
+        crc[c] = rds_crc16(data + (size_t) c * RFT_CHUNK_SEGMENTS * SEGMENT_BYTES, chunk_bytes(r, c));
+    r->dirty_count = 0;
+    r->dirty_chunk = r->dirty_segment = 0;
+    if (old.data != NULL && old.size == r->size) {
+        for (int c = 0; c < chunks; c++) {
+            if (crc[c] != old.crc[c] || old.dirty[c]) {     // changed now or still pending
+                dirty[c] = 1;
+                r->dirty_count++;
+            }
+        }
+        if (r->dirty_count > 0) r->version++;
+    } else {
+        // New file (or another size): the complete file, from the start
+        if (old.data != NULL) r->version++;
+        r->toggle = !r->toggle;
+        r->next_segment = 0;
+        r->pass_start = r->slots;
+    }
+    free(old.data);
+    free(old.crc);
+    free(old.dirty);
+
+    if (old.path == NULL || strcmp(old.path, path) != 0) {
+        free(old.path);
+        r->path = strdup(path);
+    }
+    r->pass = 0;
+    return 0;
+}
+
+/* Number of groups in `share` given to the announcement on the main stream */
+void rds_rft_set_share(rds_rft *r, int share) {
+    r->share = share > 0 ? share : 1;
+}
+
+/* Number of carousel passes after each change of the file (0: endless) */
+void rds_rft_set_passes(rds_rft *r, int passes) {
+    r->passes = passes > 0 ? passes : 0;
+    r->pass = 0;
+}
+
+/* Before each data group: the file may have been replaced or changed in place */
+static void check_file(rds_rft *r) {
+    struct stat st;
+    if (r->path == NULL || stat(r->path, &st) < 0) return;
+    if (st.st_ino != r->st.st_ino || st.st_size != r->st.st_size ||
+        st.st_mtim.tv_sec != r->st.st_mtim.tv_sec || st.st_mtim.tv_nsec != r->st.st_mtim.tv_nsec) {
+        char *path = strdup(r->path);
+        if (path && rds_rft_set_file(r, path) == 0)
+            printf("RFT: %s changed, %d chunk(s) to send again.\n", path, r->dirty_count);
+        free(path);
+    }
+}
+
+
+/* Group source of the RDS2 stream (see set_rds_group_source()): the next
+   data group of the carousel. Returns 0 when there is nothing to send.
+*/
+int rds_rft_data_group(void *rft, uint16_t *blocks, uint16_t block1_base) {
+    rds_rft *r = rft;
+    r->slots++;
+    if (r->data == NULL) return 0;
+    check_file(r);
+
+    int segment;
+    if (r->dirty_count > 0) {
+        while (!r->dirty[r->dirty_chunk]) r->dirty_chunk = (r->dirty_chunk + 1) % r->chunks;
+        segment = r->dirty_chunk * RFT_CHUNK_SEGMENTS + r->dirty_segment++;
+        if (r->dirty_segment >= RFT_CHUNK_SEGMENTS || segment + 1 >= r->segments) {
+            r->dirty[r->dirty_chunk] = 0;
+            r->dirty_count--;
+            r->dirty_segment = 0;
+        }
+        r->resent++;
+    } else {
+        if (r->passes > 0 && r->pass >= r->passes) return 0;
+        segment = r->next_segment++;
+        if (r->next_segment >= r->segments) {
+            r->next_segment = 0;
+            r->pass++;
+            r->last_pass = r->slots - r->pass_start;
+            r->pass_start = r->slots;
+        }
+    }
+
+    uint8_t d[SEGMENT_BYTES] = {0};
+    size_t offset = (size_t) segment * SEGMENT_BYTES;
+    size_t len = offset + SEGMENT_BYTES > r->size ? r->size - offset : SEGMENT_BYTES;
+    memcpy(d, r->data + offset, len);
+
+    blocks[0] = (0x80 | r->pipe) << 8 | r->toggle << 7 | ((segment >> 8) & 0x7F);
+    blocks[1] = (segment & 0xFF) << 8 | d[0];
+    blocks[2] = d[1] << 8 | d[2];
+    blocks[3] = d[3] << 8 | d[4];
+    return 1;
+}
+
+/* Group source of the main stream: every `share` groups, the ODA
+   announcement (3A), the file description or the CRC of a chunk (13A)
+*/
+int rds_rft_oda_group(void *rft, uint16_t *blocks, uint16_t block1_base) {
+    rds_rft *r = rft;
+    if (r->data == NULL || ++r->share_count < r->share) return 0;
+    r->share_count = 0;
+
+    switch (r->oda_state++ % 4) {
+        case 0:
+            blocks[1] = 0x3000 | block1_base | ODA_GROUP << 1;
+            blocks[2] = 0x0000;
+            blocks[3] = RFT_AID;
+            break;
+        case 1:
+            blocks[1] = ODA_GROUP << 12 | block1_base | r->toggle << 4 | 0;
+            blocks[2] = r->pipe << 12 | r->file_id << 6 | (r->version & 0xF) << 2 | (r->size >> 16);
+            blocks[3] = r->size & 0xFFFF;
+            break;
+        default:
+            r->crc_chunk %= r->chunks;
+            blocks[1] = ODA_GROUP << 12 | block1_base | r->toggle << 4 | 1;
+            blocks[2] = r->pipe << 12 | r->crc_chunk;
+            blocks[3] = r->crc[r->crc_chunk];
+            r->crc_chunk++;
+    }
+    return 1;
+}
+
+
+/* Prints the file, its carousel cycle time at the full rate of an RDS2
+   stream, and the duration of the last pass actually measured
+*/
+void rds_rft_report(rds_rft *r, FILE *f) {
+    if (r->data == NULL) return;
+    double cycle = r->segments / GROUPS_PER_SECOND;
+    fprintf(f, "RFT %s: %zu bytes, %d segments, %d chunk(s), version %d; carousel cycle %.1f s",
+            r->path, r->size, r->segments, r->chunks, r->version, cycle);
+    if (r->last_pass) fprintf(f, " (last pass %.1f s)", r->last_pass / GROUPS_PER_SECOND);
+    if (r->passes && r->pass >= r->passes) fprintf(f, ", %d pass(es) done", r->passes);
+    else if (r->passes) fprintf(f, ", pass %d/%d", r->pass + 1, r->passes);
+    else fprintf(f, ", pass %d", r->pass + 1);
+    fprintf(f, ", %lu segment(s) sent again, %d chunk(s) pending\n", r->resent, r->dirty_count);
+    fprintf(f, "  announcement: 1 group in %d on the main stream (%d chunk CRC(s) per %.1f s)\n",
+            r->share, r->chunks, 2. * r->chunks * r->share / GROUPS_PER_SECOND);
+}
@@ -0,0 +1,39 @@
+#ifndef RDS_RFT_H
+#define RDS_RFT_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* RDS2 file transfer (RFT), e.g. for the station logo: a file of at most
+   163840 bytes is sent in a carousel of 5-byte segments, in the data groups
+   of an RDS2 stream; the main stream announces the file (ODA) and carries
+   its size and the CRC of each chunk of CHUNK_SEGMENTS segments.
+
+   Data group (RDS2 stream, type C: no PI), bytes in block order:
+     FH = 0x80 | pipe, toggle (1 bit) + segment address (15 bits), 5 bytes
+   Announcement (main stream): group 3A, application group 13A, AID FF7F.
+   Group 13A: block 2 bits 4..0 = toggle, variant (0: file, 1: chunk CRC);
+     variant 0: block 3 = pipe (4) + file id (6) + version (4) + size bits
+                17..16, block 4 = size bits 15..0
+     variant 1: block 3 = pipe (4) + chunk (12), block 4 = CRC-16-CCITT of
+                the chunk
+   The toggle bit changes when another file (of another size) is sent; the
+   version changes with the content, and then only the chunks whose CRC
+   changed are sent again before the carousel resumes.
+*/
+#define RFT_AID 0xFF7F
+#define RFT_MAX_SIZE (32768 * 5)
+#define RFT_CHUNK_SEGMENTS 64
+
+typedef struct rds_rft rds_rft;
+
+extern rds_rft *rds_rft_new(int pipe, int file_id);
+extern void rds_rft_free(rds_rft *r);
+extern int rds_rft_set_file(rds_rft *r, const char *path);
+extern void rds_rft_set_share(rds_rft *r, int share);
+extern void rds_rft_set_passes(rds_rft *r, int passes);
+extern int rds_rft_data_group(void *rft, uint16_t *blocks, uint16_t block1_base);
+extern int rds_rft_oda_group(void *rft, uint16_t *blocks, uint16_t block1_base);
+extern void rds_rft_report(rds_rft *r, FILE *f);
+
+#endif /* RDS_RFT_H */
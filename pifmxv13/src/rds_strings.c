@@ -308,4 +308,53 @@ void fill_rds_string_mode(char* rds_string, char* src_string, size_t rds_string_
     for (int i = converted_len; i < rds_string_size; i++) {
         *rds_string_ptr++ = 0x20;
     }
-}
\ No newline at end of file
+}
+/* Length of the UTF-8 character at `s` (at most `n` bytes), or -1 if it is
+   invalid: bad lead byte, missing continuation byte, overlong form, UTF-16
+   surrogate or beyond U+10FFFF. Does not depend on the locale.
+*/
+static int utf8_char_size(const unsigned char* s, size_t n) {
+    int size;
+    unsigned int codepoint;
+    if (s[0] < 0x80) return 1;
+    else if (s[0] >= 0xC2 && s[0] <= 0xDF) { size = 2; codepoint = s[0] & 0x1F; }
+    else if (s[0] >= 0xE0 && s[0] <= 0xEF) { size = 3; codepoint = s[0] & 0x0F; }
+    else if (s[0] >= 0xF0 && s[0] <= 0xF4) { size = 4; codepoint = s[0] & 0x07; }
+    else return -1;
+    if ((size_t) size > n) return -1;
+    for (int i = 1; i < size; i++) {
+        if ((s[i] & 0xC0) != 0x80) return -1;
+        codepoint = codepoint << 6 | (s[i] & 0x3F);
+    }
+    if ((size == 3 && codepoint < 0x800) || (size == 4 && codepoint < 0x10000)) return -1;
+    if ((codepoint >= 0xD800 && codepoint <= 0xDFFF) || codepoint > 0x10FFFF) return -1;
+    return size;
+}
+
+/* Copies the valid UTF-8 characters of `src_string` (Long PS, eRT) that fit
+   in `size` bytes: a character is never cut, invalid bytes are skipped (see
+   utf8_char_size()). A shorter text ends with 0x0D and the rest is filled
+   with zeros. Returns the length of the text in bytes.
+*/
+int fill_utf8_string(char* dst, char* src_string, size_t size) {
+    size_t remaining_src_size = strlen(src_string);
+    size_t len = 0;
+    while (remaining_src_size > 0) {
+        int char_size = utf8_char_size((unsigned char*) src_string, remaining_src_size);
+        if (char_size < 0) {
+            src_string++;
+            remaining_src_size--;
+            continue;
+        }
+        if (len + char_size > size) break;
+        memcpy(dst + len, src_string, char_size);
+        len += char_size;
+        src_string += char_size;
+        remaining_src_size -= char_size;
+    }
+    if (len < size) {
+        dst[len] = 0x0D;
+        memset(dst + len + 1, 0, size - len - 1);
+    }
+    return len;
+}
@@ -1,11 +1,12 @@
-#ifndef RDS_H
-#define RDS_H
+#ifndef RDS_STRINGS_H
+#define RDS_STRINGS_H
 
 
 #include <stdlib.h>
 
 extern void fill_rds_string(char* rds_string, char* src_string, size_t rds_string_size);
 extern void fill_rds_string_mode(char* rds_string, char* src_string, size_t rds_string_size, char mode);
+extern int fill_utf8_string(char* dst, char* src_string, size_t size);
 
 
-#endif /* RDS_H */
\ No newline at end of file
+#endif /* RDS_STRINGS_H */
\ No newline at end of file
@@ -68,6 +68,51 @@ void test_skip_invalid() {
     assert_string("Skip invalid bytes", dst, dst_ref, dst_size);
 }
 
+void test_utf8_whole_characters() {
+    size_t dst_size = 8;
+    char dst[dst_size];
+    // "Ф" and "я" take 2 bytes each
+    char dst_ref[] = {'A', 'B', '\xd0', '\xa4', '\xd1', '\x8f', 'C', '\x0d'};
+    fill_utf8_string(dst, "AB\xd0\xa4\xd1\x8f""C", dst_size);
+    assert_string("UTF-8: copy and terminate with 0x0D", dst, dst_ref, dst_size);
+    char dst_ref2[] = {'A', 'B', 'C', 'D', 'E', 'F', 'G', 0x0d};
+    fill_utf8_string(dst, "ABCDEFG\xd1\x8f", dst_size);
+    assert_string("UTF-8: never cut a character", dst, dst_ref2, dst_size);
+}
+
+void test_utf8_skip_invalid() {
+    size_t dst_size = 6;
+    char dst[dst_size];
+    char dst_ref[] = {'A', 'B', 'C', 0x0d, 0, 0};
+    fill_utf8_string(dst, "A\xc0""B\xd1""C", dst_size);
+    assert_string("UTF-8: skip invalid bytes", dst, dst_ref, dst_size);
+}
+
+void test_utf8_reject_invalid() {
+    size_t dst_size = 8;
+    char dst[dst_size];
+    // Overlong '/', a surrogate, a stray continuation byte, a cut character
+    char dst_ref[] = {'A', 'B', 'C', 'D', 0x0d, 0, 0, 0};
+    fill_utf8_string(dst, "A\xe0\x80\xaf""B\xed\xa0\x80""C\x80""D\xe2\x82", dst_size);
+    assert_string("UTF-8: reject overlong, surrogate and cut characters", dst, dst_ref, dst_size);
+    char dst_ref2[] = {'\xf0', '\x9f', '\x93', '\xbb', '\xd1', '\x8f', 0x0d, 0};
+    fill_utf8_string(dst, "\xf0\x9f\x93\xbb\xd1\x8f\xf5\x80\x80\x80", dst_size);
+    assert_string("UTF-8: keep 4-byte characters, reject beyond U+10FFFF", dst, dst_ref2, dst_size);
+}
+
+void test_utf8_any_locale() {
+    size_t dst_size = 6;
+    char dst[dst_size];
+    char dst_ref[] = {'A', 'B', 'C', 0x0d, 0, 0};
+    char* previous = setlocale(LC_ALL, NULL);
+    char saved[64];
+    snprintf(saved, sizeof(saved), "%s", previous);
+    setlocale(LC_ALL, "C");     // single-byte: every byte would be a character
+    fill_utf8_string(dst, "A\xe9""B\xd1""C", dst_size);
+    setlocale(LC_ALL, saved);
+    assert_string("UTF-8: same decoding in the C locale", dst, dst_ref, dst_size);
+}
+
 int main() {
     const char* locale = "C.UTF-8";
     const char* locale_set = setlocale(LC_ALL, locale);
@@ -81,4 +126,8 @@ int main() {
     test_same_sizes();
     test_non_ascii();
     test_skip_invalid();
+    test_utf8_whole_characters();
+    test_utf8_skip_invalid();
+    test_utf8_reject_invalid();
+    test_utf8_any_locale();
 }
\ No newline at end of file
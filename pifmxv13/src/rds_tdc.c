@@ -0,0 +1,232 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "rds.h"
+#include "rds_tdc.h"
+
+
+#define FRAME_OVERHEAD 4            // STX, length, CRC
+#define POLL_MS 100                 // the reader checks for close() this often
+
+struct rds_tdc {
+    int channel;
+    int version_b;
+    int fd;
+    int fifo;
+
+    // Queue of frame bytes, filled by the reader thread
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t space;
+    uint8_t queue[TDC_QUEUE];
+    int head;
+    int count;
+    int frames;                 // frames queued, not completely sent
+    int stop;
+
+    // Frame being sent: bytes sent, message length
+    int frame_pos;
+    int frame_length;
+
+    // Since the last report
+    unsigned long groups;
+    unsigned long bytes;
+    unsigned long messages;
+    unsigned long payload;
+    unsigned long blocked;      // times the reader waited for space
+    int max_count;
+    unsigned long passes;       // regular file read to the end
+};
+
+
+/* Queues one message as a frame, waiting for space. Returns -1 if the
+   channel is being closed.
+*/
+static int push_message(rds_tdc *t, const char *msg, int len) {
+    uint8_t frame[TDC_MAX_MESSAGE + FRAME_OVERHEAD];
+    frame[0] = TDC_STX;
+    frame[1] = len;
+    memcpy(frame + 2, msg, len);
+    uint16_t crc = rds_crc16(frame + 1, len + 1);
+    frame[len + 2] = crc >> 8;
+    frame[len + 3] = crc & 0xFF;
+    int size = len + FRAME_OVERHEAD;
+
+    pthread_mutex_lock(&t->lock);
+    if (TDC_QUEUE - t->count < size) t->blocked++;
+    while (TDC_QUEUE - t->count < size && !t->stop) pthread_cond_wait(&t->space, &t->lock);
+    if (t->stop) {
+        pthread_mutex_unlock(&t->lock);
+        return -1;
+    }
+    for (int i = 0; i < size; i++) t->queue[(t->head + t->count + i) % TDC_QUEUE] = frame[i];
+    t->count += size;
+    t->frames++;
+    if (t->count > t->max_count) t->max_count = t->count;
+    pthread_mutex_unlock(&t->lock);
+    return 0;
+}
+
+/* Reads the lines of the file or pipe and queues them */
+static void *reader_thread(void *arg) {
+    rds_tdc *t = arg;
+    char line[TDC_MAX_MESSAGE];
+    int len = 0;
+    int pass_messages = 0;
+
+    while (!__atomic_load_n(&t->stop, __ATOMIC_ACQUIRE)) {
+        struct pollfd p = { .fd = t->fd, .events = POLLIN };
+        if (poll(&p, 1, POLL_MS) <= 0) continue;
+        ssize_t n = read(t->fd, line + len, sizeof(line) - len);
+        if (n < 0 && (errno == EAGAIN || errno == EINTR)) continue;
+        if (n <= 0) {
+            // End of the file: the last line, then the carousel starts again;
+            // a pipe without writer: wait for the next one
+            if (len > 0 && push_message(t, line, len) == 0) pass_messages++;
+            len = 0;
+            if (t->fifo) {
+                usleep(POLL_MS * 1000);
+            } else {
+                lseek(t->fd, 0, SEEK_SET);
+                __atomic_add_fetch(&t->passes, 1, __ATOMIC_RELAXED);
+                if (pass_messages == 0) usleep(POLL_MS * 1000);
+                pass_messages = 0;
+            }
+            continue;
+        }
+        len += n;
+
+        char *start = line, *nl;
+        while ((nl = memchr(start, '\n', len - (start - line))) != NULL) {
+            if (nl > start) {
+                if (push_message(t, start, nl - start) < 0) return NULL;
+                pass_messages++;
+            }
+            start = nl + 1;
+        }
+        len -= start - line;
+        memmove(line, start, len);
+        if (len == TDC_MAX_MESSAGE) {
+            // Too long for one frame
+            if (push_message(t, line, len) < 0) return NULL;
+            pass_messages++;
+            len = 0;
+        }
+    }
+    return NULL;
+}
+
+
+/* Opens the channel `channel` (0-31) fed from `path`, in groups 5A (5B if
+   `version_b`), and starts the reader. Returns NULL if the file cannot be
+   opened.
+*/
+rds_tdc *rds_tdc_open(const char *path, int channel, int version_b) {
+    // Not blocked until a writer opens the pipe
+    int fd = open(path, O_RDONLY | O_NONBLOCK);
+    if (fd < 0) return NULL;
+    struct stat st;
+    rds_tdc *t = calloc(1, sizeof(rds_tdc));
+    if (t == NULL || fstat(fd, &st) < 0) {
+        free(t);
+        close(fd);
+        return NULL;
+    }
+    t->fd = fd;
+    t->fifo = S_ISFIFO(st.st_mode);
+    t->channel = channel & 0x1F;
+    t->version_b = version_b;
+    pthread_mutex_init(&t->lock, NULL);
+    pthread_cond_init(&t->space, NULL);
+    if (pthread_create(&t->thread, NULL, reader_thread, t) != 0) {
+        close(fd);
+        free(t);
+        return NULL;
+    }
+    return t;
+}
+
+void rds_tdc_close(rds_tdc *t) {
+    if (t == NULL) return;
+    pthread_mutex_lock(&t->lock);
+    __atomic_store_n(&t->stop, 1, __ATOMIC_RELEASE);
+    pthread_cond_broadcast(&t->space);
+    pthread_mutex_unlock(&t->lock);
+    pthread_join(t->thread, NULL);
+    pthread_mutex_destroy(&t->lock);
+    pthread_cond_destroy(&t->space);
+    close(t->fd);
+    free(t);
+}
+
+
+/* Next TDC group, with the next bytes of the queue. Returns 0 if no frame
+   is waiting.
+*/
+int rds_tdc_group(rds_tdc *t, uint16_t *blocks, uint16_t block1_base) {
+    uint8_t bytes[4] = {0};
+    int size = t->version_b ? 2 : 4;
+
+    pthread_mutex_lock(&t->lock);
+    if (t->count == 0) {
+        pthread_mutex_unlock(&t->lock);
+        return 0;
+    }
+    int n = t->count < size ? t->count : size;
+    for (int i = 0; i < n; i++) {
+        uint8_t b = t->queue[t->head];
+        bytes[i] = b;
+        t->head = (t->head + 1) % TDC_QUEUE;
+
+        // Frames are queued whole: follow them to count the messages sent
+        if (t->frame_pos == 1) t->frame_length = b;
+        if (++t->frame_pos >= 2 && t->frame_pos == t->frame_length + FRAME_OVERHEAD) {
+            t->frame_pos = 0;
+            t->frames--;
+            t->messages++;
+            t->payload += t->frame_length;
+        }
+    }
+    t->count -= n;
+    pthread_cond_signal(&t->space);
+    pthread_mutex_unlock(&t->lock);
+
+    blocks[1] = 0x5000 | (t->version_b ? 0x0800 : 0) | block1_base | t->channel;
+    if (t->version_b) {
+        blocks[3] = bytes[0] << 8 | bytes[1];
+    } else {
+        blocks[2] = bytes[0] << 8 | bytes[1];
+        blocks[3] = bytes[2] << 8 | bytes[3];
+    }
+    t->groups++;
+    t->bytes += n;
+    return 1;
+}
+
+
+/* Prints the payload rate achieved over `seconds` and the queue depth */
+void rds_tdc_report(rds_tdc *t, FILE *f, double seconds) {
+    pthread_mutex_lock(&t->lock);
+    int count = t->count, frames = t->frames, max_count = t->max_count;
+    unsigned long blocked = t->blocked;
+    t->max_count = count;
+    t->blocked = 0;
+    pthread_mutex_unlock(&t->lock);
+
+    if (seconds <= 0) return;
+    fprintf(f, "  channel %d (5%c): %lu message(s) sent, %.0f payload bits/s (%.0f bits/s of frames, "
+            "%.2f groups/s)\n", t->channel, t->version_b ? 'B' : 'A', t->messages,
+            8 * t->payload / seconds, 8 * t->bytes / seconds, t->groups / seconds);
+    fprintf(f, "  queue: %d bytes in %d frame(s), at most %d of %d; producer blocked %lu time(s)",
+            count, frames, max_count, TDC_QUEUE, blocked);
+    if (!t->fifo) fprintf(f, "; %lu pass(es) of the file", __atomic_exchange_n(&t->passes, 0, __ATOMIC_RELAXED));
+    fprintf(f, "\n");
+    t->groups = t->bytes = t->messages = t->payload = 0;
+}
@@ -0,0 +1,32 @@
+#ifndef RDS_TDC_H
+#define RDS_TDC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* Transparent data channel (group 5A or 5B): messages from a file or a named
+   pipe, one per line (longer lines are split at TDC_MAX_MESSAGE bytes), sent
+   as frames on one of the 32 channels:
+     STX (0x02), length, message, CRC-16-CCITT of the length and the message
+   Group 5A: block 2 bits 4..0 = channel, blocks 3 and 4 = the next 4 bytes;
+   group 5B: block 4 = the next 2 bytes. A group is padded with 0x00 after the
+   last frame queued; without frames, no group is sent.
+
+   A background thread reads the messages into a queue of TDC_QUEUE bytes.
+   When it is full, the thread stops reading: the writer of a pipe is then
+   blocked as soon as the pipe buffer is full (backpressure). A regular file
+   is read again from the start at its end (carousel); a pipe waits for the
+   next writer.
+*/
+#define TDC_QUEUE 4096
+#define TDC_MAX_MESSAGE 255
+#define TDC_STX 0x02
+
+typedef struct rds_tdc rds_tdc;
+
+extern rds_tdc *rds_tdc_open(const char *path, int channel, int version_b);
+extern void rds_tdc_close(rds_tdc *t);
+extern int rds_tdc_group(rds_tdc *t, uint16_t *blocks, uint16_t block1_base);
+extern void rds_tdc_report(rds_tdc *t, FILE *f, double seconds);
+
+#endif /* RDS_TDC_H */
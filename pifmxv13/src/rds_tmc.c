@@ -0,0 +1,262 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rds_tmc.h"
+
+
+#define SYSINFO_PERIOD 10           // one 3A group in 10 TMC groups
+#define ODA_GROUP 8                 // application group 8A
+
+typedef struct {
+    int id;
+    uint16_t event;
+    uint16_t location;
+    uint8_t extent;
+    uint8_t direction;
+    uint8_t duration;           // duration and persistence code
+    double expires;             // time of the encoder clock
+    int heap_pos;
+} tmc_message;
+
+struct rds_tmc {
+    int ltn;                    // location table number
+    int sid;                    // service identifier
+    int repeat;
+
+    // Messages in no particular order (sent in turn), and a min-heap of
+    // their indices by expiry time
+    tmc_message *msgs;
+    int *heap;
+    int count;
+    int capacity;
+
+    int current;                // message being sent, -1: none
+    int copies;                 // copies of it still to send
+    int next;
+    int groups;
+    int sysinfo_variant;
+
+    // Since the last report
+    unsigned long sent;
+    unsigned long sysinfo_sent;
+    unsigned long expired;
+};
+
+
+rds_tmc *rds_tmc_new(int ltn, int sid) {
+    rds_tmc *t = calloc(1, sizeof(rds_tmc));
+    if (t == NULL) return NULL;
+    t->ltn = ltn & 0x3F;
+    t->sid = sid & 0x3F;
+    t->repeat = 2;
+    t->current = -1;
+    return t;
+}
+
+void rds_tmc_free(rds_tmc *t) {
+    if (t == NULL) return;
+    free(t->msgs);
+    free(t->heap);
+    free(t);
+}
+
+void rds_tmc_set_system(rds_tmc *t, int ltn, int sid) {
+    t->ltn = ltn & 0x3F;
+    t->sid = sid & 0x3F;
+}
+
+/* Number of copies of each message sent in a row (1 to 5) */
+void rds_tmc_set_repeat(rds_tmc *t, int repeat) {
+    t->repeat = repeat < 1 ? 1 : repeat > 5 ? 5 : repeat;
+}
+
+int rds_tmc_count(rds_tmc *t) {
+    return t->count;
+}
+
+
+static void heap_swap(rds_tmc *t, int a, int b) {
+    int m = t->heap[a];
+    t->heap[a] = t->heap[b];
+    t->heap[b] = m;
+    t->msgs[t->heap[a]].heap_pos = a;
+    t->msgs[t->heap[b]].heap_pos = b;
+}
+
+static int heap_less(rds_tmc *t, int a, int b) {
+    return t->msgs[t->heap[a]].expires < t->msgs[t->heap[b]].expires;
+}
+
+static void heap_up(rds_tmc *t, int pos) {
+    while (pos > 0 && heap_less(t, pos, (pos - 1) / 2)) {
+        heap_swap(t, pos, (pos - 1) / 2);
+        pos = (pos - 1) / 2;
+    }
+}
+
+static void heap_down(rds_tmc *t, int pos) {
+    for (;;) {
+        int child = 2 * pos + 1;
+        if (child >= t->count) return;
+        if (child + 1 < t->count && heap_less(t, child + 1, child)) child++;
+        if (!heap_less(t, child, pos)) return;
+        heap_swap(t, pos, child);
+        pos = child;
+    }
+}
+
+/* Removes the message at index `m`: the last message takes its place in the
+   table, the last heap entry its place in the heap
+*/
+static void remove_at(rds_tmc *t, int m) {
+    int pos = t->msgs[m].heap_pos;
+    int last = t->count - 1;
+    if (pos != last) {
+        heap_swap(t, pos, last);
+    }
+    if (m != last) {
+        t->msgs[m] = t->msgs[last];
+        t->heap[t->msgs[m].heap_pos] = m;
+    }
+    t->count--;
+    if (pos < t->count) {
+        heap_down(t, pos);
+        heap_up(t, pos);
+    }
+
+    // Keep the turn on the messages that are left
+    if (t->current == m) t->current = -1;
+    else if (t->current == last) t->current = m;
+    if (t->next > t->count) t->next = 0;
+}
+
+static int find(rds_tmc *t, int id) {
+    for (int m = 0; m < t->count; m++) {
+        if (t->msgs[m].id == id) return m;
+    }
+    return -1;
+}
+
+/* Duration and persistence code of a single-group message: the shortest
+   persistence that covers `minutes` (15 min, 30 min, 1 h, 2 h, 3 h, 4 h, rest
+   of the day)
+*/
+static int duration_code(int minutes) {
+    static const int persistence[] = {15, 30, 60, 120, 180, 240};
+    for (int i = 0; i < 6; i++) {
+        if (minutes <= persistence[i]) return i + 1;
+    }
+    return 7;
+}
+
+/* Adds a message, or replaces the message with the same id. It is sent
+   until `minutes` after `now` (time of the encoder clock). Returns 0, or -1
+   for invalid fields or if no memory is available.
+*/
+int rds_tmc_add(rds_tmc *t, int id, int event, int location, int extent, int direction,
+                int minutes, double now) {
+    if (event < 1 || event > 0x7FF || location < 0 || location > 0xFFFF ||
+        extent < 0 || extent > 7 || minutes <= 0) return -1;
+
+    int m = find(t, id);
+    if (m < 0) {
+        if (t->count == t->capacity) {
+            int capacity = t->capacity ? 2 * t->capacity : 64;
+            tmc_message *msgs = realloc(t->msgs, capacity * sizeof(tmc_message));
+            if (msgs == NULL) return -1;
+            t->msgs = msgs;
+            int *heap = realloc(t->heap, capacity * sizeof(int));
+            if (heap == NULL) return -1;
+            t->heap = heap;
+            t->capacity = capacity;
+        }
+        m = t->count++;
+        t->heap[m] = m;
+        t->msgs[m].heap_pos = m;
+    }
+    tmc_message *msg = &t->msgs[m];
+    msg->id = id;
+    msg->event = event;
+    msg->location = location;
+    msg->extent = extent;
+    msg->direction = direction ? 1 : 0;
+    msg->duration = duration_code(minutes);
+    msg->expires = now + 60. * minutes;
+    heap_down(t, msg->heap_pos);
+    heap_up(t, msg->heap_pos);
+    return 0;
+}
+
+/* Removes the message `id` (-1: all). Returns 0, or -1 if there is none. */
+int rds_tmc_remove(rds_tmc *t, int id) {
+    if (id < 0) {
+        int had = t->count;
+        t->count = 0;
+        t->current = -1;
+        t->next = 0;
+        return had ? 0 : -1;
+    }
+    int m = find(t, id);
+    if (m < 0) return -1;
+    remove_at(t, m);
+    return 0;
+}
+
+
+/* Next TMC group: the system information once in SYSINFO_PERIOD groups,
+   otherwise a copy of the current message. Expired messages are removed
+   first. Without messages, only the system information is sent (and 0 is
+   returned for the other groups, which are left to the group cycle).
+*/
+int rds_tmc_group(rds_tmc *t, uint16_t *blocks, uint16_t block1_base, double now) {
+    while (t->count > 0 && t->msgs[t->heap[0]].expires <= now) {
+        remove_at(t, t->heap[0]);
+        t->expired++;
+    }
+
+    if (t->groups++ % SYSINFO_PERIOD == 0) {
+        blocks[1] = 0x3000 | block1_base | ODA_GROUP << 1;
+        if (t->sysinfo_variant == 0) {
+            // Location table, basic mode, national scope
+            blocks[2] = 0 << 14 | t->ltn << 6 | 1 << 2;
+        } else {
+            blocks[2] = 1 << 14 | t->sid << 6;
+        }
+        blocks[3] = TMC_AID;
+        t->sysinfo_variant = !t->sysinfo_variant;
+        t->sysinfo_sent++;
+        return 1;
+    }
+    if (t->count == 0) return 0;
+
+    if (t->current < 0 || t->copies == 0) {
+        if (t->next >= t->count) t->next = 0;
+        t->current = t->next++;
+        t->copies = t->repeat;
+    }
+    tmc_message *msg = &t->msgs[t->current];
+    t->copies--;
+    blocks[1] = ODA_GROUP << 12 | block1_base | 0 << 4 | 1 << 3 | msg->duration;
+    blocks[2] = msg->direction << 14 | msg->extent << 11 | msg->event;
+    blocks[3] = msg->location;
+    t->sent++;
+    return 1;
+}
+
+
+/* Prints the table, the time to send every message once at `rate` TMC
+   groups/s, and the next expiry
+*/
+void rds_tmc_report(rds_tmc *t, FILE *f, double now, double rate) {
+    fprintf(f, "  %d message(s) (LTN %d, SID %d, %d cop%s each), %lu message group(s) and %lu system "
+            "group(s) sent, %lu expired\n", t->count, t->ltn, t->sid, t->repeat, t->repeat > 1 ? "ies" : "y",
+            t->sent, t->sysinfo_sent, t->expired);
+    if (t->count > 0 && rate > 0) {
+        double cycle = t->count * t->repeat * SYSINFO_PERIOD / (SYSINFO_PERIOD - 1.) / rate;
+        tmc_message *first = &t->msgs[t->heap[0]];
+        fprintf(f, "  all messages sent in %.1f s; next expiry: message %d in %.0f s\n",
+                cycle, first->id, first->expires - now);
+    }
+    t->sent = t->sysinfo_sent = t->expired = 0;
+}
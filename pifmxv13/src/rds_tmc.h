@@ -0,0 +1,36 @@
+#ifndef RDS_TMC_H
+#define RDS_TMC_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+/* TMC (ALERT-C, AID CD46): a table of traffic messages sent in single-group
+   user messages of group 8A, each one `repeat` times in a row (receivers
+   take a message when they got it twice), in turn; and the system
+   information in 3A groups (variant 0: location table number, variant 1:
+   service identifier).
+
+   Group 8A: block 2 bits 4..0 = T (0: user message), F (1: single group),
+             duration and persistence (3 bits);
+             block 3 = diversion (1), direction (1), extent (3), event (11);
+             block 4 = location.
+
+   Messages expire after their duration: the table keeps a min-heap of the
+   expiry times, so that expiring or removing a message costs O(log n).
+*/
+#define TMC_AID 0xCD46
+
+typedef struct rds_tmc rds_tmc;
+
+extern rds_tmc *rds_tmc_new(int ltn, int sid);
+extern void rds_tmc_free(rds_tmc *t);
+extern void rds_tmc_set_system(rds_tmc *t, int ltn, int sid);
+extern void rds_tmc_set_repeat(rds_tmc *t, int repeat);
+extern int rds_tmc_add(rds_tmc *t, int id, int event, int location, int extent, int direction,
+                       int minutes, double now);
+extern int rds_tmc_remove(rds_tmc *t, int id);
+extern int rds_tmc_count(rds_tmc *t);
+extern int rds_tmc_group(rds_tmc *t, uint16_t *blocks, uint16_t block1_base, double now);
+extern void rds_tmc_report(rds_tmc *t, FILE *f, double now, double rate);
+
+#endif /* RDS_TMC_H */
@@ -1,31 +1,347 @@
+#include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <math.h>
 #include <sndfile.h>
 #include <string.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "rds.h"
 #include "fm_mpx.h"
+#include "profile.h"
 
 
 #define LENGTH 114000
 
 
+// Clock of the rendered signal (-time): start time + samples rendered so far
+static time_t start_time;
+static unsigned long rendered;
+
+static double render_clock(void *arg) {
+    return start_time + rendered / 228000.;
+}
+
+// Change of PS and RT during the render (-update)
+static double update_at = -1;
+static char *update_text;
+static int update_lps = 0;      // -lps given: the update changes the Long PS too
+static int update_ert = 0;      // same for -ert
+
+static void apply_update() {
+    if(update_at < 0 || rendered < update_at * 228000) return;
+    set_rds_ps(update_text);
+    set_rds_rt(update_text);
+    if(update_lps) set_rds_lps(update_text);
+    if(update_ert) set_rds_ert(update_text);
+    update_at = -1;
+}
+
+// Scroller (-scroll), like PiFMPSRT: every `scroll_interval` seconds, PS
+// and RT move on by one character of the text
+static double scroll_interval = 0;
+static char *scroll_text;
+static double scroll_next = 0;
+static int scroll_pos = 0;
+
+static void apply_scroll() {
+    int len = scroll_interval > 0 ? strlen(scroll_text) : 0;
+    while(len > 0 && rendered >= scroll_next * 228000) {
+        char ps[9], rt[65];
+        for(int i=0; i<8; i++) ps[i] = scroll_text[(scroll_pos + i) % len];
+        ps[8] = 0;
+        snprintf(rt, sizeof(rt), "%s%.*s", scroll_text + scroll_pos, scroll_pos, scroll_text);
+        set_rds_ps(ps);
+        set_rds_rt(rt);
+        scroll_pos = (scroll_pos + 1) % len;
+        scroll_next += scroll_interval;
+    }
+}
+
+// Change of an other network during the render (-eonupdate), e.g. its TA
+static double eon_update_at = -1;
+static char *eon_update;
+
+static void apply_eon_update() {
+    if(eon_update_at < 0 || rendered < eon_update_at * 228000) return;
+    set_rds_eon(eon_update);
+    eon_update_at = -1;
+}
+
+// TA switched on and off every `ta_interval` seconds (-tatoggle), TP every
+// `tp_interval` seconds (-tptoggle): each switch drops the groups built
+// ahead (-lookahead)
+static double ta_interval = 0;
+static double ta_next = 0;
+static double tp_interval = 0;
+static double tp_next = 0;
+
+static void apply_ta_toggle() {
+    while(ta_interval > 0 && rendered >= ta_next * 228000) {
+        if(ta_next > 0) set_rds_ta(!get_rds_ta());
+        ta_next += ta_interval;
+    }
+    while(tp_interval > 0 && rendered >= tp_next * 228000) {
+        if(tp_next > 0) set_rds_tp(!get_rds_tp());
+        tp_next += tp_interval;
+    }
+}
+
+// Priority group during the render (-emergency): preempts the samples
+// rendered after its time, as with the DMA ring of pi_fm_x
+static double emergency_at = -1;
+static char *emergency_spec;
+
+static void apply_emergency(float *mpx_buffer, int length) {
+    if(emergency_at < 0 || rendered < emergency_at * 228000) return;
+    // The command comes at its time, before the samples rendered after it
+    unsigned long end = rendered;
+    rendered = emergency_at * 228000;
+    if(!set_rds_emergency(emergency_spec)) {
+        fprintf(stderr, "Error: invalid priority group %s.\n", emergency_spec);
+        exit(EXIT_FAILURE);
+    }
+    int ahead = end - rendered;
+    rendered = end;
+    static float delta[LENGTH];
+    if(ahead > length) ahead = length;
+    int air = rds_preempt(ahead, delta);
+    for(int i=0; i<ahead && air >= 0; i++) mpx_buffer[length - ahead + i] += delta[i];
+    if(air >= 0) {
+        fprintf(stderr, "Emergency %s at %.3f s: %.1f ms of samples re-rendered, priority group on air "
+                "after %.1f ms.\n", emergency_spec, emergency_at, ahead / 228., air / 228.);
+    }
+    emergency_at = -1;
+}
+
+
 /* Simple test program */
 int main(int argc, char **argv) {
     if(argc < 4) {
         fprintf(stderr, "Error: missing argument.\n");
-        fprintf(stderr, "Syntax: rds_wav <in_audio.wav> <out_mpx.wav> <text>\n");
+        fprintf(stderr, "Syntax: rds_wav <in_audio.wav> <out_mpx.wav> <text> [-time unix_time] [-seed n] [-seconds s]\n"
+                        "               [-groups file] [-groups-bin file] [-inject file] [-nompx] [-profile]\n"
+                        "               [-update seconds text] [-burst 0/1] [-rtm P/A/D] [-afa freqs] [-sla targets]\n"
+                        "               [-rds2 stream,groups[,level[,phase]]] [-rft file[,stream[,share[,passes]]]]\n"
+                        "               [-lps text] [-ert text] [-ertg group] [-tmc ltn,sid[,rate[,copies]]]\n"
+                        "               [-tmcadd id,event,location[,extent[,direction[,minutes]]]]\n"
+                        "               [-emergency seconds TA|\"EWS b,c,d\"] [-tdc file[,channel[,rate[,A/B]]]]\n"
+                        "               [-eon network] [-eonf file] [-eonrate rate] [-eonupdate seconds network]\n"
+                        "               [-rtp type.start.len[,type.start.len]] [-odadump] [-afb variants] [-afbf file]\n"
+                        "               [-lookahead groups] [-scroll seconds text] [-tatoggle seconds] [-tptoggle seconds] [-plrt 0/1]\n");
         return EXIT_FAILURE;
     }
     
+    // Texts are UTF-8 (Long PS, non-ASCII characters of PS/RT), whatever
+    // the environment, so that renders are reproducible
+    setlocale(LC_ALL, "C.UTF-8");
     set_rds_pi(0x1234);
     set_rds_ps(argv[3]);
     set_rds_rt(argv[3]);
+
+    // Options for reproducible renders (see `make check`)
+    double seconds = 20;
+    int nompx = 0;
+    int oda_dump = 0;
+    int lookahead = 0;
+    for(int i=4; i<argc; i++) {
+        char *param = i+1 < argc ? argv[i+1] : NULL;
+        if(strcmp("-nompx", argv[i]) == 0) {
+            nompx = 1;
+        } else if(strcmp("-odadump", argv[i]) == 0) {
+            oda_dump = 1;
+        } else if(strcmp("-profile", argv[i]) == 0) {
+            if(profile_start() < 0) fprintf(stderr, "Warning: perf_event_open() is not available.\n");
+        } else if(param == NULL) {
+            fprintf(stderr, "Error: missing value for %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        } else if(strcmp("-time", argv[i]) == 0) {
+            start_time = strtoll(param, NULL, 10);
+            set_rds_clock(render_clock, NULL);
+            i++;
+        } else if(strcmp("-seed", argv[i]) == 0) {
+            set_rds_seed(strtoul(param, NULL, 10));
+            set_rds_pi_random_mode(1);
+            i++;
+        } else if(strcmp("-seconds", argv[i]) == 0) {
+            seconds = atof(param);
+            i++;
+        } else if(strcmp("-groups", argv[i]) == 0 || strcmp("-groups-bin", argv[i]) == 0) {
+            if(set_rds_group_output(param, strcmp("-groups-bin", argv[i]) == 0) < 0) {
+                fprintf(stderr, "Error: could not open group file %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-update", argv[i]) == 0 && i+2 < argc) {
+            update_at = atof(param);
+            update_text = argv[i+2];
+            i += 2;
+        } else if(strcmp("-scroll", argv[i]) == 0 && i+2 < argc) {
+            scroll_interval = atof(param);
+            scroll_text = argv[i+2];
+            i += 2;
+        } else if(strcmp("-emergency", argv[i]) == 0 && i+2 < argc) {
+            emergency_at = atof(param);
+            emergency_spec = argv[i+2];
+            if(!set_rds_preempt(1)) return EXIT_FAILURE;
+            i += 2;
+        } else if(strcmp("-burst", argv[i]) == 0) {
+            set_rds_burst(atoi(param));
+            i++;
+        } else if(strcmp("-sla", argv[i]) == 0) {
+            if(!set_rds_sla(param)) {
+                fprintf(stderr, "Error: invalid SLA targets %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-rds2", argv[i]) == 0) {
+            if(fm_mpx_set_rds2(param) < 0) {
+                fprintf(stderr, "Error: invalid RDS2 stream %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-rft", argv[i]) == 0) {
+            if(fm_mpx_set_rft(param) < 0) {
+                fprintf(stderr, "Error: invalid RFT file or specification %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-afa", argv[i]) == 0) {
+            if(!set_rds_af(param)) return EXIT_FAILURE;
+            i++;
+        } else if(strcmp("-afb", argv[i]) == 0) {
+            if(!set_rds_afb(param)) {
+                fprintf(stderr, "Error: invalid AFB list %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-afbf", argv[i]) == 0) {
+            if(set_rds_afb_file(param) < 0) return EXIT_FAILURE;
+            i++;
+        } else if(strcmp("-lps", argv[i]) == 0) {
+            set_rds_lps(param);
+            update_lps = 1;
+            i++;
+        } else if(strcmp("-ert", argv[i]) == 0) {
+            set_rds_ert(param);
+            update_ert = 1;
+            i++;
+        } else if(strcmp("-ertg", argv[i]) == 0) {
+            if(!set_rds_ert_group(param)) {
+                fprintf(stderr, "Error: invalid eRT group %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-tmc", argv[i]) == 0) {
+            if(!set_rds_tmc(param)) {
+                fprintf(stderr, "Error: invalid TMC settings %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-tmcadd", argv[i]) == 0) {
+            if(!add_rds_tmc_message(param)) {
+                fprintf(stderr, "Error: invalid TMC message %s (or -tmc not given before).\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-tdc", argv[i]) == 0) {
+            if(!set_rds_tdc(param)) {
+                fprintf(stderr, "Error: invalid TDC file or settings %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-eon", argv[i]) == 0) {
+            if(!set_rds_eon(param)) {
+                fprintf(stderr, "Error: invalid other network %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-eonf", argv[i]) == 0) {
+            if(set_rds_eon_from_file(param) < 0) {
+                fprintf(stderr, "Error: could not read the other networks from %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-eonrate", argv[i]) == 0) {
+            if(!set_rds_eon_rate(atof(param))) {
+                fprintf(stderr, "Error: invalid EON rate %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-rtp", argv[i]) == 0) {
+            if(!set_rds_rtp(param)) {
+                fprintf(stderr, "Error: invalid RT+ tags %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else if(strcmp("-eonupdate", argv[i]) == 0 && i+2 < argc) {
+            eon_update_at = atof(param);
+            eon_update = argv[i+2];
+            i += 2;
+        } else if(strcmp("-tatoggle", argv[i]) == 0) {
+            ta_interval = atof(param);
+            i++;
+        } else if(strcmp("-tptoggle", argv[i]) == 0) {
+            tp_interval = atof(param);
+            i++;
+        } else if(strcmp("-plrt", argv[i]) == 0) {
+            fm_mpx_set_playlist_rds(atoi(param));
+            i++;
+        } else if(strcmp("-lookahead", argv[i]) == 0) {
+            lookahead = atoi(param);
+            i++;
+        } else if(strcmp("-rtm", argv[i]) == 0) {
+            set_rds_rt_mode(param[0]);
+            i++;
+        } else if(strcmp("-inject", argv[i]) == 0) {
+            if(set_rds_group_input(param) < 0) {
+                fprintf(stderr, "Error: could not open group file %s.\n", param);
+                return EXIT_FAILURE;
+            }
+            i++;
+        } else {
+            fprintf(stderr, "Error: unknown option %s.\n", argv[i]);
+            return EXIT_FAILURE;
+        }
+    }
+    int blocks = seconds * 228000 / LENGTH;
+
+    // Groups only: no multiplex, the encoder clock moves on group by group
+    if(nompx) {
+        long groups = seconds * 228000 / (104 * 192);
+        uint16_t group[4];
+        clock_t start = clock();
+        for(long g=0; g<groups; g++) {
+            apply_update();
+            apply_scroll();
+            apply_eon_update();
+            apply_ta_toggle();
+            apply_emergency(NULL, 0);
+            get_rds_group_blocks(group);
+            rendered += 104 * 192;
+        }
+        set_rds_group_output(NULL, 0);
+        fprintf(stderr, "%ld groups (%.0f s) generated in %.1f ms.\n",
+                groups, seconds, 1e3 * (clock() - start) / CLOCKS_PER_SEC);
+        rds_update_report(stderr);
+        rds_sla_report(stderr);
+        rds_afb_status(stderr);
+        rds_tmc_status(stderr);
+        rds_tdc_status(stderr);
+        rds_eon_status(stderr);
+        fm_mpx_rft_report(stderr);
+        if(oda_dump) rds_oda_queue_dump(stderr);
+        rds_oda_status(stderr);
+        if(profiling) profile_report(stderr);
+        return EXIT_SUCCESS;
+    }
     
     char *in_file = argv[1];
     if(strcmp("NONE", argv[1]) == 0) in_file = NULL;
     
+    // Output samples in -1..1
+    fm_mpx_set_scale(.1);
     if(fm_mpx_open(in_file, LENGTH) != 0) {
         printf("Could not setup FM mulitplex generator.\n");
         return EXIT_FAILURE;
@@ -37,7 +353,7 @@ int main(int argc, char **argv) {
     SNDFILE *outf;
     SF_INFO sfinfo;
 
-    sfinfo.frames = LENGTH;
+    sfinfo.frames = LENGTH * blocks;
     sfinfo.samplerate = 228000;
     sfinfo.channels = 1;
     sfinfo.format = SF_FORMAT_WAV | SF_FORMAT_PCM_16;
@@ -53,13 +369,28 @@ int main(int argc, char **argv) {
 
     float mpx_buffer[LENGTH];
 
-    for(int j=0; j<40; j++) {
-        if( fm_mpx_get_samples(mpx_buffer) < 0 ) break;
-        
-        // scale samples
-        for(int i=0; i<LENGTH; i++) {
-            mpx_buffer[i] /= 10.;
+    // Groups built ahead by another thread: the same render, unless a change
+    // drops groups already built
+    if(lookahead && !set_rds_lookahead(lookahead)) {
+        fprintf(stderr, "Error: invalid lookahead %d (1 to 8 groups).\n", lookahead);
+        return EXIT_FAILURE;
+    }
+
+    for(int j=0; j<blocks; j++) {
+        // Like the transmitter between two refills
+        if(lookahead) {
+            rds_unlock();
+            usleep(1000);
+            rds_lock();
         }
+        apply_update();
+        apply_scroll();
+        apply_eon_update();
+        apply_ta_toggle();
+        if( fm_mpx_get_samples(mpx_buffer) < 0 ) break;
+        rendered += LENGTH;
+        apply_emergency(mpx_buffer, LENGTH);
+        if(profiling) profile_add_samples(LENGTH);
 
         if(sf_write_float(outf, mpx_buffer, LENGTH) != LENGTH) {
             fprintf(stderr, "Error: writing to file %s.\n", argv[1]);
@@ -70,8 +401,21 @@ int main(int argc, char **argv) {
     if(sf_close(outf) ) {
         fprintf(stderr, "Error: closing file %s.\n", argv[1]);
     }
+    rds_lookahead_status(stderr);
+    set_rds_lookahead(0);
     
     fm_mpx_close();
+    set_rds_group_output(NULL, 0);
+    rds_update_report(stderr);
+    rds_sla_report(stderr);
+    rds_afb_status(stderr);
+    rds_tmc_status(stderr);
+    rds_tdc_status(stderr);
+    rds_eon_status(stderr);
+    fm_mpx_rft_report(stderr);
+    if(oda_dump) rds_oda_queue_dump(stderr);
+    rds_oda_status(stderr);
+    if(profiling) profile_report(stderr);
 
     return EXIT_SUCCESS;
 }